@@ -39,6 +39,8 @@ int jobToJSON(struct job *j, buff_t *buf);
 int queueToJSON(struct queue *q, buff_t *buf);
 int resourceToJSON(struct resource *r, buff_t *buf);
 
+extern const field fields[];
+
 acctClient *acctClientList = NULL;
 
 static void acctMain(acctClient *a);
@@ -209,7 +211,142 @@ static int sendInitial(acctClient *a) {
 	return 0;
 }
 
-/* Locate to 'id' */
+/* Tell the client their stream can't continue. The connection is closed
+ * once this has been sent */
+static void streamError(acctClient *a, const char *error) {
+	buff_t b;
+	buffNew(&b, 0);
+
+	JSONStart(&b);
+	JSONStartObject(&b, "STREAM_ERROR", 12);
+	JSONAddString(&b, ERROR, error);
+	JSONEndObject(&b);
+	JSONEnd(&b);
+
+	buffAddBuff(&a->response, &b);
+	buffFree(&b);
+
+	a->state = ACCT_CLOSING;
+	pollSetWritable(&a->connection);
+}
+
+/* Work out the format of the journal just opened */
+static void openJournal(acctClient *a) {
+	a->binary = journalIsBinary(fileno(a->journal));
+	a->reader.fd = fileno(a->journal);
+	a->reader.offset = JOURNAL_MAGIC_LEN;
+}
+
+/* Switch to the journal following the one we have open, if there is one.
+ * Returns 1 if we switched */
+static int nextJournal(acctClient *a) {
+	/* Get a list of all journal files, find the one we currently have open */
+	char glob_pattern[PATH_MAX];
+	char current_journal[PATH_MAX];
+	int switched = 0;
+	sprintf(glob_pattern, "%s/journal.*", server.state_dir);
+	sprintf(current_journal, "%s/journal.%s", server.state_dir, a->datetime);
+
+	glob_t glob_buff;
+
+	if (glob(glob_pattern, 0, NULL, &glob_buff) != 0)
+		return 0;
+
+	size_t i = 0;
+	for (i = 0; i < glob_buff.gl_pathc; i++) {
+		if (strcmp(current_journal, glob_buff.gl_pathv[i]) == 0) {
+			i++;
+			break;
+		}
+	}
+
+	if (i < glob_buff.gl_pathc) {
+		/* Have a new journal to open */
+		FILE *new_journal = fopen(glob_buff.gl_pathv[i], "rb");
+
+		if (new_journal == NULL) {
+			print_msg(JERS_LOG_WARNING, "Failed to open journal file '%s' for accounting client: %s", glob_buff.gl_pathv[i], strerror(errno));
+			streamError(a, "Unable to open the next journal");
+			globfree(&glob_buff);
+			return 0;
+		}
+
+		/* Opened a new journal. Reset the current stats */
+		fclose(a->journal);
+		a->record = 0;
+		char *dot = strchr(glob_buff.gl_pathv[i], '.');
+		dot++;
+		strcpy(a->datetime, dot);
+
+		a->journal = new_journal;
+		openJournal(a);
+		switched = 1;
+
+		print_msg_info("Switched to new journal %s\n", a->datetime);
+	}
+
+	globfree(&glob_buff);
+
+	return switched;
+}
+
+/* Add a request decoded from a binary journal as the MESSAGE object, in the
+ * same form it was sent to us */
+static void addMessage(buff_t *b, const msg_t *m) {
+	JSONStartObject(b, "MESSAGE", 7);
+	JSONStartObject(b, m->command, 0);
+	JSONAddInt(b, VERSION, m->version);
+
+	if (m->item_count == 1)
+		JSONStartObject(b, "FIELDS", 6);
+	else
+		JSONStartArray(b, "DATA", 4);
+
+	for (int64_t i = 0; i < m->item_count; i++) {
+		if (m->item_count != 1)
+			JSONStartObject(b, NULL, 0);
+
+		for (int64_t k = 0; k < m->items[i].field_count; k++) {
+			field *f = &m->items[i].fields[k];
+
+			switch (fields[f->number].type) {
+				case FIELD_TYPE_NUM:
+					JSONAddInt(b, f->number, f->value.number);
+					break;
+
+				case FIELD_TYPE_BOOL:
+					JSONAddBool(b, f->number, f->value.boolean);
+					break;
+
+				case FIELD_TYPE_STRING:
+					JSONAddString(b, f->number, f->value.string);
+					break;
+
+				case FIELD_TYPE_STRINGARRAY:
+					JSONAddStringArray(b, f->number, f->value.string_array.count, f->value.string_array.strings);
+					break;
+
+				case FIELD_TYPE_MAP:
+					JSONAddMap(b, f->number, f->value.map.count, f->value.map.keys);
+					break;
+			}
+		}
+
+		if (m->item_count != 1)
+			JSONEndObject(b);
+	}
+
+	if (m->item_count == 1)
+		JSONEndObject(b);
+	else
+		JSONEndArray(b);
+
+	JSONEndObject(b);
+	JSONEndObject(b);
+}
+
+/* Locate to 'id'. Returns non-zero if the id is invalid or its journal
+ * can't be opened, ie. it has been removed by the retention policy */
 int locateJournal(acctClient *a, char *id) {
 	print_msg_debug("LOCATING Journal to : %s\n", id);
 	/* Break up and validate the id */
@@ -240,15 +377,59 @@ int locateJournal(acctClient *a, char *id) {
 
 	a->journal = fopen(journal, "rb");
 
-	if (a->journal == NULL)
-		error_die("Failed to open journal file '%s': %s", journal, strerror(errno));
+	if (a->journal == NULL) {
+		print_msg(JERS_LOG_WARNING, "Failed to open journal file '%s' for accounting client: %s", journal, strerror(errno));
+		return 1;
+	}
+
+	openJournal(a);
 
-	/* Now locate to the requested record */
+	/* Now locate to the requested record, starting from the closest
+	 * indexed record. The index is only a hint, so check the offset
+	 * is at the start of a record before using it */
 	char *record = NULL;
 	size_t record_size = 0;
 	ssize_t record_len = 0;
 
-	off_t current = 0;
+	int64_t current = 0;
+	off_t offset = journalIndexLookup(a->datetime, a->record, &current);
+
+	if (a->binary) {
+		struct journalRecord r;
+
+		if (offset > 0) {
+			a->reader.offset = offset;
+
+			if (journalReadRecord(&a->reader, &r) > 0) {
+				free_message(&r.msg);
+				a->reader.offset = offset;
+			} else {
+				print_msg(JERS_LOG_WARNING, "Ignoring invalid index entry for journal %s record %ld", a->datetime, current);
+				a->reader.offset = JOURNAL_MAGIC_LEN;
+				current = 0;
+			}
+		}
+
+		print_msg_debug("Located journal %s to record %ld from index\n", a->datetime, current);
+
+		while (current < a->record && journalReadRecord(&a->reader, &r) > 0) {
+			free_message(&r.msg);
+			current++;
+		}
+
+		return 0;
+	}
+
+	if (offset > 0 && (fseek(a->journal, offset - 1, SEEK_SET) != 0 || fgetc(a->journal) != '\n')) {
+		print_msg(JERS_LOG_WARNING, "Ignoring invalid index entry for journal %s record %ld", a->datetime, current);
+		rewind(a->journal);
+		current = 0;
+	}
+
+	print_msg_debug("Located journal %s to record %ld from index\n", a->datetime, current);
+
+	if (current == a->record)
+		return 0;
 
 	while ((record_len = getline(&record, &record_size, a->journal)) != -1) {
 		if (*record == '\0')
@@ -266,6 +447,9 @@ int locateJournal(acctClient *a, char *id) {
 static int processRequest(acctClient *a, const char *cmd) {
 	print_msg(JERS_LOG_DEBUG, "Got accounting stream cmd: %s\n", cmd);
 
+	if (a->state == ACCT_CLOSING)
+		return 0;
+
 	if (strncasecmp(cmd, "START", 5) == 0) {
 		/* The START command might have an additional parameter */
 		if (strlen(cmd) > 6) {
@@ -284,7 +468,11 @@ static int processRequest(acctClient *a, const char *cmd) {
 			}
 
 			/* Locate onto the provided position */
-			locateJournal(a, a->id);
+			if (locateJournal(a, a->id) != 0) {
+				print_msg(JERS_LOG_WARNING, "Unable to resume accounting stream from: %s", cmd + 6);
+				streamError(a, "Unable to resume from the requested position");
+				return 1;
+			}
 		} else {
 			if (a->initalised == 0) {
 				/* Need to send them the current list of jobs/queue/resources */
@@ -292,7 +480,11 @@ static int processRequest(acctClient *a, const char *cmd) {
 				a->initalised = 1;
 
 				asprintf(&a->id, "%s:%ld", server.journal.datetime, server.journal.record);
-				locateJournal(a, a->id);
+
+				if (locateJournal(a, a->id) != 0) {
+					streamError(a, "Unable to open the current journal");
+					return 1;
+				}
 			}
 		}
 
@@ -338,6 +530,62 @@ static void acctShutdownHandler(int signo) {
 	return;
 }
 
+/* Send any new records from a binary journal */
+static void sendBinaryRecords(acctClient *a, buff_t *b) {
+	struct journalRecord r;
+	char id[32];
+	char timestamp[32];
+
+	while (!shutdown_flag) {
+		if (journalReadRecord(&a->reader, &r) <= 0) {
+			/* Nothing more yet, or the journal has been rolled over */
+			nextJournal(a);
+			break;
+		}
+
+		if (r.marker == '$') {
+			nextJournal(a);
+			break;
+		}
+
+		a->record++;
+
+		if (strcmp(r.msg.command, "REPLAY_COMPLETE") == 0) {
+			free_message(&r.msg);
+			continue;
+		}
+
+		/* Serialize this message, in the same form as a text journal record */
+		JSONStart(b);
+		JSONStartObject(b, "UPDATE", 6);
+
+		sprintf(id, "%s:%ld", a->datetime, a->record);
+		sprintf(timestamp, "%ld.%03ld", r.timestamp / 1000, r.timestamp % 1000);
+
+		JSONAddString(b, ACCT_ID, id);
+		JSONAddString(b, TIMESTAMP, timestamp);
+		JSONAddString(b, COMMAND, r.msg.command);
+		JSONAddInt(b, UID, r.uid);
+
+		if (r.jobid)
+			JSONAddInt(b, JOBID, r.jobid);
+
+		if (r.has_msg)
+			addMessage(b, &r.msg);
+
+		JSONEndObject(b);
+		JSONEnd(b);
+
+		buffAddBuff(&a->response, b);
+		buffAdd(&a->response, "\n", 1);
+
+		buffClear(b, 0);
+		free_message(&r.msg);
+
+		pollSetWritable(&a->connection);
+	}
+}
+
 /* Does not return */
 static void acctMain(acctClient *a) {
 	setproctitle("jersd_acct[%d]", a->connection.socket);
@@ -410,12 +658,24 @@ static void acctMain(acctClient *a) {
 
 		checkRequests(a);
 
+		if (a->state == ACCT_CLOSING) {
+			if (a->response.used == 0)
+				break;
+
+			continue;
+		}
+
 		if (a->state == ACCT_STOPPED)
 			continue;
 
 		/* Read the current journal, sending any new messages.
 		 * We need to also check if we need to open the next journal. */
 
+		if (a->binary) {
+			sendBinaryRecords(a, &b);
+			continue;
+		}
+
 		current_pos = ftell(a->journal);
 
 		while ((record_len = getline(&record, &record_size, a->journal)) != -1) {
@@ -423,46 +683,7 @@ static void acctMain(acctClient *a) {
 				fseek(a->journal, current_pos, SEEK_SET);
 
 				/* Check if we need to switch to a new journal file */
-				/* Get a list of all journal files, find the one we currently have open */
-				char glob_pattern[PATH_MAX];
-				char current_journal[PATH_MAX];
-				sprintf(glob_pattern, "%s/journal.*", server.state_dir);
-				sprintf(current_journal, "%s/journal.%s", server.state_dir, a->datetime);
-
-				glob_t glob_buff;
-
-				if (glob(glob_pattern, 0, NULL, &glob_buff) == 0) {
-					size_t i = 0;
-					for (i = 0; i < glob_buff.gl_pathc; i++) {
-						if (strcmp(current_journal, glob_buff.gl_pathv[i]) == 0) {
-							i++;
-							break;
-						}
-					}
-
-					if (i < glob_buff.gl_pathc) {
-						/* Have a new journal to open */
-						FILE *new_journal = fopen(glob_buff.gl_pathv[i], "rb");
-
-						if (new_journal == NULL)
-							error_die("Failed to open journal file '%s': %s", glob_buff.gl_pathv[i], strerror(errno));
-
-						/* Opened a new journal. Reset the current stats */
-						fclose(a->journal);
-						a->record = 0;
-						char *dot = strchr(glob_buff.gl_pathv[i], '.');
-						dot++;
-						strcpy(a->datetime, dot);
-
-						a->journal = new_journal;
-						current_pos = 0;
-
-						print_msg_info("Switched to new journal %s\n", a->datetime);
-					}
-
-					globfree(&glob_buff);
-				}
-
+				nextJournal(a);
 				break;
 			}
 
@@ -525,6 +746,8 @@ static void acctMain(acctClient *a) {
 
 	free(record);
 	free(a->id);
+	free(a->reader.data);
+	free(a->reader.buffer);
 
 	exit(0);
 }
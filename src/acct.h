@@ -37,7 +37,18 @@
 
 enum acctStates {
 	ACCT_STOPPED = 0,
-	ACCT_STARTED
+	ACCT_STARTED,
+	ACCT_CLOSING		// Sending an error before closing the stream
+};
+
+/* Reads records from a binary journal through a file descriptor */
+struct journalReader {
+	int fd;
+	off_t offset;		// Offset of the next record
+	char *data;
+	size_t data_size;
+	char *buffer;		// Strings of the last record read
+	size_t buffer_size;
 };
 
 typedef struct _acctClient {
@@ -57,6 +68,8 @@ typedef struct _acctClient {
 
 	FILE *journal;
 	off_t record;
+	int binary;			// The journal is in the binary format, read through 'reader'
+	struct journalReader reader;
 	char datetime[10]; // YYYYMMDD
 
 	int initalised;
@@ -67,6 +67,7 @@ const char * getErrMsg(int jers_error);
 int getJersErrno(char *, char **);
 
 static int jersConnect(void);
+static int sendMessage(buff_t *b);
 
 static void setJersErrno(int err, char * msg) {
 	int saved_errno = errno;
@@ -189,14 +190,19 @@ static int jersConnect(void) {
 
 /* Block until the entire request is sent */
 static int sendRequest(buff_t *b) {
-	size_t total_sent = 0;
-	size_t length;
-	char *request;
-
 	JSONEndObject(b);
 	JSONEndObject(b);
 	JSONEnd(b);
 
+	return sendMessage(b);
+}
+
+/* Send a request that has already been closed off */
+static int sendMessage(buff_t *b) {
+	size_t total_sent = 0;
+	size_t length;
+	char *request;
+
 	length = b->used;
 	request = b->data;
 
@@ -224,6 +230,16 @@ static int readResponse(void) {
 	char *nl = NULL;
 
 	while (1) {
+		/* A previous read might have already received the whole message,
+		 * as events from a subscription can arrive together */
+		if (response.used > checked && (nl = memchr(response.data + checked, '\n', response.used - checked)) != NULL) {
+			*nl = '\0';
+			nl++;
+			break;
+		}
+
+		checked = response.used;
+
 		/* Allocate more memory if we might need it */
 		if (buffResize(&response, 0) != 0) {
 			setJersErrno(JERS_ERR_MEM, NULL);
@@ -247,17 +263,6 @@ static int readResponse(void) {
 		}
 
 		response.used += bytes_read;
-
-		/* Got a full message yet? */
-		nl = memchr(response.data + checked, '\n', bytes_read);
-
-		if (nl != NULL) {
-			*nl = '\0';
-			nl++;
-			break;
-		}
-
-		checked = response.used;
 	}
 
 	if (nl == NULL) {
@@ -433,6 +438,7 @@ static int deserialize_jersJob(msg_item * item, jersJob *j) {
 			case JOBPID    : j->pid = getNumberField(&item->fields[i]); break;
 			case REVISION  : j->revision = getNumberField(&item->fields[i]); break;
 			case ENVS      : j->env_count = getStringArrayField(&item->fields[i], &j->envs); break;
+			case DELETED   : j->deleted = getBoolField(&item->fields[i]); break;
 
 			default: fprintf(stderr, "Unknown field '%s' encountered - Ignoring\n",item->fields[i].name); break;
 		}
@@ -441,70 +447,75 @@ static int deserialize_jersJob(msg_item * item, jersJob *j) {
 	return 0;
 }
 
-JERS_EXPORT int jersGetJob(jobid_t jobid, const jersJobFilter * filter, jersJobInfo * job_info) {
-	if (jersInitAPI(NULL))
-		return 1;
+static void serializeJobFilter(buff_t *b, const jersJobFilter *filter) {
+	if (filter->filter_fields & JERS_FILTER_JOBNAME)
+		JSONAddString(b, JOBNAME, filter->filters.job_name);
 
-	job_info->count = 0;
-	job_info->jobs = NULL;
+	if (filter->filter_fields & JERS_FILTER_QUEUE)
+		JSONAddString(b, QUEUENAME, filter->filters.queue_name);
 
-	buff_t b;
+	if (filter->filter_fields & JERS_FILTER_STATE)
+		JSONAddInt(b, STATE, filter->filters.state);
 
-	initRequest(&b, CMD_GET_JOB, 1);
+	if (filter->filter_fields & JERS_FILTER_TAGS)
+		JSONAddMap(b, TAGS, filter->filters.tag_count, (key_val_t *)filter->filters.tags);
 
-	if (jobid) {
-		JSONAddInt(&b, JOBID, jobid);
-	} else if (filter) {
-		if (filter->filter_fields) {
+	if (filter->filter_fields & JERS_FILTER_RESOURCES)
+		JSONAddStringArray(b, RESOURCES, filter->filters.res_count, filter->filters.resources);
 
-			if (filter->filter_fields & JERS_FILTER_JOBNAME)
-				JSONAddString(&b, JOBNAME, filter->filters.job_name);
+	if (filter->filter_fields & JERS_FILTER_UID)
+		JSONAddInt(b, UID, filter->filters.uid);
 
-			if (filter->filter_fields & JERS_FILTER_QUEUE)
-				JSONAddString(&b, QUEUENAME, filter->filters.queue_name);
+	if (filter->filter_fields & JERS_FILTER_SUBMITTER)
+		JSONAddInt(b, SUBMITTER, filter->filters.submitter);
 
-			if (filter->filter_fields & JERS_FILTER_STATE)
-				JSONAddInt(&b, STATE, filter->filters.state);
+	if (filter->filter_fields & JERS_FILTER_BEFORE) {
+		if (filter->filters.before.added)
+			JSONAddInt(b, BEFORE_ADDED, filter->filters.before.added);
 
-			if (filter->filter_fields & JERS_FILTER_TAGS)
-				JSONAddMap(&b, TAGS, filter->filters.tag_count, (key_val_t *)filter->filters.tags);
+		if (filter->filters.before.started)
+			JSONAddInt(b, BEFORE_STARTED, filter->filters.before.started);
 
-			if (filter->filter_fields & JERS_FILTER_RESOURCES)
-				JSONAddStringArray(&b, RESOURCES, filter->filters.res_count, filter->filters.resources);
+		if (filter->filters.before.finished)
+			JSONAddInt(b, BEFORE_FINISHED, filter->filters.before.finished);
+	}
 
-			if (filter->filter_fields & JERS_FILTER_UID)
-				JSONAddInt(&b, UID, filter->filters.uid);
+	if (filter->filter_fields & JERS_FILTER_AFTER) {
+		if (filter->filters.after.added)
+			JSONAddInt(b, AFTER_ADDED, filter->filters.after.added);
 
-			if (filter->filter_fields & JERS_FILTER_SUBMITTER)
-				JSONAddInt(&b, SUBMITTER, filter->filters.submitter);
+		if (filter->filters.after.started)
+			JSONAddInt(b, AFTER_STARTED, filter->filters.after.started);
 
-			if (filter->filter_fields & JERS_FILTER_BEFORE) {
-				if (filter->filters.before.added)
-					JSONAddInt(&b, BEFORE_ADDED, filter->filters.before.added);
+		if (filter->filters.after.finished)
+			JSONAddInt(b, AFTER_FINISHED, filter->filters.after.finished);
+	}
 
-				if (filter->filters.before.started)
-					JSONAddInt(&b, BEFORE_STARTED, filter->filters.before.started);
+}
 
-				if (filter->filters.before.finished)
-					JSONAddInt(&b, BEFORE_FINISHED, filter->filters.before.finished);
-			}
+static int getJobs(jobid_t jobid, const jersJobFilter * filter, const int64_t *changed_since, jersJobInfo * job_info) {
+	if (jersInitAPI(NULL))
+		return 1;
 
-			if (filter->filter_fields & JERS_FILTER_AFTER) {
-				if (filter->filters.before.added)
-					JSONAddInt(&b, AFTER_ADDED, filter->filters.after.added);
+	job_info->count = 0;
+	job_info->jobs = NULL;
 
-				if (filter->filters.before.started)
-					JSONAddInt(&b, AFTER_STARTED, filter->filters.after.started);
+	buff_t b;
 
-				if (filter->filters.before.finished)
-					JSONAddInt(&b, AFTER_FINISHED, filter->filters.after.finished);
-			}
-		}
+	initRequest(&b, CMD_GET_JOB, 1);
+
+	if (jobid) {
+		JSONAddInt(&b, JOBID, jobid);
+	} else if (filter) {
+		serializeJobFilter(&b, filter);
 
 		if (filter->return_fields)
 			JSONAddInt(&b, RETFIELDS, filter->return_fields);
 	}
 
+	if (changed_since)
+		JSONAddInt(&b, CHANGED_SINCE, *changed_since);
+
 	if (sendRequest(&b))
 		return 1;
 
@@ -526,6 +537,20 @@ JERS_EXPORT int jersGetJob(jobid_t jobid, const jersJobFilter * filter, jersJobI
 	return 0;
 }
 
+JERS_EXPORT int jersGetJob(jobid_t jobid, const jersJobFilter * filter, jersJobInfo * job_info) {
+	return getJobs(jobid, filter, NULL, job_info);
+}
+
+JERS_EXPORT int jersGetJobChanges(int64_t since, const jersJobFilter * filter, jersJobInfo * job_info, int64_t *change_seq, int *resync) {
+	if (getJobs(0, filter, &since, job_info))
+		return 1;
+
+	*change_seq = msg.change_seq;
+	*resync = msg.resync;
+
+	return 0;
+}
+
 
 JERS_EXPORT int jersDelJob(jobid_t jobid) {
 	if (jersInitAPI(NULL))
@@ -579,80 +604,91 @@ JERS_EXPORT jobid_t jersAddJob(const jersJobAdd * j) {
 
 	buff_t b;
 	initRequest(&b, CMD_ADD_JOB, 1);
+	serializeJobAddFields(&b, j);
 
-	JSONAddStringArray(&b, ARGS, j->argc, j->argv);
-
-	if (j->name)
-		JSONAddString(&b, JOBNAME, j->name);
-
-	if (j->queue)
-		JSONAddString(&b, QUEUENAME, j->queue);
-
-	if (j->uid > 0)
-		JSONAddInt(&b, UID, j->uid);
-
-	if (j->shell)
-		JSONAddString(&b, SHELL, j->shell);
+	if (sendRequest(&b))
+		return 0;
 
-	if (j->priority != UNSET_32)
-		JSONAddInt(&b, PRIORITY, j->priority);
+	if (readResponse())
+		return 0;
 
-	if (j->hold)
-		JSONAddBool(&b, HOLD, 1);
+	/* Should just have a single JOBID field returned */
+	if (msg.item_count != 1 || msg.items[0].field_count != 1 || msg.items[0].fields[0].number != JOBID) {
+		setJersErrno(JERS_ERR_INVRESP, NULL);
+		return 0;
+	}
 
-	if (j->nice)
-		JSONAddInt(&b, NICE, j->nice);
+	new_jobid = getNumberField(&msg.items[0].fields[0]);
 
-	if (j->tag_count)
-		JSONAddMap(&b, TAGS, j->tag_count, (key_val_t *)j->tags);
+	free_message(&msg);
+	return new_jobid;
+}
 
-	if (j->res_count)
-		JSONAddStringArray(&b, RESOURCES, j->res_count, j->resources);
+/* Submit a batch of jobs in a single request. The daemon adds either all of
+ * the jobs or none of them. The new jobids are stored in ids, which must
+ * have room for count entries. */
 
-	if (j->env_count != UNSET_64)
-		JSONAddStringArray(&b, ENVS, j->env_count, j->envs);
+JERS_EXPORT int jersAddJobs(const jersJobAdd *jobs, size_t count, jobid_t *ids) {
+	if (jersInitAPI(NULL))
+		return 1;
 
-	if (j->jobid)
-		JSONAddInt(&b, JOBID, j->jobid);
+	if (!jobs || !ids || count == 0) {
+		setJersErrno(JERS_ERR_INVARG, NULL);
+		return 1;
+	}
 
-	if (j->wrapper) {
-		JSONAddString(&b, WRAPPER, j->wrapper);
-	} else {
-		if (j->pre_cmd)
-			JSONAddString(&b, PRECMD, j->pre_cmd);
+	for (size_t i = 0; i < count; i++) {
+		if (jobs[i].argc <= 0 || jobs[i].argv == NULL) {
+			setJersErrno(JERS_ERR_INVARG, "argc/argv must be populated");
+			return 1;
+		}
 
-		if (j->post_cmd)
-			JSONAddString(&b, POSTCMD, j->post_cmd);
+		if (jobs[i].env_count > 0 && jobs[i].envs == NULL) {
+			setJersErrno(JERS_ERR_INVARG, "env_count populated, but env not passed");
+			return 1;
+		}
 	}
 
-	if (j->stdout)
-		JSONAddString(&b, STDOUT, j->stdout);
+	/* The jobs are sent as an array of items, rather than a single fields object */
+	buff_t b;
 
-	if (j->stderr)
-		JSONAddString(&b, STDERR, j->stderr);
+	buffNew(&b, DEFAULT_REQUEST_SIZE);
+	JSONStart(&b);
+	JSONStartObject(&b, CMD_ADD_JOBS, CONST_STRLEN(CMD_ADD_JOBS));
+	JSONAddInt(&b, VERSION, 1);
+	JSONStartArray(&b, "DATA", 4);
 
-	if (j->defer_time != -1)
-		JSONAddInt(&b, DEFERTIME, j->defer_time);
+	for (size_t i = 0; i < count; i++)
+		serializeJobAdd(&b, &jobs[i]);
 
-	if (j->flags)
-		JSONAddInt(&b, FLAGS, j->flags);
+	JSONEndArray(&b);
+	JSONEndObject(&b);
+	JSONEnd(&b);
 
-	if (sendRequest(&b))
-		return 0;
+	if (sendMessage(&b))
+		return 1;
 
 	if (readResponse())
-		return 0;
+		return 1;
 
-	/* Should just have a single JOBID field returned */
-	if (msg.item_count != 1 || msg.items[0].field_count != 1 || msg.items[0].fields[0].number != JOBID) {
+	if ((size_t)msg.item_count != count) {
 		setJersErrno(JERS_ERR_INVRESP, NULL);
-		return 0;
+		free_message(&msg);
+		return 1;
 	}
 
-	new_jobid = getNumberField(&msg.items[0].fields[0]);
+	for (int64_t i = 0; i < msg.item_count; i++) {
+		if (msg.items[i].field_count != 1 || msg.items[i].fields[0].number != JOBID) {
+			setJersErrno(JERS_ERR_INVRESP, NULL);
+			free_message(&msg);
+			return 1;
+		}
+
+		ids[i] = getNumberField(&msg.items[i].fields[0]);
+	}
 
 	free_message(&msg);
-	return new_jobid;
+	return 0;
 }
 
 JERS_EXPORT void jersInitJobMod(jersJobMod *j) {
@@ -677,41 +713,7 @@ JERS_EXPORT int jersModJob(const jersJobMod *j) {
 
 	buff_t b;
 	initRequest(&b, CMD_MOD_JOB, 1);
-
-	JSONAddInt(&b, JOBID, j->jobid);
-
-	if (j->name)
-		JSONAddString(&b, JOBNAME, j->name);
-
-	if (j->queue)
-		JSONAddString(&b, QUEUENAME, j->queue);
-
-	if (j->defer_time != UNSET_TIME_T)
-		JSONAddInt(&b, DEFERTIME, j->defer_time);
-
-	if (j->restart)
-		JSONAddBool(&b, RESTART, 1);
-
-	if (j->nice != UNSET_32)
-		JSONAddInt(&b, NICE, j->nice);
-
-	if (j->priority != UNSET_32)
-		JSONAddInt(&b, PRIORITY, j->priority);
-
-	if (j->hold != UNSET_8)
-		JSONAddBool(&b, HOLD, j->hold);
-
-	if (j->env_count != UNSET_64)
-		JSONAddStringArray(&b, ENVS, j->env_count, j->envs);
-
-	if (j->tag_count != UNSET_64)
-		JSONAddMap(&b, TAGS, j->tag_count, (key_val_t *)j->tags);
-
-	if (j->res_count != UNSET_64)
-		JSONAddStringArray(&b, RESOURCES, j->res_count, j->resources);
-
-	if (j->clear_resources)
-		JSONAddBool(&b, CLEARRES, 1);
+	serializeJobModFields(&b, j);
 
 	if (sendRequest(&b)) {
 		return 1;
@@ -762,6 +764,91 @@ JERS_EXPORT int jersSignalJob(jobid_t id, int signum) {
 	return status;
 }
 
+/* The bulk requests are sent as an array of items. The first item is the
+ * action to apply to the jobs, the second is the filter used to select them */
+
+static int bulkRequest(const char *cmd, size_t cmd_len, const jersJobFilter *filter, const jersJobMod *mod, int signum, int64_t *count, int64_t *failed) {
+	if (jersInitAPI(NULL))
+		return 1;
+
+	if (filter == NULL || filter->filter_fields == 0) {
+		setJersErrno(JERS_ERR_INVARG, "No filter provided");
+		return 1;
+	}
+
+	buff_t b;
+
+	buffNew(&b, DEFAULT_REQUEST_SIZE);
+	JSONStart(&b);
+	JSONStartObject(&b, cmd, cmd_len);
+	JSONAddInt(&b, VERSION, 1);
+	JSONStartArray(&b, "DATA", 4);
+
+	JSONStartObject(&b, NULL, 0);
+
+	if (mod)
+		serializeJobModFields(&b, mod);
+
+	if (signum >= 0)
+		JSONAddInt(&b, SIGNAL, signum);
+
+	JSONEndObject(&b);
+
+	JSONStartObject(&b, NULL, 0);
+	serializeJobFilter(&b, filter);
+	JSONEndObject(&b);
+
+	JSONEndArray(&b);
+	JSONEndObject(&b);
+	JSONEnd(&b);
+
+	if (sendMessage(&b))
+		return 1;
+
+	if (readResponse())
+		return 1;
+
+	if (msg.item_count != 1) {
+		setJersErrno(JERS_ERR_INVRESP, NULL);
+		free_message(&msg);
+		return 1;
+	}
+
+	for (int i = 0; i < msg.items[0].field_count; i++) {
+		switch (msg.items[0].fields[i].number) {
+			case COUNT : if (count) *count = getNumberField(&msg.items[0].fields[i]); break;
+			case FAILED: if (failed) *failed = getNumberField(&msg.items[0].fields[i]); break;
+
+			default: fprintf(stderr, "Unknown field '%s' encountered - Ignoring\n",msg.items[0].fields[i].name); break;
+		}
+	}
+
+	free_message(&msg);
+	return 0;
+}
+
+JERS_EXPORT int jersDelJobs(const jersJobFilter *filter, int64_t *count, int64_t *failed) {
+	return bulkRequest(CMD_DEL_JOBS, CONST_STRLEN(CMD_DEL_JOBS), filter, NULL, -1, count, failed);
+}
+
+JERS_EXPORT int jersModJobs(const jersJobFilter *filter, const jersJobMod *j, int64_t *count, int64_t *failed) {
+	if (j == NULL) {
+		setJersErrno(JERS_ERR_INVARG, NULL);
+		return 1;
+	}
+
+	return bulkRequest(CMD_MOD_JOBS, CONST_STRLEN(CMD_MOD_JOBS), filter, j, -1, count, failed);
+}
+
+JERS_EXPORT int jersSignalJobs(const jersJobFilter *filter, int signum, int64_t *count, int64_t *failed) {
+	if (signum < 0 || signum >= SIGRTMAX) {
+		setJersErrno(JERS_ERR_INVARG, "Invalid signum provided");
+		return 1;
+	}
+
+	return bulkRequest(CMD_SIG_JOBS, CONST_STRLEN(CMD_SIG_JOBS), filter, NULL, signum, count, failed);
+}
+
 JERS_EXPORT int jersClearCache(void) {
 	if (jersInitAPI(NULL))
 		return 1;
@@ -1188,6 +1275,125 @@ JERS_EXPORT int jersGetStats(jersStats * s) {
 	return 0;
 }
 
+JERS_EXPORT int jersGetSchedStats(jersSchedStats * s) {
+	int i;
+
+	if (jersInitAPI(NULL))
+		return 1;
+
+	memset(s, 0, sizeof(jersSchedStats));
+
+	buff_t b;
+
+	initRequest(&b, CMD_SCHED_STATS, 1);
+
+	if (sendRequest(&b))
+		return 1;
+
+	if (readResponse())
+		return 1;
+
+	msg_item * item = &msg.items[0];
+
+	for (i = 0; i < item->field_count; i++) {
+		switch(item->fields[i].number) {
+			case SCHEDSTARTED    : s->started = getNumberField(&item->fields[i]); break;
+			case SCHEDLATENCYAVG : s->latency_avg_ms = getNumberField(&item->fields[i]); break;
+			case SCHEDLATENCYMAX : s->latency_max_ms = getNumberField(&item->fields[i]); break;
+			case SCHEDPASSES     : s->passes = getNumberField(&item->fields[i]); break;
+			case SCHEDFULLPASSES : s->full_passes = getNumberField(&item->fields[i]); break;
+
+			default: fprintf(stderr, "Unknown field '%s' encountered - Ignoring\n",item->fields[i].name); break;
+		}
+	}
+
+	free_message(&msg);
+
+	return 0;
+}
+
+/* Stream state changes for jobs matching the queue, tag and uid filters
+ * to the callback, until it returns non-zero or an error occurs.
+ * The subscription takes over the connection to the daemon, so it is
+ * closed before returning. The next request will reconnect. */
+
+JERS_EXPORT int jersSubscribe(const jersJobFilter *filter, jersEventCallback callback, void *arg) {
+	int rc = 0;
+
+	if (jersInitAPI(NULL))
+		return 1;
+
+	buff_t b;
+
+	initRequest(&b, CMD_SUBSCRIBE, 1);
+
+	if (filter) {
+		if (filter->filter_fields & JERS_FILTER_QUEUE)
+			JSONAddString(&b, QUEUENAME, filter->filters.queue_name);
+
+		if (filter->filter_fields & JERS_FILTER_TAGS)
+			JSONAddMap(&b, TAGS, filter->filters.tag_count, (key_val_t *)filter->filters.tags);
+
+		if (filter->filter_fields & JERS_FILTER_UID)
+			JSONAddInt(&b, UID, filter->filters.uid);
+	}
+
+	if (sendRequest(&b))
+		return 1;
+
+	if (readResponse())
+		return 1;
+
+	free_message(&msg);
+
+	/* Events can be a long time apart, so don't timeout waiting for them */
+	struct timeval tv = {0, 0};
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1)
+		fprintf(stderr, "Warning: Failed to set recv timeout on socket\n");
+
+	while (1) {
+		int stop = 0;
+
+		if (readResponse()) {
+			rc = 1;
+			break;
+		}
+
+		for (int64_t i = 0; i < msg.item_count && !stop; i++) {
+			msg_item *item = &msg.items[i];
+			jersJobEvent event = {0};
+
+			for (int k = 0; k < item->field_count; k++) {
+				switch (item->fields[k].number) {
+					case JOBID   : event.jobid = getNumberField(&item->fields[k]); break;
+					case REVISION: event.revision = getNumberField(&item->fields[k]); break;
+					case STATE   : event.state = getNumberField(&item->fields[k]); break;
+					case EXITCODE: event.exitcode = getNumberField(&item->fields[k]); break;
+					case DROPPED : event.dropped = getNumberField(&item->fields[k]); break;
+
+					default: fprintf(stderr, "Unknown field '%s' encountered - Ignoring\n",item->fields[k].name); break;
+				}
+			}
+
+			stop = callback(&event, arg);
+		}
+
+		free_message(&msg);
+
+		if (stop)
+			break;
+	}
+
+	/* Drop the connection, so the daemon stops sending us events */
+	close(fd);
+	fd = -1;
+	buffFree(&response);
+	initalised = 0;
+
+	return rc;
+}
+
 JERS_EXPORT int jersSetTag(jobid_t id, const char * key, const char * value) {
 	if (jersInitAPI(NULL))
 		return 1;
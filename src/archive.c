@@ -0,0 +1,827 @@
+/* Copyright (c) 2020 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <server.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Archive segments
+ *
+ * With 'archive_after' set, completed and exited jobs that finished more
+ * than that many hours ago are moved out of the job table into archive
+ * segments under state_dir/archive. Each run of the archiver writes a new
+ * segment, which is never modified afterwards.
+ *
+ * Segments are written as part of a background save, by the forked child or
+ * the writer thread, after the state files. The jobs are only removed from
+ * the job table once the save has finished and the segment is on disk.
+ *
+ * A segment is a header followed by a set of columns. Each column holds one
+ * group of fields for every job in the segment, encoded as varints. Jobs are
+ * sorted by jobid, with jobids and submit times stored as deltas from the
+ * previous job and the start and finish times as deltas from the submit
+ * time, so most values only take a byte or two. Queue names are stored once
+ * per segment, with each job holding an index into them.
+ *
+ * The header records the jobid and time ranges covered by the segment.
+ * These are kept in memory, so a search only reads the segments that can
+ * hold a matching job. */
+
+#define ARCHIVE_MAGIC "JERSARC1"
+#define ARCHIVE_MAX_JOBS 50000	// Maximum jobs written to a segment per run
+
+enum archiveColumn {
+	ARCHIVE_COL_QUEUES,	// Name, node and nice of each queue used in the segment
+	ARCHIVE_COL_JOBID,
+	ARCHIVE_COL_TIMES,	// Submit, defer, start and finish times
+	ARCHIVE_COL_STATUS,	// State, exitcode, signal and fail reason
+	ARCHIVE_COL_USER,	// uid and submitter
+	ARCHIVE_COL_QUEUE,	// Queue index, priority and nice
+	ARCHIVE_COL_NAME,
+	ARCHIVE_COL_COMMAND,	// Arguments, shell, wrapper, pre and post commands
+	ARCHIVE_COL_OUTPUT,	// stdout and stderr
+	ARCHIVE_COL_ENV,
+	ARCHIVE_COL_TAGS,
+	ARCHIVE_COL_RESOURCES,
+	ARCHIVE_COL_USAGE,
+	ARCHIVE_COLUMNS
+};
+
+struct archiveHeader {
+	char magic[8];
+	uint32_t crc;		// CRC32C of the header from 'columns' onwards and the column data
+	uint32_t columns;
+	uint64_t count;		// Jobs in the segment
+	uint32_t min_jobid;
+	uint32_t max_jobid;
+	int64_t min_submit;
+	int64_t max_submit;
+	int64_t min_start;	// Start and finish ranges only cover jobs with the time set
+	int64_t max_start;
+	int64_t min_finish;
+	int64_t max_finish;
+	uint64_t length[ARCHIVE_COLUMNS];
+} __attribute__((packed));
+
+#define ARCHIVE_HEADER_CRC_OFFSET offsetof(struct archiveHeader, columns)
+
+struct archiveSegment {
+	int64_t seq;
+	struct archiveHeader h;
+};
+
+int flushDir(char *path);
+int syncDir(const char *path);
+void createDir(const char *path);
+
+static char *archive_dir = NULL;
+
+/* The jobs being archived by the background save in progress */
+static struct {
+	struct job **jobs;	// Only valid until the segment is built
+	struct savedJob {
+		jobid_t jobid;
+		int64_t revision;
+	} *archived;
+	int64_t count;
+	int64_t seq;
+	char path[PATH_MAX];
+} save;
+
+static const char *archivePath(int64_t seq) {
+	static char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%016ld.segment", archive_dir, seq);
+	return path;
+}
+
+static void addSegment(int64_t seq, struct archiveHeader *h) {
+	server.archive.segments = realloc(server.archive.segments, sizeof(struct archiveSegment) * (server.archive.count + 1));
+
+	if (server.archive.segments == NULL)
+		error_die("Failed to allocate memory for archive segments: %s", strerror(errno));
+
+	server.archive.segments[server.archive.count].seq = seq;
+	memcpy(&server.archive.segments[server.archive.count].h, h, sizeof(struct archiveHeader));
+	server.archive.count++;
+
+	if (seq > server.archive.seq)
+		server.archive.seq = seq;
+}
+
+static int readHeader(const char *path, struct archiveHeader *h) {
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to open archive segment %s: %s", path, strerror(errno));
+		return 1;
+	}
+
+	if (pread(fd, h, sizeof(*h), 0) != sizeof(*h) || memcmp(h->magic, ARCHIVE_MAGIC, sizeof(h->magic)) != 0 || h->columns != ARCHIVE_COLUMNS) {
+		print_msg(JERS_LOG_WARNING, "Ignoring invalid archive segment %s", path);
+		close(fd);
+		return 1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/* Read the header of each segment, which is all that's kept in memory */
+
+void archiveInit(void) {
+	char pattern[PATH_MAX];
+	glob_t segments;
+
+	free(archive_dir);
+	free(server.archive.segments);
+	server.archive.segments = NULL;
+	server.archive.count = 0;
+	server.archive.seq = 0;
+
+	if (asprintf(&archive_dir, "%s/archive", server.state_dir) == -1)
+		error_die("Failed to allocate archive directory name: %s", strerror(errno));
+
+	if (server.archive.after)
+		createDir(archive_dir);
+
+	snprintf(pattern, sizeof(pattern), "%s/*.segment", archive_dir);
+
+	if (glob(pattern, 0, NULL, &segments) != 0)
+		return;
+
+	for (size_t i = 0; i < segments.gl_pathc; i++) {
+		struct archiveHeader h;
+
+		if (readHeader(segments.gl_pathv[i], &h))
+			continue;
+
+		addSegment(atoll(strrchr(segments.gl_pathv[i], '/') + 1), &h);
+	}
+
+	print_msg(JERS_LOG_INFO, "Found %ld archive segments in %s", server.archive.count, archive_dir);
+	globfree(&segments);
+}
+
+/* Times are stored relative to a base, with 0 kept for unset */
+
+static void encodeTime(buff_t *b, time_t t, time_t base) {
+	int64_t delta = t - base;
+	encodeVarint(b, t ? (((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63)) + 1 : 0);
+}
+
+static time_t decodeTime(struct decoder *d, time_t base) {
+	uint64_t value = decodeVarint(d);
+
+	if (value == 0)
+		return 0;
+
+	value--;
+	return base + ((int64_t)(value >> 1) ^ -(int64_t)(value & 1));
+}
+
+static void updateRange(int64_t *min, int64_t *max, int64_t value) {
+	if (value == 0)
+		return;
+
+	if (*min == 0 || value < *min)
+		*min = value;
+
+	if (value > *max)
+		*max = value;
+}
+
+static int jobidComp(const void *a, const void *b) {
+	jobid_t x = (*(struct job **)a)->jobid;
+	jobid_t y = (*(struct job **)b)->jobid;
+
+	return (x > y) - (x < y);
+}
+
+static void encodeJobs(struct job **jobs, int64_t count, struct archiveHeader *h, buff_t *cols) {
+	struct queue **queues = NULL;
+	int64_t queue_count = 0;
+	int64_t range[6] = {0};	// Min and max submit, start and finish times
+	jobid_t prev_jobid = 0;
+	time_t prev_submit = 0;
+
+	for (int64_t i = 0; i < count; i++) {
+		struct job *j = jobs[i];
+		int64_t q;
+
+		/* The full job is needed if it was lazily loaded */
+		stateLoadJobDetails(j);
+
+		for (q = 0; q < queue_count; q++) {
+			if (queues[q] == j->queue)
+				break;
+		}
+
+		if (q == queue_count) {
+			queues = realloc(queues, sizeof(struct queue *) * (queue_count + 1));
+			queues[queue_count++] = j->queue;
+		}
+
+		encodeVarint(&cols[ARCHIVE_COL_JOBID], j->jobid - prev_jobid);
+		prev_jobid = j->jobid;
+
+		encodeTime(&cols[ARCHIVE_COL_TIMES], j->submit_time, prev_submit);
+		encodeTime(&cols[ARCHIVE_COL_TIMES], j->defer_time, j->submit_time);
+		encodeTime(&cols[ARCHIVE_COL_TIMES], j->start_time, j->submit_time);
+		encodeTime(&cols[ARCHIVE_COL_TIMES], j->finish_time, j->submit_time);
+		prev_submit = j->submit_time;
+
+		encodeVarint(&cols[ARCHIVE_COL_STATUS], j->state);
+		encodeSigned(&cols[ARCHIVE_COL_STATUS], j->exitcode);
+		encodeVarint(&cols[ARCHIVE_COL_STATUS], j->signal);
+		encodeVarint(&cols[ARCHIVE_COL_STATUS], j->fail_reason);
+
+		encodeVarint(&cols[ARCHIVE_COL_USER], j->uid);
+		encodeVarint(&cols[ARCHIVE_COL_USER], j->submitter);
+
+		encodeVarint(&cols[ARCHIVE_COL_QUEUE], q);
+		encodeSigned(&cols[ARCHIVE_COL_QUEUE], j->priority);
+		encodeSigned(&cols[ARCHIVE_COL_QUEUE], j->nice);
+
+		encodeString(&cols[ARCHIVE_COL_NAME], j->jobname);
+
+		encodeVarint(&cols[ARCHIVE_COL_COMMAND], j->argc);
+		for (int k = 0; k < j->argc; k++)
+			encodeString(&cols[ARCHIVE_COL_COMMAND], j->argv[k]);
+
+		encodeString(&cols[ARCHIVE_COL_COMMAND], j->shell);
+		encodeString(&cols[ARCHIVE_COL_COMMAND], j->wrapper);
+		encodeString(&cols[ARCHIVE_COL_COMMAND], j->pre_cmd);
+		encodeString(&cols[ARCHIVE_COL_COMMAND], j->post_cmd);
+
+		encodeString(&cols[ARCHIVE_COL_OUTPUT], j->stdout);
+		encodeString(&cols[ARCHIVE_COL_OUTPUT], j->stderr);
+
+		encodeVarint(&cols[ARCHIVE_COL_ENV], j->env_count);
+		for (int k = 0; k < j->env_count; k++)
+			encodeString(&cols[ARCHIVE_COL_ENV], j->envs[k]);
+
+		encodeVarint(&cols[ARCHIVE_COL_TAGS], j->tag_count);
+		for (int k = 0; k < j->tag_count; k++) {
+			encodeString(&cols[ARCHIVE_COL_TAGS], j->tags[k].key);
+			encodeString(&cols[ARCHIVE_COL_TAGS], j->tags[k].value);
+		}
+
+		/* Resources are stored by name, as they may be removed later */
+		encodeVarint(&cols[ARCHIVE_COL_RESOURCES], j->res_count);
+		for (int k = 0; k < j->res_count; k++) {
+			encodeString(&cols[ARCHIVE_COL_RESOURCES], j->req_resources[k].res->name);
+			encodeVarint(&cols[ARCHIVE_COL_RESOURCES], j->req_resources[k].needed);
+		}
+
+		encodeVarint(&cols[ARCHIVE_COL_USAGE], j->usage.ru_utime.tv_sec);
+		encodeVarint(&cols[ARCHIVE_COL_USAGE], j->usage.ru_utime.tv_usec);
+		encodeVarint(&cols[ARCHIVE_COL_USAGE], j->usage.ru_stime.tv_sec);
+		encodeVarint(&cols[ARCHIVE_COL_USAGE], j->usage.ru_stime.tv_usec);
+		encodeVarint(&cols[ARCHIVE_COL_USAGE], j->usage.ru_maxrss);
+		encodeVarint(&cols[ARCHIVE_COL_USAGE], j->usage.ru_minflt);
+		encodeVarint(&cols[ARCHIVE_COL_USAGE], j->usage.ru_majflt);
+		encodeVarint(&cols[ARCHIVE_COL_USAGE], j->usage.ru_inblock);
+		encodeVarint(&cols[ARCHIVE_COL_USAGE], j->usage.ru_oublock);
+		encodeVarint(&cols[ARCHIVE_COL_USAGE], j->usage.ru_nvcsw);
+		encodeVarint(&cols[ARCHIVE_COL_USAGE], j->usage.ru_nivcsw);
+
+		if (h->min_jobid == 0 || j->jobid < h->min_jobid)
+			h->min_jobid = j->jobid;
+
+		if (j->jobid > h->max_jobid)
+			h->max_jobid = j->jobid;
+
+		updateRange(&range[0], &range[1], j->submit_time);
+		updateRange(&range[2], &range[3], j->start_time);
+		updateRange(&range[4], &range[5], j->finish_time);
+	}
+
+	h->min_submit = range[0];
+	h->max_submit = range[1];
+	h->min_start = range[2];
+	h->max_start = range[3];
+	h->min_finish = range[4];
+	h->max_finish = range[5];
+
+	encodeVarint(&cols[ARCHIVE_COL_QUEUES], queue_count);
+
+	for (int64_t q = 0; q < queue_count; q++) {
+		encodeString(&cols[ARCHIVE_COL_QUEUES], queues[q]->name);
+		encodeString(&cols[ARCHIVE_COL_QUEUES], queues[q]->host);
+		encodeSigned(&cols[ARCHIVE_COL_QUEUES], queues[q]->nice);
+	}
+
+	free(queues);
+}
+
+/* Encode the jobs into a segment. The jobs are sorted by jobid */
+
+void archiveBuild(struct job **jobs, int64_t count, buff_t *segment) {
+	struct archiveHeader h = {0};
+	buff_t cols[ARCHIVE_COLUMNS];
+
+	qsort(jobs, count, sizeof(struct job *), jobidComp);
+
+	for (int i = 0; i < ARCHIVE_COLUMNS; i++)
+		buffNew(&cols[i], 0);
+
+	encodeJobs(jobs, count, &h, cols);
+
+	memcpy(h.magic, ARCHIVE_MAGIC, sizeof(h.magic));
+	h.columns = ARCHIVE_COLUMNS;
+	h.count = count;
+
+	buffNew(segment, 0);
+	buffAdd(segment, (char *)&h, sizeof(h));
+
+	for (int i = 0; i < ARCHIVE_COLUMNS; i++) {
+		h.length[i] = cols[i].used;
+		buffAddBuff(segment, &cols[i]);
+		buffFree(&cols[i]);
+	}
+
+	h.crc = crc32c(0, (char *)&h + ARCHIVE_HEADER_CRC_OFFSET, sizeof(h) - ARCHIVE_HEADER_CRC_OFFSET);
+	h.crc = crc32c(h.crc, segment->data + sizeof(h), segment->used - sizeof(h));
+	memcpy(segment->data, &h, sizeof(h));
+}
+
+/* Write a segment to disk. A segment that can't be made durable is removed,
+ * so its jobs are left in the job table. Safe to call from the writer thread */
+
+/* Write a segment and flush the directory it's in. This doesn't log
+ * anything, as it's also used by the background save writer thread */
+
+static int writeSegment(const char *path, buff_t *segment) {
+	struct stateFile sf = {0};
+	int rc;
+
+	sf.filename = (char *)path;
+	sf.data = segment->data;
+	sf.len = segment->used;
+
+	rc = writeStateFile(&sf);
+
+	if (rc == 0 && (rc = syncDir(path)) != 0)
+		unlink(path);
+
+	return rc;
+}
+
+/* Write the jobs to a new archive segment straight away */
+
+int archiveWrite(struct job **jobs, int64_t count) {
+	char path[PATH_MAX];
+	buff_t segment;
+	int64_t seq = server.archive.seq + 1;
+
+	snprintf(path, sizeof(path), "%s", archivePath(seq));
+	archiveBuild(jobs, count, &segment);
+
+	int rc = writeSegment(path, &segment);
+
+	if (rc != 0)
+		print_msg(JERS_LOG_WARNING, "Failed to write archive segment %s", path);
+
+	if (rc == 0) {
+		addSegment(seq, (struct archiveHeader *)segment.data);
+		print_msg(JERS_LOG_INFO, "Archived %ld jobs to %s (%ld bytes)", count, path, segment.used);
+	}
+
+	buffFree(&segment);
+
+	return rc;
+}
+
+/* Flag the finished jobs older than archive_after hours to be moved into a
+ * new segment by the next background save. The finish time index holds the
+ * oldest jobs first */
+
+void archiveJobs(void) {
+	time_t target_time = time(NULL) - (server.archive.after * 60 * 60);
+	struct job *j = server.timeIndex[TIME_INDEX_FINISH].head[0];
+
+	if (j && j->time_links[TIME_INDEX_FINISH].key <= target_time)
+		server.archive.due = 1;
+}
+
+/* Pick the jobs to archive as a background save starts. Their jobid and
+ * revision are kept, so only jobs unchanged since are removed once it's done */
+
+void archiveStartSave(void) {
+	time_t target_time = time(NULL) - (server.archive.after * 60 * 60);
+	int64_t size = 0;
+
+	if (!server.archive.due)
+		return;
+
+	server.archive.due = 0;
+
+	struct job *j = server.timeIndex[TIME_INDEX_FINISH].head[0];
+
+	for (; j && j->time_links[TIME_INDEX_FINISH].key <= target_time && save.count < ARCHIVE_MAX_JOBS; j = j->time_links[TIME_INDEX_FINISH].next[0]) {
+		if (j->internal_state &JERS_FLAG_DELETED || (j->state != JERS_JOB_COMPLETED && j->state != JERS_JOB_EXITED))
+			continue;
+
+		if (save.count >= size) {
+			size = size ? size * 2 : 1024;
+			save.jobs = realloc(save.jobs, sizeof(struct job *) * size);
+			save.archived = realloc(save.archived, sizeof(struct savedJob) * size);
+
+			if (save.jobs == NULL || save.archived == NULL)
+				error_die("Failed to allocate memory to archive jobs: %s", strerror(errno));
+		}
+
+		save.jobs[save.count] = j;
+		save.archived[save.count].jobid = j->jobid;
+		save.archived[save.count].revision = j->obj.revision;
+		save.count++;
+	}
+
+	save.seq = server.archive.seq + 1;
+	snprintf(save.path, sizeof(save.path), "%s", archivePath(save.seq));
+}
+
+/* Build the segment for the jobs picked by archiveStartSave(), along with
+ * the path to write it to. This is done by the forked child, or by the main
+ * thread before handing the segment to the writer thread. Returns 0 if there
+ * is nothing to archive */
+
+int archiveBuildSave(buff_t *segment, char *path) {
+	if (save.count == 0)
+		return 0;
+
+	archiveBuild(save.jobs, save.count, segment);
+	strcpy(path, save.path);
+
+	free(save.jobs);
+	save.jobs = NULL;
+
+	return 1;
+}
+
+/* Write the segment as part of the background save. Failures are
+ * reported by archiveSaveDone(), which finds the segment missing */
+
+int archiveWriteSave(buff_t *segment, const char *path) {
+	return writeSegment(path, segment);
+}
+
+/* Once the save has finished, remove the jobs that made it into the segment */
+
+void archiveSaveDone(int status) {
+	struct archiveHeader h;
+	int64_t archived = 0;
+
+	if (save.count == 0)
+		return;
+
+	if (status == 0 && readHeader(save.path, &h) == 0 && h.count == (uint64_t)save.count) {
+		addSegment(save.seq, &h);
+
+		for (int64_t i = 0; i < save.count; i++) {
+			struct job *j = findJob(save.archived[i].jobid);
+
+			/* A job changed during the save keeps its place in the job table */
+			if (j == NULL || j->internal_state &JERS_FLAG_DELETED || j->obj.revision != save.archived[i].revision)
+				continue;
+
+			deleteJob(j);
+			archived++;
+		}
+
+		print_msg(JERS_LOG_INFO, "Archived %ld jobs to %s", archived, save.path);
+	} else {
+		print_msg(JERS_LOG_WARNING, "Archive segment %s was not written, keeping %ld jobs", save.path, save.count);
+	}
+
+	free(save.jobs);
+	free(save.archived);
+	save.jobs = NULL;
+	save.archived = NULL;
+	save.count = 0;
+}
+
+/* Can a segment hold a job with a time between 'after' and 'before'? 0 is unbounded */
+
+static int inRange(int64_t min, int64_t max, time_t after, time_t before) {
+	if (after == 0 && before == 0)
+		return 1;
+
+	/* No job in the segment has this time set */
+	if (max == 0)
+		return 0;
+
+	if (after && max < after)
+		return 0;
+
+	if (before && min > before)
+		return 0;
+
+	return 1;
+}
+
+static int segmentMatches(const struct archiveHeader *h, const jersJobFilter *s) {
+	time_t before_added = 0, before_started = 0, before_finished = 0;
+	time_t after_added = 0, after_started = 0, after_finished = 0;
+
+	if (s->filter_fields & JERS_FILTER_BEFORE) {
+		before_added = s->filters.before.added;
+		before_started = s->filters.before.started;
+		before_finished = s->filters.before.finished;
+	}
+
+	if (s->filter_fields & JERS_FILTER_AFTER) {
+		after_added = s->filters.after.added;
+		after_started = s->filters.after.started;
+		after_finished = s->filters.after.finished;
+	}
+
+	return inRange(h->min_submit, h->max_submit, after_added, before_added) &&
+		inRange(h->min_start, h->max_start, after_started, before_started) &&
+		inRange(h->min_finish, h->max_finish, after_finished, before_finished);
+}
+
+static char **decodeStrings(struct decoder *d, int *count) {
+	*count = decodeCount(d);
+
+	if (*count == 0)
+		return NULL;
+
+	char **strings = malloc(sizeof(char *) * *count);
+
+	for (int i = 0; i < *count; i++)
+		strings[i] = decodeStringDup(d);
+
+	return strings;
+}
+
+/* Decode the next job from the columns. The job's queue points into 'queues' */
+
+static struct job *decodeJob(struct decoder *cols, struct queue *queues, int64_t queue_count, jobid_t *jobid, time_t *submit) {
+	struct job *j = calloc(1, sizeof(struct job));
+	struct decoder *d;
+
+	j->obj.type = JERS_OBJECT_JOB;
+
+	j->jobid = *jobid += decodeVarint(&cols[ARCHIVE_COL_JOBID]);
+
+	d = &cols[ARCHIVE_COL_TIMES];
+	j->submit_time = *submit = decodeTime(d, *submit);
+	j->defer_time = decodeTime(d, j->submit_time);
+	j->start_time = decodeTime(d, j->submit_time);
+	j->finish_time = decodeTime(d, j->submit_time);
+
+	d = &cols[ARCHIVE_COL_STATUS];
+	j->state = decodeVarint(d);
+	j->exitcode = decodeSigned(d);
+	j->signal = decodeVarint(d);
+	j->fail_reason = decodeVarint(d);
+
+	d = &cols[ARCHIVE_COL_USER];
+	j->uid = decodeVarint(d);
+	j->submitter = decodeVarint(d);
+
+	d = &cols[ARCHIVE_COL_QUEUE];
+	uint64_t q = decodeVarint(d);
+	j->queue = &queues[q < (uint64_t)queue_count ? q : 0];
+	j->priority = decodeSigned(d);
+	j->nice = decodeSigned(d);
+
+	j->jobname = decodeStringDup(&cols[ARCHIVE_COL_NAME]);
+
+	d = &cols[ARCHIVE_COL_COMMAND];
+	j->argv = decodeStrings(d, &j->argc);
+	j->shell = decodeStringDup(d);
+	j->wrapper = decodeStringDup(d);
+	j->pre_cmd = decodeStringDup(d);
+	j->post_cmd = decodeStringDup(d);
+
+	d = &cols[ARCHIVE_COL_OUTPUT];
+	j->stdout = decodeStringDup(d);
+	j->stderr = decodeStringDup(d);
+
+	j->envs = decodeStrings(&cols[ARCHIVE_COL_ENV], &j->env_count);
+
+	d = &cols[ARCHIVE_COL_TAGS];
+	j->tag_count = decodeCount(d);
+
+	if (j->tag_count) {
+		j->tags = malloc(sizeof(key_val_t) * j->tag_count);
+
+		for (int i = 0; i < j->tag_count; i++) {
+			j->tags[i].key = decodeStringDup(d);
+			j->tags[i].value = decodeStringDup(d);
+		}
+	}
+
+	/* Only resources that still exist are returned */
+	d = &cols[ARCHIVE_COL_RESOURCES];
+	int res_count = decodeCount(d);
+
+	if (res_count)
+		j->req_resources = malloc(sizeof(struct jobResource) * res_count);
+
+	for (int i = 0; i < res_count; i++) {
+		char *name = decodeStringDup(d);
+		int needed = decodeVarint(d);
+		struct resource *r = name ? findResource(name) : NULL;
+
+		if (r) {
+			j->req_resources[j->res_count].res = r;
+			j->req_resources[j->res_count++].needed = needed;
+		}
+
+		free(name);
+	}
+
+	if (j->res_count == 0) {
+		free(j->req_resources);
+		j->req_resources = NULL;
+	}
+
+	d = &cols[ARCHIVE_COL_USAGE];
+	j->usage.ru_utime.tv_sec = decodeVarint(d);
+	j->usage.ru_utime.tv_usec = decodeVarint(d);
+	j->usage.ru_stime.tv_sec = decodeVarint(d);
+	j->usage.ru_stime.tv_usec = decodeVarint(d);
+	j->usage.ru_maxrss = decodeVarint(d);
+	j->usage.ru_minflt = decodeVarint(d);
+	j->usage.ru_majflt = decodeVarint(d);
+	j->usage.ru_inblock = decodeVarint(d);
+	j->usage.ru_oublock = decodeVarint(d);
+	j->usage.ru_nvcsw = decodeVarint(d);
+	j->usage.ru_nivcsw = decodeVarint(d);
+
+	return j;
+}
+
+/* A job archived again after a crash, before its removal from the job table
+ * was saved, is in two segments. Only the first copy is returned */
+
+struct archivedJob {
+	struct {
+		jobid_t jobid;
+		time_t submit_time;
+	} key;
+	UT_hash_handle hh;
+};
+
+static int seenJob(struct archivedJob **seen, struct job *j) {
+	struct archivedJob *a = calloc(1, sizeof(struct archivedJob)), *found = NULL;
+
+	a->key.jobid = j->jobid;
+	a->key.submit_time = j->submit_time;
+
+	HASH_FIND(hh, *seen, &a->key, sizeof(a->key), found);
+
+	if (found) {
+		free(a);
+		return 1;
+	}
+
+	HASH_ADD(hh, *seen, key, sizeof(a->key), a);
+	return 0;
+}
+
+static void searchSegment(struct archiveSegment *seg, void (*func)(struct job *, void *), void *arg, struct archivedJob **seen) {
+	const char *path = archivePath(seg->seq);
+	struct decoder cols[ARCHIVE_COLUMNS];
+	struct archiveHeader h;
+	struct stat buf;
+	struct queue *queues = NULL;
+	int64_t queue_count;
+	char *data;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &buf) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to open archive segment %s: %s", path, strerror(errno));
+
+		if (fd >= 0)
+			close(fd);
+
+		return;
+	}
+
+	size_t size = buf.st_size;
+
+	data = size >= sizeof(h) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+
+	if (data == MAP_FAILED) {
+		print_msg(JERS_LOG_WARNING, "Failed to map archive segment %s: %s", path, strerror(errno));
+		return;
+	}
+
+	madvise(data, size, MADV_SEQUENTIAL);
+	memcpy(&h, data, sizeof(h));
+
+	/* Check the columns fit in the file and the data is intact */
+	size_t offset = sizeof(h);
+
+	for (int i = 0; i < ARCHIVE_COLUMNS; i++) {
+		if (h.length[i] > size - offset)
+			goto corrupt_segment;
+
+		cols[i].pos = (const unsigned char *)data + offset;
+		cols[i].end = cols[i].pos + h.length[i];
+		cols[i].strings = NULL;
+		cols[i].error = 0;
+		offset += h.length[i];
+	}
+
+	if (crc32c(crc32c(0, (char *)&h + ARCHIVE_HEADER_CRC_OFFSET, sizeof(h) - ARCHIVE_HEADER_CRC_OFFSET), data + sizeof(h), offset - sizeof(h)) != h.crc)
+		goto corrupt_segment;
+
+	queue_count = decodeCount(&cols[ARCHIVE_COL_QUEUES]);
+
+	if (queue_count == 0)
+		goto corrupt_segment;
+
+	queues = calloc(queue_count, sizeof(struct queue));
+
+	for (int64_t q = 0; q < queue_count; q++) {
+		queues[q].name = decodeStringDup(&cols[ARCHIVE_COL_QUEUES]);
+		queues[q].host = decodeStringDup(&cols[ARCHIVE_COL_QUEUES]);
+		queues[q].nice = decodeSigned(&cols[ARCHIVE_COL_QUEUES]);
+	}
+
+	jobid_t jobid = 0;
+	time_t submit = 0;
+
+	for (uint64_t i = 0; i < h.count; i++) {
+		struct job *j = decodeJob(cols, queues, queue_count, &jobid, &submit);
+
+		for (int c = 0; c < ARCHIVE_COLUMNS; c++) {
+			if (cols[c].error) {
+				freeJob(j);
+				goto corrupt_segment;
+			}
+		}
+
+		if (!seenJob(seen, j))
+			func(j, arg);
+
+		freeJob(j);
+	}
+
+	goto search_done;
+
+corrupt_segment:
+	print_msg(JERS_LOG_WARNING, "Archive segment %s is corrupt", path);
+
+search_done:
+	for (int64_t q = 0; queues && q < queue_count; q++) {
+		free(queues[q].name);
+		free(queues[q].host);
+	}
+
+	free(queues);
+	munmap(data, size);
+}
+
+/* Call func for each archived job in a segment that may match the time ranges
+ * in the filter. The caller applies the rest of the filter to the job. */
+
+void archiveSearch(const jersJobFilter *s, void (*func)(struct job *, void *), void *arg) {
+	struct archivedJob *seen = NULL, *a, *tmp;
+
+	for (int64_t i = 0; i < server.archive.count; i++) {
+		if (segmentMatches(&server.archive.segments[i].h, s))
+			searchSegment(&server.archive.segments[i], func, arg, &seen);
+	}
+
+	HASH_ITER(hh, seen, a, tmp) {
+		HASH_DEL(seen, a);
+		free(a);
+	}
+}
@@ -0,0 +1,706 @@
+/* Copyright (c) 2020 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <server.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <glob.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Checkpoint segments
+ *
+ * With 'state_format checkpoint', each background save appends a single
+ * checkpoint holding every dirty job to a segment file, instead of writing
+ * one state file per job. A checkpoint is a header, the encoded job records,
+ * then an index of jobid/offset entries. Deleted jobs are written as index
+ * entries flagged as tombstones. The whole checkpoint is covered by a CRC, so
+ * a checkpoint torn by a crash is discarded when the segment is loaded.
+ *
+ * The first checkpoint in a segment is a full snapshot of every job. Once a
+ * segment has grown to twice the size of its snapshot (and is larger than
+ * checkpoint_compact_size) the next save writes a fresh snapshot to a new
+ * segment and removes the old one. Loading only reads the newest complete
+ * segment, walking its checkpoints newest first. */
+
+#define CHECKPOINT_MAGIC "JERSCKP1"
+#define CHECKPOINT_MAGIC_LEN 8
+#define CHECKPOINT_HEADER_MAGIC "JERSCKPT"
+
+struct checkpointHeader {
+	char magic[8];
+	uint32_t crc;		// CRC32C of the header from 'flags' onwards and the data
+	uint32_t flags;
+	uint64_t length;	// Length of the data following the header
+	uint64_t index;		// Offset of the index within the data
+	uint64_t count;		// Number of index entries
+	int64_t timestamp;
+} __attribute__((packed));
+
+struct checkpointEntry {
+	uint32_t jobid;
+	uint32_t flags;
+	uint64_t offset;	// Offset of the job record within the data
+	uint64_t length;
+} __attribute__((packed));
+
+#define CHECKPOINT_FULL 0x01		// The checkpoint is a snapshot of every job
+
+#define CHECKPOINT_ENTRY_DELETED 0x01	// Tombstone for a deleted job
+
+#define CHECKPOINT_HEADER_CRC_OFFSET offsetof(struct checkpointHeader, flags)
+
+int flushDir(char *path);
+int syncDir(const char *path);
+void createDir(const char *path);
+
+static char *checkpoint_dir = NULL;
+
+/* Deleted jobs being written by the running background save */
+static jobid_t *flush_deleted = NULL;
+static int64_t flush_deleted_count = 0;
+
+static const char *segmentPath(int64_t seq) {
+	static char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/segment.%016ld", checkpoint_dir, seq);
+	return path;
+}
+
+void checkpointInit(void) {
+	free(checkpoint_dir);
+
+	if (asprintf(&checkpoint_dir, "%s/checkpoint", server.state_dir) == -1)
+		error_die("Failed to allocate checkpoint directory name: %s", strerror(errno));
+
+	if (server.checkpoint.enabled)
+		createDir(checkpoint_dir);
+}
+
+/* Remove the segments in 'dir' with a sequence number up to 'seq'.
+ * Returns the number that couldn't be removed */
+
+static int64_t removeSegments(const char *dir, int64_t seq) {
+	char pattern[PATH_MAX];
+	glob_t segments;
+	int64_t failed = 0;
+
+	snprintf(pattern, sizeof(pattern), "%s/segment.*", dir);
+
+	if (glob(pattern, 0, NULL, &segments) != 0)
+		return 0;
+
+	for (size_t i = 0; i < segments.gl_pathc; i++) {
+		if (atoll(strrchr(segments.gl_pathv[i], '.') + 1) > seq)
+			continue;
+
+		if (unlink(segments.gl_pathv[i]) != 0)
+			failed++;
+	}
+
+	globfree(&segments);
+	syncDir(dir);
+
+	return failed;
+}
+
+/* Remove the per job state files, once they have been replaced by a snapshot.
+ * Returns the number removed */
+
+static int64_t removeJobFiles(const char *jobs_dir) {
+	char pattern[PATH_MAX];
+	glob_t jobFiles;
+	int64_t removed = 0;
+
+	snprintf(pattern, sizeof(pattern), "%s/*/*.job", jobs_dir);
+
+	if (glob(pattern, 0, NULL, &jobFiles) != 0)
+		return 0;
+
+	for (size_t i = 0; i < jobFiles.gl_pathc; i++) {
+		if (unlink(jobFiles.gl_pathv[i]) == 0)
+			removed++;
+	}
+
+	globfree(&jobFiles);
+
+	return removed;
+}
+
+static void encodeJob(buff_t *b, struct job *j) {
+	int i;
+
+	encodeSigned(b, j->obj.revision);
+	encodeString(b, j->jobname);
+	encodeString(b, j->queue->name);
+	encodeSigned(b, j->submit_time);
+	encodeVarint(b, j->submitter);
+
+	encodeVarint(b, j->argc);
+	for (i = 0; i < j->argc; i++)
+		encodeString(b, j->argv[i]);
+
+	encodeString(b, j->shell);
+	encodeString(b, j->pre_cmd);
+	encodeString(b, j->post_cmd);
+	encodeString(b, j->stdout);
+	encodeString(b, j->stderr);
+
+	encodeVarint(b, j->env_count);
+	for (i = 0; i < j->env_count; i++)
+		encodeString(b, j->envs[i]);
+
+	encodeVarint(b, j->tag_count);
+	for (i = 0; i < j->tag_count; i++) {
+		encodeString(b, j->tags[i].key);
+		encodeString(b, j->tags[i].value);
+	}
+
+	encodeVarint(b, j->res_count);
+	for (i = 0; i < j->res_count; i++) {
+		encodeString(b, j->req_resources[i].res->name);
+		encodeSigned(b, j->req_resources[i].needed);
+	}
+
+	encodeVarint(b, j->uid);
+	encodeSigned(b, j->nice);
+	encodeSigned(b, j->state);
+	encodeSigned(b, j->priority);
+	encodeSigned(b, j->defer_time);
+	encodeSigned(b, j->start_time);
+	encodeSigned(b, j->finish_time);
+	encodeSigned(b, j->exitcode);
+	encodeSigned(b, j->signal);
+	encodeSigned(b, j->flags);
+
+	encodeSigned(b, j->usage.ru_utime.tv_sec);
+	encodeSigned(b, j->usage.ru_utime.tv_usec);
+	encodeSigned(b, j->usage.ru_stime.tv_sec);
+	encodeSigned(b, j->usage.ru_stime.tv_usec);
+	encodeSigned(b, j->usage.ru_maxrss);
+	encodeSigned(b, j->usage.ru_minflt);
+	encodeSigned(b, j->usage.ru_majflt);
+	encodeSigned(b, j->usage.ru_inblock);
+	encodeSigned(b, j->usage.ru_oublock);
+	encodeSigned(b, j->usage.ru_nvcsw);
+	encodeSigned(b, j->usage.ru_nivcsw);
+}
+
+static struct job *decodeJob(jobid_t jobid, const char *data, size_t length) {
+	struct decoder d = {(const unsigned char *)data, (const unsigned char *)data + length, NULL, 0};
+	struct job *j = calloc(sizeof(struct job), 1);
+	char *name;
+	int i;
+
+	j->jobid = jobid;
+	j->obj.type = JERS_OBJECT_JOB;
+
+	j->obj.revision = decodeSigned(&d);
+	j->jobname = decodeStringDup(&d);
+
+	name = decodeStringDup(&d);
+	j->queue = name ? findQueue(name) : NULL;
+
+	if (j->queue == NULL)
+		error_die("Error loading job %d from checkpoint - Queue '%s' does not exist", jobid, name ? name : "");
+
+	free(name);
+
+	j->submit_time = decodeSigned(&d);
+	j->submitter = decodeVarint(&d);
+
+	if ((j->argc = decodeCount(&d))) {
+		j->argv = malloc(sizeof(char *) * j->argc);
+
+		for (i = 0; i < j->argc; i++)
+			j->argv[i] = decodeStringDup(&d);
+	}
+
+	j->shell = decodeStringDup(&d);
+	j->pre_cmd = decodeStringDup(&d);
+	j->post_cmd = decodeStringDup(&d);
+	j->stdout = decodeStringDup(&d);
+	j->stderr = decodeStringDup(&d);
+
+	if ((j->env_count = decodeCount(&d))) {
+		j->envs = malloc(sizeof(char *) * j->env_count);
+
+		for (i = 0; i < j->env_count; i++)
+			j->envs[i] = decodeStringDup(&d);
+	}
+
+	if ((j->tag_count = decodeCount(&d))) {
+		j->tags = malloc(sizeof(key_val_t) * j->tag_count);
+
+		for (i = 0; i < j->tag_count; i++) {
+			j->tags[i].key = decodeStringDup(&d);
+			j->tags[i].value = decodeStringDup(&d);
+		}
+	}
+
+	if ((j->res_count = decodeCount(&d))) {
+		j->req_resources = malloc(sizeof(struct jobResource) * j->res_count);
+
+		for (i = 0; i < j->res_count; i++) {
+			name = decodeStringDup(&d);
+			j->req_resources[i].res = name ? findResource(name) : NULL;
+			j->req_resources[i].needed = decodeSigned(&d);
+
+			if (j->req_resources[i].res == NULL)
+				error_die("Invalid resource encountered for job %d\n", jobid);
+
+			free(name);
+		}
+	}
+
+	j->uid = decodeVarint(&d);
+	j->nice = decodeSigned(&d);
+	j->state = decodeSigned(&d);
+	j->priority = decodeSigned(&d);
+	j->defer_time = decodeSigned(&d);
+	j->start_time = decodeSigned(&d);
+	j->finish_time = decodeSigned(&d);
+	j->exitcode = decodeSigned(&d);
+	j->signal = decodeSigned(&d);
+	j->flags = decodeSigned(&d);
+
+	j->usage.ru_utime.tv_sec = decodeSigned(&d);
+	j->usage.ru_utime.tv_usec = decodeSigned(&d);
+	j->usage.ru_stime.tv_sec = decodeSigned(&d);
+	j->usage.ru_stime.tv_usec = decodeSigned(&d);
+	j->usage.ru_maxrss = decodeSigned(&d);
+	j->usage.ru_minflt = decodeSigned(&d);
+	j->usage.ru_majflt = decodeSigned(&d);
+	j->usage.ru_inblock = decodeSigned(&d);
+	j->usage.ru_oublock = decodeSigned(&d);
+	j->usage.ru_nvcsw = decodeSigned(&d);
+	j->usage.ru_nivcsw = decodeSigned(&d);
+
+	if (d.error)
+		error_die("Error loading job %d from checkpoint - Record is corrupt", jobid);
+
+	if (j->state == 0)
+		j->state = JERS_JOB_PENDING;
+
+	return j;
+}
+
+/* Returns 1 if the jobid was already marked in the bitmap, marking it if not */
+
+static int testAndSetJob(unsigned char **seen, size_t *size, jobid_t jobid) {
+	size_t byte = jobid / 8;
+
+	if (byte >= *size) {
+		size_t new_size = (byte + 1) * 2;
+		*seen = realloc(*seen, new_size);
+
+		if (*seen == NULL)
+			error_die("Failed to allocate memory for loaded jobs: %s", strerror(errno));
+
+		memset(*seen + *size, 0, new_size - *size);
+		*size = new_size;
+	}
+
+	if ((*seen)[byte] & (1 << (jobid % 8)))
+		return 1;
+
+	(*seen)[byte] |= 1 << (jobid % 8);
+	return 0;
+}
+
+/* Load the jobs from a segment, returning the number loaded, or -1
+ * if the segment doesn't contain a complete snapshot */
+
+static int64_t loadSegment(const char *path, int64_t seq) {
+	struct checkpointHeader h;
+	struct stat buf;
+	char *data;
+	off_t *checkpoints = NULL;
+	int64_t count = 0, loaded = 0;
+	off_t offset = CHECKPOINT_MAGIC_LEN;
+	unsigned char *seen = NULL;
+	size_t seen_size = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		error_die("Failed to open checkpoint segment %s: %s", path, strerror(errno));
+
+	if (fstat(fd, &buf) != 0)
+		error_die("Failed to stat checkpoint segment %s: %s", path, strerror(errno));
+
+	size_t size = buf.st_size;
+
+	if (size < CHECKPOINT_MAGIC_LEN + sizeof(h)) {
+		close(fd);
+		return -1;
+	}
+
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (data == MAP_FAILED)
+		error_die("Failed to map checkpoint segment %s: %s", path, strerror(errno));
+
+	madvise(data, size, MADV_SEQUENTIAL);
+	close(fd);
+
+	if (memcmp(data, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_LEN) != 0) {
+		munmap(data, size);
+		return -1;
+	}
+
+	/* Find the valid checkpoints. The first must be a full snapshot */
+	while (offset + sizeof(h) <= size) {
+		memcpy(&h, data + offset, sizeof(h));
+
+		if (memcmp(h.magic, CHECKPOINT_HEADER_MAGIC, sizeof(h.magic)) != 0)
+			break;
+
+		if (h.length > size - offset - sizeof(h) || h.index > h.length || h.count > (h.length - h.index) / sizeof(struct checkpointEntry))
+			break;
+
+		if (crc32c(crc32c(0, (char *)&h + CHECKPOINT_HEADER_CRC_OFFSET, sizeof(h) - CHECKPOINT_HEADER_CRC_OFFSET), data + offset + sizeof(h), h.length) != h.crc)
+			break;
+
+		if (count == 0 && (h.flags & CHECKPOINT_FULL) == 0)
+			break;
+
+		checkpoints = realloc(checkpoints, sizeof(off_t) * (count + 1));
+		checkpoints[count++] = offset;
+		offset += sizeof(h) + h.length;
+	}
+
+	if (count == 0) {
+		munmap(data, size);
+		return -1;
+	}
+
+	if ((size_t)offset < size) {
+		print_msg(JERS_LOG_WARNING, "Checkpoint segment %s has an incomplete checkpoint at offset %ld - Discarding it", path, offset);
+
+		if (truncate(path, offset) != 0)
+			error_die("Failed to truncate checkpoint segment %s: %s", path, strerror(errno));
+	}
+
+	/* Newest first, so the first entry found for a job is its latest state */
+	for (int64_t c = count - 1; c >= 0; c--) {
+		memcpy(&h, data + checkpoints[c], sizeof(h));
+		const char *records = data + checkpoints[c] + sizeof(h);
+
+		for (int64_t i = h.count - 1; i >= 0; i--) {
+			struct checkpointEntry e;
+			memcpy(&e, records + h.index + i * sizeof(e), sizeof(e));
+
+			if (testAndSetJob(&seen, &seen_size, e.jobid))
+				continue;
+
+			if (e.flags & CHECKPOINT_ENTRY_DELETED)
+				continue;
+
+			if (e.offset > h.index || e.length > h.index - e.offset)
+				error_die("Error loading job %d from checkpoint segment %s - Invalid index entry", e.jobid, path);
+
+			addJob(decodeJob(e.jobid, records + e.offset, e.length), 0);
+			loaded++;
+		}
+	}
+
+	server.checkpoint.seq = seq;
+	server.checkpoint.size = offset;
+	server.checkpoint.full_size = count > 1 ? checkpoints[1] : offset;
+
+	free(checkpoints);
+	free(seen);
+	munmap(data, size);
+
+	return loaded;
+}
+
+/* Load the jobs from the newest complete checkpoint segment.
+ * Returns the number of jobs loaded, or -1 if there are no segments */
+
+int checkpointLoadJobs(void) {
+	char pattern[PATH_MAX];
+	glob_t segments;
+	int64_t loaded = -1;
+
+	snprintf(pattern, sizeof(pattern), "%s/segment.*", checkpoint_dir);
+
+	if (glob(pattern, 0, NULL, &segments) != 0)
+		return -1;
+
+	/* The segment names are zero padded, so glob() returns them oldest first */
+	for (int64_t i = segments.gl_pathc - 1; i >= 0; i--) {
+		char *path = segments.gl_pathv[i];
+
+		if ((loaded = loadSegment(path, atoll(strrchr(path, '.') + 1))) >= 0) {
+			print_msg(JERS_LOG_INFO, "Loaded %ld jobs from checkpoint segment %s", loaded, path);
+			break;
+		}
+
+		print_msg(JERS_LOG_WARNING, "Ignoring checkpoint segment %s - It does not contain a complete snapshot", path);
+	}
+
+	globfree(&segments);
+
+	return loaded;
+}
+
+/* Deleted jobs are written as tombstones by the next save */
+
+void checkpointDelJob(jobid_t jobid) {
+	if (server.checkpoint.deleted_count == server.checkpoint.deleted_size) {
+		server.checkpoint.deleted_size = server.checkpoint.deleted_size ? server.checkpoint.deleted_size * 2 : 64;
+		server.checkpoint.deleted = realloc(server.checkpoint.deleted, sizeof(jobid_t) * server.checkpoint.deleted_size);
+
+		if (server.checkpoint.deleted == NULL)
+			error_die("Failed to allocate memory for deleted jobs: %s", strerror(errno));
+	}
+
+	server.checkpoint.deleted[server.checkpoint.deleted_count++] = jobid;
+}
+
+/* Called before forking the background save. Takes the jobs deleted since
+ * the last save, and decides if this save should compact the segment */
+
+void checkpointStartSave(void) {
+	if (!server.checkpoint.enabled)
+		return;
+
+	flush_deleted = server.checkpoint.deleted;
+	flush_deleted_count = server.checkpoint.deleted_count;
+
+	server.checkpoint.deleted = NULL;
+	server.checkpoint.deleted_count = server.checkpoint.deleted_size = 0;
+
+	if (server.checkpoint.size > server.checkpoint.compact_size && server.checkpoint.size > server.checkpoint.full_size * 2)
+		server.checkpoint.compact = 1;
+}
+
+static void addEntry(buff_t *index, jobid_t jobid, uint32_t flags, uint64_t offset, uint64_t length) {
+	struct checkpointEntry e = {jobid, flags, offset, length};
+	buffAdd(index, (char *)&e, sizeof(e));
+}
+
+static int writeAt(int fd, const char *data, size_t len, off_t offset) {
+	while (len) {
+		ssize_t written = pwrite(fd, data, len, offset);
+
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return 1;
+		}
+
+		data += written;
+		len -= written;
+		offset += written;
+	}
+
+	return 0;
+}
+
+/* Encode a checkpoint of the dirty and deleted jobs, or a snapshot of every
+ * job when compacting. The header is at the start of the buffer */
+
+void checkpointBuild(struct job **jobs, int64_t count, struct checkpointBatch *cb) {
+	struct checkpointHeader h = {0};
+	buff_t *checkpoint = &cb->data;
+	buff_t index;
+
+	/* Where the writer puts it */
+	cb->compact = server.checkpoint.compact;
+	cb->migrate = server.checkpoint.migrate;
+	cb->seq = server.checkpoint.seq + cb->compact;
+	cb->offset = cb->compact ? CHECKPOINT_MAGIC_LEN : server.checkpoint.size;
+	cb->removed = 0;
+	cb->error[0] = '\0';
+	snprintf(cb->path, sizeof(cb->path), "%s", segmentPath(cb->seq));
+	snprintf(cb->jobs_dir, sizeof(cb->jobs_dir), "%s/jobs", server.state_dir);
+
+	buffNew(checkpoint, 0);
+	buffNew(&index, 0);
+
+	/* Space for the header, which is filled in last */
+	buffAdd(checkpoint, (char *)&h, sizeof(h));
+
+	if (server.checkpoint.compact) {
+		h.flags |= CHECKPOINT_FULL;
+
+		for (struct job *j = server.jobTable; j; j = j->hh.next) {
+			size_t start = checkpoint->used;
+			encodeJob(checkpoint, j);
+			addEntry(&index, j->jobid, 0, start - sizeof(h), checkpoint->used - start);
+		}
+	} else {
+		/* Tombstones first, so a deleted jobid reused by a new job is superseded */
+		for (int64_t i = 0; i < flush_deleted_count; i++)
+			addEntry(&index, flush_deleted[i], CHECKPOINT_ENTRY_DELETED, 0, 0);
+
+		for (int64_t i = 0; i < count; i++) {
+			size_t start = checkpoint->used;
+			encodeJob(checkpoint, jobs[i]);
+			addEntry(&index, jobs[i]->jobid, 0, start - sizeof(h), checkpoint->used - start);
+		}
+	}
+
+	memcpy(h.magic, CHECKPOINT_HEADER_MAGIC, sizeof(h.magic));
+	h.index = checkpoint->used - sizeof(h);
+	h.count = index.used / sizeof(struct checkpointEntry);
+	h.timestamp = time(NULL);
+
+	buffAddBuff(checkpoint, &index);
+	buffFree(&index);
+
+	h.length = checkpoint->used - sizeof(h);
+	h.crc = crc32c(crc32c(0, (char *)&h + CHECKPOINT_HEADER_CRC_OFFSET, sizeof(h) - CHECKPOINT_HEADER_CRC_OFFSET), checkpoint->data + sizeof(h), h.length);
+
+	memcpy(checkpoint->data, &h, sizeof(h));
+}
+
+/* Append an encoded checkpoint to the current segment, or write it to a new
+ * segment when compacting. Only the batch is used, as this runs in the
+ * background save writer thread. Errors are left in cb->error */
+
+int checkpointWrite(struct checkpointBatch *cb) {
+	int fd;
+
+	if (cb->compact) {
+		fd = open(cb->path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+
+		if (fd >= 0 && writeAt(fd, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_LEN, 0) != 0)
+			goto checkpoint_write_failed;
+	} else {
+		fd = open(cb->path, O_WRONLY);
+	}
+
+	if (fd < 0) {
+		snprintf(cb->error, sizeof(cb->error), "Failed to open checkpoint segment %s: %s", cb->path, strerror(errno));
+		return 1;
+	}
+
+	if (writeAt(fd, cb->data.data, cb->data.used, cb->offset) != 0)
+		goto checkpoint_write_failed;
+
+	/* Drop anything left beyond this checkpoint by a failed save */
+	if (ftruncate(fd, cb->offset + cb->data.used) != 0 || fdatasync(fd) != 0)
+		goto checkpoint_write_failed;
+
+	close(fd);
+
+	if (cb->compact) {
+		char *dir = strdup(cb->path);
+
+		syncDir(dir);
+
+		int64_t failed = removeSegments(dirname(dir), cb->seq - 1);
+
+		if (failed)
+			snprintf(cb->error, sizeof(cb->error), "Failed to remove %ld old checkpoint segments from %s", failed, dir);
+
+		free(dir);
+
+		if (cb->migrate)
+			cb->removed = removeJobFiles(cb->jobs_dir);
+	}
+
+	return 0;
+
+checkpoint_write_failed:
+	snprintf(cb->error, sizeof(cb->error), "Failed to write checkpoint segment %s: %s", cb->path, strerror(errno));
+	close(fd);
+	return 1;
+}
+
+/* Log the outcome of writing a checkpoint, once back on the main thread */
+
+void checkpointWriteDone(struct checkpointBatch *cb) {
+	if (cb->error[0])
+		print_msg(JERS_LOG_WARNING, "%s", cb->error);
+
+	if (cb->removed)
+		print_msg(JERS_LOG_INFO, "Removed %ld job state files replaced by checkpoint segment %ld", cb->removed, cb->seq);
+}
+
+/* Build and write a checkpoint. Called in the background save child */
+
+int checkpointSave(struct job **jobs, int64_t count) {
+	struct checkpointBatch cb;
+
+	checkpointBuild(jobs, count, &cb);
+	int rc = checkpointWrite(&cb);
+	checkpointWriteDone(&cb);
+	buffFree(&cb.data);
+
+	return rc;
+}
+
+/* Called once the background save has finished */
+
+void checkpointSaveDone(int status) {
+	struct stat buf;
+
+	if (!server.checkpoint.enabled) {
+		/* The jobs loaded from a segment have now been written to state files */
+		if (status == 0 && server.checkpoint.remove) {
+			print_msg(JERS_LOG_INFO, "Removing checkpoint segments - Jobs are now saved to state files");
+
+			if (removeSegments(checkpoint_dir, INT64_MAX))
+				print_msg(JERS_LOG_WARNING, "Failed to remove some checkpoint segments from %s", checkpoint_dir);
+
+			server.checkpoint.remove = 0;
+		}
+
+		return;
+	}
+
+	if (status) {
+		/* Write the deletions again with the next save */
+		for (int64_t i = 0; i < flush_deleted_count; i++)
+			checkpointDelJob(flush_deleted[i]);
+	} else {
+		if (server.checkpoint.compact)
+			server.checkpoint.seq++;
+
+		if (stat(segmentPath(server.checkpoint.seq), &buf) != 0)
+			error_die("Failed to stat checkpoint segment %s: %s", segmentPath(server.checkpoint.seq), strerror(errno));
+
+		server.checkpoint.size = buf.st_size;
+
+		if (server.checkpoint.compact) {
+			server.checkpoint.full_size = buf.st_size;
+			server.checkpoint.compact = server.checkpoint.migrate = 0;
+		}
+	}
+
+	free(flush_deleted);
+	flush_deleted = NULL;
+	flush_deleted_count = 0;
+}
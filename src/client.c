@@ -29,6 +29,7 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -36,7 +37,11 @@
 #include "client.h"
 #include "logging.h"
 
+#include <utlist.h>
+
 client * clientList = NULL;
+client * clientReadyList = NULL;
+client * clientHeldList = NULL;
 
 void addClient(client * c) {
 	if (clientList) {
@@ -58,6 +63,49 @@ void removeClient(client * c) {
 		clientList = c->next;
 }
 
+/* Maintain the list of clients with complete requests waiting to be run */
+
+void setClientReady(client * c) {
+	if (c->ready)
+		return;
+
+	DL_APPEND2(clientReadyList, c, ready_prev, ready_next);
+	c->ready = 1;
+}
+
+void clearClientReady(client * c) {
+	if (!c->ready)
+		return;
+
+	DL_DELETE2(clientReadyList, c, ready_prev, ready_next);
+	c->ready = 0;
+}
+
+/* Hold the responses from offset onwards until the journal is committed */
+
+void holdClientResponse(client * c, size_t offset) {
+	if (c->held)
+		return;
+
+	DL_APPEND2(clientHeldList, c, held_prev, held_next);
+	c->held = 1;
+	c->response_held = offset;
+}
+
+/* The journal has been committed, so the held responses can be sent */
+
+void releaseHeldClients(void) {
+	client *c, *tmp;
+
+	DL_FOREACH_SAFE2(clientHeldList, c, tmp, held_next) {
+		DL_DELETE2(clientHeldList, c, held_prev, held_next);
+		c->held = 0;
+
+		if (c->response_sent < c->response.used)
+			pollSetWritable(&c->connection);
+	}
+}
+
 /* Accept a new client connection, adding to our existing list of clients and adding it
  * to our event polling */
 
@@ -125,6 +173,11 @@ int handleClientDisconnect(client * c) {
 		free(c->blocking.data);
 	}
 
+	clearClientReady(c);
+
+	if (c->held)
+		DL_DELETE2(clientHeldList, c, held_prev, held_next);
+
 	removeClient(c);
 	free(c);
 
@@ -134,6 +187,7 @@ int handleClientDisconnect(client * c) {
 /* Handle read activity on a client socket */
 int handleClientRead(client * c) {
 	int len = 0;
+	char *p, *end;
 
 	buffResize(&c->request, 0);
 
@@ -154,30 +208,46 @@ int handleClientRead(client * c) {
 	/* Got some data from the client.
 	 * Update the buffer and length in the
 	 * reader, so we can try to parse this request */
+	p = c->request.data + c->request.used;
 	c->request.used += len;
+	end = c->request.data + c->request.used;
+
+	/* Count the complete requests in the data we just read */
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		c->requests_ready++;
+		p++;
+	}
+
+	if (c->requests_ready)
+		setClientReady(c);
 
 	return 0;
 }
 
 int handleClientWrite(client * c) {
 	int len = 0;
+	size_t end = c->held ? c->response_held : c->response.used;
 
-	len = _send(c->connection.socket, c->response.data + c->response_sent, c->response.used - c->response_sent);
+	if (c->response_sent < end) {
+		len = _send(c->connection.socket, c->response.data + c->response_sent, end - c->response_sent);
 
-	if (len == -1) {
-		print_msg(JERS_LOG_WARNING, "send to client failed: %s", strerror(errno));
-		handleClientDisconnect(c);
-		return 1;
-	}
+		if (len == -1) {
+			print_msg(JERS_LOG_WARNING, "send to client failed: %s", strerror(errno));
+			handleClientDisconnect(c);
+			return 1;
+		}
 
-	c->response_sent += len;
+		c->response_sent += len;
+	}
 
 	/* If we have sent all our data, remove EPOLLOUT
 	 * from the event. Leave readable on, as we might read another request
 	 * from the client, or process their disconnect */
-	if (c->response_sent == c->response.used) {
+	if (c->response_sent == end) {
 		pollSetReadable(&c->connection);
-		c->response_sent = c->response.used = 0;
+
+		if (end == c->response.used)
+			c->response_sent = c->response.used = c->response_held = 0;
 	}
 
 	return 0;
@@ -52,19 +52,35 @@ typedef struct _client {
 	uid_t uid;
 	struct user * user;
 
+	/* Set while the client is blocked waiting on an object. The
+	 * free_callback is called before data is freed on disconnect */
 	struct {
-		int (*callback)(struct _client *, void *);
-		int (*timeout_callback)(struct _client *, void *);
 		void (*free_callback)(void *);
 		void *data;
-		int64_t timeout;
 	} blocking;
 
+	/* Number of complete requests in the request buffer */
+	int64_t requests_ready;
+
 	struct _client * next;
 	struct _client * prev;
+
+	/* Clients with requests_ready are kept on the ready list */
+	int ready;
+	struct _client * ready_next;
+	struct _client * ready_prev;
+
+	/* With group commit, the responses from response_held onwards
+	 * are held until the journal has been flushed */
+	int held;
+	size_t response_held;
+	struct _client * held_next;
+	struct _client * held_prev;
 } client;
 
 extern client *clientList;
+extern client *clientReadyList;
+extern client *clientHeldList;
 
 int handleClientConnection(struct connectionType * connection);
 int handleClientDisconnect(client *c);
@@ -73,5 +89,9 @@ int handleClientWrite(client *c);
 
 void addClient(client *c);
 void removeClient(client *c);
+void setClientReady(client *c);
+void clearClientReady(client *c);
+void holdClientResponse(client *c, size_t offset);
+void releaseHeldClients(void);
 
 #endif
\ No newline at end of file
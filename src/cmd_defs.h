@@ -1,9 +1,14 @@
 #define CMD_ADD_JOB "JOB_ADD"
+#define CMD_ADD_JOBS "JOBS_ADD"
 #define CMD_GET_JOB "JOB_GET"
 #define CMD_MOD_JOB "JOB_MOD"
 #define CMD_DEL_JOB "JOB_DEL"
 #define CMD_SIG_JOB "JOB_SIG"
+#define CMD_DEL_JOBS "JOBS_DEL"
+#define CMD_MOD_JOBS "JOBS_MOD"
+#define CMD_SIG_JOBS "JOBS_SIG"
 #define CMD_WAIT_JOB "JOB_WAIT"
+#define CMD_SUBSCRIBE "JOB_SUBSCRIBE"
 #define CMD_ADD_QUEUE "QUEUE_ADD"
 #define CMD_GET_QUEUE "QUEUE_GET"
 #define CMD_MOD_QUEUE "QUEUE_MOD"
@@ -15,6 +20,7 @@
 #define CMD_SET_TAG "TAG_SET"
 #define CMD_DEL_TAG "TAG_DEL"
 #define CMD_STATS "STATS"
+#define CMD_SCHED_STATS "SCHED_STATS"
 #define CMD_GET_AGENT "AGENT_GET"
 #define CMD_CLEAR_CACHE "CLEAR_CACHE"
 
@@ -249,6 +249,11 @@ int command_agent_recon(agent * a, msg_t * msg) {
 
 	a->recon = 0;
 
+	for (struct queue *q = server.queueTable; q; q = q->hh.next) {
+		if (q->agent == a)
+			schedQueueChanged(q);
+	}
+
 	return 0;
 }
 
@@ -278,12 +283,12 @@ int command_agent_jobstart(agent * a, msg_t * msg) {
 		return 1;
 	}
 
+	j->start_time = start_time;
 	changeJobState(j, JERS_JOB_RUNNING, NULL, 1);
 
 	j->internal_state &= ~JERS_FLAG_JOB_STARTED;
 	j->pend_reason = 0;
 	j->pid = pid;
-	j->start_time = start_time;
 
 	if (server.recovery.in_progress && j->res_count)
 		allocateRes(j);
@@ -76,45 +76,60 @@ struct jobResource * convertResourceStrings(int res_count, char ** res_strings)
 	return resources;
 }
 
-void * deserialize_add_job(msg_t * t) {
-	jersJobAdd *s = calloc(sizeof(jersJobAdd), 1);
-
+static void deserializeJobAdd(msg_item *item, jersJobAdd *s) {
 	s->priority = JERS_JOB_DEFAULT_PRIORITY;
 	s->nice = UNSET_32;
 
-	for (int i = 0; i < t->items[0].field_count; i++) {
-		switch(t->items[0].fields[i].number) {
-			case JOBID    : s->jobid = getNumberField(&t->items[0].fields[i]); break;
-			case JOBNAME  : s->name = getStringField(&t->items[0].fields[i]); break;
-			case QUEUENAME: s->queue = getStringField(&t->items[0].fields[i]); break;
-			case UID      : s->uid = getNumberField(&t->items[0].fields[i]); break;
-			case SHELL    : s->shell = getStringField(&t->items[0].fields[i]); break;
-			case PRIORITY : s->priority = getNumberField(&t->items[0].fields[i]); break;
-			case HOLD     : s->hold = getBoolField(&t->items[0].fields[i]); break;
-			case ENVS     : s->env_count = getStringArrayField(&t->items[0].fields[i], &s->envs); break;
-			case ARGS     : s->argc = getStringArrayField(&t->items[0].fields[i], &s->argv); break;
-			case PRECMD   : s->pre_cmd = getStringField(&t->items[0].fields[i]); break;
-			case POSTCMD  : s->post_cmd = getStringField(&t->items[0].fields[i]); break;
-			case DEFERTIME: s->defer_time = getNumberField(&t->items[0].fields[i]); break;
-			case TAGS     : s->tag_count = getStringMapField(&t->items[0].fields[i], (key_val_t **)&s->tags); break;
-			case RESOURCES: s->res_count = getStringArrayField(&t->items[0].fields[i], &s->resources); break;
-			case STDOUT   : s->stdout = getStringField(&t->items[0].fields[i]); break;
-			case STDERR   : s->stderr = getStringField(&t->items[0].fields[i]); break;
-			case WRAPPER  : s->wrapper = getStringField(&t->items[0].fields[i]); break;
-			case NICE     : s->nice = getNumberField(&t->items[0].fields[i]); break;
-			case FLAGS    : s->flags = getNumberField(&t->items[0].fields[i]); break;
-
-			default: fprintf(stderr, "Unknown field %s encountered - Ignoring\n",t->items[0].fields[i].name); break;
+	for (int i = 0; i < item->field_count; i++) {
+		switch(item->fields[i].number) {
+			case JOBID    : s->jobid = getNumberField(&item->fields[i]); break;
+			case JOBNAME  : s->name = getStringField(&item->fields[i]); break;
+			case QUEUENAME: s->queue = getStringField(&item->fields[i]); break;
+			case UID      : s->uid = getNumberField(&item->fields[i]); break;
+			case SHELL    : s->shell = getStringField(&item->fields[i]); break;
+			case PRIORITY : s->priority = getNumberField(&item->fields[i]); break;
+			case HOLD     : s->hold = getBoolField(&item->fields[i]); break;
+			case ENVS     : s->env_count = getStringArrayField(&item->fields[i], &s->envs); break;
+			case ARGS     : s->argc = getStringArrayField(&item->fields[i], &s->argv); break;
+			case PRECMD   : s->pre_cmd = getStringField(&item->fields[i]); break;
+			case POSTCMD  : s->post_cmd = getStringField(&item->fields[i]); break;
+			case DEFERTIME: s->defer_time = getNumberField(&item->fields[i]); break;
+			case TAGS     : s->tag_count = getStringMapField(&item->fields[i], (key_val_t **)&s->tags); break;
+			case RESOURCES: s->res_count = getStringArrayField(&item->fields[i], &s->resources); break;
+			case STDOUT   : s->stdout = getStringField(&item->fields[i]); break;
+			case STDERR   : s->stderr = getStringField(&item->fields[i]); break;
+			case WRAPPER  : s->wrapper = getStringField(&item->fields[i]); break;
+			case NICE     : s->nice = getNumberField(&item->fields[i]); break;
+			case FLAGS    : s->flags = getNumberField(&item->fields[i]); break;
+
+			default: fprintf(stderr, "Unknown field %s encountered - Ignoring\n",item->fields[i].name); break;
 		}
 	}
+}
+
+void * deserialize_add_job(msg_t * t) {
+	jersJobAdd *s = calloc(sizeof(jersJobAdd), 1);
+
+	deserializeJobAdd(&t->items[0], s);
 
 	return s;
 }
 
-void * deserialize_get_job(msg_t * t) {
-	jersJobFilter * s = calloc(sizeof(jersJobFilter), 1);
-	msg_item * item = &t->items[0];
+void * deserialize_add_jobs(msg_t * t) {
+	jersJobAddBatch *batch = calloc(sizeof(jersJobAddBatch), 1);
+
+	batch->count = t->item_count;
+	batch->jobs = calloc(sizeof(jersJobAdd), batch->count ? batch->count : 1);
+
+	for (int64_t i = 0; i < batch->count; i++)
+		deserializeJobAdd(&t->items[i], &batch->jobs[i]);
 
+	return batch;
+}
+
+/* The sequence of a delta query is returned in changed_since, if it's provided */
+
+static void deserializeJobFilter(msg_item *item, jersJobFilter *s, int64_t *changed_since) {
 	for (int i = 0; i < item->field_count; i++) {
 		switch(item->fields[i].number) {
 			case JOBID    : s->jobid = getNumberField(&item->fields[i]); break;
@@ -136,21 +151,31 @@ void * deserialize_get_job(msg_t * t) {
 
 			case RETFIELDS: s->return_fields = getNumberField(&item->fields[i]); break;
 
-			default: fprintf(stderr, "Unknown field '%s' encountered - Ignoring\n",t->items[0].fields[i].name); break;
+			case CHANGED_SINCE:
+				if (changed_since) {
+					*changed_since = getNumberField(&item->fields[i]);
+					s->filter_fields |= JERS_FILTER_CHANGED;
+				}
+				break;
+
+			default: fprintf(stderr, "Unknown field '%s' encountered - Ignoring\n",item->fields[i].name); break;
 		}
 
 		/* If a jobid was provided, we ignore everything else */
 		if (s->jobid)
 			break;
 	}
-
-	return s;
 }
 
-void * deserialize_mod_job(msg_t * t) {
-	jersJobMod *jm = calloc(sizeof(jersJobMod), 1);
-	msg_item *item = &t->items[0];
+void * deserialize_get_job(msg_t * t) {
+	jersJobQuery * query = calloc(sizeof(jersJobQuery), 1);
 
+	deserializeJobFilter(&t->items[0], &query->filter, &query->changed_since);
+
+	return query;
+}
+
+static void deserializeJobMod(msg_item *item, jersJobMod *jm) {
 	jm->hold = UNSET_8;
 	jm->nice = UNSET_32;
 	jm->priority = UNSET_32;
@@ -176,9 +201,16 @@ void * deserialize_mod_job(msg_t * t) {
 
 			case CLEARRES : jm->clear_resources = getBoolField(&item->fields[i]); break;
 
-			default: fprintf(stderr, "Unknown field '%s' encountered - Ignoring\n",t->items[0].fields[i].name); break;
+			default: fprintf(stderr, "Unknown field '%s' encountered - Ignoring\n",item->fields[i].name); break;
 		}
 	}
+}
+
+void * deserialize_mod_job(msg_t * t) {
+	jersJobMod *jm = calloc(sizeof(jersJobMod), 1);
+
+	deserializeJobMod(&t->items[0], jm);
+
 	return jm;
 }
 
@@ -215,6 +247,55 @@ void * deserialize_sig_job(msg_t * t) {
 	return js;
 }
 
+/* The bulk commands are an array of items. The first is the action to apply,
+ * followed by either a filter, or a list of jobids and revisions when the
+ * command is replayed from the journal */
+
+void * deserialize_bulk_jobs(msg_t * t) {
+	jersJobBulk *jb = calloc(sizeof(jersJobBulk), 1);
+
+	jb->signum = -1;
+
+	if (t->item_count < 2) {
+		free(jb);
+		return NULL;
+	}
+
+	for (int i = 0; i < t->items[0].field_count; i++) {
+		if (t->items[0].fields[i].number == SIGNAL)
+			jb->signum = getNumberField(&t->items[0].fields[i]);
+	}
+
+	if (strcmp(t->command, CMD_MOD_JOBS) == 0)
+		deserializeJobMod(&t->items[0], &jb->mod);
+
+	jb->jobids = calloc(sizeof(jobid_t), t->item_count - 1);
+	jb->revisions = calloc(sizeof(int64_t), t->item_count - 1);
+
+	for (int64_t k = 1; k < t->item_count; k++) {
+		msg_item *item = &t->items[k];
+		jobid_t jobid = 0;
+		int64_t revision = 0;
+
+		for (int i = 0; i < item->field_count; i++) {
+			switch (item->fields[i].number) {
+				case JOBID   : jobid = getNumberField(&item->fields[i]); break;
+				case REVISION: revision = getNumberField(&item->fields[i]); break;
+			}
+		}
+
+		if (jobid == 0) {
+			deserializeJobFilter(item, &jb->filter, NULL);
+			continue;
+		}
+
+		jb->jobids[jb->count] = jobid;
+		jb->revisions[jb->count++] = revision;
+	}
+
+	return jb;
+}
+
 void * deserialize_wait_job(msg_t *t) {
 	jersJobWait *jw = calloc(sizeof(jersJobWait), 1);
 	msg_item *item = &t->items[0];
@@ -267,7 +348,13 @@ void * deserialize_del_tag(msg_t * t) {
 	return td;
 }
 
+/* Fields that need the details of a lazily loaded job */
+#define JERS_RET_DETAILS (JERS_RET_STDOUT|JERS_RET_STDERR|JERS_RET_TAGS|JERS_RET_PRECMD|JERS_RET_POSTCMD|JERS_RET_ARGS|JERS_RET_SHELL|JERS_RET_ENV)
+
 void serialize_jersJob(buff_t *b, struct job *j, int fields) {
+	if (fields == 0 || fields & JERS_RET_DETAILS)
+		stateLoadJobDetails(j);
+
 	JSONStartObject(b, NULL, 0);
 
 	if (fields == 0 || fields & JERS_RET_JOBID)
@@ -353,8 +440,8 @@ void serialize_jersJob(buff_t *b, struct job *j, int fields) {
 	JSONAddInt(b, EXITCODE, j->exitcode);
 	JSONAddInt(b, SIGNAL, j->signal);
 
-	if (j->pend_reason)
-		JSONAddInt(b, PENDREASON, j->pend_reason);
+	if (getPendReason(j))
+		JSONAddInt(b, PENDREASON, getPendReason(j));
 
 	if (j->fail_reason)
 		JSONAddInt(b, FAILREASON, j->fail_reason);
@@ -383,24 +470,40 @@ static inline int check_perm(client *c, uid_t job_uid, int required_perm) {
 	return 0;
 }
 
-int command_add_job(client *c, void *args) {
-	jersJobAdd * s = args;
-	struct job * j = NULL;
-	struct queue * q = NULL;
-	struct jobResource * resources = NULL;
-	struct user * u = NULL;
+/* Forget the strings that have been handed over to a job */
+static void releaseJobAdd(jersJobAdd *ja) {
+	ja->name = ja->shell = ja->stdout = ja->stderr = NULL;
+	ja->wrapper = ja->pre_cmd = ja->post_cmd = NULL;
+	ja->argv = ja->envs = NULL;
+	ja->tags = NULL;
+	ja->argc = ja->env_count = ja->tag_count = 0;
+}
 
-	if (unlikely(server.recovery.in_progress)) {
-		/* Have we already loaded this job? */
-		j = findJob(server.recovery.jobid);
+/* Free the strings in a job add request that are normally handed over to the job */
+static void freeJobAdd(jersJobAdd *ja) {
+	free(ja->name);
+	free(ja->shell);
+	free(ja->stdout);
+	free(ja->stderr);
+	free(ja->wrapper);
+	free(ja->pre_cmd);
+	free(ja->post_cmd);
+
+	freeStringArray(ja->argc, &ja->argv);
+	freeStringArray(ja->env_count, &ja->envs);
+	freeStringMap(ja->tag_count, (key_val_t **)&ja->tags);
+
+	releaseJobAdd(ja);
+}
 
-		if (j)
-			return 0;
+/* Validate a job add request, returning the queue and resources for the job.
+ * An error is sent to the client and non-zero returned if it's invalid */
 
-		print_msg(JERS_LOG_INFO, "Recovering jobid:%d\n", server.recovery.jobid);
-		s->jobid = server.recovery.jobid;
-		s->uid = server.recovery.uid;
-	}
+static int validateJobAdd(client *c, jersJobAdd *s, struct queue **queue, struct jobResource **res) {
+	struct queue * q = NULL;
+	struct job * j = NULL;
+	struct jobResource * resources = NULL;
+	struct user * u = NULL;
 
 	if (s->uid <= 0)
 		s->uid = c->uid;
@@ -444,22 +547,11 @@ int command_add_job(client *c, void *args) {
 	if (s->jobid) {
 		j = findJob(s->jobid);
 
-		if (j != NULL) {
-			/* If the job id requested exists, but is deleted, clean it up to reuse it */
-			if (j->internal_state &JERS_FLAG_DELETED) {
-				if (cleanupJob(j) != 0)
-				{
-					sendError(c, JERS_ERR_JOBEXISTS, NULL);
-					return -1;
-				}
-
-				j = NULL;
-			}
-			else
-			{
-				sendError(c, JERS_ERR_JOBEXISTS, NULL);
-				return -1;
-			}
+		/* If the job id requested exists, but is deleted, it's cleaned up
+		 * to reuse it when the job is created */
+		if (j != NULL && (!(j->internal_state &JERS_FLAG_DELETED) || !canCleanupJob(j))) {
+			sendError(c, JERS_ERR_JOBEXISTS, NULL);
+			return -1;
 		}
 	}
 
@@ -490,8 +582,29 @@ int command_add_job(client *c, void *args) {
 		}
 	}
 
-	/* Request looks good. Allocate a new job structure and jobid */
-	j = calloc(sizeof(struct job), 1);
+	*queue = q;
+	*res = resources;
+
+	return 0;
+}
+
+/* Create a job from a validated request, without adding it to the job table.
+ * The job takes ownership of the strings in the request */
+
+static struct job * newJob(client *c, jersJobAdd *s, struct queue *q, struct jobResource *resources) {
+	/* Request looks good. Clean up the deleted job holding the requested jobid */
+	if (s->jobid) {
+		struct job *deleted = findJob(s->jobid);
+
+		if (deleted && cleanupJob(deleted) != 0) {
+			sendError(c, JERS_ERR_JOBEXISTS, NULL);
+			free(resources);
+			return NULL;
+		}
+	}
+
+	/* Allocate a new job structure and jobid */
+	struct job *j = calloc(sizeof(struct job), 1);
 
 	if (s->jobid == 0)
 		j->jobid = getNextJobID();
@@ -502,7 +615,7 @@ int command_add_job(client *c, void *args) {
 		sendError(c, JERS_ERR_NOJOB, "No available Job IDs");
 		free(j);
 		free(resources);
-		return -1;
+		return NULL;
 	}
 
 	/* Default the job name if one was not provided */
@@ -511,7 +624,7 @@ int command_add_job(client *c, void *args) {
 			free(j);
 			free(resources);
 			sendError(c, JERS_ERR_MEM, "Failed to allocated jobname");
-			return -1;
+			return NULL;
 		}
 	}
 
@@ -554,8 +667,48 @@ int command_add_job(client *c, void *args) {
 	else
 		j->submit_time = time(NULL);
 
+	return j;
+}
+
+static struct job * createJob(client *c, jersJobAdd *s, struct queue *q, struct jobResource *resources) {
+	struct job *j = newJob(c, s, q, resources);
+
 	/* Add it to the hashtable */
-	addJob(j, 1);
+	if (j)
+		addJob(j, 1);
+
+	return j;
+}
+
+int command_add_job(client *c, void *args) {
+	jersJobAdd * s = args;
+	struct job * j = NULL;
+	struct queue * q = NULL;
+	struct jobResource * resources = NULL;
+
+	if (unlikely(server.recovery.in_progress)) {
+		/* Have we already loaded this job? */
+		j = findJob(server.recovery.jobid);
+
+		if (j)
+			return 0;
+
+		print_msg(JERS_LOG_INFO, "Recovering jobid:%d\n", server.recovery.jobid);
+		s->jobid = server.recovery.jobid;
+
+		/* The journal records the submitter, which is only the jobs
+		 * user if one wasn't provided in the request */
+		if (s->uid <= 0)
+			s->uid = server.recovery.uid;
+	}
+
+	if (validateJobAdd(c, s, &q, &resources) != 0)
+		return -1;
+
+	j = createJob(c, s, q, resources);
+
+	if (j == NULL)
+		return -1;
 
 	/* Don't respond if we are replaying a command */
 	if (c == NULL)
@@ -584,268 +737,707 @@ int command_add_job(client *c, void *args) {
 	return 0;
 }
 
-int command_get_job(client *c, void * args) {
-	jersJobFilter * s = args;
-	struct queue * q = NULL;
-	struct job * j = NULL;
-	struct indexed_tag *it = NULL;
-	int indexed_tag_index;
-	int read_all = (c->uid == 0 || c->user->permissions &PERM_READ);
-	int self = (server.permissions.self.count == 0 || c->uid == 0 || (c->user->permissions &PERM_SELF) == PERM_SELF);
+static int jobidComp(const void *a, const void *b) {
+	jobid_t x = *(const jobid_t *)a;
+	jobid_t y = *(const jobid_t *)b;
 
-	int64_t count = 0;
+	return (x > y) - (x < y);
+}
 
-	buff_t r;
+/* Add a batch of jobs. Every job is validated before any are added, so
+ * either all of the jobs are added or none are. The batch is journalled as a
+ * single record, rewritten to contain the jobid, uid and queue of every job
+ * so that it can be replayed. */
+
+int command_add_jobs(client *c, void *args) {
+	jersJobAddBatch *batch = args;
+	struct queue **queues = NULL;
+	struct jobResource **resources = NULL;
+	struct job **jobs = NULL;
+	char *created = NULL;
+	jobid_t *requested = NULL;
+	int64_t requested_count = 0;
+	int64_t needed = 0;
+	int64_t i;
+	int status = -1;
+	buff_t journal, response;
+
+	if (batch->count == 0) {
+		sendError(c, JERS_ERR_INVARG, "No jobs provided");
+		return -1;
+	}
 
-	/* JobId? Just look it up and return the result */
-	if (s->jobid) {
-		j = findJob(s->jobid);
+	queues = calloc(batch->count, sizeof(struct queue *));
+	resources = calloc(batch->count, sizeof(struct jobResource *));
+	jobs = calloc(batch->count, sizeof(struct job *));
+	created = calloc(batch->count, sizeof(char));
+	requested = malloc(batch->count * sizeof(jobid_t));
 
-		/* Validate the user has permission
-		 * We use a bogus UID if the job doesn't exist, just to check their permissions */
-		if (check_perm(c, j ? j->uid : 0, PERM_READ)) {
-			sendError(c, JERS_ERR_NOPERM, NULL);
-			return -1;
-		}
+	if (queues == NULL || resources == NULL || jobs == NULL || created == NULL || requested == NULL) {
+		sendError(c, JERS_ERR_MEM, NULL);
+		goto add_jobs_cleanup;
+	}
 
-		if (j == NULL || (j->internal_state &JERS_FLAG_DELETED)) {
-			sendError(c, JERS_ERR_NOJOB, NULL);
-			return 1;
+	for (i = 0; i < batch->count; i++) {
+		jersJobAdd *s = &batch->jobs[i];
+
+		/* Skip jobs already loaded from the state files when replaying */
+		if (unlikely(server.recovery.in_progress) && (jobs[i] = findJob(s->jobid)) != NULL) {
+			freeJobAdd(s);
+			continue;
 		}
 
-		initClientResponse(&r, 1);
-		serialize_jersJob(&r, j, 0);
-		count = 1;
-	} else {
-		/* If a queue filter has been provided, and its not a wildcard look it up first */
-		if (s->filter_fields & JERS_FILTER_QUEUE) {
+		if (validateJobAdd(c, s, &queues[i], &resources[i]) != 0)
+			goto add_jobs_cleanup;
 
-			if (strchr(s->filters.queue_name, '*') == NULL && strchr(s->filters.queue_name, '?') == NULL)
-			{
-				q = findQueue(s->filters.queue_name);
+		if (s->jobid)
+			requested[requested_count++] = s->jobid;
 
-				if (q == NULL) {
-					sendError(c, JERS_ERR_NOQUEUE, NULL);
-					return -1;
-				}
-			}
-		}
+		needed++;
+	}
 
-		initClientResponse(&r, 1);
+	/* Check the same jobid hasn't been requested twice, and that
+	 * there are enough free jobids for the whole batch */
+	qsort(requested, requested_count, sizeof(jobid_t), jobidComp);
 
-		/* If the user is filtering on tags, check if one is the indexed tag.
-		 * This greatly speeds up the lookups */
-		if (server.index_tag && s->filter_fields &JERS_FILTER_TAGS && s->filters.tag_count) {
-			for (int i = 0; i < s->filters.tag_count; i++) {
-				if (strcmp(server.index_tag, s->filters.tags[i].key) == 0) {
-					/* Only attempt to use it if it's not wildcarded */
-					if (strchr(s->filters.tags[i].value, '*') == NULL && strchr(s->filters.tags[i].value, '?') == NULL) {
-						HASH_FIND_STR(server.index_tag_table, s->filters.tags[i].value, it);
-						indexed_tag_index = i;
-					}
-
-					break;
-				 }
-			}
+	for (i = 1; i < requested_count; i++) {
+		if (requested[i] == requested[i - 1]) {
+			sendErrorFmt(c, JERS_ERR_JOBEXISTS, "Jobid %d requested more than once", requested[i]);
+			goto add_jobs_cleanup;
 		}
+	}
+
+	if (needed > (int64_t)server.max_jobid - (int64_t)HASH_COUNT(server.jobTable)) {
+		sendError(c, JERS_ERR_NOJOB, "Not enough available Job IDs");
+		goto add_jobs_cleanup;
+	}
 
-		/* Loop through all non-deleted jobs and match against the criteria provided
-		 * Add the jobs to the response as we go. We either drive though the main job
-		 * table, or the tag index table */
+	/* Add the jobs that requested a jobid first, so their
+	 * jobid can't be given to another job in this batch */
+	for (int pass = 0; pass < 2; pass++) {
+		for (i = 0; i < batch->count; i++) {
+			jersJobAdd *s = &batch->jobs[i];
 
-		for (j = (it ? it->jobs : server.jobTable); j != NULL; j = (it ? j->tag_hh.next : j->hh.next)) {
-			if (j->internal_state &JERS_FLAG_DELETED)
+			if (jobs[i] || (pass == 0) != (s->jobid != 0))
 				continue;
 
-			/* Try and filter on the easier criteria first */
+			jobs[i] = newJob(c, s, queues[i], resources[i]);
+			resources[i] = NULL;
 
-			if (s->filter_fields & JERS_FILTER_STATE) {
-				if (!(s->filters.state &j->state))
-					continue;
-			}
+			if (jobs[i] == NULL)
+				goto add_jobs_rollback;
 
-			if (s->filter_fields & JERS_FILTER_QUEUE) {
-				if (q && j->queue != q) {
-					continue;
-				} else {
-					if (matches(s->filters.queue_name, j->queue->name) != 0)
-						continue;
-				}
-			}
+			/* Reserve the jobid, without anyone being told about the job yet */
+			HASH_ADD_INT(server.jobTable, jobid, jobs[i]);
+			created[i] = 1;
+		}
+	}
 
-			if (s->filter_fields & JERS_FILTER_UID) {
-				if (s->filters.uid != j->uid)
-					continue;
-			}
+	/* Every job has been created, so they can now be added properly */
+	for (i = 0; i < batch->count; i++) {
+		if (!created[i])
+			continue;
 
-			if (s->filter_fields & JERS_FILTER_JOBNAME) {
-				if (matches(s->filters.job_name, j->jobname) != 0)
-					continue;
-			}
+		HASH_DEL(server.jobTable, jobs[i]);
+		addJob(jobs[i], 1);
+	}
 
-			/* Check that all the tag filters provided match the job */
-			if (s->filter_fields & JERS_FILTER_TAGS) {
-				int i;
-				int match = 1;
-				for (i = 0; i < s->filters.tag_count; i++) {
-					/* Skip the indexed tag */
-					if (it && i == indexed_tag_index)
-						continue;
-
-					int k;
-					for (k = 0; k < j->tag_count; k++) {
-						/* Match the tag first */
-						if (strcmp(j->tags[k].key, s->filters.tags[i].key) == 0) {
-							/* Match the value */
-							if (matches(s->filters.tags[i].value, j->tags[k].value) == 0)
-								break;
-						}
-					}
-
-					if (k == j->tag_count) {
-						match = 0;
-						break;
-					}
-				}
+	status = 0;
 
-				if (!match)
-					continue;
-			}
+	/* Don't respond if we are replaying a command */
+	if (c == NULL)
+		goto add_jobs_cleanup;
 
-			/* Check before/after filtering */
-			if (s->filter_fields & JERS_FILTER_BEFORE) {
-				if (s->filters.before.added && j->submit_time > s->filters.before.added)
-					continue;
+	/* Return the jobids in the order they were provided,
+	 * and rewrite the request for the journal with them filled in */
+	initClientResponse(&response, 1);
 
-				if (s->filters.before.started && (j->start_time == 0 || j->start_time > s->filters.before.started))
-					continue;
+	buffNew(&journal, 256 * batch->count);
+	JSONStart(&journal);
+	JSONStartObject(&journal, CMD_ADD_JOBS, CONST_STRLEN(CMD_ADD_JOBS));
+	JSONAddInt(&journal, VERSION, 1);
+	JSONStartArray(&journal, "DATA", 4);
 
-				if (s->filters.before.finished && (j->finish_time == 0 || j->finish_time > s->filters.before.finished))
-					continue;
-			}
+	for (i = 0; i < batch->count; i++) {
+		jersJobAdd *s = &batch->jobs[i];
 
-			if (s->filter_fields & JERS_FILTER_AFTER) {
-				if (s->filters.after.added && j->submit_time < s->filters.after.added)
-					continue;
+		JSONStartObject(&response, NULL, 0);
+		JSONAddInt(&response, JOBID, jobs[i]->jobid);
+		JSONEndObject(&response);
 
-				if (s->filters.after.started && (j->start_time == 0 || j->start_time < s->filters.after.started))
-					continue;
+		s->jobid = jobs[i]->jobid;
 
-				if (s->filters.after.finished && (j->finish_time == 0 || j->finish_time < s->filters.after.finished))
-					continue;
-			}
+		if (s->queue == NULL)
+			s->queue = strdup(jobs[i]->queue->name);
+
+		serializeJobAdd(&journal, s);
+	}
 
+	JSONEndArray(&journal);
+	JSONEndObject(&journal);
+	JSONEnd(&journal);
 
-			/* Made it here, add it to our response if the user has permission */
-			if (read_all || (self && j->uid == c->uid))
-			{
-				serialize_jersJob(&r, j, s->return_fields);
-				count++;
-			}
-		}
+	/* Replace the newline, so it can be used as a string */
+	journal.data[journal.used - 1] = '\0';
+
+	free(c->msg.msg_cpy);
+	c->msg.msg_cpy = journal.data;
+	c->msg.rewritten = 1;
+
+	sendClientMessage(c, NULL, &response);
+
+	print_msg(JERS_LOG_INFO, "%ld jobs created, first JobID %d. uid: %d", batch->count, jobs[0]->jobid, c->uid);
+
+	server.stats.total.submitted += batch->count;
+
+	goto add_jobs_cleanup;
+
+add_jobs_rollback:
+	/* Free the jobs this batch reserved before the failure, but not any
+	 * already loaded when replaying. They own their strings now */
+	for (i = 0; i < batch->count; i++) {
+		if (!created[i])
+			continue;
+
+		HASH_DEL(server.jobTable, jobs[i]);
+		freeJob(jobs[i]);
+		releaseJobAdd(&batch->jobs[i]);
 	}
 
-	return sendClientMessage(c, NULL, &r);
+add_jobs_cleanup:
+	for (i = 0; resources && i < batch->count; i++)
+		free(resources[i]);
+
+	free(queues);
+	free(resources);
+	free(jobs);
+	free(created);
+	free(requested);
+
+	return status;
 }
 
-int command_mod_job(client *c, void *args) {
-	jersJobMod *mj = args;
-	struct job * j = NULL;
-	struct queue * q = NULL;
-	int state = 0;
-	int dirty = 0;
-	int hold = 0;
-	int completed = 0;
-	struct jobResource *new_resources = NULL;
+/* Check if a job matches the filter. The tag at skip_tag has already been
+ * matched using the tag index, or is -1 */
 
-	if (mj->jobid == 0) {
-		sendError(c, JERS_ERR_NOJOB, NULL);
-		return 0;
-	}
+static int jobMatchesFilter(struct job *j, const jersJobFilter *s, struct queue *q, int skip_tag) {
+	/* Try and filter on the easier criteria first */
 
-	j = findJob(mj->jobid);
+	if (s->filter_fields & JERS_FILTER_STATE) {
+		if (!(s->filters.state &j->state))
+			return 0;
+	}
 
-	if (likely(server.recovery.in_progress == 0)) {
-		/* Validate the user has permission
-		 * We use a bogus ID if the job doesn't exist, just to check their permissions */
-		if (check_perm(c, j ? j->uid : 0, PERM_WRITE)) {
-			sendError(c, JERS_ERR_NOPERM, NULL);
-			return -1;
+	if (s->filter_fields & JERS_FILTER_QUEUE) {
+		if (q && j->queue != q) {
+			return 0;
+		} else {
+			if (matches(s->filters.queue_name, j->queue->name) != 0)
+				return 0;
 		}
 	}
 
-	if (j == NULL || j->internal_state &JERS_FLAG_DELETED) {
-		sendError(c, JERS_ERR_NOJOB, NULL);
-		return 0;
+	if (s->filter_fields & JERS_FILTER_UID) {
+		if (s->filters.uid != j->uid)
+			return 0;
 	}
 
-	if (unlikely(server.recovery.in_progress)) {
-		if (j->obj.revision >= server.recovery.revision) {
-			print_msg(JERS_LOG_DEBUG, "Skipping recovery of job_mod job %d rev:%ld trans rev:%ld", j->jobid, j->obj.revision, server.recovery.revision);
+	if (s->filter_fields & JERS_FILTER_JOBNAME) {
+		if (matches(s->filters.job_name, j->jobname) != 0)
 			return 0;
-		}
 	}
 
-	state = j->state;
-	hold = (j->state == JERS_JOB_HOLDING);
+	/* Check that all the tag filters provided match the job */
+	if (s->filter_fields & JERS_FILTER_TAGS) {
+		if (s->filters.tag_count > (skip_tag >= 0))
+			stateLoadJobDetails(j);
 
-	if ((j->state == JERS_JOB_COMPLETED || j->state == JERS_JOB_EXITED || j->state == JERS_JOB_UNKNOWN))
-		completed = 1;
+		for (int i = 0; i < s->filters.tag_count; i++) {
+			/* Skip the indexed tag */
+			if (i == skip_tag)
+				continue;
 
-	if (completed && mj->restart != 1) {
-		/* If a job is completed, we are allowed to run a subset of 'mod' actions.
-		 * Actions that are not allowed, unless the restart flag is set:
-		 *  - Hold
-		 *  - Defer
-		 */
-		if (mj->defer_time != UNSET_TIME_T || mj->hold != UNSET_8) {
-			sendError(c, JERS_ERR_INVARG, "Unable to modify a completed job without restart flag");
-			return 0;
+			int k;
+			for (k = 0; k < j->tag_count; k++) {
+				/* Match the tag first */
+				if (strcmp(j->tags[k].key, s->filters.tags[i].key) == 0) {
+					/* Match the value */
+					if (matches(s->filters.tags[i].value, j->tags[k].value) == 0)
+						break;
+				}
+			}
+
+			if (k == j->tag_count)
+				return 0;
 		}
 	}
 
-	if (j->state == JERS_JOB_RUNNING || j->internal_state &JERS_FLAG_JOB_STARTED) {
-		sendError(c, JERS_ERR_INVARG, "Unable to modify a running job");
-		return 0;
-	}
+	/* Check before/after filtering */
+	if (s->filter_fields & JERS_FILTER_BEFORE) {
+		if (s->filters.before.added && j->submit_time > s->filters.before.added)
+			return 0;
 
-	if (mj->priority != UNSET_32) {
-		if (mj->priority < JERS_JOB_MIN_PRIORITY || mj->priority > JERS_JOB_MAX_PRIORITY) {
-			sendError(c, JERS_ERR_INVARG, "Invalid priority specified");
+		if (s->filters.before.started && (j->start_time == 0 || j->start_time > s->filters.before.started))
+			return 0;
+
+		if (s->filters.before.finished && (j->finish_time == 0 || j->finish_time > s->filters.before.finished))
 			return 0;
-		}
 	}
 
-	if (mj->queue) {
-		q = findQueue(mj->queue);
+	if (s->filter_fields & JERS_FILTER_AFTER) {
+		if (s->filters.after.added && j->submit_time < s->filters.after.added)
+			return 0;
 
-		if (q == NULL) {
-			sendError(c, JERS_ERR_NOQUEUE, NULL);
+		if (s->filters.after.started && (j->start_time == 0 || j->start_time < s->filters.after.started))
+			return 0;
+
+		if (s->filters.after.finished && (j->finish_time == 0 || j->finish_time < s->filters.after.finished))
 			return 0;
-		}
+	}
+
+	return 1;
+}
+
+/* Call func for every non-deleted job matching the filter. q is the queue
+ * being filtered on, if it's not wildcarded.
+ *
+ * The search is driven from the smallest set of jobs that can match. This
+ * is either an indexed tag, one of the state, queue or uid indexes, a range
+ * of one of the time indexes, the job name index, or the whole job table */
+
+/* Get the range of times a filter covers in one of the time indexes,
+ * returning 0 if the filter doesn't cover that time */
+
+static int filterTimeRange(const jersJobFilter *s, int type, time_t *from, time_t *to) {
+	time_t before = 0, after = 0;
+
+	if (s->filter_fields & JERS_FILTER_BEFORE)
+		before = type == TIME_INDEX_SUBMIT ? s->filters.before.added : type == TIME_INDEX_START ? s->filters.before.started : s->filters.before.finished;
+
+	if (s->filter_fields & JERS_FILTER_AFTER)
+		after = type == TIME_INDEX_SUBMIT ? s->filters.after.added : type == TIME_INDEX_START ? s->filters.after.started : s->filters.after.finished;
+
+	*from = after ? after : 1;
+	*to = before ? before : INT64_MAX;
+
+	return before || after;
+}
+
+static void filterJobs(const jersJobFilter *s, struct queue *q, void (*func)(struct job *, void *), void *arg) {
+	struct indexed_tag *it = NULL;
+	int indexed_tag_index = -1;
+	struct jobIndex *idx = NULL;
+	int link = 0;
+	int states = (s->filter_fields & JERS_FILTER_STATE) ? s->filters.state : ~0;
+	int64_t cost = HASH_COUNT(server.jobTable);
+	struct job *j;
+
+	/* If the user is filtering on tags, check if any are indexed tags,
+	 * using the value with the fewest jobs. This greatly speeds up the lookups */
+	if (server.index_tag_count && s->filter_fields &JERS_FILTER_TAGS) {
+		for (int i = 0; i < s->filters.tag_count; i++) {
+			int idx = indexTagPosition(s->filters.tags[i].key);
+			struct indexed_tag *t = NULL;
+
+			/* Only attempt to use it if it's not wildcarded */
+			if (idx < 0 || strchr(s->filters.tags[i].value, '*') || strchr(s->filters.tags[i].value, '?'))
+				continue;
+
+			HASH_FIND_STR(server.index_tags[idx].table, s->filters.tags[i].value, t);
+
+			/* No jobs have this value */
+			if (t == NULL || t->jobs == NULL)
+				return;
+
+			if (HASH_CNT(hh, t->jobs) < cost) {
+				it = t;
+				indexed_tag_index = i;
+				cost = HASH_CNT(hh, t->jobs);
+			}
+		}
+	}
+
+	if (s->filter_fields & JERS_FILTER_UID) {
+		struct uidIndex *u = findUidIndex(s->filters.uid);
+
+		if (u == NULL)
+			return;
+
+		if (jobIndexCount(&u->index, states) < cost) {
+			idx = &u->index;
+			link = JOB_LINK_UID;
+			cost = jobIndexCount(idx, states);
+		}
+	}
+
+	if (q && jobIndexCount(&q->index, states) < cost) {
+		idx = &q->index;
+		link = JOB_LINK_QUEUE;
+		cost = jobIndexCount(idx, states);
+	}
+
+	if (s->filter_fields & JERS_FILTER_STATE && jobIndexCount(&server.stateIndex, states) < cost) {
+		idx = &server.stateIndex;
+		link = JOB_LINK_STATE;
+		cost = jobIndexCount(idx, states);
+	}
+
+	/* Time ranges are counted by walking them, up to the best cost so far */
+	int time_type = -1;
+	time_t from = 0, to = 0;
+
+	for (int type = 0; s->filter_fields & (JERS_FILTER_BEFORE | JERS_FILTER_AFTER) && type < TIME_INDEX_COUNT; type++) {
+		time_t type_from, type_to;
+
+		if (!filterTimeRange(s, type, &type_from, &type_to))
+			continue;
+
+		int64_t count = timeIndexCount(type, type_from, type_to, cost);
+
+		if (count < cost) {
+			time_type = type;
+			from = type_from;
+			to = type_to;
+			cost = count;
+		}
+	}
+
+	/* The name index gives an upper bound on the jobs a name pattern can match */
+	int names = 0;
+
+	if (server.index_job_names && s->filter_fields & JERS_FILTER_JOBNAME) {
+		int64_t estimate = nameIndexEstimate(s->filters.job_name);
+
+		if (estimate == 0)
+			return;
+
+		if (estimate > 0 && estimate < cost) {
+			names = 1;
+			cost = estimate;
+		}
+	}
+
+	if (names) {
+		jobid_t *jobids;
+		int64_t count = nameIndexSearch(s->filters.job_name, &jobids);
+
+		for (int64_t i = 0; i < count; i++) {
+			j = findJob(jobids[i]);
+
+			if (j && !(j->internal_state &JERS_FLAG_DELETED) && jobMatchesFilter(j, s, q, -1))
+				func(j, arg);
+		}
+
+		free(jobids);
+		return;
+	}
+
+	if (time_type >= 0) {
+		for (j = timeIndexSeek(time_type, from); j && j->time_links[time_type].key <= to; j = j->time_links[time_type].next[0]) {
+			if (jobMatchesFilter(j, s, q, -1))
+				func(j, arg);
+		}
+
+		return;
+	}
+
+	if (idx) {
+		for (int i = 0; i < JOB_STATE_LISTS; i++) {
+			if (!(states & (1 << i)))
+				continue;
+
+			for (j = idx->jobs[i]; j != NULL; j = j->links[link].next) {
+				if (jobMatchesFilter(j, s, q, -1))
+					func(j, arg);
+			}
+		}
+
+		return;
+	}
+
+	if (it) {
+		for (struct jobTagHandle *h = it->jobs; h != NULL; h = h->hh.next) {
+			if (!(h->job->internal_state &JERS_FLAG_DELETED) && jobMatchesFilter(h->job, s, q, indexed_tag_index))
+				func(h->job, arg);
+		}
+
+		return;
+	}
+
+	/* Loop through all non-deleted jobs and match against the criteria provided */
+	for (j = server.jobTable; j != NULL; j = j->hh.next) {
+		if (j->internal_state &JERS_FLAG_DELETED)
+			continue;
+
+		if (jobMatchesFilter(j, s, q, -1))
+			func(j, arg);
+	}
+}
+
+/* Look up the queue being filtered on, if it's not wildcarded.
+ * Returns non-zero if the queue doesn't exist */
+
+static int filterQueue(const jersJobFilter *s, struct queue **q) {
+	*q = NULL;
+
+	if (s->filter_fields & JERS_FILTER_QUEUE) {
+		if (strchr(s->filters.queue_name, '*') == NULL && strchr(s->filters.queue_name, '?') == NULL)
+		{
+			*q = findQueue(s->filters.queue_name);
+
+			if (*q == NULL)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+struct getJobArgs {
+	client *c;
+	buff_t *r;
+	int fields;
+	int read_all;
+	int self;
+};
+
+static void getJobMatched(struct job *j, void *arg) {
+	struct getJobArgs *ga = arg;
+
+	/* Made it here, add it to our response if the user has permission */
+	if (ga->read_all || (ga->self && j->uid == ga->c->uid))
+		serialize_jersJob(ga->r, j, ga->fields);
+}
+
+struct changeMatch {
+	const jersJobFilter *s;
+	struct queue *q;
+	struct getJobArgs *ga;
+};
+
+/* Deleted jobs are sent as a tombstone, with just their jobid. Only the uid
+ * and queue of a deleted job are kept, so those are the filters checked */
+
+static void addTombstone(struct changeMatch *cm, jobid_t jobid, uid_t uid, const char *queue) {
+	if (!cm->ga->read_all && !(cm->ga->self && uid == cm->ga->c->uid))
+		return;
+
+	if (cm->s->filter_fields & JERS_FILTER_UID && cm->s->filters.uid != uid)
+		return;
+
+	if (cm->s->filter_fields & JERS_FILTER_QUEUE && matches(cm->s->filters.queue_name, queue) != 0)
+		return;
+
+	JSONStartObject(cm->ga->r, NULL, 0);
+	JSONAddInt(cm->ga->r, JOBID, jobid);
+	JSONAddBool(cm->ga->r, DELETED, 1);
+	JSONEndObject(cm->ga->r);
+}
+
+static void getDeletedJob(const struct tombstone *t, void *arg) {
+	addTombstone(arg, t->jobid, t->uid, t->queue);
+}
+
+static void getChangedJobMatched(struct job *j, void *arg) {
+	struct changeMatch *cm = arg;
+
+	/* Deleted, but not cleaned up yet */
+	if (j->internal_state &JERS_FLAG_DELETED) {
+		addTombstone(cm, j->jobid, j->uid, j->queue->name);
+		return;
+	}
+
+	if (jobMatchesFilter(j, cm->s, cm->q, -1))
+		getJobMatched(j, cm->ga);
+}
+
+struct archiveMatch {
+	const jersJobFilter *s;
+	struct getJobArgs *ga;
+};
+
+static void getArchivedJobMatched(struct job *j, void *arg) {
+	struct archiveMatch *am = arg;
+	struct job *live = findJob(j->jobid);
+
+	/* The job was reloaded before its removal from the job table was saved */
+	if (live && !(live->internal_state &JERS_FLAG_DELETED) && live->submit_time == j->submit_time)
+		return;
+
+	/* Archived jobs are matched on the queue name, as the queue may no longer exist */
+	if (jobMatchesFilter(j, am->s, NULL, -1))
+		getJobMatched(j, am->ga);
+}
+
+int command_get_job(client *c, void * args) {
+	jersJobQuery * query = args;
+	jersJobFilter * s = &query->filter;
+	struct queue * q = NULL;
+	struct job * j = NULL;
+	int read_all = (c->uid == 0 || c->user->permissions &PERM_READ);
+	int self = (server.permissions.self.count == 0 || c->uid == 0 || (c->user->permissions &PERM_SELF) == PERM_SELF);
+
+	buff_t r;
+
+	/* JobId? Just look it up and return the result */
+	if (s->jobid) {
+		j = findJob(s->jobid);
+
+		/* Validate the user has permission
+		 * We use a bogus UID if the job doesn't exist, just to check their permissions */
+		if (check_perm(c, j ? j->uid : 0, PERM_READ)) {
+			sendError(c, JERS_ERR_NOPERM, NULL);
+			return -1;
+		}
+
+		if (j == NULL || (j->internal_state &JERS_FLAG_DELETED)) {
+			sendError(c, JERS_ERR_NOJOB, NULL);
+			return 1;
+		}
+
+		initClientResponse(&r, 1);
+		serialize_jersJob(&r, j, 0);
+	} else {
+		/* If a queue filter has been provided, and its not a wildcard look it up first */
+		if (filterQueue(s, &q) != 0) {
+			sendError(c, JERS_ERR_NOQUEUE, NULL);
+			return -1;
+		}
+
+		struct getJobArgs ga = {c, &r, s->return_fields, read_all, self};
+
+		/* Delta queries only visit the jobs changed since the sequence given. If
+		 * it's too old to answer, every matching job is sent and flagged as a resync */
+		if (s->filter_fields & JERS_FILTER_CHANGED) {
+			struct changeMatch cm = {s, q, &ga};
+			int resync = query->changed_since < server.changes.floor || query->changed_since > server.changes.seq;
+
+			initClientChangeResponse(&r, 1, server.changes.seq, resync);
+
+			if (resync)
+				filterJobs(s, q, getJobMatched, &ga);
+			else
+				jobChangesSince(query->changed_since, getChangedJobMatched, getDeletedJob, &cm);
+
+			return sendClientMessage(c, NULL, &r);
+		}
+
+		initClientResponse(&r, 1);
+
+		filterJobs(s, q, getJobMatched, &ga);
+
+		/* Searches on a time range also cover the archive */
+		if (server.archive.count && s->filter_fields & (JERS_FILTER_BEFORE | JERS_FILTER_AFTER)) {
+			struct archiveMatch am = {s, &ga};
+			archiveSearch(s, getArchivedJobMatched, &am);
+		}
+	}
+
+	return sendClientMessage(c, NULL, &r);
+}
+
+/* Check a modification can be applied to this job, returning an error message if not */
+
+static const char * checkJobMod(const jersJobMod *mj, struct job *j) {
+	int completed = (j->state == JERS_JOB_COMPLETED || j->state == JERS_JOB_EXITED || j->state == JERS_JOB_UNKNOWN);
+
+	if (completed && mj->restart != 1) {
+		/* If a job is completed, we are allowed to run a subset of 'mod' actions.
+		 * Actions that are not allowed, unless the restart flag is set:
+		 *  - Hold
+		 *  - Defer
+		 */
+		if (mj->defer_time != UNSET_TIME_T || mj->hold != UNSET_8)
+			return "Unable to modify a completed job without restart flag";
+	}
+
+	if (j->state == JERS_JOB_RUNNING || j->internal_state &JERS_FLAG_JOB_STARTED)
+		return "Unable to modify a running job";
+
+	/* The job would be saved without the details it's missing */
+	if (stateLoadJobDetails(j) != 0)
+		return "Unable to load the job details";
+
+	return NULL;
+}
+
+/* Validate the parts of a modification that don't depend on the job,
+ * returning the new queue and resources. An error is sent to the client
+ * and non-zero returned if it's invalid */
+
+static int validateJobMod(client *c, const jersJobMod *mj, struct queue **q, struct jobResource **new_resources) {
+	*q = NULL;
+	*new_resources = NULL;
+
+	if (mj->priority != UNSET_32) {
+		if (mj->priority < JERS_JOB_MIN_PRIORITY || mj->priority > JERS_JOB_MAX_PRIORITY) {
+			sendError(c, JERS_ERR_INVARG, "Invalid priority specified");
+			return 1;
+		}
+	}
+
+	if (mj->queue) {
+		*q = findQueue(mj->queue);
+
+		if (*q == NULL) {
+			sendError(c, JERS_ERR_NOQUEUE, NULL);
+			return 1;
+		}
 	}
 
 	if (mj->clear_resources == 0 && mj->res_count > 0) {
-		new_resources = convertResourceStrings(mj->res_count, mj->resources);
+		*new_resources = convertResourceStrings(mj->res_count, mj->resources);
 
-		if (new_resources == NULL) {
+		if (*new_resources == NULL) {
 			sendError(c, JERS_ERR_NORES, NULL);
 			return -1;
 		}
 	}
 
+	return 0;
+}
+
+/* Apply a validated modification to a job. The strings in the request are
+ * handed over to the job, unless copy is set, in which case the job gets its
+ * own copy of them and the new resources */
+
+static void applyJobMod(const jersJobMod *mj, struct job *j, struct queue *q, struct jobResource *new_resources, int copy) {
+	int state = j->state;
+	int dirty = 0;
+	int hold = (j->state == JERS_JOB_HOLDING);
+	int completed = 0;
+
+	if ((j->state == JERS_JOB_COMPLETED || j->state == JERS_JOB_EXITED || j->state == JERS_JOB_UNKNOWN))
+		completed = 1;
+
+	stateLoadJobDetails(j);
+
 	/* If we are restarting an unknown job, we need to deallocate the used resources */
 	if (mj->restart && j->state == JERS_JOB_UNKNOWN)
 		deallocateRes(j);
 
 	if (mj->name) {
+		if (server.index_job_names)
+			nameIndexDel(j);
+
 		free(j->jobname);
-		j->jobname = mj->name;
+		j->jobname = copy ? strdup(mj->name) : mj->name;
+
+		if (server.index_job_names)
+			nameIndexAdd(j);
 		dirty = 1;
 	}
 
 	if (mj->priority != UNSET_32) {
-		j->priority = mj->priority;
+		/* A pending job needs to be repositioned in its queue */
+		if (j->state == JERS_JOB_PENDING) {
+			removePendingJob(j);
+			j->priority = mj->priority;
+			addPendingJob(j);
+			schedQueueChanged(j->queue);
+		} else {
+			j->priority = mj->priority;
+		}
 
 		dirty = 1;
 	}
@@ -882,15 +1474,18 @@ int command_mod_job(client *c, void *args) {
 			freeStringArray(j->env_count, &j->envs);
 
 		j->env_count = mj->env_count;
-		j->envs = mj->envs;
+		j->envs = copy ? dupStringArray(mj->env_count, mj->envs) : mj->envs;
 	}
 
 	if (mj->tag_count != UNSET_64) {
+		unindexJobTags(j);
+
 		if (j->tag_count)
 			freeStringMap(j->tag_count, &j->tags);
 
 		j->tag_count = mj->tag_count;
-		j->tags = (key_val_t *)mj->tags;
+		j->tags = copy ? dupStringMap(mj->tag_count, (key_val_t *)mj->tags) : (key_val_t *)mj->tags;
+		indexJobTags(j);
 	}
 
 	if (mj->res_count != UNSET_64) {
@@ -903,7 +1498,7 @@ int command_mod_job(client *c, void *args) {
 		}
 
 		if (new_resources) {
-			j->req_resources = new_resources;
+			j->req_resources = copy ? dup_mem(new_resources, sizeof(struct jobResource) * mj->res_count, 0) : new_resources;
 			j->res_count = mj->res_count;
 
 			dirty = 1;
@@ -946,6 +1541,53 @@ int command_mod_job(client *c, void *args) {
 		dirty = 1;
 
 	changeJobState(j, state, q, dirty);
+}
+
+int command_mod_job(client *c, void *args) {
+	jersJobMod *mj = args;
+	struct job * j = NULL;
+	struct queue * q = NULL;
+	struct jobResource *new_resources = NULL;
+	const char *err;
+	int rc;
+
+	if (mj->jobid == 0) {
+		sendError(c, JERS_ERR_NOJOB, NULL);
+		return 0;
+	}
+
+	j = findJob(mj->jobid);
+
+	if (likely(server.recovery.in_progress == 0)) {
+		/* Validate the user has permission
+		 * We use a bogus ID if the job doesn't exist, just to check their permissions */
+		if (check_perm(c, j ? j->uid : 0, PERM_WRITE)) {
+			sendError(c, JERS_ERR_NOPERM, NULL);
+			return -1;
+		}
+	}
+
+	if (j == NULL || j->internal_state &JERS_FLAG_DELETED) {
+		sendError(c, JERS_ERR_NOJOB, NULL);
+		return 0;
+	}
+
+	if (unlikely(server.recovery.in_progress)) {
+		if (j->obj.revision >= server.recovery.revision) {
+			print_msg(JERS_LOG_DEBUG, "Skipping recovery of job_mod job %d rev:%ld trans rev:%ld", j->jobid, j->obj.revision, server.recovery.revision);
+			return 0;
+		}
+	}
+
+	if ((err = checkJobMod(mj, j)) != NULL) {
+		sendError(c, JERS_ERR_INVARG, err);
+		return 0;
+	}
+
+	if ((rc = validateJobMod(c, mj, &q, &new_resources)) != 0)
+		return rc < 0 ? -1 : 0;
+
+	applyJobMod(mj, j, q, new_resources, 0);
 
 	return sendClientReturnCode(c, &j->obj, "0");
 }
@@ -980,9 +1622,49 @@ int command_del_job(client * c, void * args) {
 	return sendClientReturnCode(c, NULL, "0");
 }
 
+/* Send a signal to a running job, via its agent. Returns an error message if
+ * the job isn't running. A signal of 0 just checks the job is running */
+
+static const char * signalJob(struct job *j, int signum, uid_t uid) {
+	if (j->state != JERS_JOB_RUNNING) {
+		/* If the job state is unknown, we will set this job state to the signal provided
+		 * We also need to deallocate the resources assigned to this job */
+		if (j->state == JERS_JOB_UNKNOWN && signum != 0) {
+			j->pid = -1;
+			j->finish_time = time(NULL);
+			j->signal = signum;
+			j->exitcode = 128 + j->signal;
+
+			changeJobState(j, JERS_JOB_EXITED, NULL, 1);
+			deallocateRes(j);
+
+			return NULL;
+		}
+
+		return "Job is not running";
+	}
+
+	/* signo == 0 wants to just test the job is running */
+	if (signum == 0)
+		return NULL;
+
+	/* Send the requested signal to the job (via the agent) */
+	buff_t sig_message;
+	initRequest(&sig_message, CMD_SIG_JOB, 1);
+
+	JSONAddInt(&sig_message, JOBID, j->jobid);
+	JSONAddInt(&sig_message, SIGNAL, signum);
+	JSONAddInt(&sig_message, UID, uid);
+
+	sendAgentMessage(j->queue->agent, &sig_message);
+
+	return NULL;
+}
+
 int command_sig_job(client * c, void * args) {
 	jersJobSig * js = args;
 	struct job * j = NULL;
+	const char *err;
 
 	j = findJob(js->jobid);
 
@@ -998,63 +1680,273 @@ int command_sig_job(client * c, void * args) {
 		return 1;
 	}
 
-	if (j->state != JERS_JOB_RUNNING) {
-		/* If the job state is unknown, we will set this job state to the signal provided
-		 * We also need to deallocate the resources assigned to this job */
-		if (j->state == JERS_JOB_UNKNOWN && js->signum != 0) {
-			j->pid = -1;
-			j->finish_time = time(NULL);
-			j->signal = js->signum;
-			j->exitcode = 128 + j->signal;
+	if ((err = signalJob(j, js->signum, c->uid)) != NULL) {
+		sendError(c, JERS_ERR_INVSTATE, err);
+		return 1;
+	}
 
-			changeJobState(j, JERS_JOB_EXITED, NULL, 1);
-			deallocateRes(j);
+	return sendClientReturnCode(c, NULL, "0");
+}
+
+struct jobList {
+	struct job **jobs;
+	int64_t *revisions;
+	int64_t count;
+	int64_t size;
+};
+
+static void jobListAdd(struct job *j, void *arg) {
+	struct jobList *list = arg;
+
+	if (list->count == list->size) {
+		list->size = list->size ? list->size * 2 : 64;
+		list->jobs = realloc(list->jobs, sizeof(struct job *) * list->size);
+
+		if (list->jobs == NULL)
+			error_die("Failed to allocate memory for job list: %s", strerror(errno));
+	}
+
+	list->jobs[list->count++] = j;
+}
+
+/* Select the jobs a bulk command applies to, either from the filter or, when
+ * replaying, from the list of jobids in the journal record. The revision each
+ * job had when the command was journalled is also returned.
+ * An error is sent to the client and non-zero returned on failure */
+
+static int selectJobs(client *c, const jersJobBulk *jb, struct jobList *list) {
+	struct queue *q = NULL;
+
+	memset(list, 0, sizeof(struct jobList));
+
+	if (jb->count) {
+		list->revisions = malloc(sizeof(int64_t) * jb->count);
+
+		for (int64_t i = 0; i < jb->count; i++) {
+			struct job *j = findJob(jb->jobids[i]);
 
-			return sendClientReturnCode(c, NULL, "0");
+			if (j == NULL || j->internal_state &JERS_FLAG_DELETED)
+				continue;
+
+			list->revisions[list->count] = jb->revisions[i];
+			jobListAdd(j, list);
 		}
 
-		sendError(c, JERS_ERR_INVSTATE, "Job is not running");
+		return 0;
+	}
+
+	/* Don't allow every job to be changed by accident */
+	if (jb->filter.filter_fields == 0) {
+		sendError(c, JERS_ERR_INVARG, "No filter provided");
 		return 1;
 	}
 
-	/* signo == 0 wants to just test the job is running */
-	if (js->signum == 0)
-		return sendClientReturnCode(c, NULL, "0");
+	if (filterQueue(&jb->filter, &q) != 0) {
+		sendError(c, JERS_ERR_NOQUEUE, NULL);
+		return 1;
+	}
 
-	/* Send the requested signal to the job (via the agent) */
-	buff_t sig_message;
-	initRequest(&sig_message, CMD_SIG_JOB, 1);
+	filterJobs(&jb->filter, q, jobListAdd, list);
 
-	JSONAddInt(&sig_message, JOBID, js->jobid);
-	JSONAddInt(&sig_message, SIGNAL, js->signum);
-	JSONAddInt(&sig_message, UID, c->uid);
+	return 0;
+}
 
-	sendAgentMessage(j->queue->agent, &sig_message);
+/* Start the journal record for a bulk command with the action item.
+ * The jobs changed are added as they are processed */
 
-	return sendClientReturnCode(c, NULL, "0");
+static void initBulkJournal(buff_t *b, const char *cmd, size_t cmd_len, const jersJobMod *mod, int64_t count) {
+	buffNew(b, 128 + 48 * count);
+	JSONStart(b);
+	JSONStartObject(b, cmd, cmd_len);
+	JSONAddInt(b, VERSION, 1);
+	JSONStartArray(b, "DATA", 4);
+
+	JSONStartObject(b, NULL, 0);
+
+	if (mod)
+		serializeJobModFields(b, mod);
+
+	JSONEndObject(b);
 }
 
-/* wait job is a blocking command for the client.
- * If we can't respond straight away, we define our callback
- * function which will get run in the event loop to check for changes */
+static void addBulkJournal(buff_t *b, struct job *j) {
+	JSONStartObject(b, NULL, 0);
+	JSONAddInt(b, JOBID, j->jobid);
+	JSONAddInt(b, REVISION, j->obj.revision);
+	JSONEndObject(b);
+}
 
-int command_wait_job_callback(client *c, void *args) {
-	jersJobWait *jw = args;
+/* Finish the journal record and the response. Nothing is journalled
+ * if no jobs were changed */
 
-	struct job *j = findJob(jw->jobid);
+static int sendBulkResponse(client *c, buff_t *journal, int64_t count, int64_t failed) {
+	buff_t response;
 
-	if (j == NULL || jw->revision != j->obj.revision)
-		return sendClientReturnCode(c, NULL, "0");
+	if (c == NULL) {
+		buffFree(journal);
+		return 0;
+	}
 
-	return 0;
+	if (count) {
+		JSONEndArray(journal);
+		JSONEndObject(journal);
+		JSONEnd(journal);
+
+		/* Replace the newline, so it can be used as a string */
+		journal->data[journal->used - 1] = '\0';
+
+		free(c->msg.msg_cpy);
+		c->msg.msg_cpy = journal->data;
+		c->msg.rewritten = 1;
+	} else {
+		buffFree(journal);
+	}
+
+	initClientResponse(&response, 1);
+
+	JSONStartObject(&response, NULL, 0);
+	JSONAddInt(&response, COUNT, count);
+	JSONAddInt(&response, FAILED, failed);
+	JSONEndObject(&response);
+
+	sendClientMessage(c, NULL, &response);
+
+	return count ? 0 : 1;
 }
 
-int command_wait_job_timeout(client *c, void *args) {
-	UNUSED(args);
-	sendError(c, JERS_ERR_TIMEOUT, NULL);
-	return 0;
+/* Delete all the jobs matching a filter. The jobs deleted are journalled as
+ * a single record */
+
+int command_del_jobs(client *c, void *args) {
+	jersJobBulk *jb = args;
+	struct jobList list;
+	int64_t count = 0, failed = 0;
+	buff_t journal;
+
+	if (selectJobs(c, jb, &list) != 0)
+		return 1;
+
+	initBulkJournal(&journal, CMD_DEL_JOBS, CONST_STRLEN(CMD_DEL_JOBS), NULL, list.count);
+
+	for (int64_t i = 0; i < list.count; i++) {
+		struct job *j = list.jobs[i];
+
+		if (likely(server.recovery.in_progress == 0) && check_perm(c, j->uid, PERM_WRITE)) {
+			failed++;
+			continue;
+		}
+
+		addBulkJournal(&journal, j);
+		deleteJob(j);
+		count++;
+	}
+
+	free(list.jobs);
+	free(list.revisions);
+
+	if (c)
+		print_msg(JERS_LOG_INFO, "%ld jobs deleted, %ld failed. uid: %d", count, failed, c->uid);
+
+	return sendBulkResponse(c, &journal, count, failed);
+}
+
+/* Modify all the jobs matching a filter. Jobs that can't be modified,
+ * ie. they are running, are counted as failed */
+
+int command_mod_jobs(client *c, void *args) {
+	jersJobBulk *jb = args;
+	struct jobList list;
+	struct queue *q = NULL;
+	struct jobResource *new_resources = NULL;
+	int64_t count = 0, failed = 0;
+	buff_t journal;
+
+	if (validateJobMod(c, &jb->mod, &q, &new_resources) != 0)
+		return 1;
+
+	if (selectJobs(c, jb, &list) != 0) {
+		free(new_resources);
+		return 1;
+	}
+
+	initBulkJournal(&journal, CMD_MOD_JOBS, CONST_STRLEN(CMD_MOD_JOBS), &jb->mod, list.count);
+
+	for (int64_t i = 0; i < list.count; i++) {
+		struct job *j = list.jobs[i];
+
+		if (unlikely(server.recovery.in_progress)) {
+			if (j->obj.revision >= list.revisions[i]) {
+				print_msg(JERS_LOG_DEBUG, "Skipping recovery of jobs_mod job %d rev:%ld trans rev:%ld", j->jobid, j->obj.revision, list.revisions[i]);
+				continue;
+			}
+		} else if (check_perm(c, j->uid, PERM_WRITE)) {
+			failed++;
+			continue;
+		}
+
+		if (checkJobMod(&jb->mod, j) != NULL) {
+			failed++;
+			continue;
+		}
+
+		applyJobMod(&jb->mod, j, q, new_resources, 1);
+		addBulkJournal(&journal, j);
+		count++;
+	}
+
+	free(new_resources);
+	free(list.jobs);
+	free(list.revisions);
+
+	if (c)
+		print_msg(JERS_LOG_INFO, "%ld jobs modified, %ld failed. uid: %d", count, failed, c->uid);
+
+	return sendBulkResponse(c, &journal, count, failed);
 }
 
+/* Signal all the jobs matching a filter. Jobs that aren't running are
+ * counted as failed. Not journalled, as there is nothing to replay */
+
+int command_sig_jobs(client *c, void *args) {
+	jersJobBulk *jb = args;
+	struct jobList list;
+	int64_t count = 0, failed = 0;
+	buff_t response;
+
+	if (jb->signum < 0 || jb->signum >= SIGRTMAX) {
+		sendError(c, JERS_ERR_INVARG, "Invalid signum provided");
+		return 1;
+	}
+
+	if (selectJobs(c, jb, &list) != 0)
+		return 1;
+
+	for (int64_t i = 0; i < list.count; i++) {
+		struct job *j = list.jobs[i];
+
+		if (check_perm(c, j->uid, (jb->signum == 0 ? PERM_READ : PERM_WRITE)) || signalJob(j, jb->signum, c->uid) != NULL)
+			failed++;
+		else
+			count++;
+	}
+
+	free(list.jobs);
+	free(list.revisions);
+
+	initClientResponse(&response, 1);
+
+	JSONStartObject(&response, NULL, 0);
+	JSONAddInt(&response, COUNT, count);
+	JSONAddInt(&response, FAILED, failed);
+	JSONEndObject(&response);
+
+	return sendClientMessage(c, NULL, &response);
+}
+
+/* wait job is a blocking command for the client.
+ * If we can't respond straight away, the client is attached to the job
+ * and is woken when the job changes or the timeout expires */
+
 int command_wait_job(client *c, void *args) {
 	jersJobWait *jw = args;
 	struct job *j = NULL;
@@ -1084,16 +1976,41 @@ int command_wait_job(client *c, void *args) {
 	}
 
 	/* Can't reply now, so we'll need to block the client */
-	c->blocking.callback = command_wait_job_callback;
-	c->blocking.timeout_callback = command_wait_job_timeout;
+	if (c->blocking.data) {
+		sendError(c, JERS_ERR_INVARG, "Already waiting");
+		return 1;
+	}
 
-	if (jw->revision == 0)
-		jw->revision = j->obj.revision;
+	addJobWaiter(c, j, j->obj.revision, jw->timeout);
 
-	c->blocking.data = dup_mem(jw, sizeof(jersJobWait), sizeof(jersJobWait));
+	return 0;
+}
 
-	if (jw->timeout > 0)
-		c->blocking.timeout = getTimeMS() + (jw->timeout * 1000);
+/* Stream state changes for jobs matching the filter to the client.
+ * The queue and tag filters are kept by the subscription */
+
+int command_subscribe(client *c, void *args) {
+	jersJobFilter *s = args;
+	int read_all = (c->uid == 0 || c->user->permissions &PERM_READ);
+
+	if (c->blocking.data) {
+		sendError(c, JERS_ERR_INVARG, "Already waiting");
+		return 1;
+	}
+
+	/* Users without read permission only get events for their own jobs */
+	if (!read_all) {
+		if (s->filter_fields &JERS_FILTER_UID && s->filters.uid != c->uid) {
+			sendError(c, JERS_ERR_NOPERM, NULL);
+			return 1;
+		}
+
+		s->filter_fields |= JERS_FILTER_UID;
+		s->filters.uid = c->uid;
+	}
+
+	sendClientReturnCode(c, NULL, "0");
+	addSubscriber(c, s);
 
 	return 0;
 }
@@ -1102,7 +2019,7 @@ int command_set_tag(client * c, void * args) {
 	jersTagSet * ts = args;
 	struct job * j = NULL;
 	int i;
-	int indexed = 0;
+	int indexed = -1;
 
 	j = findJob(ts->jobid);
 
@@ -1120,22 +2037,26 @@ int command_set_tag(client * c, void * args) {
 		return 1;
 	}
 
+	if (stateLoadJobDetails(j) != 0) {
+		sendError(c, JERS_ERR_INVSTATE, "Unable to load the job details");
+		return 1;
+	}
+
 	/* The key can only be printable characters */
 	if (isprintable(ts->key) == 0) {
 		sendError(c, JERS_ERR_INVTAG, NULL);
 		return 1;
 	}
 
-	if (server.index_tag && strcmp(ts->key, server.index_tag) == 0)
-		indexed = 1;
+	indexed = indexTagPosition(ts->key);
 
 	/* Does it have that tag? */
 	for (i = 0; i < j->tag_count; i++) {
 		if (strcmp(j->tags[i].key, ts->key) == 0) {
 			/* Update an existing tag.
-			 * Remove it from the index tag table if it's the index tag*/
-			if (indexed)
-				delIndexTag(j);
+			 * Remove it from the index tag table if it's an index tag*/
+			if (indexed >= 0)
+				delIndexTag(j, indexed);
 
 			free(j->tags[i].value);
 			free(ts->key);
@@ -1151,8 +2072,8 @@ int command_set_tag(client * c, void * args) {
 		j->tags[i].value = ts->value;
 	}
 
-	if (indexed)
-		addIndexTag(j, ts->value);
+	if (indexed >= 0 && ts->value)
+		addIndexTag(j, indexed, ts->value);
 
 	updateObject(&j->obj, 1);
 
@@ -1163,7 +2084,7 @@ int command_del_tag(client * c, void * args) {
 	jersTagDel * td = args;
 	struct job * j = NULL;
 	int i;
-	int indexed = 0;
+	int indexed = -1;
 
 	j = findJob(td->jobid);
 
@@ -1181,14 +2102,18 @@ int command_del_tag(client * c, void * args) {
 		return 1;
 	}
 
-	if (server.index_tag && strcmp(server.index_tag, td->key) == 0)
-		indexed = 1;
+	if (stateLoadJobDetails(j) != 0) {
+		sendError(c, JERS_ERR_INVSTATE, "Unable to load the job details");
+		return 1;
+	}
+
+	indexed = indexTagPosition(td->key);
 
 	/* Does it have that tag? */
 	for (i = 0; i < j->tag_count; i++) {
 		if (strcmp(j->tags[i].key, td->key) == 0) {
-			if (indexed)
-				delIndexTag(j);
+			if (indexed >= 0)
+				delIndexTag(j, indexed);
 
 			free(j->tags[i].key);
 			free(j->tags[i].value);
@@ -1213,25 +2138,31 @@ int command_del_tag(client * c, void * args) {
 void free_add_job(void * args, int status) {
 	jersJobAdd * ja = args;
 
-	if (status) {
-		free(ja->name);
-		free(ja->shell);
-		free(ja->stdout);
-		free(ja->stderr);
-		free(ja->wrapper);
-		free(ja->pre_cmd);
-		free(ja->post_cmd);
-
-		freeStringArray(ja->argc, &ja->argv);
-		freeStringArray(ja->env_count, &ja->envs);
-		freeStringMap(ja->tag_count, (key_val_t **)&ja->tags);
-	}
+	if (status)
+		freeJobAdd(ja);
 
 	free(ja->queue);
 	freeStringArray(ja->res_count, &ja->resources);
 	free(ja);
 }
 
+void free_add_jobs(void *args, int status) {
+	jersJobAddBatch *batch = args;
+
+	for (int64_t i = 0; i < batch->count; i++) {
+		jersJobAdd *ja = &batch->jobs[i];
+
+		if (status)
+			freeJobAdd(ja);
+
+		free(ja->queue);
+		freeStringArray(ja->res_count, &ja->resources);
+	}
+
+	free(batch->jobs);
+	free(batch);
+}
+
 void free_get_job(void * args, int status) {
 	jersJobFilter * jf = args;
 
@@ -1270,12 +2201,46 @@ void free_sig_job(void * args, int status) {
 	free(js);
 }
 
+void free_bulk_jobs(void *args, int status) {
+	jersJobBulk *jb = args;
+
+	UNUSED(status);
+
+	free(jb->mod.name);
+	free(jb->mod.queue);
+	freeStringArray(jb->mod.env_count, &jb->mod.envs);
+	freeStringMap(jb->mod.tag_count, (key_val_t **)&jb->mod.tags);
+	freeStringArray(jb->mod.res_count, &jb->mod.resources);
+
+	free(jb->filter.filters.job_name);
+	free(jb->filter.filters.queue_name);
+	freeStringMap(jb->filter.filters.tag_count, (key_val_t **)&jb->filter.filters.tags);
+	freeStringArray(jb->filter.filters.res_count, &jb->filter.filters.resources);
+
+	free(jb->jobids);
+	free(jb->revisions);
+	free(jb);
+}
+
 void free_wait_job(void *args, int status) {
 	jersJobWait *jw = args;
 	UNUSED(status);
 	free(jw);
 }
 
+void free_subscribe(void *args, int status) {
+	jersJobFilter *jf = args;
+
+	if (status) {
+		free(jf->filters.queue_name);
+		freeStringMap(jf->filters.tag_count, (key_val_t **)&jf->filters.tags);
+	}
+
+	free(jf->filters.job_name);
+	freeStringArray(jf->filters.res_count, &jf->filters.resources);
+	free(jf);
+}
+
 void free_set_tag(void * args, int status) {
 	jersTagSet * ts = args;
 
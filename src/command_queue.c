@@ -147,6 +147,7 @@ int command_add_queue(client * c, void * args) {
 			/* Asked to create a queue which has just been deleted.
 			 * It's easier to remove it from the hashtable, then re-add it. */
 			HASH_DEL(server.queueTable, q);
+			server.candidate_recalc = 1;
 
 			free(q->name);
 			free(q->desc);
@@ -349,6 +350,7 @@ int command_mod_queue(client *c, void * args) {
 
 	if (qm->priority != UNSET_32 && q->priority != qm->priority) {
 		q->priority = qm->priority;
+		server.candidate_recalc = 1;
 		dirty = 1;
 	}
 
@@ -369,13 +371,15 @@ int command_mod_queue(client *c, void * args) {
 
 	updateObject(&q->obj, dirty);
 
+	if (dirty)
+		schedQueueChanged(q);
+
 	return sendClientReturnCode(c, &q->obj, "0");
 }
 
 int command_del_queue(client *c, void *args) {
 	jersQueueDel *qd = args;
 	struct queue *q = NULL;
-	struct job *j = NULL;
 
 	if (qd->name == NULL) {
 		sendError(c, JERS_ERR_INVARG, "No queue provided");
@@ -395,12 +399,7 @@ int command_del_queue(client *c, void *args) {
 	}
 
 	/* We can only delete a queue if there are no active jobs on it. Deleted jobs are ok. */
-	for (j = server.jobTable; j != NULL; j = j->hh.next) {
-		if (j->queue == q && !(j->internal_state &JERS_FLAG_DELETED))
-			break;
-	}
-
-	if (j != NULL) {
+	if (jobIndexCount(&q->index, ~0) != 0) {
 		sendError(c, JERS_ERR_NOTEMPTY, NULL);
 		return 1;
 	}
@@ -209,6 +209,7 @@ int command_mod_resource(client *c, void *args) {
 
 	r->count = rm->count;
 	updateObject(&r->obj, 1);
+	schedResourceFreed(r);
 
 	return sendClientReturnCode(c, &r->obj, "0");
 }
@@ -51,11 +51,16 @@ void runComplexCommand(client * c);
 
 command_t commands[] = {
 	{CMD_ADD_JOB,      0,                     CMDFLG_REPLAY, command_add_job,      deserialize_add_job,   free_add_job},
+	{CMD_ADD_JOBS,     0,                     CMDFLG_REPLAY, command_add_jobs,     deserialize_add_jobs,  free_add_jobs},
 	{CMD_GET_JOB,      0,                     0,             command_get_job,      deserialize_get_job,   free_get_job},
 	{CMD_MOD_JOB,      0,                     CMDFLG_REPLAY, command_mod_job,      deserialize_mod_job,   free_mod_job},
 	{CMD_DEL_JOB,      0,                     CMDFLG_REPLAY, command_del_job,      deserialize_del_job,   free_del_job},
 	{CMD_SIG_JOB,      0,                     0,             command_sig_job,      deserialize_sig_job,   free_sig_job},
+	{CMD_DEL_JOBS,     0,                     CMDFLG_REPLAY, command_del_jobs,     deserialize_bulk_jobs, free_bulk_jobs},
+	{CMD_MOD_JOBS,     0,                     CMDFLG_REPLAY, command_mod_jobs,     deserialize_bulk_jobs, free_bulk_jobs},
+	{CMD_SIG_JOBS,     0,                     0,             command_sig_jobs,     deserialize_bulk_jobs, free_bulk_jobs},
 	{CMD_WAIT_JOB,     0,                     0,             command_wait_job,     deserialize_wait_job,  free_wait_job},
+	{CMD_SUBSCRIBE,    0,                     0,             command_subscribe,    deserialize_get_job,   free_subscribe},
 	{CMD_ADD_QUEUE,    PERM_QUEUE,            CMDFLG_REPLAY, command_add_queue,    deserialize_add_queue, free_add_queue},
 	{CMD_GET_QUEUE,    PERM_READ,             0,             command_get_queue,    deserialize_get_queue, free_get_queue},
 	{CMD_MOD_QUEUE,    0,                     CMDFLG_REPLAY, command_mod_queue,    deserialize_mod_queue, free_mod_queue},
@@ -68,6 +73,7 @@ command_t commands[] = {
 	{CMD_DEL_TAG,      0,                     CMDFLG_REPLAY, command_del_tag,      deserialize_del_tag, free_del_tag},
 	{CMD_GET_AGENT,    PERM_READ,             0,             command_get_agent,    deserialize_get_agent, free_get_agent},
 	{CMD_STATS,        PERM_READ,             0,             command_stats,        NULL, NULL},
+	{CMD_SCHED_STATS,  PERM_READ,             0,             command_sched_stats,  NULL, NULL},
 	{CMD_CLEAR_CACHE,  0,                     0,             command_clearcache,   NULL, NULL},
 };
 
@@ -188,11 +194,22 @@ int runCommand(client *c) {
 		}
 	}
 
+	size_t response_start = c->response.used;
 	int status = command_to_run->cmd_func(c, args);
 
 	/* Write to the journal if the transaction was an update and successful */
 	if (command_to_run->flags &CMDFLG_REPLAY && status == 0) {
-		stateSaveCmd(c->uid, c->msg.command, c->msg.msg_cpy, c->msg.jobid, c->msg.revision);
+		stateSaveCmd(c->uid, c->msg.command, &c->msg, c->msg.jobid, c->msg.revision);
+
+		/* With group commit, hold the response until the record is on disk.
+		 * Proxied clients are answered via their agent, so commit straight away */
+		if (server.flush.group) {
+			if (c->connection.proxy.agent == NULL)
+				holdClientResponse(c, response_start);
+
+			if (c->connection.proxy.agent || server.flush.pending >= server.flush.group_bytes)
+				commitJournal();
+		}
 	}
 
 	if (likely(command_to_run->free_func != NULL))
@@ -239,7 +256,7 @@ int runAgentCommand(agent * a) {
 
 	/* Write to the journal if the transaction was an update and successful */
 	if (status == 0 && command_to_run->flags &CMDFLG_REPLAY)
-		stateSaveCmd(0, a->msg.command, a->msg.msg_cpy, 0, 0);
+		stateSaveCmd(0, a->msg.command, &a->msg, 0, 0);
 
 	free_message(&a->msg);
 
@@ -280,6 +297,10 @@ int initClientResponse(buff_t *b, int version) {
 	return initResponse(b, version);
 }
 
+int initClientChangeResponse(buff_t *b, int version, int64_t change_seq, int resync) {
+	return initChangeResponse(b, version, unlikely(server.readonly) ? "ReadOnly mode is active" : NULL, change_seq, resync);
+}
+
 void sendError(client *c, int error, const char *err_msg) {
 	buff_t response;
 	char str[1024];
@@ -484,6 +505,28 @@ int command_stats(client * c, void * args) {
 	return sendClientMessage(c, NULL, &b);
 }
 
+/* Scheduler activity and the time taken for pending jobs to be started */
+
+int command_sched_stats(client * c, void * args) {
+	UNUSED(args);
+	buff_t b;
+	int64_t started = server.sched_stats.started;
+
+	initClientResponse(&b, 1);
+
+	JSONStartObject(&b, NULL, 0);
+
+	JSONAddInt(&b, SCHEDSTARTED, started);
+	JSONAddInt(&b, SCHEDLATENCYAVG, started ? server.sched_stats.latency_total_ms / started : 0);
+	JSONAddInt(&b, SCHEDLATENCYMAX, server.sched_stats.latency_max_ms);
+	JSONAddInt(&b, SCHEDPASSES, server.sched_stats.passes);
+	JSONAddInt(&b, SCHEDFULLPASSES, server.sched_stats.full_passes);
+
+	JSONEndObject(&b);
+
+	return sendClientMessage(c, NULL, &b);
+}
+
 int command_clearcache(client * c, void * args) {
 	UNUSED(args);
 
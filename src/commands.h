@@ -37,6 +37,7 @@ void sendError(client * c, int error, const char * msg);
 void sendErrorFmt(client *c, int error, const char *fmt, ...) __attribute__((format(printf,3,4)));
 
 int initClientResponse(buff_t *b, int version);
+int initClientChangeResponse(buff_t *b, int version, int64_t change_seq, int resync);
 
 void replayCommand(msg_t * msg);
 
@@ -65,13 +66,19 @@ int command_agent_proxydata(agent * a, msg_t * msg);
 int command_agent_proxyclose(agent * a, msg_t * msg);
 
 int command_stats(client *, void *);
+int command_sched_stats(client *, void *);
 
 int command_add_job(client *, void *);
+int command_add_jobs(client *, void *);
 int command_get_job(client *, void *);
 int command_mod_job(client *, void *);
 int command_del_job(client *, void *);
 int command_sig_job(client *, void *);
+int command_del_jobs(client *, void *);
+int command_mod_jobs(client *, void *);
+int command_sig_jobs(client *, void *);
 int command_wait_job(client *, void*);
+int command_subscribe(client *, void *);
 int command_add_queue(client *, void *);
 int command_get_queue(client *, void *);
 int command_mod_queue(client *, void *);
@@ -90,10 +97,12 @@ int command_clearcache(client *, void *);
 
 
 void* deserialize_add_job(msg_t *);
+void* deserialize_add_jobs(msg_t *);
 void* deserialize_get_job(msg_t *);
 void* deserialize_mod_job(msg_t *);
 void* deserialize_del_job(msg_t *);
 void* deserialize_sig_job(msg_t *);
+void* deserialize_bulk_jobs(msg_t *);
 void* deserialize_wait_job(msg_t *);
 
 void* deserialize_add_queue(msg_t *);
@@ -109,11 +118,14 @@ void* deserialize_del_tag(msg_t *);
 void* deserialize_get_agent(msg_t *);
 
 void free_add_job(void *, int);
+void free_add_jobs(void *, int);
 void free_get_job(void *, int);
 void free_mod_job(void *, int);
 void free_del_job(void *, int);
 void free_sig_job(void *, int);
+void free_bulk_jobs(void *, int);
 void free_wait_job(void *, int);
+void free_subscribe(void *, int);
 
 void free_add_queue(void *, int);
 void free_get_queue(void *, int);
@@ -149,11 +161,34 @@ void free_get_agent(void *, int);
 
 /* Internal command structures */
 
+typedef struct {
+	int64_t count;
+	jersJobAdd *jobs;
+} jersJobAddBatch;
+
 typedef struct {
 	jobid_t jobid;
 	int signum;
 } jersJobSig;
 
+/* A get job request. The change sequence of a delta query doesn't fit
+ * in the public filter, so is set here along with JERS_FILTER_CHANGED */
+#define JERS_FILTER_CHANGED 0x0800
+
+typedef struct {
+	jersJobFilter filter;
+	int64_t changed_since;
+} jersJobQuery;
+
+typedef struct {
+	jersJobFilter filter;
+	jersJobMod mod;
+	int signum;
+	int64_t count;
+	jobid_t *jobids;
+	int64_t *revisions;
+} jersJobBulk;
+
 typedef struct {
 	jobid_t jobid;
 } jersJobDel;
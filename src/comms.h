@@ -47,7 +47,10 @@ enum connectionTypes {
 	ACCT_CONN,
 	ACCT_CLIENT,
 	JOB_ADOPT_CONN,
-	JOB_ADOPT
+	JOB_ADOPT,
+	DEFER_TIMER,
+	EVENT_TIMER,
+	WAIT_TIMER
 };
 
 struct connectionType {
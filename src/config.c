@@ -217,7 +217,6 @@ void loadConfig(char * config) {
 	server.state_dir = strdup(DEFAULT_CONFIG_STATEDIR);
 	server.background_save_ms = DEFAULT_CONFIG_BACKGROUNDSAVEMS;
 	server.logging_mode = DEFAULT_CONFIG_LOGGINGMODE;
-	server.event_freq = DEFAULT_CONFIG_EVENTFREQ;
 	server.sched_freq = DEFAULT_CONFIG_SCHEDFREQ;
 	server.sched_max = DEFAULT_CONFIG_SCHEDMAX;
 	server.max_run_jobs = DEFAULT_CONFIG_MAXJOBS;
@@ -228,9 +227,13 @@ void loadConfig(char * config) {
 	server.acct_socket_path = strdup(DEFAULT_CONFIG_ACCTSOCKETPATH);
 
 	server.journal.extend_block_size = JOURNAL_EXTEND_DEFAULT;
+	server.checkpoint.compact_size = CHECKPOINT_COMPACT_DEFAULT;
+	server.retention.compact = 1;
 
 	server.flush.defer = DEFAULT_CONFIG_FLUSHDEFER;
 	server.flush.defer_ms = DEFAULT_CONFIG_FLUSHDEFERMS;
+	server.flush.group_ms = DEFAULT_CONFIG_FLUSHGROUPMS;
+	server.flush.group_bytes = DEFAULT_CONFIG_FLUSHGROUPBYTES;
 
 	server.email_freq_ms = DEFAULT_CONFIG_EMAIL_FREQ;
 
@@ -238,6 +241,7 @@ void loadConfig(char * config) {
 
 	server.slowrequest_logging = SLOWREQUEST_ON;
 	server.slow_threshold_ms = DEFAULT_SLOWLOG;
+	server.client_pipeline_max = DEFAULT_CONFIG_CLIENTPIPELINE;
 
 	listNew(&server.queue_acls, sizeof(struct queue_acl));
 
@@ -263,14 +267,63 @@ void loadConfig(char * config) {
 				server.flush.defer = 0;
 		} else if (strcmp(key, "flush_defer_ms") == 0) {
 			server.flush.defer_ms = atoi(value);
+		} else if (strcmp(key, "journal_format") == 0) {
+			if (strcasecmp(value, "binary") == 0)
+				server.journal.format_binary = 1;
+			else
+				server.journal.format_binary = 0;
+		} else if (strcmp(key, "state_format") == 0) {
+			if (strcasecmp(value, "checkpoint") == 0)
+				server.checkpoint.enabled = 1;
+			else
+				server.checkpoint.enabled = 0;
+		} else if (strcmp(key, "checkpoint_compact_size") == 0) {
+			server.checkpoint.compact_size = atoll(value);
+		} else if (strcmp(key, "journal_buffer_size") == 0) {
+			server.journal.buffer_size = atoll(value);
+		} else if (strcmp(key, "journal_retain_days") == 0) {
+			server.retention.days = atoi(value);
+		} else if (strcmp(key, "journal_retain_size") == 0) {
+			server.retention.size = atoll(value) * 1024 * 1024;
+		} else if (strcmp(key, "journal_compact") == 0) {
+			if (strcasecmp(value, "yes") == 0)
+				server.retention.compact = 1;
+			else
+				server.retention.compact = 0;
+		} else if (strcmp(key, "flush_group_commit") == 0) {
+			if (strcasecmp(value, "yes") == 0)
+				server.flush.group = 1;
+			else
+				server.flush.group = 0;
+		} else if (strcmp(key, "flush_group_ms") == 0) {
+			server.flush.group_ms = atoi(value);
+		} else if (strcmp(key, "flush_group_bytes") == 0) {
+			server.flush.group_bytes = atoll(value);
+		} else if (strcmp(key, "background_save_thread") == 0) {
+			if (strcasecmp(value, "yes") == 0)
+				server.flush.thread = 1;
+			else
+				server.flush.thread = 0;
 		} else if (strcmp(key, "background_save_ms") == 0) {
 			server.background_save_ms = atoi(value);
 		} else if (strcmp(key, "event_freq") == 0) {
-			server.event_freq = atoi(value);
+			/* No longer used, timed events are driven by a timerfd */
 		} else if (strcmp(key, "sched_freq") == 0) {
 			server.sched_freq = atoi(value);
 		} else if (strcmp(key, "sched_max") == 0) {
 			server.sched_max = atoi(value);
+		} else if (strcmp(key, "client_pipeline_max") == 0) {
+			server.client_pipeline_max = atoi(value);
+
+			if (server.client_pipeline_max <= 0)
+				server.client_pipeline_max = 1;
+		} else if (strcmp(key, "load_threads") == 0) {
+			server.load_threads = atoi(value);
+		} else if (strcmp(key, "lazy_load_jobs") == 0) {
+			if (strcasecmp(value, "yes") == 0)
+				server.lazy_load_jobs = 1;
+			else
+				server.lazy_load_jobs = 0;
 		} else if (strcmp(key, "max_system_jobs") == 0) {
 			server.max_run_jobs = atoi(value);
 		} else if (strcmp(key, "max_jobid") == 0) {
@@ -323,6 +376,8 @@ void loadConfig(char * config) {
 				error_die("Unable to load secret specified in configuration file: %s", value);
 		} else if (strcmp(key, "auto_cleanup") == 0) {
 			server.auto_cleanup = atoi(value);
+		} else if (strcmp(key, "archive_after") == 0) {
+			server.archive.after = atoi(value);
 		} else if (strcmp(key, "default_job_nice") == 0) {
 			server.default_job_nice = atoi(value);
 
@@ -343,7 +398,17 @@ void loadConfig(char * config) {
 
 			server.slow_threshold_ms = atoi(value);
 		} else if (strcmp(key, "index_tag") == 0) {
-			server.index_tag = strdup(value);
+			char *saveptr = NULL;
+
+			for (char *tag = strtok_r(value, ", \t", &saveptr); tag; tag = strtok_r(NULL, ", \t", &saveptr)) {
+				if (addIndexTagKey(tag))
+					print_msg(JERS_LOG_WARNING, "Tag '%s' is already indexed", tag);
+			}
+		} else if (strcmp(key, "index_job_names") == 0) {
+			if (strcasecmp(value, "yes") == 0)
+				server.index_job_names = 1;
+			else
+				server.index_job_names = 0;
 		} else if (strcmp(key, "queue_acl") == 0) {
 			loadQueueACL(value);
 		} else {
@@ -31,6 +31,10 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
 
 #include "client.h"
 #include "agent.h"
@@ -39,102 +43,191 @@
 
 #define MINUTE_MS(x) (60000 * x)
 
+/* Timed events are kept in a min-heap ordered by when they next need to fire.
+ * A single timerfd in the main epoll set is armed for the earliest one. */
+
 struct event {
 	void (*func)(void);
 	int interval;    // Milliseconds between event triggering
-	int64_t last_fire;
-	struct event * next;
+	int64_t next_fire;
 };
 
-struct event * eventList = NULL;
+static struct {
+	struct event **heap;
+	int64_t count;
+	int64_t size;
+	int64_t armed;
+	struct connectionType timer;
+} events;
+
+static int64_t eventTimeMS(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (tp.tv_sec * 1000) + (tp.tv_nsec / 1000000);
+}
+
+static void eventSiftUp(int64_t pos) {
+	struct event *e = events.heap[pos];
+
+	while (pos > 0) {
+		int64_t parent = (pos - 1) / 2;
+
+		if (events.heap[parent]->next_fire <= e->next_fire)
+			break;
+
+		events.heap[pos] = events.heap[parent];
+		pos = parent;
+	}
+
+	events.heap[pos] = e;
+}
+
+static void eventSiftDown(int64_t pos) {
+	struct event *e = events.heap[pos];
+
+	while (1) {
+		int64_t child = pos * 2 + 1;
+
+		if (child >= events.count)
+			break;
+
+		if (child + 1 < events.count && events.heap[child + 1]->next_fire < events.heap[child]->next_fire)
+			child++;
+
+		if (e->next_fire <= events.heap[child]->next_fire)
+			break;
+
+		events.heap[pos] = events.heap[child];
+		pos = child;
+	}
+
+	events.heap[pos] = e;
+}
+
+/* Arm the timer for the next event to fire */
+
+static void armEventTimer(void) {
+	struct itimerspec its = {{0}};
+
+	if (events.count == 0 || events.timer.type != EVENT_TIMER)
+		return;
+
+	int64_t next = events.heap[0]->next_fire;
+
+	if (next == events.armed)
+		return;
+
+	/* An absolute time of zero would disarm the timer */
+	if (next <= 0)
+		next = 1;
+
+	its.it_value.tv_sec = next / 1000;
+	its.it_value.tv_nsec = (next % 1000) * 1000000;
+
+	if (timerfd_settime(events.timer.socket, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to arm event timer: %s", strerror(errno));
+		return;
+	}
+
+	events.armed = next;
+}
 
 void registerEvent(void(*func)(void), int interval) {
 	struct event * e = calloc(sizeof(struct event), 1);
 
+	if (e == NULL)
+		error_die("Failed to allocate memory for event: %s", strerror(errno));
+
 	e->func = func;
 	e->interval = interval;
 
-	/* Add it to the linked list of events */
-	e->next = eventList;
-	eventList = e;
-	return;
-}
+	/* Events fire for the first time on the next check */
+	e->next_fire = eventTimeMS();
 
-void freeEvents(void) {
-	struct event *e = eventList;
+	if (events.count >= events.size) {
+		events.size = events.size ? events.size * 2 : 16;
+		events.heap = realloc(events.heap, sizeof(struct event *) * events.size);
 
-	while (e) {
-		struct event *next = e->next;
-		free(e);
-		e = next;
+		if (events.heap == NULL)
+			error_die("Failed to allocate memory for event heap: %s", strerror(errno));
 	}
+
+	events.heap[events.count++] = e;
+	eventSiftUp(events.count - 1);
+	armEventTimer();
+	return;
 }
 
-void checkBlockingClientEvent(void) {
-	client *c = clientList;
+void freeEvents(void) {
+	for (int64_t i = 0; i < events.count; i++)
+		free(events.heap[i]);
 
-	while (c) {
-		client *next = c->next;
+	free(events.heap);
 
-		if (c->blocking.callback) {
-			if (c->blocking.timeout > 0 && getTimeMS() > c->blocking.timeout) {
-				if (c->blocking.timeout_callback == NULL ||
-						(c->blocking.timeout_callback)(c, c->blocking.data) != 0) {
-					handleClientDisconnect(c);
-				}
-			} else {
-				if ((c->blocking.callback)(c, c->blocking.data) != 0)
-					handleClientDisconnect(c);
-			}
-		}
+	if (events.timer.type == EVENT_TIMER)
+		close(events.timer.socket);
 
-		c = next;
-	}
+	memset(&events, 0, sizeof(events));
 }
 
+/* Run the requests from clients on the ready list. Each client gets to run up to
+ * client_pipeline_max requests before being moved to the back of the list, so a
+ * single busy client can't starve the others. */
+
 void checkClientEvent(void) {
-	client * c = clientList;
+	client *c, *last;
 
-	/* Check the connected clients for commands to action,
-	 * we can limit the amount of time we spend running command here. */
+	if (clientReadyList == NULL)
+		return;
 
-	while (c) {
-		if (c->request.used == 0) {
-			c = c->next;
-			continue;
-		}
+	/* Only process the clients that were ready when we started */
+	last = clientReadyList->ready_prev;
 
-		/* Check if the client has a full request to process */
-		char *nl = memchr(c->request.data, '\n', c->request.used);
+	do {
+		c = clientReadyList;
+		int final = (c == last);
+		size_t consumed = 0;
+		int disconnected = 0;
 
-		if (nl == NULL) {
-			c = c->next;
-			continue;
-		}
+		clearClientReady(c);
+
+		for (int i = 0; i < server.client_pipeline_max && c->requests_ready; i++) {
+			char *p = c->request.data + consumed;
+			char *nl = memchr(p, '\n', c->request.used - consumed);
+
+			*nl = '\0';
+			nl++;
+			c->requests_ready--;
 
-		*nl = '\0';
-		nl++;
+			if (load_message(p, &c->msg)) {
+				print_msg(JERS_LOG_WARNING, "Failed to load client request, disconnecting them.");
+				handleClientDisconnect(c);
+				disconnected = 1;
+				break;
+			}
 
-		if (load_message(c->request.data, &c->msg)) {
-			client * c_next = c->next;
-			print_msg(JERS_LOG_WARNING, "Failed to load client request, disconnecting them.");
-			handleClientDisconnect(c);
-			c = c_next;
-			continue;
+			runCommand(c);
+			consumed += nl - p;
 		}
 
-		runCommand(c);
+		if (!disconnected) {
+			/* Remove the used data from the clients request stream */
+			buffRemove(&c->request, consumed, 0);
 
-		/* Remove the used data from the clients request stream */
-		buffRemove(&c->request, (size_t)(nl - c->request.data), 0);
+			if (c->requests_ready)
+				setClientReady(c);
+		}
 
-		c = c->next;
-	}
+		if (final)
+			break;
+	} while (clientReadyList);
 }
 
 void checkAgentEvent(void) {
 	agent * a = agentList;
 
+	server.agent_ready = 0;
+
 	while (a) {
 		agent * a_next = a->next;
 		size_t consumed = 0;
@@ -199,15 +292,12 @@ void checkAcctEvent(void) {
 
 }
 
-void checkDeferEvent(void) {
-	releaseDeferred();
-}
-
 void flushEvent(void) {
 	flush_journal(0);
 }
 
 void checkJobsEvent(void) {
+	server.sched_all = 1;
 	checkJobs();
 }
 
@@ -216,7 +306,7 @@ void cleanupEvent(void) {
 	uint32_t max_clean = server.max_cleanup;
 
 	/* If we are busy, don't try and clean up as many deleted items */
-	if (server.candidate_pool_jobs || server.candidate_recalc)
+	if (server.stats.jobs.pending)
 		max_clean = (max_clean + 1) / 2;
 
 	cleaned += cleanupJobs(max_clean);
@@ -236,11 +326,13 @@ void cleanupIndexTag(void) {
 	/* Check for unused index tag tables and clean them up */
 	struct indexed_tag *t = NULL, *tmp = NULL;
 
-	HASH_ITER(hh, server.index_tag_table, t, tmp) {
-		if (t->jobs == NULL) {
-			HASH_DELETE(hh, server.index_tag_table, t);
-			free(t->value);
-			free(t);
+	for (int i = 0; i < server.index_tag_count; i++) {
+		HASH_ITER(hh, server.index_tags[i].table, t, tmp) {
+			if (t->jobs == NULL) {
+				HASH_DELETE(hh, server.index_tags[i].table, t);
+				free(t->value);
+				free(t);
+			}
 		}
 	}
 }
@@ -254,55 +346,97 @@ void checkEmails(void) {
 	checkEmailProcesses();
 }
 
+/* Delete completed jobs that finished before the target time.
+ * The finish time index holds the oldest jobs first */
+
 void autoCleanup(void) {
 	time_t target_time = time(NULL) - (server.auto_cleanup * 60 * 60);
+	struct job *j = server.timeIndex[TIME_INDEX_FINISH].head[0];
 
-	for (struct job *j = server.jobTable; j != NULL; j = j->hh.next) {
-		if (j->internal_state &JERS_FLAG_DELETED || j->state != JERS_JOB_COMPLETED)
-			continue;
+	while (j && j->time_links[TIME_INDEX_FINISH].key <= target_time) {
+		/* Deleting the job removes it from the index */
+		struct job *next = j->time_links[TIME_INDEX_FINISH].next[0];
 
-		if (j->finish_time <= target_time)
+		if (j->state == JERS_JOB_COMPLETED)
 			deleteJob(j);
+
+		j = next;
 	}
 }
 
 void initEvents(void) {
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0)
+		error_die("Failed to create event timer: %s", strerror(errno));
+
+	events.timer.type = EVENT_TIMER;
+	events.timer.socket = fd;
+	events.timer.event_fd = server.event_fd;
+	events.timer.ptr = NULL;
+	events.timer.events = 0;
+
+	if (pollSetReadable(&events.timer))
+		error_die("Failed to add event timer to epoll: %s", strerror(errno));
+
 	registerEvent(checkJobsEvent, server.sched_freq);
 	registerEvent(cleanupEvent, 1000);
 	registerEvent(backgroundSaveEvent, server.background_save_ms);
 
-	if (server.flush.defer)
+	if (server.flush.defer && !server.flush.group)
 		registerEvent(flushEvent, server.flush.defer_ms);
 
-	registerEvent(checkDeferEvent, 750);
-
 	registerEvent(checkEmails, server.email_freq_ms);
 
-	registerEvent(checkAgentEvent, 0);
-	registerEvent(checkClientEvent, 0);
-	registerEvent(checkBlockingClientEvent, 500);
 	registerEvent(checkAcctEvent, 1000);
 
-	if (server.index_tag)
+	if (server.index_tag_count)
 		registerEvent(cleanupIndexTag, 5000);
 
 	if (server.auto_cleanup != 0)
 		registerEvent(autoCleanup, MINUTE_MS(5));
+
+	if (server.archive.after != 0)
+		registerEvent(archiveJobs, MINUTE_MS(1));
+
+	if (server.retention.compact || server.retention.days || server.retention.size)
+		registerEvent(journalRetention, MINUTE_MS(60));
 }
 
-/* Check for any timed events to expire */
+/* Run any timed events that are due, then rearm the timer */
 
 void checkEvents(void) {
-	struct event * e = eventList;
+	int64_t now = eventTimeMS();
 
-	int64_t now = getTimeMS();
-
-	while (e) {
-		if (now >= e->last_fire + e->interval) {
-			e->func();
-			e->last_fire = getTimeMS();
-		}
+	while (events.count && events.heap[0]->next_fire <= now) {
+		struct event *e = events.heap[0];
 
-		e = e->next;
+		e->func();
+		e->next_fire = eventTimeMS() + e->interval;
+		eventSiftDown(0);
 	}
+
+	armEventTimer();
+}
+
+int handleEventTimer(struct connectionType *connection) {
+	uint64_t expirations;
+
+	if (read(connection->socket, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		print_msg(JERS_LOG_WARNING, "Failed to read event timer: %s", strerror(errno));
+
+	events.armed = 0;
+	checkEvents();
+
+	return 0;
+}
+
+/* Process any client/agent requests that have arrived */
+
+void checkReadyEvents(void) {
+	if (server.agent_ready)
+		checkAgentEvent();
+
+	if (clientReadyList)
+		checkClientEvent();
 }
@@ -146,6 +146,21 @@ const field fields[] = {
 
 	{FLAGS, FIELD_TYPE_NUM, FIELDNAME("FLAGS")},
 
+	{DROPPED, FIELD_TYPE_NUM, FIELDNAME("DROPPED")},
+	{COUNT,   FIELD_TYPE_NUM, FIELDNAME("COUNT")},
+	{FAILED,  FIELD_TYPE_NUM, FIELDNAME("FAILED")},
+
+	{CHANGED_SINCE, FIELD_TYPE_NUM,  FIELDNAME("CHANGED_SINCE")},
+	{CHANGESEQ,     FIELD_TYPE_NUM,  FIELDNAME("CHANGESEQ")},
+	{DELETED,       FIELD_TYPE_BOOL, FIELDNAME("DELETED")},
+	{RESYNC,        FIELD_TYPE_BOOL, FIELDNAME("RESYNC")},
+
+	{SCHEDSTARTED,    FIELD_TYPE_NUM, FIELDNAME("SCHEDSTARTED")},
+	{SCHEDLATENCYAVG, FIELD_TYPE_NUM, FIELDNAME("SCHEDLATENCYAVG")},
+	{SCHEDLATENCYMAX, FIELD_TYPE_NUM, FIELDNAME("SCHEDLATENCYMAX")},
+	{SCHEDPASSES,     FIELD_TYPE_NUM, FIELDNAME("SCHEDPASSES")},
+	{SCHEDFULLPASSES, FIELD_TYPE_NUM, FIELDNAME("SCHEDFULLPASSES")},
+
 	{ENDOFFIELDS, FIELD_TYPE_NUM, FIELDNAME("ENDOFFIELDS")}
 };
 
@@ -187,6 +202,26 @@ void freeStringMap(int count, key_val_t ** keys) {
 	return;
 }
 
+char **dupStringArray(int count, char **array) {
+	char **copy = malloc(sizeof(char *) * (count ? count : 1));
+
+	for (int i = 0; i < count; i++)
+		copy[i] = strdup(array[i]);
+
+	return copy;
+}
+
+key_val_t *dupStringMap(int count, const key_val_t *keys) {
+	key_val_t *copy = malloc(sizeof(key_val_t) * (count ? count : 1));
+
+	for (int i = 0; i < count; i++) {
+		copy[i].key = strdup(keys[i].key);
+		copy[i].value = keys[i].value ? strdup(keys[i].value) : NULL;
+	}
+
+	return copy;
+}
+
 char * getStringField(field *f) {
 	char * ret = strdup(f->value.string ? f->value.string : "");
 	return ret;
@@ -333,6 +368,7 @@ void free_message(msg_t * msg) {
 	msg->version = 0;
 	msg->error = NULL;
 	msg->msg_cpy = NULL;
+	msg->rewritten = 0;
 }
 
 
@@ -412,6 +448,12 @@ int load_message(char *json, msg_t *m)
 					return 1;
 
 				setenv(JERS_ALERT, alert, 1);
+			} else if (strcmp(name, "CHANGESEQ") == 0) {
+				if (JSONGetNum(&cmd_object, &m->change_seq))
+					return 1;
+			} else if (strcmp(name, "RESYNC") == 0) {
+				if (JSONGetBool(&cmd_object, &m->resync))
+					return 1;
 			}
 		}
 	} else {
@@ -566,6 +608,116 @@ static int loadItemArray(char **json, msg_t *m) {
 	return 0;
 }
 
+/* Add the fields of a job add request to the current object */
+
+void serializeJobAddFields(buff_t *b, const jersJobAdd *j) {
+
+	JSONAddStringArray(b, ARGS, j->argc, j->argv);
+
+	if (j->name)
+		JSONAddString(b, JOBNAME, j->name);
+
+	if (j->queue)
+		JSONAddString(b, QUEUENAME, j->queue);
+
+	if (j->uid > 0)
+		JSONAddInt(b, UID, j->uid);
+
+	if (j->shell)
+		JSONAddString(b, SHELL, j->shell);
+
+	if (j->priority != UNSET_32)
+		JSONAddInt(b, PRIORITY, j->priority);
+
+	if (j->hold)
+		JSONAddBool(b, HOLD, 1);
+
+	if (j->nice)
+		JSONAddInt(b, NICE, j->nice);
+
+	if (j->tag_count)
+		JSONAddMap(b, TAGS, j->tag_count, (key_val_t *)j->tags);
+
+	if (j->res_count)
+		JSONAddStringArray(b, RESOURCES, j->res_count, j->resources);
+
+	if (j->env_count != UNSET_64)
+		JSONAddStringArray(b, ENVS, j->env_count, j->envs);
+
+	if (j->jobid)
+		JSONAddInt(b, JOBID, j->jobid);
+
+	if (j->wrapper) {
+		JSONAddString(b, WRAPPER, j->wrapper);
+	} else {
+		if (j->pre_cmd)
+			JSONAddString(b, PRECMD, j->pre_cmd);
+
+		if (j->post_cmd)
+			JSONAddString(b, POSTCMD, j->post_cmd);
+	}
+
+	if (j->stdout)
+		JSONAddString(b, STDOUT, j->stdout);
+
+	if (j->stderr)
+		JSONAddString(b, STDERR, j->stderr);
+
+	if (j->defer_time != -1)
+		JSONAddInt(b, DEFERTIME, j->defer_time);
+
+	if (j->flags)
+		JSONAddInt(b, FLAGS, j->flags);
+
+}
+
+/* Add a job add request as an item of an array */
+
+void serializeJobAdd(buff_t *b, const jersJobAdd *j) {
+	JSONStartObject(b, NULL, 0);
+	serializeJobAddFields(b, j);
+	JSONEndObject(b);
+}
+
+void serializeJobModFields(buff_t *b, const jersJobMod *j) {
+
+	if (j->jobid)
+		JSONAddInt(b, JOBID, j->jobid);
+
+	if (j->name)
+		JSONAddString(b, JOBNAME, j->name);
+
+	if (j->queue)
+		JSONAddString(b, QUEUENAME, j->queue);
+
+	if (j->defer_time != UNSET_TIME_T)
+		JSONAddInt(b, DEFERTIME, j->defer_time);
+
+	if (j->restart)
+		JSONAddBool(b, RESTART, 1);
+
+	if (j->nice != UNSET_32)
+		JSONAddInt(b, NICE, j->nice);
+
+	if (j->priority != UNSET_32)
+		JSONAddInt(b, PRIORITY, j->priority);
+
+	if (j->hold != UNSET_8)
+		JSONAddBool(b, HOLD, j->hold);
+
+	if (j->env_count != UNSET_64)
+		JSONAddStringArray(b, ENVS, j->env_count, j->envs);
+
+	if (j->tag_count != UNSET_64)
+		JSONAddMap(b, TAGS, j->tag_count, (key_val_t *)j->tags);
+
+	if (j->res_count != UNSET_64)
+		JSONAddStringArray(b, RESOURCES, j->res_count, j->resources);
+
+	if (j->clear_resources)
+		JSONAddBool(b, CLEARRES, 1);
+}
+
 /* Initalise a new request */
 
 int _initRequest(buff_t *b, const char *resp_name, size_t resp_name_len, int version) {
@@ -588,7 +740,7 @@ int closeRequest(buff_t *b) {
 	return 0;
 }
 
-int initNamedResponse(buff_t *b, const char *name, size_t name_len, int version, const char *alert) {
+static int startResponse(buff_t *b, const char *name, size_t name_len, int version, const char *alert) {
 	if (buffNew(b, 1024) != 0)
 		return 1;
 
@@ -600,6 +752,28 @@ int initNamedResponse(buff_t *b, const char *name, size_t name_len, int version,
 		JSONAddString(b, ALERT, alert);
 	}
 
+	return 0;
+}
+
+int initNamedResponse(buff_t *b, const char *name, size_t name_len, int version, const char *alert) {
+	if (startResponse(b, name, name_len, version, alert) != 0)
+		return 1;
+
+	JSONStartArray(b, "DATA", 4);
+
+	return 0;
+}
+
+/* Initalise a response to a delta query, carrying the current change sequence */
+int initChangeResponse(buff_t *b, int version, const char *alert, int64_t change_seq, int resync) {
+	if (startResponse(b, NULL, 0, version, alert) != 0)
+		return 1;
+
+	JSONAddInt(b, CHANGESEQ, change_seq);
+
+	if (resync)
+		JSONAddBool(b, RESYNC, 1);
+
 	JSONStartArray(b, "DATA", 4);
 
 	return 0;
@@ -190,6 +190,21 @@ enum field_type {
 
 	FLAGS,
 
+	DROPPED,
+	COUNT,
+	FAILED,
+
+	CHANGED_SINCE,
+	CHANGESEQ,
+	DELETED,
+	RESYNC,
+
+	SCHEDSTARTED,
+	SCHEDLATENCYAVG,
+	SCHEDLATENCYMAX,
+	SCHEDPASSES,
+	SCHEDFULLPASSES,
+
 	ENDOFFIELDS
 };
 
@@ -209,10 +224,15 @@ typedef struct {
 	msg_item *items;
 
 	char *msg_cpy;
+	char rewritten; /* msg_cpy was replaced by the command, so no longer matches the items */
 
 	/* These fields are filled in by a command so that it can be saved in the transaction journal */
 	jobid_t jobid;
 	int64_t revision;
+
+	/* Set in the response to a delta query */
+	int64_t change_seq;
+	char resync;
 } msg_t;
 
 void sortfields(void);
@@ -229,6 +249,8 @@ int setIntField(field * f, int field_no, int64_t value);
 
 void freeStringArray(int count, char *** array);
 void freeStringMap(int count, key_val_t ** keys);
+char **dupStringArray(int count, char **array);
+key_val_t *dupStringMap(int count, const key_val_t *keys);
 
 char * getStringField(field * f);
 int64_t getNumberField(field * f);
@@ -241,7 +263,12 @@ int _initRequest(buff_t *b, const char *resp_name, size_t resp_name_len, int ver
 int initResponse(buff_t *b, int version);
 int initResponseAlert(buff_t *b, int version, const char *alert);
 int initNamedResponse(buff_t *b, const char *name, size_t name_len, int version, const char *alert);
+int initChangeResponse(buff_t *b, int version, const char *alert, int64_t change_seq, int resync);
 int closeRequest(buff_t *b);
+
+void serializeJobAddFields(buff_t *b, const jersJobAdd *j);
+void serializeJobAdd(buff_t *b, const jersJobAdd *j);
+void serializeJobModFields(buff_t *b, const jersJobMod *j);
 int closeResponse(buff_t *b);
 
 #endif
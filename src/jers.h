@@ -313,7 +313,9 @@ typedef struct {
 	int env_count;
 	char **envs;
 
-	char filler[56];
+	int deleted; // Tombstone from jersGetJobChanges(), only the jobid is set
+
+	char filler[52];
 } jersJob;
 
 typedef struct {
@@ -321,6 +323,19 @@ typedef struct {
 	jersJob * jobs;
 } jersJobInfo;
 
+/* A job state change delivered by jersSubscribe(). If the daemon had to
+ * drop events for a slow subscriber, an event with a jobid of 0 and the
+ * number of events lost in 'dropped' is delivered first */
+typedef struct {
+	jobid_t jobid;
+	int64_t revision;
+	int state;
+	int exitcode;
+	int64_t dropped;
+
+	char filler[16];
+} jersJobEvent;
+
 typedef struct {
 	int64_t filter_fields; // Bitmask of fields populated in filters. 0 == no filters
 	int64_t return_fields; // Bitmask of fields to get returned; 0 == all fields
@@ -488,6 +503,16 @@ typedef struct {
 	} total;
 } jersStats;
 
+typedef struct {
+	int64_t started;        // Jobs started by the scheduler
+	int64_t latency_avg_ms; // Time from becoming pending to being started
+	int64_t latency_max_ms;
+	int64_t passes;         // Scheduling passes, including those only checking changed queues
+	int64_t full_passes;    // Scheduling passes that checked every queue
+
+	char filler[24];
+} jersSchedStats;
+
 #pragma pack(pop)
 
 void jersInitJobAdd(jersJobAdd *j);
@@ -500,14 +525,31 @@ void jersInitResourceAdd(jersResourceAdd *r);
 void jersInitResourceMod(jersResourceMod *r);
 
 jobid_t jersAddJob(const jersJobAdd *s);
+int jersAddJobs(const jersJobAdd *jobs, size_t count, jobid_t *ids);
 int jersModJob(const jersJobMod *j);
 int jersGetJob(jobid_t id, const jersJobFilter *filter, jersJobInfo *info);
+
+/* Get the jobs matching the filter that changed after the change sequence
+ * 'since', plus tombstones for the jobs deleted after it. Pass the returned
+ * change_seq as 'since' on the next call. If resync is set, 'since' was too
+ * old and every matching job was returned instead */
+int jersGetJobChanges(int64_t since, const jersJobFilter *filter, jersJobInfo *info, int64_t *change_seq, int *resync);
 int jersDelJob(jobid_t id);
 int jersSignalJob(jobid_t id, int signo);
 void jersFreeJobInfo (jersJobInfo *info);
 
+/* Apply an operation to every job matching the filter. The number of jobs
+ * changed, and the number that couldn't be changed are returned */
+int jersDelJobs(const jersJobFilter *filter, int64_t *count, int64_t *failed);
+int jersModJobs(const jersJobFilter *filter, const jersJobMod *j, int64_t *count, int64_t *failed);
+int jersSignalJobs(const jersJobFilter *filter, int signo, int64_t *count, int64_t *failed);
+
 int jersWaitJob(jobid_t id, int64_t revision, int timeout);
 
+/* Return non-zero from the callback to end the subscription */
+typedef int (*jersEventCallback)(const jersJobEvent *event, void *arg);
+int jersSubscribe(const jersJobFilter *filter, jersEventCallback callback, void *arg);
+
 int jersSetTag(jobid_t id, const char * key, const char * value);
 int jersDelTag(jobid_t id, const char * key);
 
@@ -525,6 +567,7 @@ void jersFreeResourceInfo(jersResourceInfo *info);
 
 int jersGetAgents(const char *name, jersAgentInfo *info);
 int jersGetStats(jersStats * s);
+int jersGetSchedStats(jersSchedStats * s);
 
 int jersClearCache(void);
 
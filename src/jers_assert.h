@@ -4,6 +4,7 @@
 
 CHECK_SIZE(jersJob, 256);
 CHECK_SIZE(jersJobInfo, 16);
+CHECK_SIZE(jersJobEvent, 44);
 CHECK_SIZE(jersJobFilter, 136);
 CHECK_SIZE(jersJobAdd, 256);
 CHECK_SIZE(jersJobMod, 256);
@@ -27,3 +28,4 @@ CHECK_SIZE(jersAgentFilter, 8);
 CHECK_SIZE(jersAgent, 12);
 CHECK_SIZE(struct jobStats, 64);
 CHECK_SIZE(jersStats, 112);
+CHECK_SIZE(jersSchedStats, 64);
@@ -55,6 +55,15 @@ int parseOpts(int argc, char * argv[]) {
 			server.daemon = 1;
 		else if (strcasecmp("--no-save", argv[i]) == 0)
 			server.nosave = 1;
+		else if (strcasecmp("--convert-journal", argv[i]) == 0) {
+			if (i + 2 >= argc) {
+				fprintf(stderr, "Usage: jersd --convert-journal <text journal> <binary journal>\n");
+				return 1;
+			}
+
+			server.convert_in = argv[++i];
+			server.convert_out = argv[++i];
+		}
 	}
 
 	return 0;
@@ -64,9 +73,14 @@ void serverShutdown(void) {
 	/* Lets do a final flush of our state file before we try anything else*/
 	if (server.journal.fd >= 0) {
 		print_msg(JERS_LOG_INFO, "Performing final flush of state file");
+		flushJournalBuffer();
 		fdatasync(server.journal.fd);
 	}
 
+	if (server.sched_stats.started)
+		print_msg(JERS_LOG_INFO, "Started %ld jobs. Start latency avg:%ldms max:%ldms", server.sched_stats.started,
+			server.sched_stats.latency_total_ms / server.sched_stats.started, server.sched_stats.latency_max_ms);
+
 	/* Kill off any accounting stream clients */
 	acctClient *ac = acctClientList;
 	while (ac) {
@@ -88,6 +102,28 @@ void serverShutdown(void) {
 	unlink(server.socket_path);
 	unlink(server.agent_socket_path);
 
+	/* Clients, before the jobs they might be waiting on */
+	client *c = clientList;
+	while (c) {
+		client *next = c->next;
+
+		close(c->connection.socket);
+		buffFree(&c->response);
+		buffFree(&c->request);
+
+		if (c->blocking.data) {
+			if (c->blocking.free_callback)
+				c->blocking.free_callback(c->blocking.data);
+
+			free(c->blocking.data);
+		}
+
+		removeClient(c);
+		free(c);
+
+		c = next;
+	}
+
 	/* Free jobs */
 	struct job * j, *job_tmp;
 	HASH_ITER(hh, server.jobTable, j, job_tmp) {
@@ -114,21 +150,18 @@ void serverShutdown(void) {
 
 	/* Scheduling candidate pool */
 	free(server.candidate_pool);
+	free(server.candidate_cursor);
 
-	/* Clients and agents */
-	client *c = clientList;
-	while (c) {
-		client *next = c->next;
+	/* Deferred jobs */
+	if (server.deferred.timer.type == DEFER_TIMER)
+		close(server.deferred.timer.socket);
 
-		close(c->connection.socket);
-		buffFree(&c->response);
-		buffFree(&c->request);
-		removeClient(c);
-		free(c);
+	free(server.deferred.heap);
 
-		c = next;
-	}
+	/* Job waiters */
+	freeWaitTimer();
 
+	/* Agents */
 	agent *a = agentList;
 	while (a) {
 		agent *next = a->next;
@@ -231,12 +264,18 @@ void handleReadable(struct epoll_event *e) {
 		case ACCT_CONN:         status = handleAcctClientConnection(connection); break;
 		case CLIENT:            status = handleClientRead(connection->ptr); break;
 		case AGENT:             status = handleAgentRead(connection->ptr); break;
+		case DEFER_TIMER:       status = handleDeferTimer(connection); break;
+		case EVENT_TIMER:       status = handleEventTimer(connection); break;
+		case WAIT_TIMER:        status = handleWaitTimer(connection); break;
 		default:                print_msg(JERS_LOG_WARNING, "Unexpected read event - Ignoring"); break;
 	}
 
 	if (status) {
 		/* Disconnected */
 		e->data.ptr = NULL;
+	} else if (connection->type == AGENT) {
+		/* Let the main loop know there are requests to process */
+		server.agent_ready = 1;
 	}
 
 	return;
@@ -265,6 +304,11 @@ int main (int argc, char * argv[]) {
 	if (parseOpts(argc, argv))
 		error_die("Argument parsing failed\n");
 
+	if (server.convert_in) {
+		sortfields();
+		return convertJournal(server.convert_in, server.convert_out);
+	}
+
 	if (server.daemon)
 		setupAsDaemon();
 
@@ -295,6 +339,10 @@ int main (int argc, char * argv[]) {
 	sortAgentCommands();
 	sortCommands();
 
+	/* Seed the change sequence from the clock, so it keeps increasing across
+	 * restarts and deltas from a previous run fall below the floor */
+	server.changes.seq = server.changes.floor = (int64_t)time(NULL) * 1000000;
+
 	stateInit();
 
 	/* Load and initialise the queues */
@@ -324,6 +372,8 @@ int main (int argc, char * argv[]) {
 	struct epoll_event * events = malloc(sizeof(struct epoll_event) * MAX_EVENTS);
 
 	setup_listening_sockets();
+	initDeferTimer();
+	initWaitTimer();
 
 	/* Start out event polling */
 	print_msg(JERS_LOG_DEBUG, "Initialising events\n");
@@ -351,8 +401,19 @@ int main (int argc, char * argv[]) {
 			break;
 		}
 
-		/* Poll for any events on our sockets */
-		int status = epoll_wait(server.event_fd, events, MAX_EVENTS, server.event_freq);
+		/* Poll for any events on our sockets and timers. Sleep until something
+		 * happens, unless there is still work left over from the last iteration */
+		int timeout = (server.sched_wake || clientReadyList || server.agent_ready) ? 0 : -1;
+
+		/* Don't sleep past a pending group commit */
+		if (server.flush.group && server.flush.dirty) {
+			int64_t wait = groupCommitWait();
+
+			if (timeout == -1 || wait < timeout)
+				timeout = wait;
+		}
+
+		int status = epoll_wait(server.event_fd, events, MAX_EVENTS, timeout);
 
 		for (int i = 0; i < status; i++) {
 			struct epoll_event * e = &events[i];
@@ -366,8 +427,18 @@ int main (int argc, char * argv[]) {
 				handleWriteable(e);
 		}
 
-		/* Check for any expired events to check */
-		checkEvents();
+		/* Process any requests that have arrived */
+		checkReadyEvents();
+
+		/* Run the scheduler straight away if anything changed that could
+		 * allow a job to start. The sched_freq event is a safety net. */
+		if (server.sched_wake)
+			checkJobs();
+
+		/* Commit the journal records written this iteration, releasing
+		 * the responses waiting on them */
+		if (server.flush.group && groupCommitWait() == 0)
+			commitJournal();
 	}
 
 	print_msg(JERS_LOG_INFO, "Exited main loop - Shutting down.\n");
@@ -29,6 +29,8 @@
 
 #include <server.h>
 #include <limits.h>
+#include <errno.h>
+#include <string.h>
 
 #include <json.h>
 
@@ -96,6 +98,11 @@ void freeJob (struct job * j) {
 	free(j->wrapper);
 	free(j->stdout);
 	free(j->stderr);
+	free(j->pending_next);
+	free(j->tag_handles);
+
+	for (int i = 0; i < TIME_INDEX_COUNT; i++)
+		free(j->time_links[i].next);
 
 	free(j);
 }
@@ -107,27 +114,306 @@ struct job * findJob(jobid_t jobid) {
 	return j;
 }
 
+/* Secondary indexes. Jobs are moved between the lists as they change state,
+ * so a search on state, queue or uid only visits the jobs that can match */
+
+#define stateList(state) __builtin_ctz(state)
+
+struct uidIndex *findUidIndex(uid_t uid) {
+	struct uidIndex *u = NULL;
+	HASH_FIND(hh, server.uidIndex, &uid, sizeof(uid_t), u);
+	return u;
+}
+
+static void linkJob(struct jobIndex *idx, struct job *j, int link) {
+	int list = stateList(j->state);
+	DL_APPEND2(idx->jobs[list], j, links[link].prev, links[link].next);
+	idx->count[list]++;
+}
+
+static void unlinkJob(struct jobIndex *idx, struct job *j, int link) {
+	int list = stateList(j->state);
+	DL_DELETE2(idx->jobs[list], j, links[link].prev, links[link].next);
+	idx->count[list]--;
+	j->links[link].prev = j->links[link].next = NULL;
+}
+
+/* Add a job to the indexes under its current state */
+
+void indexJob(struct job *j) {
+	if (j->state == 0)
+		return;
+
+	if (j->uid_index == NULL) {
+		j->uid_index = findUidIndex(j->uid);
+
+		if (j->uid_index == NULL) {
+			j->uid_index = calloc(1, sizeof(struct uidIndex));
+
+			if (j->uid_index == NULL)
+				error_die("Failed to allocate memory for uid index: %s", strerror(errno));
+
+			j->uid_index->uid = j->uid;
+			HASH_ADD(hh, server.uidIndex, uid, sizeof(uid_t), j->uid_index);
+		}
+	}
+
+	linkJob(&server.stateIndex, j, JOB_LINK_STATE);
+	linkJob(&j->queue->index, j, JOB_LINK_QUEUE);
+	linkJob(&j->uid_index->index, j, JOB_LINK_UID);
+}
+
+/* Remove a job from the indexes. Every job in a list has a prev link */
+
+void unindexJob(struct job *j) {
+	if (j->links[JOB_LINK_STATE].prev == NULL)
+		return;
+
+	unlinkJob(&server.stateIndex, j, JOB_LINK_STATE);
+	unlinkJob(&j->queue->index, j, JOB_LINK_QUEUE);
+	unlinkJob(&j->uid_index->index, j, JOB_LINK_UID);
+}
+
+/* Time indexes */
+
+static inline time_t jobTime(const struct job *j, int type) {
+	switch (type) {
+		case TIME_INDEX_SUBMIT: return j->submit_time;
+		case TIME_INDEX_START: return j->start_time;
+		default: return j->finish_time;
+	}
+}
+
+/* Order jobs by the time they are indexed under, then jobid */
+
+static inline int timeComp(const struct job *a, time_t key, jobid_t jobid, int type) {
+	time_t a_key = a->time_links[type].key;
+
+	if (a_key != key)
+		return (a_key > key) - (a_key < key);
+
+	return (a->jobid > jobid) - (a->jobid < jobid);
+}
+
+static int timeRandomLevel(void) {
+	int level = 1;
+
+	while (level < JERS_TIME_MAXLEVEL && (random() & 3) == 0)
+		level++;
+
+	return level;
+}
+
+static void addTimeIndex(struct job *j, int type, time_t key) {
+	struct timeIndex *ti = &server.timeIndex[type];
+	struct job **update[JERS_TIME_MAXLEVEL];
+	struct job **next = ti->head;
+	struct timeLink *link = &j->time_links[type];
+	int level, i;
+
+	for (i = ti->level - 1; i >= 0; i--) {
+		while (next[i] && timeComp(next[i], key, j->jobid, type) < 0)
+			next = next[i]->time_links[type].next;
+
+		update[i] = next;
+	}
+
+	level = timeRandomLevel();
+
+	for (i = ti->level; i < level; i++)
+		update[i] = ti->head;
+
+	if (level > ti->level)
+		ti->level = level;
+
+	link->key = key;
+	link->level = level;
+	link->next = malloc(sizeof(struct job *) * level);
+
+	if (link->next == NULL)
+		error_die("Failed to allocate memory for time index: %s", strerror(errno));
+
+	for (i = 0; i < level; i++) {
+		link->next[i] = update[i][i];
+		update[i][i] = j;
+	}
+
+	ti->count++;
+}
+
+static void removeTimeIndex(struct job *j, int type) {
+	struct timeIndex *ti = &server.timeIndex[type];
+	struct job **next = ti->head;
+	struct timeLink *link = &j->time_links[type];
+
+	for (int i = ti->level - 1; i >= 0; i--) {
+		while (next[i] && timeComp(next[i], link->key, j->jobid, type) < 0)
+			next = next[i]->time_links[type].next;
+
+		if (i < link->level && next[i] == j)
+			next[i] = link->next[i];
+	}
+
+	while (ti->level > 0 && ti->head[ti->level - 1] == NULL)
+		ti->level--;
+
+	free(link->next);
+	link->next = NULL;
+	link->key = 0;
+	link->level = 0;
+	ti->count--;
+}
+
+/* Move a job to the position of its current times in the time indexes.
+ * Deleted jobs are removed from them */
+
+void updateTimeIndexes(struct job *j) {
+	for (int type = 0; type < TIME_INDEX_COUNT; type++) {
+		time_t key = (j->internal_state &JERS_FLAG_DELETED) ? 0 : jobTime(j, type);
+
+		if (j->time_links[type].key == key)
+			continue;
+
+		if (j->time_links[type].key)
+			removeTimeIndex(j, type);
+
+		if (key)
+			addTimeIndex(j, type, key);
+	}
+}
+
+/* Return the first job indexed at or after 'from'. The jobs
+ * that follow it are linked through time_links[type].next[0] */
+
+struct job *timeIndexSeek(int type, time_t from) {
+	struct timeIndex *ti = &server.timeIndex[type];
+	struct job **next = ti->head;
+
+	for (int i = ti->level - 1; i >= 0; i--) {
+		while (next[i] && next[i]->time_links[type].key < from)
+			next = next[i]->time_links[type].next;
+	}
+
+	return next[0];
+}
+
+/* Count the jobs indexed between 'from' and 'to' inclusive,
+ * stopping once 'limit' have been counted */
+
+int64_t timeIndexCount(int type, time_t from, time_t to, int64_t limit) {
+	int64_t count = 0;
+
+	for (struct job *j = timeIndexSeek(type, from); j && j->time_links[type].key <= to && count < limit; j = j->time_links[type].next[0])
+		count++;
+
+	return count;
+}
+
+/* Change list - Every job is kept in order of its last change, so a
+ * delta query only visits the jobs changed since the sequence it was given */
+
+void jobChanged(struct job *j) {
+	if (j->change_link.prev)
+		DL_DELETE2(server.changes.jobs, j, change_link.prev, change_link.next);
+
+	DL_APPEND2(server.changes.jobs, j, change_link.prev, change_link.next);
+}
+
+/* Remove a job from the change list, leaving a tombstone for it */
+
+static void jobCleaned(struct job *j) {
+	if (j->change_link.prev == NULL)
+		return;
+
+	DL_DELETE2(server.changes.jobs, j, change_link.prev, change_link.next);
+
+	struct tombstone *t = &server.changes.tombstones[server.changes.tombstone_count++ % JERS_TOMBSTONE_MAX];
+
+	/* Deltas from before an overwritten tombstone can't be answered */
+	if (t->change_seq > server.changes.floor)
+		server.changes.floor = t->change_seq;
+
+	t->change_seq = ++server.changes.seq;
+	t->jobid = j->jobid;
+	t->uid = j->uid;
+
+	free(t->queue);
+	t->queue = strdup(j->queue->name);
+
+	if (t->queue == NULL)
+		error_die("Failed to allocate memory for tombstone: %s", strerror(errno));
+}
+
+/* Call deleted for each job cleaned up after 'since', then func for each
+ * job changed after it, both oldest first. 'since' must be between
+ * server.changes.floor and server.changes.seq */
+
+void jobChangesSince(int64_t since, void (*func)(struct job *, void *), void (*deleted)(const struct tombstone *, void *), void *arg) {
+	int64_t oldest = server.changes.tombstone_count > JERS_TOMBSTONE_MAX ? server.changes.tombstone_count - JERS_TOMBSTONE_MAX : 0;
+	int64_t first = server.changes.tombstone_count;
+
+	while (first > oldest && server.changes.tombstones[(first - 1) % JERS_TOMBSTONE_MAX].change_seq > since)
+		first--;
+
+	for (int64_t i = first; i < server.changes.tombstone_count; i++)
+		deleted(&server.changes.tombstones[i % JERS_TOMBSTONE_MAX], arg);
+
+	if (server.changes.jobs == NULL)
+		return;
+
+	/* Walk back from the most recent change */
+	struct job *j = server.changes.jobs->change_link.prev;
+
+	if (j->obj.change_seq <= since)
+		return;
+
+	while (j != server.changes.jobs && j->change_link.prev->obj.change_seq > since)
+		j = j->change_link.prev;
+
+	for (; j != NULL; j = j->change_link.next)
+		func(j, arg);
+}
+
+/* Return the number of jobs in an index in any of 'states' */
+
+int64_t jobIndexCount(const struct jobIndex *idx, int states) {
+	int64_t count = 0;
+
+	for (int i = 0; i < JOB_STATE_LISTS; i++) {
+		if (states & (1 << i))
+			count += idx->count[i];
+	}
+
+	return count;
+}
+
+/* Don't clean up jobs flagged dirty or as being flushed */
+
+int canCleanupJob(const struct job *j) {
+	return !(j->obj.dirty || j->internal_state &JERS_FLAG_FLUSHING);
+}
+
 int cleanupJob(struct job *j) {
 	/* Cleanup a single job if possible */
-
-	/* Don't clean up jobs flagged dirty or as being flushed */
-	if (j->obj.dirty || j->internal_state &JERS_FLAG_FLUSHING)
+	if (!canCleanupJob(j))
 		return 1;
 
 	stateDelJob(j);
 	HASH_DEL(server.jobTable, j);
 
-	/* If the job was a candidate for execution, clear it out of the pool */
-	for (int i = 0; i < server.candidate_pool_jobs; i++) {
-		if (server.candidate_pool[i] == j) {
-			server.candidate_pool[i] = NULL;
-			break;
-		}
-	}
+	if (j->waiters)
+		wakeJobWaiters(j);
 
-	/* Remove the job from the indexed tag table */
-	if (server.index_tag)
-		delIndexTag(j);
+	/* If the job was a candidate for execution, remove it from its queue */
+	removePendingJob(j);
+
+	/* Remove the job from the indexed tag tables */
+	unindexJobTags(j);
+
+	if (server.index_job_names)
+		nameIndexDel(j);
+
+	jobCleaned(j);
 
 	freeJob(j);
 
@@ -179,15 +465,12 @@ int addJob(struct job * j, int dirty) {
 
 	HASH_ADD_INT(server.jobTable, jobid, j);
 
-	/* Add the job to the indexed tag table, if it has the indexed tag */
-	if (server.index_tag && j->tag_count) {
-		for (int i = 0; i < j->tag_count; i++) {
-			if (strcmp(j->tags[i].key, server.index_tag) == 0) {
-				addIndexTag(j, j->tags[i].value);
-				break;
-			}
-		}
-	}
+	/* Add the job to the indexed tag tables, if it has any of the indexed tags */
+	if (server.index_tag_count && j->tag_count)
+		indexJobTags(j);
+
+	if (server.index_job_names)
+		nameIndexAdd(j);
 
 	if (j->defer_time)
 		addDeferredJob(j);
@@ -222,6 +505,8 @@ void markJobsUnknown(agent *a) {
 /* Convert a JERS object to json */
 int jobToJSON(struct job *j, buff_t *buff)
 {
+	stateLoadJobDetails(j);
+
 	JSONStart(buff);
 	JSONStartObject(buff, "JOB", 3);
 
@@ -279,8 +564,8 @@ int jobToJSON(struct job *j, buff_t *buff)
 	JSONAddInt(buff, EXITCODE, j->exitcode);
 	JSONAddInt(buff, SIGNAL, j->signal);
 
-	if (j->pend_reason)
-		JSONAddInt(buff, PENDREASON, j->pend_reason);
+	if (getPendReason(j))
+		JSONAddInt(buff, PENDREASON, getPendReason(j));
 
 	if (j->fail_reason)
 		JSONAddInt(buff, FAILREASON, j->fail_reason);
@@ -291,16 +576,87 @@ int jobToJSON(struct job *j, buff_t *buff)
 	return 0;
 }
 
-/* Maintain the deferred job linked list */
+/* Maintain the deferred job heap */
+
+static inline void deferredSet(int64_t pos, struct job *j) {
+	server.deferred.heap[pos] = j;
+	j->deferred_index = pos + 1;
+}
+
+static void deferredSiftUp(int64_t pos) {
+	struct job *j = server.deferred.heap[pos];
+
+	while (pos > 0) {
+		int64_t parent = (pos - 1) / 2;
+
+		if (server.deferred.heap[parent]->defer_time <= j->defer_time)
+			break;
+
+		deferredSet(pos, server.deferred.heap[parent]);
+		pos = parent;
+	}
+
+	deferredSet(pos, j);
+}
+
+static void deferredSiftDown(int64_t pos) {
+	struct job *j = server.deferred.heap[pos];
 
-static inline time_t deferCmp(const struct job *a, const struct job *b) {
-	return a->defer_time - b->defer_time;
+	while (1) {
+		int64_t child = pos * 2 + 1;
+
+		if (child >= server.deferred.count)
+			break;
+
+		if (child + 1 < server.deferred.count && server.deferred.heap[child + 1]->defer_time < server.deferred.heap[child]->defer_time)
+			child++;
+
+		if (j->defer_time <= server.deferred.heap[child]->defer_time)
+			break;
+
+		deferredSet(pos, server.deferred.heap[child]);
+		pos = child;
+	}
+
+	deferredSet(pos, j);
 }
 
 void addDeferredJob(struct job *j) {
-	DL_INSERT_INORDER2(server.deferred_list, j, deferCmp, deferred_prev, deferred_next);
+	if (j->deferred_index)
+		return;
+
+	if (server.deferred.count >= server.deferred.size) {
+		server.deferred.size = server.deferred.size ? server.deferred.size * 2 : 1024;
+		server.deferred.heap = realloc(server.deferred.heap, sizeof(struct job *) * server.deferred.size);
+
+		if (server.deferred.heap == NULL)
+			error_die("Failed to allocate memory for deferred jobs: %s", strerror(errno));
+	}
+
+	server.deferred.heap[server.deferred.count++] = j;
+	deferredSiftUp(server.deferred.count - 1);
+
+	/* New earliest deferred job */
+	if (j->deferred_index == 1)
+		armDeferTimer();
 }
 
 void removeDeferredJob(struct job *j) {
-	DL_DELETE2(server.deferred_list, j, deferred_prev, deferred_next);
+	int64_t pos = j->deferred_index - 1;
+	struct job *last;
+
+	if (j->deferred_index == 0)
+		return;
+
+	j->deferred_index = 0;
+	last = server.deferred.heap[--server.deferred.count];
+
+	if (pos < server.deferred.count) {
+		deferredSet(pos, last);
+		deferredSiftUp(pos);
+		deferredSiftDown(last->deferred_index - 1);
+	}
+
+	if (pos == 0)
+		armDeferTimer();
 }
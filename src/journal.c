@@ -0,0 +1,864 @@
+/* Copyright (c) 2020 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <server.h>
+#include <commands.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Binary journal format
+ *
+ * A binary journal starts with an 8 byte magic string, followed by records.
+ * Each record is a fixed header followed by the command name and the
+ * message fields. Numbers are stored as varints (signed numbers are zigzag
+ * encoded) and strings are length prefixed, so replaying a record doesn't
+ * need any JSON parsing or unescaping.
+ *
+ * Each field is tagged with its ID from journalFieldIds and its type. The IDs
+ * are independent of the field numbers, so fields can be added anywhere. A
+ * field without an ID is tagged with 0 and followed by its name. Fields this
+ * version doesn't know about are skipped on replay.
+ *
+ * The first byte of the header is the same marker used by the text journal:
+ * ' ' for a normal record, '*' once the record has been committed to the
+ * state files and '$' for the end of journal record. The marker isn't
+ * covered by the CRC, as it's updated in place.
+ *
+ * The journal is preallocated with zeros, so a header with a type of 0 marks
+ * the end of the records. A record failing its CRC check is treated as a
+ * torn write, and also ends the journal. */
+
+extern const field fields[];
+
+struct journalHeader {
+	char marker;
+	uint8_t type;
+	uint16_t cmd_len;
+	uint32_t length;	// Length of the data following the header
+	uint32_t crc;		// CRC32C of the header from 'flags' onwards and the data
+	uint32_t flags;
+	uint32_t uid;
+	uint32_t jobid;
+	int64_t revision;
+	int64_t timestamp;	// milliseconds
+} __attribute__((packed));
+
+#define JOURNAL_RECORD_CMD 1
+#define JOURNAL_RECORD_EOJ 2
+
+#define JOURNAL_FLAG_MSG 0x01	// The record contains a message
+
+#define JOURNAL_HEADER_CRC_OFFSET offsetof(struct journalHeader, flags)
+
+/* Field IDs stored in binary journals. These must never change - new fields
+ * are added to the end, and removed fields keep their entry */
+
+static const char *journalFieldIds[] = {
+	/*  0 */ NULL,
+	/*  1 */ "JOBID", "JOBNAME", "QUEUENAME", "ARGS",
+	/*  5 */ "ENVS", "UID", "SHELL", "PRIORITY",
+	/*  9 */ "HOLD", "PRECMD", "POSTCMD", "DEFERTIME",
+	/* 13 */ "SUBMITTIME", "STARTIME", "TAGS", "STATE",
+	/* 17 */ "NICE", "STDOUT", "STDERR", "FINISHTIME",
+	/* 21 */ "NODE", "RESOURCES", "RETFIELDS", "JOBPID",
+	/* 25 */ "EXITCODE", "DESC", "JOBLIMIT", "RESTART",
+	/* 29 */ "RESNAME", "RESCOUNT", "STATSRUNNING", "STATSPENDING",
+	/* 33 */ "STATSDEFERRED", "STATSHOLDING", "STATSCOMPLETED", "STATSEXITED",
+	/* 37 */ "STATSUNKNOW", "STATSTOTALSUBMITTED", "STATSTOTALSTARTED", "STATSTOTALCOMPLETED",
+	/* 41 */ "STATSTOTALEXITED", "STATSTOTALDELETED", "STATSTOTALUNKNOWN", "WRAPPER",
+	/* 45 */ "COMMENT", "RESINUSE", "SIGNAL", "TAG_KEY",
+	/* 49 */ "TAG_VALUE", "PENDREASON", "FAILREASON", "SUBMITTER",
+	/* 53 */ "DEFAULT", "USAGE_UTIME_SEC", "USAGE_UTIME_USEC", "USAGE_STIME_SEC",
+	/* 57 */ "USAGE_STIME_USEC", "USAGE_MAXRSS", "USAGE_MINFLT", "USAGE_MAJFLT",
+	/* 61 */ "USAGE_INBLOCK", "USAGE_OUBLOCK", "USAGE_NVCSW", "USAGE_NIVCSW",
+	/* 65 */ "CLEARRES", "NONCE", "DATETIME", "HMAC",
+	/* 69 */ "CONNECTED", "PID", "PROXYDATA", "ACCT_ID",
+	/* 73 */ "ERROR", "RETURN_CODE", "VERSION", "ALERT",
+	/* 77 */ "BEFORE_ADDED", "BEFORE_STARTED", "BEFORE_FINISHED", "AFTER_ADDED",
+	/* 81 */ "AFTER_STARTED", "AFTER_FINISHED", "REVISION", "TIMEOUT",
+	/* 85 */ "COMMAND", "TIMESTAMP", "FLAGS", "DROPPED",
+	/* 89 */ "COUNT", "FAILED", "CHANGED_SINCE", "CHANGESEQ",
+	/* 93 */ "DELETED", "RESYNC", "SCHEDSTARTED", "SCHEDLATENCYAVG",
+	/* 97 */ "SCHEDLATENCYMAX", "SCHEDPASSES", "SCHEDFULLPASSES",
+};
+
+#define JOURNAL_FIELD_IDS (int)(sizeof(journalFieldIds) / sizeof(journalFieldIds[0]))
+#define FIELD_TAG_TYPE_BITS 3
+
+static int fieldIds[ENDOFFIELDS];		// Field number to journal ID
+static int idFields[JOURNAL_FIELD_IDS];	// Journal ID to field number, -1 if unknown
+
+static void initFieldIds(void) {
+	static int initialised = 0;
+
+	if (initialised)
+		return;
+
+	for (int i = 0; i < ENDOFFIELDS; i++)
+		fieldIds[i] = 0;
+
+	idFields[0] = -1;
+
+	for (int id = 1; id < JOURNAL_FIELD_IDS; id++) {
+		idFields[id] = fieldtonum(journalFieldIds[id]);
+
+		if (idFields[id] >= 0)
+			fieldIds[idFields[id]] = id;
+	}
+
+	initialised = 1;
+}
+
+/* The journal ID of a field, or 0 if it doesn't have one */
+
+int journalFieldId(int number) {
+	initFieldIds();
+	return fieldIds[number];
+}
+
+/* CRC32C (Castagnoli), table driven */
+
+static uint32_t crc32c_table[256];
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+	const unsigned char *p = data;
+
+	if (crc32c_table[1] == 0) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+
+			for (int k = 0; k < 8; k++)
+				c = (c >> 1) ^ (0x82F63B78 & -(c & 1));
+
+			crc32c_table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+void encodeVarint(buff_t *b, uint64_t value) {
+	unsigned char tmp[10];
+	int len = 0;
+
+	do {
+		tmp[len] = value & 0x7f;
+		value >>= 7;
+
+		if (value)
+			tmp[len] |= 0x80;
+
+		len++;
+	} while (value);
+
+	buffAdd(b, (char *)tmp, len);
+}
+
+void encodeSigned(buff_t *b, int64_t value) {
+	encodeVarint(b, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+/* Strings are stored as length + 1, with 0 used for NULL */
+void encodeString(buff_t *b, const char *str) {
+	if (str == NULL) {
+		encodeVarint(b, 0);
+		return;
+	}
+
+	size_t len = strlen(str);
+	encodeVarint(b, len + 1);
+	buffAdd(b, str, len);
+}
+
+static void encodeMessage(buff_t *b, const msg_t *m) {
+	initFieldIds();
+
+	encodeVarint(b, m->version);
+	encodeVarint(b, m->item_count);
+
+	for (int64_t i = 0; i < m->item_count; i++) {
+		msg_item *item = &m->items[i];
+
+		encodeVarint(b, item->field_count);
+
+		for (int64_t k = 0; k < item->field_count; k++) {
+			field *f = &item->fields[k];
+			int id = fieldIds[f->number];
+
+			encodeVarint(b, (uint64_t)id << FIELD_TAG_TYPE_BITS | fields[f->number].type);
+
+			if (id == 0)
+				encodeString(b, fields[f->number].name);
+
+			switch (fields[f->number].type) {
+				case FIELD_TYPE_NUM:
+					encodeSigned(b, f->value.number);
+					break;
+
+				case FIELD_TYPE_BOOL:
+					buffAdd(b, &f->value.boolean, 1);
+					break;
+
+				case FIELD_TYPE_STRING:
+					encodeString(b, f->value.string);
+					break;
+
+				case FIELD_TYPE_STRINGARRAY:
+					encodeVarint(b, f->value.string_array.count);
+
+					for (int64_t s = 0; s < f->value.string_array.count; s++)
+						encodeString(b, f->value.string_array.strings[s]);
+
+					break;
+
+				case FIELD_TYPE_MAP:
+					encodeVarint(b, f->value.map.count);
+
+					for (int64_t s = 0; s < f->value.map.count; s++) {
+						encodeString(b, f->value.map.keys[s].key);
+						encodeString(b, f->value.map.keys[s].value);
+					}
+
+					break;
+			}
+		}
+	}
+}
+
+/* Append a record to the buffer, encoding the already decoded request.
+ * msg is NULL for records without a message */
+
+int journalEncodeRecord(buff_t *b, int64_t timestamp, uid_t uid, const char *cmd, const msg_t *msg, jobid_t jobid, int64_t revision) {
+	struct journalHeader h = {0};
+	size_t start = b->used;
+
+	h.marker = ' ';
+	h.type = JOURNAL_RECORD_CMD;
+	h.cmd_len = strlen(cmd);
+	h.uid = uid;
+	h.jobid = jobid;
+	h.revision = revision;
+	h.timestamp = timestamp;
+
+	buffAdd(b, (char *)&h, sizeof(h));
+	buffAdd(b, cmd, h.cmd_len);
+
+	if (msg) {
+		h.flags |= JOURNAL_FLAG_MSG;
+		encodeMessage(b, msg);
+	}
+
+	h.length = b->used - start - sizeof(h);
+
+	/* Fill in the header now the length is known */
+	memcpy(b->data + start, &h, sizeof(h));
+	h.crc = crc32c(0, b->data + start + JOURNAL_HEADER_CRC_OFFSET, b->used - start - JOURNAL_HEADER_CRC_OFFSET);
+	memcpy(b->data + start + offsetof(struct journalHeader, crc), &h.crc, sizeof(h.crc));
+
+	return 0;
+}
+
+/* Append a record to the buffer from the request as written to the text journal.
+ * This has to decode the JSON first, so is only used when converting a journal
+ * and for requests rewritten by their command. */
+
+int journalEncodeJSON(buff_t *b, int64_t timestamp, uid_t uid, const char *cmd, const char *json, jobid_t jobid, int64_t revision) {
+	msg_t m;
+	int rc;
+
+	if (json == NULL || *json == '\0')
+		return journalEncodeRecord(b, timestamp, uid, cmd, NULL, jobid, revision);
+
+	/* load_message modifies the string it's passed */
+	char *copy = strdup(json);
+
+	if (load_message(copy, &m) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to load %s message for the journal", cmd);
+		free_message(&m);
+		free(copy);
+		return 1;
+	}
+
+	rc = journalEncodeRecord(b, timestamp, uid, cmd, &m, jobid, revision);
+
+	free_message(&m);
+	free(copy);
+
+	return rc;
+}
+
+/* Append an end of journal record to the buffer */
+
+void journalEncodeEOJ(buff_t *b) {
+	struct journalHeader h = {0};
+
+	h.marker = '$';
+	h.type = JOURNAL_RECORD_EOJ;
+	h.crc = crc32c(0, (char *)&h + JOURNAL_HEADER_CRC_OFFSET, sizeof(h) - JOURNAL_HEADER_CRC_OFFSET);
+
+	buffAdd(b, (char *)&h, sizeof(h));
+}
+
+uint64_t decodeVarint(struct decoder *d) {
+	uint64_t value = 0;
+	int shift = 0;
+
+	while (d->pos < d->end && shift < 64) {
+		unsigned char c = *d->pos++;
+		value |= (uint64_t)(c & 0x7f) << shift;
+
+		if ((c & 0x80) == 0)
+			return value;
+
+		shift += 7;
+	}
+
+	d->error = 1;
+	return 0;
+}
+
+int64_t decodeSigned(struct decoder *d) {
+	uint64_t value = decodeVarint(d);
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static char *decodeString(struct decoder *d) {
+	uint64_t len = decodeVarint(d);
+
+	if (len == 0 || d->error)
+		return NULL;
+
+	len--;
+
+	if (len > (uint64_t)(d->end - d->pos)) {
+		d->error = 1;
+		return NULL;
+	}
+
+	char *str = d->strings;
+	memcpy(str, d->pos, len);
+	str[len] = '\0';
+
+	d->strings += len + 1;
+	d->pos += len;
+
+	return str;
+}
+
+/* Decode a string into its own allocation */
+
+char *decodeStringDup(struct decoder *d) {
+	uint64_t len = decodeVarint(d);
+
+	if (len == 0 || d->error)
+		return NULL;
+
+	len--;
+
+	if (len > (uint64_t)(d->end - d->pos)) {
+		d->error = 1;
+		return NULL;
+	}
+
+	char *str = strndup((const char *)d->pos, len);
+	d->pos += len;
+
+	return str;
+}
+
+/* Check a count read from a record is sane, before allocating memory for it.
+ * Every entry needs at least one byte in the record */
+
+int64_t decodeCount(struct decoder *d) {
+	uint64_t count = decodeVarint(d);
+
+	if (count > (uint64_t)(d->end - d->pos)) {
+		d->error = 1;
+		return 0;
+	}
+
+	return count;
+}
+
+/* Read the value of a field this version doesn't know, and discard it */
+
+static void skipValue(struct decoder *d, int type) {
+	switch (type) {
+		case FIELD_TYPE_NUM:
+			decodeVarint(d);
+			break;
+
+		case FIELD_TYPE_BOOL:
+			if (d->pos < d->end)
+				d->pos++;
+			else
+				d->error = 1;
+			break;
+
+		case FIELD_TYPE_STRING:
+			decodeString(d);
+			break;
+
+		case FIELD_TYPE_STRINGARRAY:
+			for (int64_t s = decodeCount(d); s > 0 && !d->error; s--)
+				decodeString(d);
+			break;
+
+		case FIELD_TYPE_MAP:
+			for (int64_t s = decodeCount(d); s > 0 && !d->error; s--) {
+				decodeString(d);
+				decodeString(d);
+			}
+			break;
+
+		default:
+			d->error = 1;
+	}
+}
+
+static int decodeMessage(struct decoder *d, msg_t *m) {
+	initFieldIds();
+
+	m->version = decodeVarint(d);
+	m->item_count = decodeCount(d);
+
+	if (d->error)
+		return 1;
+
+	m->item_max = m->item_count;
+	m->items = calloc(m->item_count ? m->item_count : 1, sizeof(msg_item));
+
+	for (int64_t i = 0; i < m->item_count && !d->error; i++) {
+		msg_item *item = &m->items[i];
+		int64_t count = decodeCount(d);
+
+		item->field_max = count;
+		item->fields = calloc(count ? count : 1, sizeof(field));
+
+		for (int64_t k = 0; k < count && !d->error; k++) {
+			field *f = &item->fields[item->field_count];
+			uint64_t tag = decodeVarint(d);
+			uint64_t id = tag >> FIELD_TAG_TYPE_BITS;
+			int type = tag & ((1 << FIELD_TAG_TYPE_BITS) - 1);
+			int number = -1;
+
+			if (id == 0) {
+				const char *name = decodeString(d);
+				number = name ? fieldtonum(name) : -1;
+			} else if (id < JOURNAL_FIELD_IDS) {
+				number = idFields[id];
+			}
+
+			/* Unknown, or no longer stored with the same type */
+			if (number < 0 || fields[number].type != type) {
+				skipValue(d, type);
+				continue;
+			}
+
+			item->bitmap[number / 8] |= 1 << (number % 8);
+			item->field_count++;
+			f->number = number;
+			f->type = fields[number].type;
+			f->name = fields[number].name;
+
+			switch (fields[number].type) {
+				case FIELD_TYPE_NUM:
+					f->value.number = decodeSigned(d);
+					break;
+
+				case FIELD_TYPE_BOOL:
+					if (d->pos < d->end)
+						f->value.boolean = *d->pos++;
+					else
+						d->error = 1;
+					break;
+
+				case FIELD_TYPE_STRING:
+					f->value.string = decodeString(d);
+					break;
+
+				case FIELD_TYPE_STRINGARRAY:
+					f->value.string_array.count = decodeCount(d);
+					f->value.string_array.strings = malloc(sizeof(char *) * (f->value.string_array.count + 1));
+
+					for (int64_t s = 0; s < f->value.string_array.count; s++)
+						f->value.string_array.strings[s] = decodeString(d);
+
+					break;
+
+				case FIELD_TYPE_MAP:
+					f->value.map.count = decodeCount(d);
+					f->value.map.keys = malloc(sizeof(key_val_t) * (f->value.map.count + 1));
+
+					for (int64_t s = 0; s < f->value.map.count; s++) {
+						f->value.map.keys[s].key = decodeString(d);
+						f->value.map.keys[s].value = decodeString(d);
+					}
+
+					break;
+			}
+		}
+	}
+
+	return d->error;
+}
+
+/* Decode the record at the start of data into a message. The strings in the
+ * message are stored in *buffer, which is grown as needed and must be kept
+ * until the message is no longer needed.
+ * Returns the size of the record, 0 at the end of the journal or -1 if the
+ * record is incomplete or corrupt */
+
+ssize_t journalDecodeRecord(const char *data, size_t avail, struct journalRecord *r, char **buffer, size_t *buffer_size) {
+	struct journalHeader h;
+
+	memset(r, 0, sizeof(struct journalRecord));
+
+	if (avail < sizeof(h))
+		return avail == 0 ? 0 : -1;
+
+	memcpy(&h, data, sizeof(h));
+
+	if (h.type == 0)
+		return 0;
+
+	if (h.length > avail - sizeof(h) || h.cmd_len > h.length)
+		return -1;
+
+	if (crc32c(0, data + JOURNAL_HEADER_CRC_OFFSET, sizeof(h) - JOURNAL_HEADER_CRC_OFFSET + h.length) != h.crc)
+		return -1;
+
+	r->marker = h.marker;
+	r->uid = h.uid;
+	r->jobid = h.jobid;
+	r->revision = h.revision;
+	r->timestamp = h.timestamp;
+
+	if (h.type == JOURNAL_RECORD_EOJ)
+		return sizeof(h) + h.length;
+
+	/* The strings can't take more room than the record, plus a terminator each */
+	size_t needed = h.length * 2 + 1;
+
+	if (*buffer_size < needed) {
+		*buffer_size = needed;
+		*buffer = realloc(*buffer, *buffer_size);
+
+		if (*buffer == NULL)
+			error_die("Failed to allocate memory for journal record: %s", strerror(errno));
+	}
+
+	struct decoder d = {(const unsigned char *)data + sizeof(h) + h.cmd_len, (const unsigned char *)data + sizeof(h) + h.length, *buffer, 0};
+
+	memcpy(d.strings, data + sizeof(h), h.cmd_len);
+	d.strings[h.cmd_len] = '\0';
+	r->msg.command = d.strings;
+	d.strings += h.cmd_len + 1;
+
+	r->has_msg = h.flags &JOURNAL_FLAG_MSG;
+
+	if (r->has_msg && decodeMessage(&d, &r->msg) != 0) {
+		free_message(&r->msg);
+		return -1;
+	}
+
+	return sizeof(h) + h.length;
+}
+
+/* Read the next record from a binary journal that may still be being
+ * written. The reader's offset is moved past the record when one is read.
+ * Returns the size of the record, 0 if there isn't a complete record yet
+ * or -1 if the record is corrupt */
+
+ssize_t journalReadRecord(struct journalReader *jr, struct journalRecord *r) {
+	struct journalHeader h;
+	ssize_t len;
+
+	if (jr->offset < JOURNAL_MAGIC_LEN)
+		jr->offset = JOURNAL_MAGIC_LEN;
+
+	if (pread(jr->fd, &h, sizeof(h), jr->offset) != sizeof(h) || h.type == 0)
+		return 0;
+
+	size_t size = sizeof(h) + h.length;
+
+	if (jr->data_size < size) {
+		jr->data_size = size;
+		jr->data = realloc(jr->data, jr->data_size);
+
+		if (jr->data == NULL)
+			error_die("Failed to allocate memory for journal record: %s", strerror(errno));
+	}
+
+	if (pread(jr->fd, jr->data, size, jr->offset) != (ssize_t)size)
+		return 0;
+
+	len = journalDecodeRecord(jr->data, size, r, &jr->buffer, &jr->buffer_size);
+
+	if (len > 0)
+		jr->offset += len;
+
+	return len;
+}
+
+/* Check if the journal open on fd is in the binary format. The last
+ * character of the magic is the format version */
+
+int journalIsBinary(int fd) {
+	char magic[JOURNAL_MAGIC_LEN];
+
+	if (pread(fd, magic, JOURNAL_MAGIC_LEN, 0) != JOURNAL_MAGIC_LEN)
+		return 0;
+
+	if (memcmp(magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN - 1) != 0)
+		return 0;
+
+	if (magic[JOURNAL_MAGIC_LEN - 1] != JOURNAL_MAGIC[JOURNAL_MAGIC_LEN - 1])
+		error_die("Unsupported binary journal format version %c, expected %c", magic[JOURNAL_MAGIC_LEN - 1], JOURNAL_MAGIC[JOURNAL_MAGIC_LEN - 1]);
+
+	return 1;
+}
+
+/* Map a binary journal into memory, returning its size */
+
+static char *mapJournal(const char *journal, size_t *size) {
+	struct stat buf;
+	char *data;
+	int fd;
+
+	if ((fd = open(journal, O_RDONLY)) < 0)
+		error_die("Failed to open journal %s: %s", journal, strerror(errno));
+
+	if (fstat(fd, &buf) != 0)
+		error_die("Failed to stat journal %s: %s", journal, strerror(errno));
+
+	*size = buf.st_size;
+
+	if (*size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (data == MAP_FAILED)
+		error_die("Failed to map journal %s: %s", journal, strerror(errno));
+
+	madvise(data, *size, MADV_SEQUENTIAL);
+	close(fd);
+
+	return data;
+}
+
+/* Walk the records in a binary journal, calling func for each one.
+ * Returns the offset of the end of the last valid record */
+
+static off_t walkJournal(const char *journal, off_t offset, void (*func)(struct journalRecord *, off_t, off_t, void *), void *arg) {
+	size_t size;
+	char *data = mapJournal(journal, &size);
+	char *buffer = NULL;
+	size_t buffer_size = 0;
+	struct journalRecord r;
+	ssize_t len;
+
+	if (offset < JOURNAL_MAGIC_LEN)
+		offset = JOURNAL_MAGIC_LEN;
+
+	while ((size_t)offset < size) {
+		len = journalDecodeRecord(data + offset, size - offset, &r, &buffer, &buffer_size);
+
+		if (len == 0)
+			break;
+
+		if (len < 0) {
+			print_msg(JERS_LOG_WARNING, "Journal %s has an incomplete record at offset %ld - Ignoring the rest of the journal", journal, offset);
+			break;
+		}
+
+		func(&r, offset, offset + len, arg);
+		free_message(&r.msg);
+
+		offset += len;
+	}
+
+	if (data)
+		munmap(data, size);
+
+	free(buffer);
+
+	return offset;
+}
+
+static void countRecord(struct journalRecord *r, off_t start, off_t end, void *arg) {
+	UNUSED(r);
+	UNUSED(start);
+	UNUSED(end);
+	(*(off_t *)arg)++;
+}
+
+/* Find the end of the records in a binary journal, counting them as we go */
+
+off_t binaryJournalEnd(const char *journal, off_t *records) {
+	*records = 0;
+	return walkJournal(journal, 0, countRecord, records);
+}
+
+static void findCommit(struct journalRecord *r, off_t start, off_t end, void *arg) {
+	UNUSED(start);
+
+	if (r->marker == '*')
+		*(off_t *)arg = end;
+}
+
+/* Return the offset of the record following the last one committed
+ * to the state files, searching from 'offset', or -1 if there isn't one */
+
+off_t binaryJournalLastCommit(const char *journal, off_t offset) {
+	off_t last_commit = -1;
+
+	walkJournal(journal, offset, findCommit, &last_commit);
+
+	return last_commit;
+}
+
+static void replayRecord(struct journalRecord *r, off_t start, off_t end, void *arg) {
+	UNUSED(start);
+	UNUSED(end);
+	UNUSED(arg);
+
+	if (!r->has_msg)
+		return;
+
+	server.recovery.time = r->timestamp / 1000;
+	server.recovery.uid = r->uid;
+	server.recovery.jobid = r->jobid;
+	server.recovery.revision = r->revision;
+
+	replayCommand(&r->msg);
+}
+
+/* Replay the records in a binary journal from offset onwards. The records are
+ * decoded straight into messages for the command handlers */
+
+void replayBinaryJournal(const char *journal, off_t offset) {
+	walkJournal(journal, offset, replayRecord, NULL);
+}
+
+/* Parse a text journal entry. The JSON message is left in place */
+
+int parseJournalEntry(char *entry, struct journalEntry *e) {
+	int msg_offset = 0;
+	int field_count = sscanf(entry, " %ld.%d\t%d\t%64s\t%u\t%ld\t%n", &e->timestamp, &e->timestamp_ms, (int *)&e->uid, e->command, &e->jobid, &e->revision, &msg_offset);
+
+	if (field_count != 6)
+		return 1;
+
+	e->json = entry + msg_offset;
+
+	return 0;
+}
+
+/* Convert a text journal into the binary format, keeping any commit markers */
+
+int convertJournal(const char *in, const char *out) {
+	FILE *f = NULL;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	int64_t records = 0;
+	buff_t b;
+	int fd;
+
+	if ((f = fopen(in, "r")) == NULL) {
+		fprintf(stderr, "Failed to open journal %s: %s\n", in, strerror(errno));
+		return 1;
+	}
+
+	if ((fd = open(out, O_CREAT | O_EXCL | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) < 0) {
+		fprintf(stderr, "Failed to create journal %s: %s\n", out, strerror(errno));
+		fclose(f);
+		return 1;
+	}
+
+	buffNew(&b, 0);
+	buffAdd(&b, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+
+	while ((len = getline(&line, &line_size, f)) != -1) {
+		struct journalEntry e;
+
+		line[strcspn(line, "\n")] = '\0';
+
+		/* The rest of the file is preallocated space */
+		if (line[0] == '\0')
+			break;
+
+		if (line[0] == '$') {
+			journalEncodeEOJ(&b);
+			continue;
+		}
+
+		if (parseJournalEntry(line + 1, &e) != 0) {
+			fprintf(stderr, "Failed to parse journal entry %ld: %s\n", records + 1, line);
+			break;
+		}
+
+		size_t start = b.used;
+
+		if (journalEncodeJSON(&b, (int64_t)e.timestamp * 1000 + e.timestamp_ms, e.uid, e.command, e.json, e.jobid, e.revision) != 0)
+			break;
+
+		/* Keep the commit marker */
+		b.data[start] = line[0];
+		records++;
+	}
+
+	int status = !feof(f);
+
+	if (write(fd, b.data, b.used) != (ssize_t)b.used || fdatasync(fd) != 0) {
+		fprintf(stderr, "Failed to write journal %s: %s\n", out, strerror(errno));
+		status = 1;
+	}
+
+	printf("Converted %ld records from %s to %s\n", records, in, out);
+
+	close(fd);
+	fclose(f);
+	free(line);
+	buffFree(&b);
+
+	return status;
+}
@@ -267,7 +267,7 @@ int JSONAddMap(buff_t *buff, int field_no, int64_t count, key_val_t *values)
 int JSONStartObject(buff_t *buff, const char *name, size_t name_len)
 {
 	size_t required;
-	char *p = buff->data + buff->used;
+	char *p;
 	int len = 0;
 
 	if (name && name_len == 0)
@@ -276,6 +276,7 @@ int JSONStartObject(buff_t *buff, const char *name, size_t name_len)
 	required = name_len + 4;
 
 	buffResize(buff, required);
+	p = buff->data + buff->used;
 
 	if (name) {
 		p[len++] = '"';
@@ -309,10 +310,11 @@ int JSONEndObject(buff_t *buff)
 int JSONStartArray(buff_t *buff, const char *name, size_t name_len)
 {
 	size_t required = name_len + 4;
-	char *p = buff->data + buff->used;
+	char *p;
 	int len = 0;
 
 	buffResize(buff, required);
+	p = buff->data + buff->used;
 	p[len++] = '"';
 	memcpy(p + len, name, name_len);
 	len += name_len;
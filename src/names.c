@@ -0,0 +1,350 @@
+/* Copyright (c) 2020 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <server.h>
+#include <errno.h>
+#include <string.h>
+
+/* Job name index
+ *
+ * With 'index_job_names' set, job names are indexed by their trigrams, so a
+ * wildcard search on the job name only checks the jobs holding every literal
+ * part of the pattern. Names are padded with two start markers and an end
+ * marker before being split, so the trigrams at the start of a name act as a
+ * prefix index, and the one at the end as a suffix index. A pattern such as
+ * 'etl_*_daily' needs "^^e", "^et", "etl", "tl_", "_da", "dai", "ail",
+ * "ily" and "ly$".
+ *
+ * Each trigram has a posting list of the jobs with it, sorted by jobid. */
+
+#define NAME_START 0x01
+#define NAME_END 0x02
+
+struct nameTrigram {
+	uint32_t trigram;
+	int64_t count;
+	int64_t size;
+	jobid_t *jobs;
+
+	UT_hash_handle hh;
+};
+
+static int trigramComp(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* Add the trigrams of a run of literal characters */
+
+static void addTrigrams(const unsigned char *run, size_t len, uint32_t *trigrams, int64_t *count) {
+	for (size_t i = 0; i + 2 < len; i++)
+		trigrams[(*count)++] = (uint32_t)run[i] << 16 | (uint32_t)run[i + 1] << 8 | run[i + 2];
+}
+
+/* Return the sorted, unique trigrams of a name */
+
+static int64_t nameTrigrams(const char *name, uint32_t **trigrams) {
+	size_t len = strlen(name);
+	unsigned char *padded = malloc(len + 3);
+	int64_t count = 0, unique = 0;
+
+	*trigrams = malloc(sizeof(uint32_t) * (len + 1));
+
+	if (padded == NULL || *trigrams == NULL)
+		error_die("Failed to allocate memory for job name trigrams: %s", strerror(errno));
+
+	padded[0] = padded[1] = NAME_START;
+	memcpy(padded + 2, name, len);
+	padded[len + 2] = NAME_END;
+
+	addTrigrams(padded, len + 3, *trigrams, &count);
+	free(padded);
+
+	qsort(*trigrams, count, sizeof(uint32_t), trigramComp);
+
+	for (int64_t i = 0; i < count; i++) {
+		if (unique == 0 || (*trigrams)[unique - 1] != (*trigrams)[i])
+			(*trigrams)[unique++] = (*trigrams)[i];
+	}
+
+	return unique;
+}
+
+/* Return the trigrams every name matching a pattern must have,
+ * or -1 if the pattern can't be used with the index */
+
+static int64_t patternTrigrams(const char *pattern, uint32_t **trigrams) {
+	size_t len = strlen(pattern);
+	unsigned char *run = malloc(len + 3);
+	size_t run_len = 2;
+	int64_t count = 0;
+
+	*trigrams = malloc(sizeof(uint32_t) * (len + 1));
+
+	if (run == NULL || *trigrams == NULL)
+		error_die("Failed to allocate memory for job name trigrams: %s", strerror(errno));
+
+	/* A literal at the start of the pattern is anchored to the start of the name */
+	run[0] = run[1] = NAME_START;
+
+	for (const char *p = pattern; ; p++) {
+		if (*p == '\\') {
+			/* Escapes aren't worth handling, just scan instead */
+			count = -1;
+			break;
+		}
+
+		if (*p && *p != '*' && *p != '?' && *p != '[') {
+			run[run_len++] = *p;
+			continue;
+		}
+
+		if (*p == 0)
+			run[run_len++] = NAME_END;
+
+		addTrigrams(run, run_len, *trigrams, &count);
+		run_len = 0;
+
+		if (*p == 0)
+			break;
+
+		/* Skip over a bracket expression. A ']' straight after the opening
+		 * bracket is part of the set. Unterminated, it's matched literally */
+		if (*p == '[') {
+			const char *end = p + 1;
+
+			if (*end == '!' || *end == '^')
+				end++;
+
+			if (*end == ']')
+				end++;
+
+			end = strchr(end, ']');
+
+			if (end == NULL) {
+				count = -1;
+				break;
+			}
+
+			p = end;
+		}
+	}
+
+	free(run);
+
+	if (count <= 0) {
+		free(*trigrams);
+		*trigrams = NULL;
+		return -1;
+	}
+
+	return count;
+}
+
+static int64_t findPosting(const struct nameTrigram *t, jobid_t jobid) {
+	int64_t low = 0, high = t->count;
+
+	while (low < high) {
+		int64_t mid = low + (high - low) / 2;
+
+		if (t->jobs[mid] < jobid)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+void nameIndexAdd(struct job *j) {
+	uint32_t *trigrams;
+	int64_t count = nameTrigrams(j->jobname, &trigrams);
+
+	for (int64_t i = 0; i < count; i++) {
+		struct nameTrigram *t = NULL;
+
+		HASH_FIND(hh, server.nameTrigrams, &trigrams[i], sizeof(uint32_t), t);
+
+		if (t == NULL) {
+			t = calloc(1, sizeof(struct nameTrigram));
+
+			if (t == NULL)
+				error_die("Failed to allocate memory for job name index: %s", strerror(errno));
+
+			t->trigram = trigrams[i];
+			HASH_ADD(hh, server.nameTrigrams, trigram, sizeof(uint32_t), t);
+		}
+
+		if (t->count == t->size) {
+			t->size = t->size ? t->size * 2 : 4;
+			t->jobs = realloc(t->jobs, sizeof(jobid_t) * t->size);
+
+			if (t->jobs == NULL)
+				error_die("Failed to allocate memory for job name index: %s", strerror(errno));
+		}
+
+		/* Jobs are usually added in jobid order */
+		int64_t pos = (t->count == 0 || t->jobs[t->count - 1] < j->jobid) ? t->count : findPosting(t, j->jobid);
+
+		memmove(&t->jobs[pos + 1], &t->jobs[pos], sizeof(jobid_t) * (t->count - pos));
+		t->jobs[pos] = j->jobid;
+		t->count++;
+	}
+
+	free(trigrams);
+}
+
+void nameIndexDel(struct job *j) {
+	uint32_t *trigrams;
+	int64_t count = nameTrigrams(j->jobname, &trigrams);
+
+	for (int64_t i = 0; i < count; i++) {
+		struct nameTrigram *t = NULL;
+
+		HASH_FIND(hh, server.nameTrigrams, &trigrams[i], sizeof(uint32_t), t);
+
+		if (t == NULL)
+			continue;
+
+		int64_t pos = findPosting(t, j->jobid);
+
+		if (pos == t->count || t->jobs[pos] != j->jobid)
+			continue;
+
+		memmove(&t->jobs[pos], &t->jobs[pos + 1], sizeof(jobid_t) * (t->count - pos - 1));
+
+		if (--t->count == 0) {
+			HASH_DELETE(hh, server.nameTrigrams, t);
+			free(t->jobs);
+			free(t);
+		}
+	}
+
+	free(trigrams);
+}
+
+/* Look up the posting lists for a pattern, returning the number found.
+ * Returns -1 if the pattern can't use the index */
+
+static int64_t patternPostings(const char *pattern, struct nameTrigram ***postings) {
+	uint32_t *trigrams;
+	int64_t count = patternTrigrams(pattern, &trigrams);
+
+	*postings = NULL;
+
+	if (count < 0)
+		return -1;
+
+	*postings = malloc(sizeof(struct nameTrigram *) * count);
+
+	if (*postings == NULL)
+		error_die("Failed to allocate memory for job name search: %s", strerror(errno));
+
+	for (int64_t i = 0; i < count; i++) {
+		HASH_FIND(hh, server.nameTrigrams, &trigrams[i], sizeof(uint32_t), (*postings)[i]);
+
+		/* No name has this trigram, so nothing can match */
+		if ((*postings)[i] == NULL) {
+			count = 0;
+			break;
+		}
+	}
+
+	free(trigrams);
+
+	return count;
+}
+
+/* Return the most jobs a search for a pattern could return,
+ * or -1 if the pattern can't use the index */
+
+int64_t nameIndexEstimate(const char *pattern) {
+	struct nameTrigram **postings;
+	int64_t count = patternPostings(pattern, &postings);
+	int64_t estimate = count ? INT64_MAX : 0;
+
+	if (count < 0)
+		return -1;
+
+	for (int64_t i = 0; i < count; i++) {
+		if (postings[i]->count < estimate)
+			estimate = postings[i]->count;
+	}
+
+	free(postings);
+
+	return estimate;
+}
+
+/* Find the jobs with every trigram of a pattern, by checking each job in
+ * the smallest posting list against the others. These are candidates that
+ * still need to be matched against the pattern. Returns the number found,
+ * or -1 if the pattern can't use the index */
+
+int64_t nameIndexSearch(const char *pattern, jobid_t **jobs) {
+	struct nameTrigram **postings;
+	int64_t count = patternPostings(pattern, &postings);
+	int64_t smallest = 0, found = 0;
+
+	*jobs = NULL;
+
+	if (count <= 0) {
+		free(postings);
+		return count;
+	}
+
+	for (int64_t i = 1; i < count; i++) {
+		if (postings[i]->count < postings[smallest]->count)
+			smallest = i;
+	}
+
+	*jobs = malloc(sizeof(jobid_t) * postings[smallest]->count);
+
+	if (*jobs == NULL)
+		error_die("Failed to allocate memory for job name search: %s", strerror(errno));
+
+	for (int64_t k = 0; k < postings[smallest]->count; k++) {
+		jobid_t jobid = postings[smallest]->jobs[k];
+		int64_t i;
+
+		for (i = 0; i < count; i++) {
+			int64_t pos = findPosting(postings[i], jobid);
+
+			if (pos == postings[i]->count || postings[i]->jobs[pos] != jobid)
+				break;
+		}
+
+		if (i == count)
+			(*jobs)[found++] = jobid;
+	}
+
+	free(postings);
+
+	return found;
+}
@@ -45,6 +45,7 @@
 int addQueue(struct queue * q, int dirty) {
 
 	HASH_ADD_STR(server.queueTable, name, q);
+	server.candidate_recalc = 1;
 
 	if (q->def)
 		setDefaultQueue(q);
@@ -125,6 +126,7 @@ void freeQueue(struct queue * q) {
 
 void removeQueue(struct queue * q) {
 	HASH_DEL(server.queueTable, q);
+	server.candidate_recalc = 1;
 	freeQueue(q);
 }
 
@@ -157,6 +159,7 @@ int cleanupQueues(uint32_t max_clean) {
 
 		stateDelQueue(q);
 		HASH_DEL(server.queueTable, q);
+		server.candidate_recalc = 1;
 		freeQueue(q);
 
 		if (++cleaned_up >= max_clean)
@@ -75,6 +75,8 @@ void deallocateRes(struct job *j) {
 
 		if (unlikely(j->req_resources[i].res->in_use < 0))
 			j->req_resources[i].res->in_use = 0;
+
+		schedResourceFreed(j->req_resources[i].res);
 	}
 }
 
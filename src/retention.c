@@ -0,0 +1,373 @@
+/* Copyright (c) 2020 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <server.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <glob.h>
+#include <sys/stat.h>
+
+#define COMPACT_SCAN_MAX (64 * 1024 * 1024)
+
+/* Journal retention
+ *
+ * Journals are written one per day, so they accumulate in state_dir. Every
+ * journal before the one holding the last committed record has had all of
+ * its records saved to the state files, so it is no longer needed to
+ * recover. These committed journals are compacted, by trimming the
+ * preallocated space at the end of them, and removed once they are older
+ * than 'journal_retain_days' or the journals take up more than
+ * 'journal_retain_size' megabytes.
+ *
+ * The journal and offset of the last commit are recorded in a manifest
+ * (state_dir/journals.manifest) after each successful save. At startup this
+ * tells us where to start replaying from, without scanning old journals for
+ * commit markers.
+ *
+ * Accounting streams resuming from a removed journal are sent an error, and
+ * have to restart without a position. */
+
+static char *manifestPath(void) {
+	static char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/journals.manifest", server.state_dir);
+	return path;
+}
+
+/* Load the manifest, returning 0 if there is one */
+
+int readJournalManifest(void) {
+	FILE *f = fopen(manifestPath(), "r");
+	char *line = NULL;
+	size_t line_size = 0;
+	char key[MANIFEST_FIELD_MAX], value[MANIFEST_FIELD_MAX];
+
+	if (f == NULL) {
+		if (errno != ENOENT)
+			print_msg(JERS_LOG_WARNING, "Failed to open journal manifest: %s", strerror(errno));
+
+		return 1;
+	}
+
+	server.retention.journal[0] = 0;
+	server.retention.offset = 0;
+	server.retention.compacted[0] = 0;
+
+	while (getline(&line, &line_size, f) != -1) {
+		if (sscanf(line, "%63s %63s", key, value) != 2)
+			continue;
+
+		if (strcmp(key, "JOURNAL") == 0)
+			snprintf(server.retention.journal, sizeof(server.retention.journal), "%s", value);
+		else if (strcmp(key, "OFFSET") == 0)
+			server.retention.offset = atoll(value);
+		else if (strcmp(key, "COMPACTED") == 0 && strcmp(value, "-") != 0)
+			snprintf(server.retention.compacted, sizeof(server.retention.compacted), "%s", value);
+	}
+
+	free(line);
+	fclose(f);
+
+	return server.retention.journal[0] ? 0 : 1;
+}
+
+int writeJournalManifest(void) {
+	struct stateFile sf = {0};
+	int rc;
+
+	sf.filename = strdup(manifestPath());
+	rc = asprintf(&sf.data, "JOURNAL %s\nOFFSET %ld\nCOMPACTED %s\n", server.retention.journal,
+		server.retention.offset, server.retention.compacted[0] ? server.retention.compacted : "-");
+
+	if (sf.filename == NULL || rc < 0)
+		error_die("Failed to allocate memory for journal manifest: %s", strerror(errno));
+
+	sf.len = rc;
+	rc = writeStateFile(&sf);
+	freeStateFile(&sf);
+
+	if (rc)
+		print_msg(JERS_LOG_WARNING, "Failed to write journal manifest");
+
+	return rc;
+}
+
+/* List the journal from the manifest and any newer ones, oldest first.
+ * Journals are named after the day they were opened, so each day up to
+ * today is probed rather than globbing the whole state directory.
+ * Returns non-zero if the journal from the manifest doesn't exist */
+
+int manifestJournals(char ***journals, size_t *count) {
+	struct tm tm = {0};
+	char today[16], date[16];
+	time_t now = time(NULL);
+
+	*journals = NULL;
+	*count = 0;
+
+	if (strptime(server.retention.journal, "%Y%m%d", &tm) == NULL)
+		return 1;
+
+	strftime(today, sizeof(today), "%Y%m%d", localtime(&now));
+
+	/* Use midday, so daylight saving changes don't skip or repeat a day */
+	tm.tm_hour = 12;
+	tm.tm_isdst = -1;
+	mktime(&tm);
+
+	for (strftime(date, sizeof(date), "%Y%m%d", &tm); strcmp(date, today) <= 0; strftime(date, sizeof(date), "%Y%m%d", &tm)) {
+		char *path = NULL;
+		struct stat st;
+
+		if (asprintf(&path, "%s/journal.%s", server.state_dir, date) < 0)
+			error_die("Failed to allocate memory for journal name: %s", strerror(errno));
+
+		if (stat(path, &st) == 0) {
+			*journals = realloc(*journals, sizeof(char *) * (*count + 1));
+
+			if (*journals == NULL)
+				error_die("Failed to allocate memory for journal list: %s", strerror(errno));
+
+			(*journals)[(*count)++] = path;
+		} else {
+			free(path);
+
+			/* The manifest journal itself is missing */
+			if (*count == 0)
+				return 1;
+		}
+
+		tm.tm_mday++;
+		mktime(&tm);
+	}
+
+	return *count ? 0 : 1;
+}
+
+/* Record the position the save being started will commit, which is the end
+ * of the journal as the save marks the last record in it */
+
+void manifestStartSave(void) {
+	if (server.journal.fd < 0) {
+		server.retention.save_journal[0] = 0;
+		return;
+	}
+
+	snprintf(server.retention.save_journal, sizeof(server.retention.save_journal), "%s", server.journal.datetime);
+	server.retention.save_offset = server.journal.len;
+}
+
+void manifestSaveDone(int status) {
+	if (status || server.retention.save_journal[0] == 0)
+		return;
+
+	memcpy(server.retention.journal, server.retention.save_journal, sizeof(server.retention.journal));
+	server.retention.offset = server.retention.save_offset;
+	writeJournalManifest();
+}
+
+/* Find the end of the records in a journal, starting from the last record
+ * in its index so only the records after it are read. Journals without a
+ * usable index are only scanned up to COMPACT_SCAN_MAX bytes, so a large one
+ * can't hold up the event loop. Returns -1 if the end wasn't found */
+
+static off_t journalEnd(int fd, const char *datetime) {
+	char buffer[65536];
+	int64_t indexed;
+	off_t start = journalIndexLookup(datetime, INT64_MAX, &indexed);
+
+	if (journalIsBinary(fd)) {
+		struct journalReader jr = {0};
+		struct journalRecord r;
+
+		jr.fd = fd;
+		jr.offset = start;
+
+		/* The index is only a hint, so check there is a record there */
+		if (start && journalReadRecord(&jr, &r) <= 0)
+			jr.offset = start = JOURNAL_MAGIC_LEN;
+		else if (start)
+			free_message(&r.msg);
+
+		while (jr.offset - start < COMPACT_SCAN_MAX && journalReadRecord(&jr, &r) > 0)
+			free_message(&r.msg);
+
+		free(jr.data);
+		free(jr.buffer);
+
+		return jr.offset - start < COMPACT_SCAN_MAX ? jr.offset : -1;
+	}
+
+	/* Text journals end at the first zero byte */
+	if (start && (pread(fd, buffer, 1, start - 1) != 1 || buffer[0] != '\n'))
+		start = 0;
+
+	for (off_t offset = start; offset - start < COMPACT_SCAN_MAX;) {
+		ssize_t len = pread(fd, buffer, sizeof(buffer), offset);
+
+		if (len < 0)
+			return -1;
+
+		char *zero = memchr(buffer, 0, len);
+
+		if (zero)
+			return offset + (zero - buffer);
+
+		if (len == 0)
+			return offset;
+
+		offset += len;
+	}
+
+	return -1;
+}
+
+/* Truncate the unused space preallocated at the end of a journal.
+ * Returns the new size of the journal, or -1 on failure */
+
+off_t compactJournal(const char *journal, const char *datetime) {
+	struct stat st;
+	off_t end;
+	int fd = open(journal, O_RDWR);
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to open journal %s for compaction: %s", journal, strerror(errno));
+
+		if (fd >= 0)
+			close(fd);
+
+		return -1;
+	}
+
+	end = journalEnd(fd, datetime);
+
+	if (end < 0) {
+		/* Leave it as it is, rather than reading the whole journal */
+		print_msg(JERS_LOG_INFO, "Not compacting journal %s - Unable to find its end from the index", journal);
+		close(fd);
+		return st.st_size;
+	}
+
+	if (end < st.st_size) {
+		if (ftruncate(fd, end) != 0) {
+			print_msg(JERS_LOG_WARNING, "Failed to truncate journal %s: %s", journal, strerror(errno));
+			close(fd);
+			return -1;
+		}
+
+		fdatasync(fd);
+		print_msg(JERS_LOG_INFO, "Compacted journal %s from %ld to %ld bytes", journal, st.st_size, end);
+	}
+
+	close(fd);
+
+	return end;
+}
+
+static void removeJournal(const char *journal, const char *datetime) {
+	char index[PATH_MAX];
+
+	print_msg(JERS_LOG_INFO, "Removing committed journal %s", journal);
+
+	if (unlink(journal) != 0)
+		print_msg(JERS_LOG_WARNING, "Failed to remove journal %s: %s", journal, strerror(errno));
+
+	snprintf(index, sizeof(index), "%s/journal_index.%s", server.state_dir, datetime);
+
+	if (unlink(index) != 0 && errno != ENOENT)
+		print_msg(JERS_LOG_WARNING, "Failed to remove journal index %s: %s", index, strerror(errno));
+}
+
+/* Apply the retention policy to the journals before the last commit.
+ * The journal holding the last commit, and any after it, are never touched */
+
+void journalRetention(void) {
+	glob_t journalGlob;
+	char pattern[PATH_MAX];
+	char cutoff[16] = "";
+	int64_t total = 0;
+	int changed = 0;
+	struct stat st;
+
+	if (server.retention.journal[0] == 0)
+		return;
+
+	if (server.retention.days) {
+		time_t t = time(NULL) - (time_t)server.retention.days * 86400;
+		strftime(cutoff, sizeof(cutoff), "%Y%m%d", localtime(&t));
+	}
+
+	snprintf(pattern, sizeof(pattern), "%s/journal.*", server.state_dir);
+
+	if (glob(pattern, 0, NULL, &journalGlob) != 0) {
+		globfree(&journalGlob);
+		return;
+	}
+
+	if (server.retention.size) {
+		for (size_t i = 0; i < journalGlob.gl_pathc; i++) {
+			if (stat(journalGlob.gl_pathv[i], &st) == 0)
+				total += st.st_size;
+		}
+	}
+
+	/* Oldest first, so the size limit removes the oldest journals */
+	for (size_t i = 0; i < journalGlob.gl_pathc; i++) {
+		char *journal = journalGlob.gl_pathv[i];
+		char *datetime = strrchr(journal, '.') + 1;
+
+		if (strcmp(datetime, server.retention.journal) >= 0)
+			break;
+
+		if (stat(journal, &st) != 0)
+			continue;
+
+		if ((cutoff[0] && strcmp(datetime, cutoff) < 0) || (server.retention.size && total > server.retention.size)) {
+			removeJournal(journal, datetime);
+			total -= st.st_size;
+			continue;
+		}
+
+		if (server.retention.compact && strcmp(datetime, server.retention.compacted) > 0) {
+			off_t size = compactJournal(journal, datetime);
+
+			if (size < 0)
+				break;
+
+			total -= st.st_size - size;
+			snprintf(server.retention.compacted, sizeof(server.retention.compacted), "%s", datetime);
+			changed = 1;
+		}
+	}
+
+	globfree(&journalGlob);
+
+	if (changed)
+		writeJournalManifest();
+}
@@ -30,34 +30,146 @@
 #include <server.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
 #include <commands.h>
 #include <json.h>
 
 #include <utlist.h>
 
+/* Order queues by priority, highest first */
+
 int __comp(const void * a_, const void * b_) {
-	const struct job * a = *((struct job **) a_);
-	const struct job * b = *((struct job **) b_);
-	int32_t r;
+	const struct queue * a = *((struct queue **) a_);
+	const struct queue * b = *((struct queue **) b_);
+
+	return b->priority - a->priority;
+}
+
+/* Order jobs within a queue by priority, then jobid */
+
+static inline int pendingComp(const struct job * a, const struct job * b) {
+	if (a->priority != b->priority)
+		return b->priority - a->priority;
+
+	return (a->jobid > b->jobid) - (a->jobid < b->jobid);
+}
+
+static int pendingRandomLevel(void) {
+	int level = 1;
+
+	while (level < JERS_PENDING_MAXLEVEL && (random() & 3) == 0)
+		level++;
+
+	return level;
+}
+
+/* The forward pointers of jobs leaving the pending lists are kept on a
+ * freelist for each level, linked through their first pointer, so jobs
+ * becoming pending don't need to allocate them each time */
+
+static struct job **pendingFree[JERS_PENDING_MAXLEVEL + 1];
+
+static struct job **allocPendingNext(int level) {
+	struct job **next = pendingFree[level];
+
+	if (next) {
+		pendingFree[level] = (struct job **)next[0];
+		return next;
+	}
+
+	next = malloc(sizeof(struct job *) * level);
+
+	if (next == NULL)
+		error_die("Failed to allocate memory for pending job list: %s", strerror(errno));
+
+	return next;
+}
+
+static void releasePendingNext(struct job **next, int level) {
+	next[0] = (struct job *)pendingFree[level];
+	pendingFree[level] = next;
+}
+
+/* Insert a job into its queues pending skiplist.
+ * Jobs that have been sent to an agent to start aren't candidates anymore */
+
+void addPendingJob(struct job * j) {
+	struct pendingList *pl = &j->queue->pending;
+	struct job **update[JERS_PENDING_MAXLEVEL];
+	struct job **next = pl->head;
+	int level, i;
+
+	if (j->pending_next || j->internal_state &JERS_FLAG_JOB_STARTED)
+		return;
+
+	for (i = pl->level - 1; i >= 0; i--) {
+		while (next[i] && pendingComp(next[i], j) < 0)
+			next = next[i]->pending_next;
+
+		update[i] = next;
+	}
+
+	level = pendingRandomLevel();
+
+	for (i = pl->level; i < level; i++)
+		update[i] = pl->head;
+
+	if (level > pl->level)
+		pl->level = level;
+
+	j->pending_level = level;
+	j->pending_next = allocPendingNext(level);
+
+	for (i = 0; i < level; i++) {
+		j->pending_next[i] = update[i][i];
+		update[i][i] = j;
+	}
+
+	pl->count++;
+}
+
+/* Remove a job from its queues pending skiplist.
+ * The job must still have the queue/priority it was inserted with. */
 
-	r = b->queue->priority - a->queue->priority;
+void removePendingJob(struct job * j) {
+	struct pendingList *pl = &j->queue->pending;
+	struct job **next = pl->head;
 
-	if (r)
-		return r;
+	if (j->pending_next == NULL)
+		return;
+
+	for (int i = pl->level - 1; i >= 0; i--) {
+		while (next[i] && pendingComp(next[i], j) < 0)
+			next = next[i]->pending_next;
 
-	r = b->priority - a->priority;
+		if (i < j->pending_level && next[i] == j)
+			next[i] = j->pending_next[i];
+	}
 
-	if (r)
-		return r;
+	while (pl->level > 0 && pl->head[pl->level - 1] == NULL)
+		pl->level--;
 
-	return (a->jobid - b->jobid);
+	releasePendingNext(j->pending_next, j->pending_level);
+	j->pending_next = NULL;
+	j->pending_level = 0;
+	pl->count--;
 }
 
 void sendStartCmd(struct job * j) {
 	buff_t b;
+	int64_t latency = getTimeMS() - j->pending_ms;
+
+	/* Track the time taken from a job becoming pending to it being started */
+	server.sched_stats.started++;
+	server.sched_stats.latency_total_ms += latency;
+
+	if (latency > server.sched_stats.latency_max_ms)
+		server.sched_stats.latency_max_ms = latency;
 
-	print_msg(JERS_LOG_INFO, "Sending start message for JobID:%-7d Queue:%s QueuePriority:%d Priority:%d", j->jobid, j->queue->name, j->queue->priority, j->priority);
+	print_msg(JERS_LOG_INFO, "Sending start message for JobID:%-7d Queue:%s QueuePriority:%d Priority:%d Latency:%ldms", j->jobid, j->queue->name, j->queue->priority, j->priority, latency);
 
 	initRequest(&b, "START_JOB", 1);
 
@@ -120,139 +232,289 @@ void sendStartCmd(struct job * j) {
 /* Check for any deferred jobs that need to be released */
 
 void releaseDeferred(void) {
-	int64_t released = 0;
-	struct job *j, *tmp;
+	struct job *j;
 	time_t now = time(NULL);
 
-	DL_FOREACH_SAFE2(server.deferred_list, j, tmp, deferred_next) {
+	while (server.deferred.count) {
+		j = server.deferred.heap[0];
+
 		if (now < j->defer_time)
 			break;
 
+		removeDeferredJob(j);
 		j->defer_time = 0;
 		changeJobState(j, JERS_JOB_PENDING, NULL, 0);
-		removeDeferredJob(j);
-		released++;
 	}
+}
+
+/* Deferred jobs are released by a timerfd in the main epoll set, which is
+ * armed for the defer time of the earliest deferred job. */
 
-	if (released)
-		server.candidate_recalc = 1;
+void initDeferTimer(void) {
+	int fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0)
+		error_die("Failed to create deferred job timer: %s", strerror(errno));
+
+	server.deferred.timer.type = DEFER_TIMER;
+	server.deferred.timer.socket = fd;
+	server.deferred.timer.event_fd = server.event_fd;
+	server.deferred.timer.ptr = NULL;
+	server.deferred.timer.events = 0;
+
+	if (pollSetReadable(&server.deferred.timer))
+		error_die("Failed to add deferred job timer to epoll: %s", strerror(errno));
+
+	server.deferred.armed = 0;
+	armDeferTimer();
 }
 
-/* Generate a sorted array of jobs that can be started. */
+void armDeferTimer(void) {
+	struct itimerspec its = {{0}};
+	time_t next = server.deferred.count ? server.deferred.heap[0]->defer_time : 0;
 
-int64_t generateCandidatePool(void) {
-	int64_t total_job_count = server.stats.jobs.pending + server.stats.jobs.deferred + server.stats.jobs.holding;
-	int64_t candidate_count = 0;
-	struct job * j;
-	int64_t start, end;
+	/* Timer not setup yet, or already set for this time */
+	if (server.deferred.timer.type != DEFER_TIMER || next == server.deferred.armed)
+		return;
+
+	/* A zero value disarms the timer. A time in the past fires immediately */
+	its.it_value.tv_sec = next;
+
+	if (timerfd_settime(server.deferred.timer.socket, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to arm deferred job timer: %s", strerror(errno));
+		return;
+	}
+
+	server.deferred.armed = next;
+}
+
+int handleDeferTimer(struct connectionType *connection) {
+	uint64_t expirations;
+
+	if (read(connection->socket, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		print_msg(JERS_LOG_WARNING, "Failed to read deferred job timer: %s", strerror(errno));
 
-	start = getTimeMS();
+	server.deferred.armed = 0;
+	releaseDeferred();
+	armDeferTimer();
+
+	return 0;
+}
+
+/* Generate a priority sorted array of queues. The pending jobs in each queue
+ * are already sorted, so this only needs to be redone when queues are added,
+ * removed or have their priority changed. */
+
+void generateCandidatePool(void) {
+	int64_t queue_count = HASH_COUNT(server.queueTable);
+	int64_t count = 0;
+	struct queue *q;
 
 	print_msg(JERS_LOG_DEBUG, "Regenerating job candidate pool");
 
-	/* Assume we will need to add every non-completed job into this pool at some point.
-	 * We add some additional room so we don't need to realloc constantly */
+	if (server.candidate_pool_size < queue_count) {
+		server.candidate_pool_size = queue_count * 1.5;
+		server.candidate_pool = realloc(server.candidate_pool, sizeof(struct queue *) * server.candidate_pool_size);
+		server.candidate_cursor = realloc(server.candidate_cursor, sizeof(struct job *) * server.candidate_pool_size);
+
+		if (server.candidate_pool == NULL || server.candidate_cursor == NULL)
+			error_die("Failed to allocate memory for candidate pool: %s", strerror(errno));
+	}
+
+	for (q = server.queueTable; q != NULL; q = q->hh.next)
+		server.candidate_pool[count++] = q;
+
+	qsort(server.candidate_pool, count, sizeof(struct queue *), __comp);
+	server.candidate_pool_queues = count;
+	server.candidate_recalc = 0;
+}
+
+/* Return the next job to consider for scheduling, or NULL once all pending jobs
+ * in unblocked queues have been returned. Queues with the same priority have their pending lists
+ * merged, giving the same order as sorting every pending job by queue priority,
+ * job priority and jobid. */
+
+struct job * nextCandidate(struct candidateIter * it) {
+	struct job **cursor = server.candidate_cursor;
+	struct queue **pool = server.candidate_pool;
+
+	while (1) {
+		int64_t best = -1;
+
+		/* Queues blocked from starting anything, or not part of this pass, are skipped */
+		for (int64_t i = it->group; i < it->group_end; i++) {
+			if (cursor[i] && pool[i]->pend_reason == 0 && !pool[i]->sched_skip && (best < 0 || pendingComp(cursor[i], cursor[best]) < 0))
+				best = i;
+		}
+
+		if (best >= 0) {
+			struct job *j = cursor[best];
+			cursor[best] = j->pending_next[0];
+			return j;
+		}
+
+		/* Move onto the next group of queues sharing a priority */
+		it->group = it->group_end;
+
+		if (it->group >= server.candidate_pool_queues)
+			return NULL;
 
-	if (server.candidate_pool_size < total_job_count) {
-		server.candidate_pool_size = total_job_count * 1.5;
-		server.candidate_pool = realloc(server.candidate_pool, sizeof(struct job *) * server.candidate_pool_size);
+		while (it->group_end < server.candidate_pool_queues && pool[it->group_end]->priority == pool[it->group]->priority) {
+			cursor[it->group_end] = pool[it->group_end]->pending.head[0];
+			it->group_end++;
+		}
 	}
+}
+
+/* Return the reason every pending job in a queue is unable to start,
+ * or 0 if the queue is able to start jobs */
+
+static int queuePendReason(struct queue * q) {
+	/* Check the queue limit */
+	if (q->stats.running + q->stats.start_pending >= q->job_limit)
+		return JERS_PEND_QUEUEFULL;
+
+	/* Queue stopped? */
+	if (!(q->state &JERS_QUEUE_FLAG_STARTED))
+		return JERS_PEND_QUEUESTOPPED;
+
+	/* Agent not connected? */
+	if (q->agent == NULL || q->agent->logged_in == 0)
+		return JERS_PEND_AGENTDOWN;
+
+	if (q->agent->recon)
+		return JERS_PEND_RECON;
+
+	return 0;
+}
+
+static void setQueuePendReasons(int reason) {
+	for (int64_t i = 0; i < server.candidate_pool_queues; i++)
+		server.candidate_pool[i]->pend_reason = reason;
+}
+
+/* The pend reason of a job. Queue level blockers are recorded once on the
+ * queue by the scheduler, rather than on every pending job in it. */
+
+int getPendReason(const struct job * j) {
+	if (j->state == JERS_JOB_PENDING && !(j->internal_state &JERS_FLAG_JOB_STARTED) && j->queue->pend_reason)
+		return j->queue->pend_reason;
+
+	return j->pend_reason;
+}
+
+/* Flag a queue as having changed in a way that may allow its jobs to start,
+ * ie. a job became pending or a running job in it finished. */
+
+void schedQueueChanged(struct queue * q) {
+	q->sched_dirty = 1;
+	server.sched_wake = 1;
+}
+
+/* Some of a resource has been released. Wake the queues with jobs
+ * that were waiting on a resource, if this one was waited on. */
 
-	if (server.stats.jobs.pending == 0) {
-		server.candidate_pool_jobs = 0;
-		server.candidate_recalc = 0;
-		return server.candidate_pool_jobs;
+void schedResourceFreed(struct resource * r) {
+	if (!r->waiting)
+		return;
+
+	r->waiting = 0;
+
+	for (struct queue *q = server.queueTable; q; q = q->hh.next) {
+		if (q->res_wait)
+			schedQueueChanged(q);
 	}
+}
 
-	/* Check each job for it's eligibility */
+/* Check every queue on the next pass */
 
-	for (j = server.jobTable; j != NULL; j = j->hh.next) {
-		if (j->internal_state &JERS_FLAG_DELETED)
-			continue;
+void schedWakeAll(void) {
+	server.sched_all = 1;
+	server.sched_wake = 1;
+}
 
-		if (j->state != JERS_JOB_PENDING)
-			continue;
+/* Record the resources a job is short of, so it is retried once they are freed */
 
-		server.candidate_pool[candidate_count++] = j;
+static void waitRes(struct job * j) {
+	for (int i = 0; i < j->res_count; i++) {
+		if (j->req_resources[i].needed > j->req_resources[i].res->count - j->req_resources[i].res->in_use)
+			j->req_resources[i].res->waiting = 1;
 	}
 
-	qsort(server.candidate_pool, candidate_count, sizeof(struct job *), __comp);
-	server.candidate_pool_jobs = candidate_count;
-	server.candidate_recalc = 0;
-	end = getTimeMS();
-	print_msg(JERS_LOG_DEBUG, "Regenerated job candidate pool. Took %ldms", end - start);
-	return server.candidate_pool_jobs;
+	j->queue->res_wait = 1;
 }
 
 /* Main scheduling function
- * - This is started via an event, every server.schedfreq milliseconds.
+ * - This is run from the main loop whenever server.sched_wake is set, and via
+ *   an event every server.schedfreq milliseconds as a safety net.
  *   We will only attempt to release server.sched_max jobs per attempt, to
- *   avoid becoming unresponsive. */
+ *   avoid becoming unresponsive. If we hit that limit the scheduler is woken
+ *   again on the next loop iteration.
+ * - Only queues flagged via schedQueueChanged() are checked, unless a full
+ *   pass was requested, the pool was regenerated or this is the periodic event.
+ *   A pass cut short by a system wide limit makes the next one a full pass.
+ * - Queue level blockers are checked once per queue, with blocked queues
+ *   being skipped entirely. */
 
 void checkJobs(void) {
-	int64_t i = 0;
-	jobid_t checked = 0;
 	jobid_t started = 0;
-	jobid_t jobs_to_start = server.sched_max;
+	jobid_t jobs_to_start = server.sched_max > 0 ? server.sched_max : server.stats.jobs.pending;
 	struct job * j;
+	struct candidateIter it = {0};
+	int full = server.sched_all || server.candidate_recalc;
 
-	/* Don't need to do anything if we are at maximum capacity */
-	if (server.max_run_jobs != UNLIMITED_JOBS && server.stats.jobs.running >= server.max_run_jobs)
-		return;
+	server.sched_wake = 0;
+	server.sched_all = 0;
 
 	if (server.candidate_recalc)
 		generateCandidatePool();
 
-	jobs_to_start = server.candidate_pool_jobs;
+	server.sched_stats.passes++;
 
-	if (server.max_run_jobs != UNLIMITED_JOBS &&
-		jobs_to_start > server.max_run_jobs - server.stats.jobs.running) {
-		jobs_to_start = server.max_run_jobs - server.stats.jobs.running;
+	if (full)
+		server.sched_stats.full_passes++;
+
+	/* Don't need to do anything if we are at maximum capacity */
+	if (server.max_run_jobs != UNLIMITED_JOBS && server.stats.jobs.running >= server.max_run_jobs) {
+		setQueuePendReasons(JERS_PEND_SYSTEMFULL);
+		server.sched_all = 1;
+		return;
 	}
 
 	/* If we are in readonly mode, tag all jobs that would have been eligble to run
 	 * with a readonly pend reason */
 
 	if (unlikely(server.readonly)) {
-		for (i = 0; i < server.candidate_pool_jobs; i++) {
-			checked++;
-			j = server.candidate_pool[i];
-
-			if (j == NULL)
-				continue;
-
-			if (j->state != JERS_JOB_PENDING || j->internal_state &JERS_FLAG_JOB_STARTED)
-				continue;
-
-			j->pend_reason = JERS_PEND_READONLY;
-			continue;
-		}
-
+		setQueuePendReasons(JERS_PEND_READONLY);
+		server.sched_all = 1;
 		return;
 	}
 
-	for (i = 0; i < server.candidate_pool_jobs; i++) {
-		checked++;
-		j = server.candidate_pool[i];
+	if (server.max_run_jobs != UNLIMITED_JOBS &&
+		jobs_to_start > server.max_run_jobs - server.stats.jobs.running) {
+		jobs_to_start = server.max_run_jobs - server.stats.jobs.running;
+	}
 
-		/* We can have gaps in the pool if we've removed a job */
-		if (j == NULL)
-			continue;
+	for (int64_t i = 0; i < server.candidate_pool_queues; i++) {
+		struct queue *q = server.candidate_pool[i];
 
-		if (j->state != JERS_JOB_PENDING || j->internal_state &JERS_FLAG_JOB_STARTED)
+		q->sched_skip = !full && !q->sched_dirty;
+		q->sched_dirty = 0;
+
+		if (q->sched_skip)
 			continue;
 
+		q->res_wait = 0;
+		q->pend_reason = q->pending.count ? queuePendReason(q) : 0;
+	}
+
+	while ((j = nextCandidate(&it))) {
 		j->pend_reason = 0;
 
 		if (server.max_run_jobs != UNLIMITED_JOBS && server.stats.jobs.running + server.stats.jobs.start_pending > server.max_run_jobs) {
-			j->pend_reason = JERS_PEND_SYSTEMFULL;
-			continue;
-		}
-
-		/* Check the queue limit */
-		if (j->queue->stats.running + j->queue->stats.start_pending >= j->queue->job_limit) {
-			j->pend_reason = JERS_PEND_QUEUEFULL;
-			continue;
+			setQueuePendReasons(JERS_PEND_SYSTEMFULL);
+			server.sched_all = 1;
+			break;
 		}
 
 		/* Resources available? */
@@ -260,27 +522,11 @@ void checkJobs(void) {
 			if (checkRes(j)) {
 				/* Not enough of the required resources are available */
 				j->pend_reason = JERS_PEND_NORES;
+				waitRes(j);
 				continue;
 			}
 		}
 
-		/* Queue stopped? */
-		if (!(j->queue->state &JERS_QUEUE_FLAG_STARTED)) {
-			j->pend_reason = JERS_PEND_QUEUESTOPPED;
-			continue;
-		}
-
-		/* Agent not connected? */
-		if (j->queue->agent == NULL || j->queue->agent->logged_in == 0) {
-			j->pend_reason = JERS_PEND_AGENTDOWN;
-			continue;
-		}
-
-		if (j->queue->agent->recon) {
-			j->pend_reason = JERS_PEND_RECON;
-			continue;
-		}
-
 		/* We can start this job! */
 
 		/* Increase all the needed resources */
@@ -291,14 +537,40 @@ void checkJobs(void) {
 		j->internal_state |= JERS_FLAG_JOB_STARTED;
 		j->pend_reason = JERS_PEND_AGENT;
 
+		/* It stays pending until the agent reports it has started, but it
+		 * isn't a candidate anymore. The iterator has already moved past it */
+		removePendingJob(j);
+
 		/* Keep track of the jobs we have attempted to start */
 		j->queue->stats.start_pending++;
 		server.stats.jobs.start_pending++;
 
+		/* Stop looking at this queue if it is now full */
+		if (j->queue->stats.running + j->queue->stats.start_pending >= j->queue->job_limit)
+			j->queue->pend_reason = JERS_PEND_QUEUEFULL;
+
 		/* Started enough jobs for this iteration? */
-		if (++started >= jobs_to_start)
+		if (++started >= jobs_to_start) {
+			/* Pick up where we left off on the next iteration */
+			if (jobs_to_start == (jobid_t)server.sched_max) {
+				server.sched_wake = 1;
+				server.sched_all = full;
+
+				for (int64_t i = 0; i < server.candidate_pool_queues; i++) {
+					if (!server.candidate_pool[i]->sched_skip)
+						server.candidate_pool[i]->sched_dirty = 1;
+				}
+			} else if (server.max_run_jobs != UNLIMITED_JOBS) {
+				/* Hit the system limit, other queues may still be waiting on it */
+				server.sched_all = 1;
+			}
+
 			break;
+		}
 	}
 
+	for (int64_t i = 0; i < server.candidate_pool_queues; i++)
+		server.candidate_pool[i]->sched_skip = 0;
+
 	return;
 }
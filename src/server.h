@@ -67,8 +67,7 @@
 #define DEFAULT_CONFIG_STATEDIR "/var/spool/jers/state"
 #define DEFAULT_CONFIG_BACKGROUNDSAVEMS 30000
 #define DEFAULT_CONFIG_LOGGINGMODE JERS_LOG_DEBUG
-#define DEFAULT_CONFIG_EVENTFREQ 10
-#define DEFAULT_CONFIG_SCHEDFREQ 25
+#define DEFAULT_CONFIG_SCHEDFREQ 1000
 #define DEFAULT_CONFIG_SCHEDMAX 250
 #define DEFAULT_CONFIG_MAXJOBS UNLIMITED_JOBS
 #define DEFAULT_CONFIG_MAXCLEAN 50
@@ -78,8 +77,11 @@
 #define DEFAULT_CONFIG_ACCTSOCKETPATH "/var/run/jers/accounting.socket"
 #define DEFAULT_CONFIG_FLUSHDEFER 1
 #define DEFAULT_CONFIG_FLUSHDEFERMS 5000
+#define DEFAULT_CONFIG_FLUSHGROUPMS 0
+#define DEFAULT_CONFIG_FLUSHGROUPBYTES (1024 * 1024)
 #define DEFAULT_CONFIG_EMAIL_FREQ 5000
 #define DEFAULT_SLOWLOG 50 // Milliseconds
+#define DEFAULT_CONFIG_CLIENTPIPELINE 16
 
 #define GROUP_LIMIT 32
 
@@ -97,6 +99,7 @@ enum jers_object_type {
 typedef struct _jers_object {
 	int type;
 	int64_t revision;
+	int64_t change_seq;	// Global change sequence at the last update
 	int dirty;
 } jers_object;
 
@@ -106,6 +109,84 @@ struct gid_perm {
 	UT_hash_handle hh;
 };
 
+#define JERS_PENDING_MAXLEVEL 16
+
+/* Skiplist of the pending jobs in a queue, ordered by
+ * job priority then jobid */
+struct pendingList {
+	int level;
+	int64_t count;
+	struct job *head[JERS_PENDING_MAXLEVEL];
+};
+
+/* Secondary job indexes - Each index holds a list of the jobs in each
+ * state, indexed by the position of the state bit. A job is linked into
+ * the global state index, its queues index and the index of its uid.
+ * Deleted jobs aren't in any of them */
+#define JOB_STATE_LISTS 7
+
+enum jobLinkType {
+	JOB_LINK_STATE,
+	JOB_LINK_QUEUE,
+	JOB_LINK_UID,
+	JOB_LINK_COUNT
+};
+
+struct jobLink {
+	struct job *prev;
+	struct job *next;
+};
+
+struct jobIndex {
+	struct job *jobs[JOB_STATE_LISTS];
+	int64_t count[JOB_STATE_LISTS];
+};
+
+struct uidIndex {
+	uid_t uid;
+	struct jobIndex index;
+	UT_hash_handle hh;
+};
+
+/* Time indexes - Skiplists of the non-deleted jobs ordered by their
+ * submit, start or finish time, then jobid. Jobs without the time set
+ * aren't in that index */
+#define JERS_TIME_MAXLEVEL 24
+
+enum timeIndexType {
+	TIME_INDEX_SUBMIT,
+	TIME_INDEX_START,
+	TIME_INDEX_FINISH,
+	TIME_INDEX_COUNT
+};
+
+struct timeIndex {
+	int level;
+	int64_t count;
+	struct job *head[JERS_TIME_MAXLEVEL];
+};
+
+struct timeLink {
+	time_t key;		// Time the job is indexed under, 0 if it isn't indexed
+	int level;
+	struct job **next;
+};
+
+/* Longest key or value in the journal manifest, including the terminator */
+#define MANIFEST_FIELD_MAX 64
+
+/* Jobs cleaned up recently, kept so delta queries can report them */
+#define JERS_TOMBSTONE_MAX 16384
+
+struct tombstone {
+	int64_t change_seq;
+	jobid_t jobid;
+
+	/* Kept so the tombstone can be checked against permissions and filters */
+	uid_t uid;
+	char *queue;
+};
+
 struct queue {
 	jers_object obj;
 	char *name;
@@ -124,6 +205,14 @@ struct queue {
 
 	struct jobStats stats;
 
+	struct pendingList pending;
+	int pend_reason; // Set by the scheduler if no jobs in this queue can start
+	char sched_dirty; // Something changed that may allow jobs in this queue to start
+	char sched_skip;  // Not being checked by the current scheduling pass
+	char res_wait;    // Jobs in this queue are waiting on resources
+
+	struct jobIndex index;	// Jobs in this queue
+
 	struct gid_perm *permissions;
 
 	UT_hash_handle hh;
@@ -136,6 +225,7 @@ struct resource {
 	int32_t count;
 	int32_t in_use;
 	int32_t internal_state;
+	char waiting; // A pending job is waiting for this resource to free up
 
 	UT_hash_handle hh;
 };
@@ -193,6 +283,7 @@ struct job {
 	int fail_reason;
 
 	int32_t priority;
+	int64_t pending_ms;	// When the job last became pending, for start latency stats
 	time_t submit_time;
 	time_t start_time;
 	time_t defer_time;
@@ -206,16 +297,64 @@ struct job {
 
 	int32_t internal_state;
 
-	struct indexed_tag *index_table;
+	/* Entries in the index of each indexed tag */
+	struct jobTagHandle *tag_handles;
 
 	UT_hash_handle hh;
-	UT_hash_handle tag_hh;
 
-	/* We keep a sorted linked list of jobs in a deferred state,
-	 * sorted by the defer time. This helps efficiently release
-	 * deferred jobs */
-	struct job *deferred_next;
-	struct job *deferred_prev;
+	/* Links in the state, queue and uid indexes */
+	struct jobLink links[JOB_LINK_COUNT];
+	struct uidIndex *uid_index;
+
+	/* Forward pointers in the time indexes */
+	struct timeLink time_links[TIME_INDEX_COUNT];
+
+	/* Link in the list of jobs ordered by their last change */
+	struct jobLink change_link;
+
+	/* Jobs in a deferred state are kept in a min-heap ordered by
+	 * defer time. This is the jobs position in the heap + 1, or 0 if
+	 * it is not in the heap */
+	int64_t deferred_index;
+
+	/* Forward pointers into the queues pending skiplist.
+	 * NULL if the job is not pending */
+	int pending_level;
+	struct job **pending_next;
+
+	/* Clients blocked waiting for this job to change */
+	struct jobWaiter *waiters;
+};
+
+/* A client blocked in a WAIT_JOB request */
+struct jobWaiter {
+	struct _client *c;
+	struct job *job;
+	int64_t revision;
+
+	/* Monotonic time in milliseconds the wait times out, and the
+	 * position in the deadline heap + 1, or 0 if there is no timeout */
+	int64_t deadline;
+	int64_t heap_index;
+
+	struct jobWaiter *next;
+	struct jobWaiter *prev;
+};
+
+/* Maximum unsent response data a subscriber can have before events
+ * for it are dropped */
+#define JERS_SUBSCRIBE_MAX_PENDING (1024 * 1024)
+
+/* A client streaming state changes for jobs matching a filter */
+struct subscriber {
+	struct _client *c;
+	jersJobFilter filter;
+
+	/* Events dropped since the last one delivered */
+	int64_t dropped;
+
+	struct subscriber *next;
+	struct subscriber *prev;
 };
 
 struct gid_array {
@@ -238,6 +377,10 @@ struct jersServer {
 	int nosave;
 	int daemon;
 
+	/* --convert-journal <in> <out> */
+	char *convert_in;
+	char *convert_out;
+
 	int secret;
 	unsigned char secret_hash[SECRET_HASH_SIZE]; // Hash of secret read from config file
 
@@ -260,7 +403,13 @@ struct jersServer {
 	/* Flags set by signal handlers */
 	volatile sig_atomic_t shutdown;
 
-	int event_freq;
+	/* Set when agents have requests waiting to be processed */
+	int agent_ready;
+
+	int client_pipeline_max; // Maximum requests to run per client, per loop
+
+	int load_threads;	// Threads used to parse the job files at startup, 0 = one per CPU
+	int lazy_load_jobs;	// Only load the header of finished jobs at startup
 
 	int sched_freq;
 	int sched_max;
@@ -278,6 +427,24 @@ struct jersServer {
 	struct queue * queueTable;
 	struct resource * resTable;
 
+	/* Secondary job indexes */
+	struct jobIndex stateIndex;
+	struct uidIndex *uidIndex;
+	struct timeIndex timeIndex[TIME_INDEX_COUNT];
+
+	/* Trigram index of job names, for wildcard searches */
+	char index_job_names;
+	struct nameTrigram *nameTrigrams;
+
+	/* Global change sequence, for delta queries */
+	struct {
+		int64_t seq;		// Last sequence number handed out
+		int64_t floor;		// Oldest sequence a delta query can be answered from
+		struct job *jobs;	// Jobs ordered by their last change, oldest first
+		int64_t tombstone_count;	// Tombstones ever recorded
+		struct tombstone tombstones[JERS_TOMBSTONE_MAX];
+	} changes;
+
 	struct {
 		struct jobStats jobs;
 		struct {
@@ -311,10 +478,22 @@ struct jersServer {
 	int initalising;
 
 	int candidate_recalc;
+	int sched_wake;		// Something changed that may allow jobs to start
+	int sched_all;		// Check every queue, not just the dirty ones
 
+	struct {
+		int64_t started;
+		int64_t latency_total_ms;
+		int64_t latency_max_ms;
+		int64_t passes;
+		int64_t full_passes;
+	} sched_stats;
+
+	/* Queues sorted by priority, with a merge cursor per queue */
 	int64_t candidate_pool_size;
-	int64_t candidate_pool_jobs;
-	struct job ** candidate_pool;
+	int64_t candidate_pool_queues;
+	struct queue ** candidate_pool;
+	struct job ** candidate_cursor;
 
 	int default_job_nice;
 
@@ -341,10 +520,20 @@ struct jersServer {
 
 	struct flush {
 		pid_t pid;
+		char thread;		// Save from a writer thread instead of a forked child
+		struct saveBatch *batch;	// Batch being written by the writer thread
 		char defer;		// 0 == flush after every write. 1 == flush every defer_ms milliseconds
 		int defer_ms;	// milliseconds between state file flushes
 		int dirty;
 		time_t lastflush;
+
+		/* Group commit - Responses to update commands are held until a
+		 * single flush covers all the records written since the last one */
+		char group;
+		int group_ms;		// milliseconds to gather records before flushing
+		int64_t group_bytes;	// flush once this many bytes are waiting
+		int64_t group_start;	// time the first unflushed record was written
+		int64_t pending;	// bytes written since the last flush
 	} flush;
 
 	struct journal {
@@ -356,15 +545,77 @@ struct jersServer {
 		off_t last_commit;
 		off_t record;
 		char datetime[10]; // YYYYMMDD
+		char binary;		// The open journal is in the binary format
+		char format_binary;	// Create new journals in the binary format
+		size_t buffer_size;	// Size of the userspace write buffer, 0 to disable
+		buff_t buffer;		// Records not yet written, ending at 'len'
+		int index_fd;		// Sparse record offset index of the open journal
 	} journal;
 
-	/* A tag can be designated an 'index' tag, which adds jobs to a
+	/* Journal retention - Journals before the one holding the last commit
+	 * are compacted and pruned. The last commit is kept in a manifest.
+	 * Journal names are sized to hold any value read from the manifest */
+	struct retention {
+		int days;		// Remove committed journals older than this many days, 0 to keep them
+		int64_t size;		// Remove the oldest committed journals while they take more than this
+		char compact;		// Trim the preallocated space from committed journals
+		char journal[MANIFEST_FIELD_MAX];	// Journal holding the last commit (YYYYMMDD)
+		off_t offset;		// Offset following the last committed record
+		char compacted[MANIFEST_FIELD_MAX];	// Newest journal that has been compacted
+		char save_journal[MANIFEST_FIELD_MAX];	// Journal and offset the running save will commit
+		off_t save_offset;
+	} retention;
+
+	/* Checkpoint segments - Jobs are saved as checkpoints appended to a
+	 * single segment file, instead of one state file per job */
+	struct checkpoint {
+		char enabled;		// state_format checkpoint
+		char compact;		// The next save writes a full snapshot to a new segment
+		char migrate;		// Remove the per job state files after the next snapshot
+		char remove;		// Remove the segments after the next save (state_format files)
+		int64_t seq;		// Sequence number of the current segment
+		off_t size;		// End of the last valid checkpoint in the current segment
+		off_t full_size;	// Size of the segment after its full snapshot
+		off_t compact_size;	// Segments smaller than this aren't compacted
+		jobid_t *deleted;	// Jobs deleted since the last save
+		int64_t deleted_count;
+		int64_t deleted_size;
+	} checkpoint;
+
+	/* Archive - Finished jobs are moved out of the job table into
+	 * read-only segments once they are older than 'after' hours */
+	struct archive {
+		int after;		// Hours after finishing a job is archived, 0 to disable
+		int64_t seq;		// Sequence number of the newest segment
+		int64_t count;		// Segments in the archive
+		struct archiveSegment *segments;
+		char due;		// Archive jobs as part of the next background save
+	} archive;
+
+	/* Tags can be designated 'index' tags, which adds jobs to a
 	 * table of jobs in a hash table under the tag value */
-	char *index_tag;
-	struct indexed_tag *index_tag_table;
+	int index_tag_count;
+	struct tagIndex *index_tags;
 
-	/* Sorted linked list of deferred jobs */
-	struct job *deferred_list;
+	/* Min-heap of deferred jobs, with a timerfd armed for the earliest one */
+	struct {
+		struct job **heap;
+		int64_t count;
+		int64_t size;
+		time_t armed;
+		struct connectionType timer;
+	} deferred;
+
+	/* Job waiters with a timeout, in a min-heap ordered by deadline */
+	struct {
+		struct jobWaiter **heap;
+		int64_t count;
+		int64_t size;
+		int64_t armed;
+		struct connectionType timer;
+	} waiters;
+
+	struct subscriber *subscribers;
 
 	struct item_list queue_acls;
 };
@@ -372,12 +623,14 @@ struct jersServer {
 #define STATE_DIV_FACTOR 10000
 
 #define JOURNAL_EXTEND_DEFAULT 524288 // 512kb
+#define CHECKPOINT_COMPACT_DEFAULT 67108864 // 64mb
 
 /* The internal_state field is a bitmap of flags */
 #define JERS_FLAG_DELETED  0x0001  // Job has been deleted and will be cleaned up
 #define JERS_FLAG_FLUSHING 0x0002  // Job state is being flushed to disk
 #define JERS_FLAG_JOB_STARTED  0x0004  // Job start message has been sent
 #define JERS_FLAG_JOB_UNKNOWN  0x0008  // Job was running/start sent to agent, agent has since disconnected.
+#define JERS_FLAG_JOB_LAZY     0x0010  // Only the job header is loaded, the rest is read from its state file on demand
 
 #define INITIAL_RESPONSE_SIZE 0x1000
 
@@ -392,6 +645,21 @@ void deleteJob(struct job * j);
 void freeJob(struct job * j);
 struct job * findJob(jobid_t jobid);
 
+void indexJob(struct job *j);
+void unindexJob(struct job *j);
+int64_t jobIndexCount(const struct jobIndex *idx, int states);
+struct uidIndex *findUidIndex(uid_t uid);
+void updateTimeIndexes(struct job *j);
+struct job *timeIndexSeek(int type, time_t from);
+int64_t timeIndexCount(int type, time_t from, time_t to, int64_t limit);
+void jobChanged(struct job *j);
+void jobChangesSince(int64_t since, void (*func)(struct job *, void *), void (*deleted)(const struct tombstone *, void *), void *arg);
+
+void nameIndexAdd(struct job *j);
+void nameIndexDel(struct job *j);
+int64_t nameIndexEstimate(const char *pattern);
+int64_t nameIndexSearch(const char *pattern, jobid_t **jobs);
+
 void addDeferredJob(struct job *j);
 void removeDeferredJob(struct job *j);
 
@@ -411,10 +679,11 @@ int checkQueueACL(client *c, struct queue *q, int required_privs);
 void loadConfig(char * config);
 void freeConfig(void);
 
-int stateSaveCmd(uid_t uid, char * cmd, char * msg, jobid_t jobid, int64_t revision);
+int stateSaveCmd(uid_t uid, char * cmd, msg_t * msg, jobid_t jobid, int64_t revision);
 void stateInit(void);
 int stateLoadJobs(void);
 struct job * stateLoadJob(const char *filename);
+int stateLoadJobDetails(struct job *j);
 int stateLoadQueues(void);
 struct queue * stateLoadQueue(const char *filename);
 int stateLoadResources(void);
@@ -422,11 +691,158 @@ struct resource * stateLoadResource(const char *filename);
 void stateReplayJournal(void);
 void stateSaveToDisk(int block);
 void flush_journal(int force);
+int flushJournalBuffer(void);
+
+/* A state file serialized in memory, waiting to be written to disk */
+struct stateFile {
+	char *filename;
+	char *data;
+	size_t len;
+};
+
+int writeStateFile(struct stateFile *sf);
+void freeStateFile(struct stateFile *sf);
+int64_t groupCommitWait(void);
+void commitJournal(void);
+
+#define JOURNAL_MAGIC "JERSJNL2"
+#define JOURNAL_MAGIC_LEN 8
+
+/* Each journal has a sparse index (journal_index.YYYYMMDD) with an entry
+ * every JOURNAL_INDEX_INTERVAL records, holding the offset that follows
+ * 'record' records. It is only a hint, so it's not synced */
+#define JOURNAL_INDEX_INTERVAL 1024
+
+struct journalIndexEntry {
+	uint64_t record;
+	uint64_t offset;
+};
+
+off_t journalIndexLookup(const char *datetime, int64_t record, int64_t *indexed);
+
+int readJournalManifest(void);
+int writeJournalManifest(void);
+int manifestJournals(char ***journals, size_t *count);
+void manifestStartSave(void);
+void manifestSaveDone(int status);
+off_t compactJournal(const char *journal, const char *datetime);
+void journalRetention(void);
+
+/* A text journal entry */
+struct journalEntry {
+	time_t timestamp;
+	int timestamp_ms;
+	uid_t uid;
+	char command[65];
+	jobid_t jobid;
+	int64_t revision;
+	char *json;
+};
+
+/* A decoded binary journal record */
+struct journalRecord {
+	char marker;
+	uid_t uid;
+	jobid_t jobid;
+	int64_t revision;
+	int64_t timestamp;
+	int has_msg;
+	msg_t msg;
+};
+
+/* Decoding state for varint encoded data */
+struct decoder {
+	const unsigned char *pos;
+	const unsigned char *end;
+	char *strings;		// Decoded strings are copied here, so they can be NULL terminated
+	int error;
+};
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+void encodeVarint(buff_t *b, uint64_t value);
+void encodeSigned(buff_t *b, int64_t value);
+void encodeString(buff_t *b, const char *str);
+uint64_t decodeVarint(struct decoder *d);
+int64_t decodeSigned(struct decoder *d);
+int64_t decodeCount(struct decoder *d);
+char *decodeStringDup(struct decoder *d);
+int journalEncodeRecord(buff_t *b, int64_t timestamp, uid_t uid, const char *cmd, const msg_t *msg, jobid_t jobid, int64_t revision);
+int journalEncodeJSON(buff_t *b, int64_t timestamp, uid_t uid, const char *cmd, const char *json, jobid_t jobid, int64_t revision);
+void journalEncodeEOJ(buff_t *b);
+ssize_t journalDecodeRecord(const char *data, size_t avail, struct journalRecord *r, char **buffer, size_t *buffer_size);
+int journalFieldId(int number);
+ssize_t journalReadRecord(struct journalReader *jr, struct journalRecord *r);
+int journalIsBinary(int fd);
+off_t binaryJournalEnd(const char *journal, off_t *records);
+off_t binaryJournalLastCommit(const char *journal, off_t offset);
+void replayBinaryJournal(const char *journal, off_t offset);
+int parseJournalEntry(char *entry, struct journalEntry *e);
+int convertJournal(const char *in, const char *out);
+
+/* Iterator over the pending jobs of all queues, in scheduling order */
+struct candidateIter {
+	int64_t group;
+	int64_t group_end;
+};
 
 void checkJobs(void);
+void schedQueueChanged(struct queue *q);
+void schedResourceFreed(struct resource *r);
+void schedWakeAll(void);
 void releaseDeferred(void);
+void initDeferTimer(void);
+void armDeferTimer(void);
+int handleDeferTimer(struct connectionType *connection);
+void generateCandidatePool(void);
+struct job * nextCandidate(struct candidateIter *it);
+void addPendingJob(struct job *j);
+void removePendingJob(struct job *j);
+int getPendReason(const struct job *j);
+
+void addJobWaiter(client *c, struct job *j, int64_t revision, int timeout);
+void removeJobWaiter(void *data);
+void wakeJobWaiters(struct job *j);
+void initWaitTimer(void);
+int handleWaitTimer(struct connectionType *connection);
+void freeWaitTimer(void);
+void addSubscriber(client *c, jersJobFilter *filter);
+void removeSubscriber(void *data);
+void notifySubscribers(struct job *j);
 
 int stateDelJob(struct job * j);
+
+/* A checkpoint built by the main thread, with everything needed to write it */
+struct checkpointBatch {
+	buff_t data;		// Encoded checkpoint, header first
+	char path[PATH_MAX];	// Segment it's written to
+	off_t offset;		// Offset in the segment
+	int64_t seq;		// Sequence number of the segment
+	char compact;		// Write a new segment, then remove the older ones
+	char migrate;		// Also remove the per job state files
+	char jobs_dir[PATH_MAX];
+	int64_t removed;	// Job state files removed by the migration
+	char error[PATH_MAX + 64];
+};
+
+void checkpointInit(void);
+int checkpointLoadJobs(void);
+void checkpointDelJob(jobid_t jobid);
+void checkpointStartSave(void);
+void checkpointBuild(struct job **jobs, int64_t count, struct checkpointBatch *cb);
+int checkpointWrite(struct checkpointBatch *cb);
+void checkpointWriteDone(struct checkpointBatch *cb);
+int checkpointSave(struct job **jobs, int64_t count);
+void checkpointSaveDone(int status);
+
+void archiveInit(void);
+void archiveJobs(void);
+void archiveBuild(struct job **jobs, int64_t count, buff_t *segment);
+int archiveWrite(struct job **jobs, int64_t count);
+void archiveStartSave(void);
+int archiveBuildSave(buff_t *segment, char *path);
+int archiveWriteSave(buff_t *segment, const char *path);
+void archiveSaveDone(int status);
+void archiveSearch(const jersJobFilter *s, void (*func)(struct job *, void *), void *arg);
 int stateDelQueue(struct queue * q);
 int stateDelResource(struct resource * r);
 
@@ -439,10 +855,13 @@ int runCommand(client * c);
 int runAgentCommand(agent * a);
 
 void checkEvents(void);
+void checkReadyEvents(void);
+int handleEventTimer(struct connectionType *connection);
 void freeEvents(void);
 
 void initEvents(void);
 
+int canCleanupJob(const struct job *j);
 int cleanupJob(struct job *j);
 int cleanupJobs(uint32_t max_clean);
 int cleanupQueues(uint32_t max_clean);
@@ -38,12 +38,16 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <limits.h>
 #include <errno.h>
 #include <sys/uio.h>
 #include <time.h>
 #include <glob.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 
 #ifdef USE_SYSTEMD
 #include <systemd/sd-daemon.h>
@@ -51,7 +55,9 @@
 
 int resourceStringToResource(const char * string, struct jobResource * res);
 int flushDir(char *path);
+int syncDir(const char *path);
 int flushStateDirs(void);
+static int syncStateDirs(char *failed);
 void createDir(const char *path);
 
 static inline int64_t strtoint64(const char *str, int64_t *result) {
@@ -182,6 +188,111 @@ static int extendJournal(void) {
 	return 0;
 }
 
+static char *journalIndexPath(const char *datetime) {
+	static char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/journal_index.%s", server.state_dir, datetime);
+	return path;
+}
+
+/* Read the index of a journal, returning the number of entries */
+
+static int64_t readJournalIndex(int fd, struct journalIndexEntry **entries) {
+	struct stat buf;
+
+	*entries = NULL;
+
+	if (fstat(fd, &buf) != 0 || buf.st_size < (off_t)sizeof(struct journalIndexEntry))
+		return 0;
+
+	/* Ignore a partially written entry */
+	int64_t count = buf.st_size / sizeof(struct journalIndexEntry);
+
+	*entries = malloc(count * sizeof(struct journalIndexEntry));
+
+	if (*entries == NULL || pread(fd, *entries, count * sizeof(struct journalIndexEntry), 0) != (ssize_t)(count * sizeof(struct journalIndexEntry))) {
+		free(*entries);
+		*entries = NULL;
+		return 0;
+	}
+
+	return count;
+}
+
+/* Open the index of the current journal. Entries past the end of the
+ * journal, left by a crash before the records were written, are dropped */
+
+static void openJournalIndex(void) {
+	struct journalIndexEntry *entries;
+	const char *path = journalIndexPath(server.journal.datetime);
+	int64_t count, keep = 0;
+
+	if (server.journal.index_fd > 0)
+		close(server.journal.index_fd);
+
+	server.journal.index_fd = open(path, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+
+	if (server.journal.index_fd < 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to open journal index %s: %s", path, strerror(errno));
+		return;
+	}
+
+	count = readJournalIndex(server.journal.index_fd, &entries);
+
+	while (keep < count && entries[keep].record <= (uint64_t)server.journal.record && entries[keep].offset <= (uint64_t)server.journal.len)
+		keep++;
+
+	if (ftruncate(server.journal.index_fd, keep * sizeof(struct journalIndexEntry)) != 0)
+		print_msg(JERS_LOG_WARNING, "Failed to truncate journal index %s: %s", path, strerror(errno));
+
+	free(entries);
+}
+
+static void addJournalIndex(off_t record, off_t offset) {
+	struct journalIndexEntry e = {record, offset};
+
+	if (server.journal.index_fd <= 0)
+		return;
+
+	if (write(server.journal.index_fd, &e, sizeof(e)) != sizeof(e))
+		print_msg(JERS_LOG_WARNING, "Failed to write to journal index: %s", strerror(errno));
+}
+
+/* Find the indexed offset closest to, but not past 'record' in a journal.
+ * The number of records before the offset is returned in 'indexed' */
+
+off_t journalIndexLookup(const char *datetime, int64_t record, int64_t *indexed) {
+	struct journalIndexEntry *entries;
+	int64_t count, low = 0, high;
+	off_t offset = 0;
+	int fd = open(journalIndexPath(datetime), O_RDONLY);
+
+	*indexed = 0;
+
+	if (fd < 0)
+		return 0;
+
+	count = readJournalIndex(fd, &entries);
+	close(fd);
+
+	/* Binary search for the last entry at or before the record */
+	high = count - 1;
+
+	while (low <= high) {
+		int64_t mid = low + (high - low) / 2;
+
+		if (entries[mid].record <= (uint64_t)record) {
+			*indexed = entries[mid].record;
+			offset = entries[mid].offset;
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+
+	free(entries);
+	return offset;
+}
+
 int openStateFile(time_t now) {
 	char * state_file = NULL;
 	int fd;
@@ -215,7 +326,13 @@ int openStateFile(time_t now) {
 		if ((fd = open(state_file, flags, mode)) < 0)
 			error_die("Failed to open state file %s: %s", state_file, strerror(errno));
 
-		server.journal.len = findJournalEnd(fd);
+		/* Keep writing in the format the journal was created with */
+		server.journal.binary = journalIsBinary(fd);
+
+		if (server.journal.binary)
+			server.journal.len = binaryJournalEnd(state_file, &server.journal.record);
+		else
+			server.journal.len = findJournalEnd(fd);
 
 		if (lseek(fd, server.journal.len, SEEK_SET) != server.journal.len)
 			error_die("Failed to seek to end of journal %s: %s", state_file, strerror(errno));
@@ -240,6 +357,14 @@ int openStateFile(time_t now) {
 		server.journal.size = 0;
 		server.journal.limit = 0;
 		server.journal.record = 0;
+		server.journal.binary = server.journal.format_binary;
+
+		if (server.journal.binary) {
+			if (write(fd, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != JOURNAL_MAGIC_LEN)
+				error_die("Failed to write to state file %s: %s", state_file, strerror(errno));
+
+			server.journal.len = server.journal.size = JOURNAL_MAGIC_LEN;
+		}
 	}
 
 	free(state_file);
@@ -256,6 +381,60 @@ time_t getRollOver(time_t now) {
 	return mktime(_tm);
 }
 
+/* Write out the iovecs at offset in the journal, handling short writes */
+
+static ssize_t journalWritev(struct iovec *iov, int iovcnt, off_t offset) {
+	ssize_t total = 0;
+
+	while (iovcnt) {
+		ssize_t written = pwritev(server.journal.fd, iov, iovcnt, offset);
+
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		total += written;
+		offset += written;
+
+		/* Skip past the iovecs that were completely written */
+		while (iovcnt && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return total;
+}
+
+/* Write any records held in the journal write buffer to the file.
+ * The buffered records always end at server.journal.len */
+
+int flushJournalBuffer(void) {
+	buff_t *b = &server.journal.buffer;
+
+	if (b->used == 0)
+		return 0;
+
+	struct iovec iov = {b->data, b->used};
+
+	if (journalWritev(&iov, 1, server.journal.len - b->used) == -1) {
+		print_msg(JERS_LOG_CRITICAL, "Failed to write to journal file: %s", strerror(errno));
+		return 1;
+	}
+
+	b->used = 0;
+	return 0;
+}
+
 /* Function to save the current command to disk (& flush it, if in sync mode)
  * Only 'update' command are written, ie command that modify jobs/queues or resources.
  *
@@ -268,20 +447,32 @@ time_t getRollOver(time_t now) {
  *       to this position when these transaction have been commited to disk as the job/queue/resource state files
  *       A '$' will be written to this position as a 'End of journal' marker when rotating the journal files */
 
-int stateSaveCmd(uid_t uid, char * cmd, char * msg, jobid_t jobid, int64_t revision) {
+int stateSaveCmd(uid_t uid, char * cmd, msg_t * msg, jobid_t jobid, int64_t revision) {
 	off_t start_offset;
 	struct timespec now;
-	int len = 0;
 	static time_t next_rollover = 0;
-	static char *msg_string = NULL;
-	static int msg_size = 0;
+	char header[128];
+	struct iovec iov[3];
+	int iovcnt = 0;
+	size_t len = 0;
 
 	clock_gettime(CLOCK_REALTIME_COARSE, &now);
 
 	if (now.tv_sec >= next_rollover) {
 		/* Write the End of journal marker and close the current file */
 		if (server.journal.fd > 0) {
-			write(server.journal.fd, "$\n", 2);
+			flushJournalBuffer();
+
+			if (server.journal.binary) {
+				buff_t eoj;
+				buffNew(&eoj, 64);
+				journalEncodeEOJ(&eoj);
+				pwrite(server.journal.fd, eoj.data, eoj.used, server.journal.len);
+				buffFree(&eoj);
+			} else {
+				pwrite(server.journal.fd, "$\n", 2, server.journal.len);
+			}
+
 			fdatasync(server.journal.fd);
 			close(server.journal.fd);
 		}
@@ -291,6 +482,7 @@ int stateSaveCmd(uid_t uid, char * cmd, char * msg, jobid_t jobid, int64_t revis
 			error_die("Failed to determine next journal rollover time");
 
 		server.journal.fd = openStateFile(now.tv_sec);
+		openJournalIndex();
 
 		if (server.journal.size == 0 || server.journal.len >= server.journal.limit) {
 			if (extendJournal())
@@ -298,32 +490,72 @@ int stateSaveCmd(uid_t uid, char * cmd, char * msg, jobid_t jobid, int64_t revis
 		}
 	}
 
-	/* Save the offset of this new record, so we can write the '*' later if needed */
-	start_offset = lseek(server.journal.fd, 0, SEEK_CUR);
+	if (server.journal.binary) {
+		static buff_t record = {0};
 
-	/* Expand the msg */
-	while (1) {
-		len = snprintf(msg_string, msg_size, " %ld.%03d\t%d\t%s\t%d\t%ld\t%s\n", now.tv_sec, (int)(now.tv_nsec / 1000000), uid, cmd, jobid, revision, msg ? msg :"");
+		if (record.data == NULL)
+			buffNew(&record, 0);
 
-		if (len < msg_size)
-			break;
+		record.used = 0;
+		int64_t timestamp = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+		int rc;
+
+		/* A command that rewrote its request has to have the new one decoded */
+		if (msg && msg->rewritten)
+			rc = journalEncodeJSON(&record, timestamp, uid, cmd, msg->msg_cpy, jobid, revision);
+		else
+			rc = journalEncodeRecord(&record, timestamp, uid, cmd, msg, jobid, revision);
+
+		if (rc != 0)
+			return 1;
+
+		iov[iovcnt++] = (struct iovec){record.data, record.used};
+	} else {
+		/* The header is formatted separately, so the message itself is never copied */
+		int header_len = snprintf(header, sizeof(header), " %ld.%03d\t%d\t%s\t%d\t%ld\t", now.tv_sec, (int)(now.tv_nsec / 1000000), uid, cmd, jobid, revision);
+
+		if (header_len < 0 || header_len >= (int)sizeof(header)) {
+			print_msg(JERS_LOG_CRITICAL, "Failed to format journal record for command %s", cmd);
+			return 1;
+		}
+
+		iov[iovcnt++] = (struct iovec){header, header_len};
 
-		msg_size = len + 64;
-		msg_string = realloc(msg_string, msg_size);
+		if (msg && msg->msg_cpy)
+			iov[iovcnt++] = (struct iovec){msg->msg_cpy, strlen(msg->msg_cpy)};
 
-		if (msg_string == NULL)
-			error_die("Failed to allocate memory for journal message: %s", strerror(errno));
+		iov[iovcnt++] = (struct iovec){"\n", 1};
 	}
 
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
 	/* Do we need to extend the journal? */
-	if (server.journal.len + len >= server.journal.limit) {
+	if (server.journal.len + (off_t)len >= server.journal.limit) {
 		extendJournal();
 		// Even if extendJournal fails, we want to write this message out.
 	}
 
-	len = write(server.journal.fd, msg_string, len);
+	/* The offset of this new record, so we can write the '*' later if needed */
+	start_offset = server.journal.len;
+
+	if (server.journal.record && server.journal.record % JOURNAL_INDEX_INTERVAL == 0)
+		addJournalIndex(server.journal.record, start_offset);
+
+	if (server.journal.buffer_size) {
+		buff_t *b = &server.journal.buffer;
+
+		if (b->data == NULL)
+			buffNew(b, server.journal.buffer_size);
 
-	if (len == -1) {
+		if (b->used + len > server.journal.buffer_size && flushJournalBuffer() != 0)
+			return 1;
+	}
+
+	if (len <= server.journal.buffer_size) {
+		for (int i = 0; i < iovcnt; i++)
+			buffAdd(&server.journal.buffer, iov[i].iov_base, iov[i].iov_len);
+	} else if (journalWritev(iov, iovcnt, start_offset) == -1) {
 		print_msg(JERS_LOG_CRITICAL, "Failed to write to journal file: %s", strerror(errno));
 		return 1;
 	}
@@ -331,16 +563,28 @@ int stateSaveCmd(uid_t uid, char * cmd, char * msg, jobid_t jobid, int64_t revis
 	server.journal.len += len;
 	server.journal.record++;
 
-	if (server.flush.defer == 0)
+	if (server.flush.group) {
+		if (server.flush.dirty++ == 0)
+			server.flush.group_start = getTimeMS();
+
+		server.flush.pending += len;
+	} else if (server.flush.defer == 0) {
+		if (flushJournalBuffer() != 0)
+			return 1;
+
 		fdatasync(server.journal.fd);
-	else
+	} else {
 		server.flush.dirty++;
+	}
 
 	server.journal.last_commit = start_offset;
 	return 0;
 }
 
-off_t checkForLastCommit(char * journal) {
+/* Return the offset following the last commit marker in a journal,
+ * searching from 'offset', or -1 if there isn't one */
+
+off_t checkForLastCommit(char * journal, off_t offset) {
 	FILE * f = NULL;
 	char * line = NULL;
 	size_t line_size = 0;
@@ -352,6 +596,14 @@ off_t checkForLastCommit(char * journal) {
 	if ((f = fopen(journal, "r")) == NULL)
 		error_die("Failed to open journal %s: %s", journal, strerror(errno));
 
+	if (journalIsBinary(fileno(f))) {
+		fclose(f);
+		return binaryJournalLastCommit(journal, offset);
+	}
+
+	if (offset > 0 && fseek(f, offset, SEEK_SET) != 0)
+		error_die("Failed to offset into journal at offset %ld: %s", offset, strerror(errno));
+
 	while ((len = getline(&line, &line_size, f)) != -1) {
 		if (line[0] == '*') {
 			last_commit = ftell(f);
@@ -373,27 +625,18 @@ off_t checkForLastCommit(char * journal) {
 /* Convert a journal entry into a message that can be used for recovering state */
 
 int convertJournalEntry(msg_t *msg, char *entry) {
-	time_t timestamp_s;
-	int timestamp_ms;
-	uid_t uid;
-	char command[65];
-	jobid_t jobid;
-	int64_t revision;
-	int field_count = 0;
-	int msg_offset = 0;
+	struct journalEntry e;
 	char *json;
 	size_t json_len = 0;
 
 	memset(msg, 0, sizeof(msg_t));
 
-	field_count = sscanf(entry, " %ld.%d\t%d\t%64s\t%u\t%ld\t%n", &timestamp_s, &timestamp_ms, (int *)&uid, command, &jobid, &revision, &msg_offset);
-
-	if (field_count != 6) {
+	if (parseJournalEntry(entry, &e) != 0) {
 		print_msg(JERS_LOG_CRITICAL, "Failed entry (len:%ld): %s", strlen(entry), entry);
-		error_die("Failed to load journal entry. Got %d fields, wanted 6\n", field_count);
+		error_die("Failed to load journal entry\n");
 	}
 
-	json = strdup(entry + msg_offset);
+	json = strdup(e.json);
 
 	if (json == NULL)
 		error_die("Failed to copy message for replaying: %s\n", strerror(errno));
@@ -405,10 +648,10 @@ int convertJournalEntry(msg_t *msg, char *entry) {
 			error_die("Failed to load message from journal entry");
 	}
 
-	server.recovery.time = timestamp_s;
-	server.recovery.uid = uid;
-	server.recovery.jobid = jobid;
-	server.recovery.revision = revision;
+	server.recovery.time = e.timestamp;
+	server.recovery.uid = e.uid;
+	server.recovery.jobid = e.jobid;
+	server.recovery.revision = e.revision;
 	server.recovery.buffer = json;
 
 	return json_len;
@@ -431,6 +674,7 @@ void replayTransaction(char * line) {
 	if (convertJournalEntry(&msg, line))
 		replayCommand(&msg);
 
+	free_message(&msg);
 	free(server.recovery.buffer);
 	server.recovery.buffer = NULL;
 
@@ -455,6 +699,13 @@ void replayJournal(char * journal, off_t offset) {
 	if ((f = fopen(journal, "r")) == NULL)
 		error_die("Failed to open journal %s: %s", journal, strerror(errno));
 
+	if (journalIsBinary(fileno(f))) {
+		fclose(f);
+		replayBinaryJournal(journal, offset);
+		print_msg(JERS_LOG_DEBUG, "Finished replaying journal %s", journal);
+		return;
+	}
+
 	if (offset >= 0 && fseek(f, offset, SEEK_SET) != 0)
 		error_die("Failed to offset into journal at offset %ld: %s", offset, strerror(errno));
 
@@ -479,56 +730,82 @@ void replayJournal(char * journal, off_t offset) {
  * in the first position corrisponding to the LAST entry we know made it to disk.
  *
  * We need to scan through the journals, newest first, looking for the last '*'
- * and reapplying any commands after that (potentially across journal files) */
+ * and reapplying any commands after that (potentially across journal files)
+ *
+ * The manifest records the journal and offset of the last successful save,
+ * so only the journals from that point on need to be scanned */
 
 void stateReplayJournal(void) {
 	print_msg(JERS_LOG_INFO, "Recovering state from journal files");
 
 	int rc = 0;
 	size_t i;
-	glob_t journalGlob;
+	glob_t journalGlob = {0};
 	char pattern[PATH_MAX];
+	char **journals = NULL;
+	size_t journal_count = 0;
 	off_t offset = -1;
+	off_t start = 0;
+
+	if (readJournalManifest() == 0) {
+		if (manifestJournals(&journals, &journal_count) == 0) {
+			print_msg(JERS_LOG_INFO, "Last commit from manifest: journal.%s offset %ld", server.retention.journal, server.retention.offset);
+			start = server.retention.offset;
+		} else {
+			print_msg(JERS_LOG_WARNING, "Journal %s from the manifest is missing - Checking all journals", server.retention.journal);
+			server.retention.journal[0] = 0;
+		}
+	}
 
-	sprintf(pattern, "%s/journal.*", server.state_dir);
-	print_msg(JERS_LOG_DEBUG, "Searching: %s", pattern);
+	/* Without a manifest, every journal needs to be checked */
+	if (journals == NULL) {
+		sprintf(pattern, "%s/journal.*", server.state_dir);
+		print_msg(JERS_LOG_DEBUG, "Searching: %s", pattern);
 
-	rc = glob(pattern, 0, NULL, &journalGlob);
+		rc = glob(pattern, 0, NULL, &journalGlob);
 
-	if (rc != 0) {
-		if (rc == GLOB_NOMATCH){
-			print_msg(JERS_LOG_WARNING, "No journals to load from disk.");
-			globfree(&journalGlob);
-			return;
+		if (rc != 0) {
+			if (rc == GLOB_NOMATCH){
+				print_msg(JERS_LOG_WARNING, "No journals to load from disk.");
+				globfree(&journalGlob);
+				return;
+			}
+
+			error_die("Failed to glob() journal files %s : %s\n", pattern, strerror(errno));
 		}
 
-		error_die("Failed to glob() journal files %s : %s\n", pattern, strerror(errno));
+		journals = journalGlob.gl_pathv;
+		journal_count = journalGlob.gl_pathc;
 	}
 
-	if (journalGlob.gl_pathc) {
-		for (i = journalGlob.gl_pathc; i > 0 ; i--) {
-			if ((offset = checkForLastCommit(journalGlob.gl_pathv[i - 1])) >= 0)
-				break;
-		}
+	/* A crash between a save and writing the manifest can leave a later commit */
+	for (i = journal_count; i > 0; i--) {
+		if ((offset = checkForLastCommit(journals[i - 1], i == 1 ? start : 0)) >= 0)
+			break;
 	}
 
-	/* If we didn't find any offset, we need to replay everything we have */
+	/* If we didn't find any offset, we need to replay everything after the manifest */
 	if (offset == -1) {
-		offset = 0;
+		offset = start;
 		i = 1;
 	}
 
 	/* We know which journal to start from, start replaying */
-	if (i > 0) {
-		server.recovery.in_progress = 1;
+	server.recovery.in_progress = 1;
 
-		for (; i <= journalGlob.gl_pathc; i++) {
-			replayJournal(journalGlob.gl_pathv[i - 1], offset);
-			offset = -1;
-		}
+	for (; i <= journal_count; i++) {
+		replayJournal(journals[i - 1], offset);
+		offset = -1;
 	}
 
-	globfree(&journalGlob);
+	if (journals == journalGlob.gl_pathv) {
+		globfree(&journalGlob);
+	} else {
+		for (i = 0; i < journal_count; i++)
+			free(journals[i]);
+
+		free(journals);
+	}
 
 	server.recovery.in_progress = 0;
 	server.recovery.time = 0;
@@ -560,6 +837,11 @@ void stateReplayJournal(void) {
 }
 
 int stateDelJob(struct job * j) {
+	if (server.checkpoint.enabled) {
+		checkpointDelJob(j->jobid);
+		return 0;
+	}
+
 	char filename[PATH_MAX];
 	int directory = j->jobid / STATE_DIV_FACTOR;
 	sprintf(filename, "%s/jobs/%d/%d.job", server.state_dir, directory, j->jobid);
@@ -570,34 +852,91 @@ int stateDelJob(struct job * j) {
 	return 0;
 }
 
-int stateSaveJob(struct job * j) {
-	char filename[PATH_MAX];
+static FILE *openStateFileStream(struct stateFile *sf) {
+	FILE *f = open_memstream(&sf->data, &sf->len);
+
+	if (f == NULL || sf->filename == NULL)
+		error_die("Failed to allocate memory for state file: %s", strerror(errno));
+
+	return f;
+}
+
+void freeStateFile(struct stateFile *sf) {
+	free(sf->filename);
+	free(sf->data);
+}
+
+/* Write out a state file. It's written to a '.new' file first,
+ * which is renamed over the existing file once it's on disk */
+
+int writeStateFile(struct stateFile *sf) {
 	char new_filename[PATH_MAX];
-	FILE * f;
-	int i;
-	int directory = j->jobid / STATE_DIV_FACTOR;
+	size_t written = 0;
+	int fd;
 
-	sprintf(filename, "%s/jobs/%d/%d.job", server.state_dir, directory, j->jobid);
-	sprintf(new_filename, "%s/jobs/%d/%d.new", server.state_dir, directory, j->jobid);
+	snprintf(new_filename, sizeof(new_filename), "%.*s.new", (int)(strrchr(sf->filename, '.') - sf->filename), sf->filename);
 
-	f = fopen(new_filename, "w");
+	fd = open(new_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
 
-	if (f == NULL) {
-		if (errno == ENOENT) {
-			/* Try again after attempting to create the sub directory */
-			char create_dir[PATH_MAX];
-			sprintf(create_dir, "%s/jobs/%d", server.state_dir, directory);
-			createDir(create_dir);
+	if (fd < 0 && errno == ENOENT) {
+		/* Try again after attempting to create the sub directory. Any
+		 * failure shows up when opening the file again */
+		char *create_dir = strdup(sf->filename);
+		mkdir(dirname(create_dir), S_IRWXU|S_IRGRP|S_IXGRP);
+		free(create_dir);
 
-			f = fopen(new_filename, "w");
-		}
+		fd = open(new_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	}
 
-		if (f == NULL) {
-			fprintf(stderr, "Failed to open job file %s : %s\n", filename, strerror(errno));
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open state file %s : %s\n", sf->filename, strerror(errno));
+		return 1;
+	}
+
+	while (written < sf->len) {
+		ssize_t rc = write(fd, sf->data + written, sf->len - written);
+
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+
+			fprintf(stderr, "Failed to write state file %s : %s\n", new_filename, strerror(errno));
+			close(fd);
 			return 1;
 		}
+
+		written += rc;
+	}
+
+	if (fsync(fd)) {
+		close(fd);
+		return 1;
+	}
+
+	close(fd);
+
+	if (rename(new_filename, sf->filename) != 0) {
+		fprintf(stderr, "Failed to rename '%s' to '%s': %s\n", new_filename, sf->filename, strerror(errno));
+		return 1;
 	}
 
+	return 0;
+}
+
+/* Returns 1 if the job can't be saved, as its details couldn't be loaded.
+ * The existing state file is left as it is */
+
+static int serializeJob(struct job * j, struct stateFile *sf) {
+	FILE * f;
+	int i;
+	int directory = j->jobid / STATE_DIV_FACTOR;
+
+	if (stateLoadJobDetails(j) != 0)
+		return 1;
+
+	asprintf(&sf->filename, "%s/jobs/%d/%d.job", server.state_dir, directory, j->jobid);
+	f = openStateFileStream(sf);
+
 	fprintf(f, "# JOB %u\n", j->jobid);
 	fprintf(f, "# SAVETIME %ld\n", time(NULL));
 	fprintf(f, "REVISION %ld\n", j->obj.revision);
@@ -693,40 +1032,27 @@ int stateSaveJob(struct job * j) {
 		fprintf(f, "USAGE_NIVCSW %ld\n", j->usage.ru_nivcsw);
 	}
 
-	if (fflush(f)) {
-		fclose(f);
-		return 1;
-	}
-
-	if (fsync(fileno(f))) {
-		fclose(f);
-		return 1;
-	}
-
 	fclose(f);
 
-	if (rename(new_filename, filename) != 0) {
-		fprintf(stderr, "Failed to rename '%s' to '%s': %s\n", new_filename, filename, strerror(errno));
-		return 1;
-	}
-
 	return 0;
 }
 
-int stateSaveQueue(struct queue * q) {
-	char filename[PATH_MAX];
-	char new_filename[PATH_MAX];
-	FILE * f;
+int stateSaveJob(struct job * j) {
+	struct stateFile sf = {0};
 
-	sprintf(filename, "%s/queues/%s.queue", server.state_dir, q->name);
-	sprintf(new_filename, "%s/queues/%s.new", server.state_dir, q->name);
+	if (serializeJob(j, &sf) != 0)
+		return 0;
+	int rc = writeStateFile(&sf);
+	freeStateFile(&sf);
 
-	f = fopen(new_filename, "w");
+	return rc;
+}
 
-	if (f == NULL) {
-		fprintf(stderr, "Failed to open queue file %s : %s\n", filename, strerror(errno));
-		return 1;
-	}
+static void serializeQueue(struct queue * q, struct stateFile *sf) {
+	FILE * f;
+
+	asprintf(&sf->filename, "%s/queues/%s.queue", server.state_dir, q->name);
+	f = openStateFileStream(sf);
 
 	fprintf(f, "# QUEUE %s\n", q->name);
 	fprintf(f, "# SAVETIME %ld\n", time(NULL));
@@ -745,24 +1071,17 @@ int stateSaveQueue(struct queue * q) {
 	if (server.defaultQueue == q)
 		fprintf(f, "DEFAULT 1\n");
 
-	if (fflush(f)) {
-		fclose(f);
-		return 1;
-	}
-
-	if (fsync(fileno(f))) {
-		fclose(f);
-		return 1;
-	}
-
 	fclose(f);
+}
 
-	if (rename(new_filename, filename) != 0) {
-		fprintf(stderr, "Failed to rename '%s' to '%s': %s\n", new_filename, filename, strerror(errno));
-		return 1;
-	}
+int stateSaveQueue(struct queue * q) {
+	struct stateFile sf = {0};
 
-	return 0;
+	serializeQueue(q, &sf);
+	int rc = writeStateFile(&sf);
+	freeStateFile(&sf);
+
+	return rc;
 }
 
 int stateDelQueue(struct queue * q) {
@@ -775,20 +1094,11 @@ int stateDelQueue(struct queue * q) {
 	return 0;
 }
 
-int stateSaveResource(struct resource * r) {
-	char filename[PATH_MAX];
-	char new_filename[PATH_MAX];
+static void serializeResource(struct resource * r, struct stateFile *sf) {
 	FILE * f;
 
-	sprintf(filename, "%s/resources/%s.resource", server.state_dir, r->name);
-	sprintf(new_filename, "%s/resources/%s.new", server.state_dir, r->name);
-
-	f = fopen(new_filename, "w");
-
-	if (f == NULL) {
-		fprintf(stderr, "Failed to open resource file %s : %s\n", filename, strerror(errno));
-		return 1;
-	}
+	asprintf(&sf->filename, "%s/resources/%s.resource", server.state_dir, r->name);
+	f = openStateFileStream(sf);
 
 	fprintf(f, "# RESOURCE %s\n", r->name);
 	fprintf(f, "# SAVETIME %ld\n", time(NULL));
@@ -796,126 +1106,362 @@ int stateSaveResource(struct resource * r) {
 	fprintf(f, "COUNT %d\n", r->count);
 	fprintf(f, "REVISION %ld\n", r->obj.revision);
 
-	if (fflush(f)) {
-		fclose(f);
+	fclose(f);
+}
+
+int stateSaveResource(struct resource * r) {
+	struct stateFile sf = {0};
+
+	serializeResource(r, &sf);
+	int rc = writeStateFile(&sf);
+	freeStateFile(&sf);
+
+	return rc;
+}
+
+int stateDelResource(struct resource * r) {
+	char filename[PATH_MAX];
+	sprintf(filename, "%s/resources/%s.resource", server.state_dir, r->name);
+
+	if (unlink(filename) != 0)
+		print_msg(JERS_LOG_WARNING, "Failed to remove statefile for deleted resource %s: %s", r->name, strerror(errno));
+
+	return 0;
+}
+
+
+static int writeJobID(const char *filename, jobid_t jobid) {
+	FILE *f = fopen(filename, "w");
+
+	if (f == NULL)
+		return 1;
+
+	fprintf(f, "%u", jobid);
+	fclose(f);
+
+	return 0;
+}
+
+/* Save the current high allocated jobid to disk.
+ * This is loaded on startup as a hint to where
+ * jobid allocation should start from */
+int stateSaveJobID(jobid_t jobid) {
+	char filename[PATH_MAX];
+	sprintf(filename, "%s/jobid", server.state_dir);
+
+	if (writeJobID(filename, jobid) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to open jobid state file for writing '%s' : %s\n", filename, strerror(errno));
 		return 1;
 	}
 
-	if (fsync(fileno(f))) {
+	return 0;
+}
+
+jobid_t stateLoadJobID(void) {
+	jobid_t jobid = 0;
+	char filename[PATH_MAX];
+	char *line = NULL;
+	size_t size = 0;
+
+	sprintf(filename, "%s/jobid", server.state_dir);
+
+	FILE *f = fopen(filename, "r");
+
+	if (f == NULL) {
+		if (errno != ENOENT)
+			print_msg(JERS_LOG_WARNING, "Failed to open jobid file '%s': %s", filename, strerror(errno));
+
+		return 0;
+	}
+
+	/* Only expect to have one line */
+	ssize_t len = getline(&line, &size, f);
+
+	if (len <= 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to read jobid file '%s': %s", filename, strerror(errno));
 		fclose(f);
-		return 1;
+		return 0;
 	}
 
+	jobid = atoi(line);
+
+	free(line);
 	fclose(f);
 
-	if (rename(new_filename, filename) != 0) {
-		fprintf(stderr, "Failed to rename '%s' to '%s': %s\n", new_filename, filename, strerror(errno));
-		return 1;
+	return jobid;
+}
+
+int stateSaveToDiskChild(struct job ** jobs, struct queue ** queues, struct resource ** resources) {
+	int64_t i;
+
+	setproctitle("jersd_state_save");
+
+	print_msg(JERS_LOG_DEBUG, "Starting background save. %ld Jobs %ld Queues %ld Resources",
+		server.flush_jobs, server.flush_queues, server.flush_resources);
+
+	/* Save the start jobid as a hint when the server starts */
+	stateSaveJobID(server.start_jobid);
+
+	/* Save the queues and resources first, to avoid having to handle
+	 * situations where we might have to recover jobs that reference
+	 * queues and resources that don't exist */
+
+	for (i = 0; i < server.flush_resources; i++) {
+		if (stateSaveResource(resources[i]))
+			return 1;
 	}
 
+	for (i = 0; i < server.flush_queues; i++) {
+		if (stateSaveQueue(queues[i]))
+			return 1;
+	}
+
+	if (server.checkpoint.enabled) {
+		if (checkpointSave(jobs, server.flush_jobs))
+			return 1;
+	} else {
+		for (i = 0; i < server.flush_jobs; i++) {
+			if (stateSaveJob(jobs[i]))
+				return 1;
+		}
+	}
+
+	/* Flush any directory we might have touched */
+	if (flushStateDirs())
+		return 1;
+
 	return 0;
 }
 
-int stateDelResource(struct resource * r) {
-	char filename[PATH_MAX];
-	sprintf(filename, "%s/resources/%s.resource", server.state_dir, r->name);
+/* Background saves without fork() - The main thread serializes the dirty
+ * objects into a batch, so each object is captured at a single revision.
+ * The batch is passed to a writer thread through a single producer, single
+ * consumer queue. The writer writes the state files and the journal commit
+ * marker, exactly as the forked child does, then flags the batch as done.
+ *
+ * The writer only uses what's in the batch, apart from the state directory
+ * names which are fixed at startup. It doesn't log either - Errors are kept
+ * in the batch and logged by the main thread, which also makes any updates
+ * to the server state once the batch is done. */
+
+struct saveBatch {
+	struct stateFile *files;
+	int64_t file_count;
+	struct checkpointBatch checkpoint;	// With state_format checkpoint
+	buff_t archive;				// Archive segment, if jobs are being archived
+	char archive_path[PATH_MAX];
+	char jobid_path[PATH_MAX];
+	jobid_t start_jobid;
+	int journal_fd;		// Duplicate of the journal fd, for the commit marker
+	off_t last_commit;
+	char error[PATH_MAX + 128];
+	char warning[PATH_MAX + 128];
+	int status;
+	atomic_int done;
+};
+
+#define SAVE_QUEUE_SIZE 4
+
+static struct {
+	struct saveBatch *batches[SAVE_QUEUE_SIZE];
+	atomic_size_t head;	// Next batch for the writer
+	atomic_size_t tail;	// Next free slot for the main thread
+	sem_t ready;		// Posted when a batch is queued
+	sem_t done;		// Posted when a batch has been written
+	pthread_t thread;
+	int started;
+} saveQueue;
+
+/* Only one save runs at a time, so the queue never fills */
+static void saveQueuePush(struct saveBatch *b) {
+	size_t tail = atomic_load_explicit(&saveQueue.tail, memory_order_relaxed);
+
+	saveQueue.batches[tail % SAVE_QUEUE_SIZE] = b;
+	atomic_store_explicit(&saveQueue.tail, tail + 1, memory_order_release);
+
+	sem_post(&saveQueue.ready);
+}
 
-	if (unlink(filename) != 0)
-		print_msg(JERS_LOG_WARNING, "Failed to remove statefile for deleted resource %s: %s", r->name, strerror(errno));
+static struct saveBatch *saveQueuePop(void) {
+	size_t head = atomic_load_explicit(&saveQueue.head, memory_order_relaxed);
+
+	if (head == atomic_load_explicit(&saveQueue.tail, memory_order_acquire))
+		return NULL;
+
+	struct saveBatch *b = saveQueue.batches[head % SAVE_QUEUE_SIZE];
+	atomic_store_explicit(&saveQueue.head, head + 1, memory_order_release);
+
+	return b;
+}
+
+static int writeSaveBatch(struct saveBatch *b) {
+	char failed[PATH_MAX];
+	int status = 1;
+
+	if (writeJobID(b->jobid_path, b->start_jobid) != 0)
+		snprintf(b->warning, sizeof(b->warning), "Failed to open jobid state file for writing '%s' : %s", b->jobid_path, strerror(errno));
+
+	for (int64_t i = 0; i < b->file_count; i++) {
+		if (writeStateFile(&b->files[i])) {
+			snprintf(b->error, sizeof(b->error), "Failed to write state file %s", b->files[i].filename);
+			goto write_batch_done;
+		}
+	}
+
+	/* Any error is kept in the checkpoint batch */
+	if (b->checkpoint.data.data && checkpointWrite(&b->checkpoint))
+		goto write_batch_done;
+
+	if (syncStateDirs(failed)) {
+		snprintf(b->error, sizeof(b->error), "Failed to flush %s: %s", failed, strerror(errno));
+		goto write_batch_done;
+	}
+
+	/* Mark the journal that we commited all those transactions to disk */
+	if (b->journal_fd >= 0) {
+		if (pwrite(b->journal_fd, "*", 1, b->last_commit) != 1)
+			snprintf(b->warning, sizeof(b->warning), "Background save: Failed to write marker to journal: %s", strerror(errno));
+
+		fdatasync(b->journal_fd);
+	}
+
+	/* Failing to archive doesn't fail the save, the jobs just stay where they are */
+	if (b->archive.data)
+		archiveWriteSave(&b->archive, b->archive_path);
+
+	status = 0;
+
+write_batch_done:
+	if (b->journal_fd >= 0)
+		close(b->journal_fd);
+
+	return status;
+}
+
+static void *saveWriter(void *arg) {
+	UNUSED(arg);
+
+	while (1) {
+		struct saveBatch *b;
+
+		if (sem_wait(&saveQueue.ready) != 0)
+			continue;
+
+		while ((b = saveQueuePop()) != NULL) {
+			b->status = writeSaveBatch(b);
+			atomic_store_explicit(&b->done, 1, memory_order_release);
+			sem_post(&saveQueue.done);
+		}
+	}
 
-	return 0;
+	return NULL;
 }
 
+static void startSaveWriter(void) {
+	sigset_t all, old;
+	int rc;
 
-/* Save the current high allocated jobid to disk.
- * This is loaded on startup as a hint to where
- * jobid allocation should start from */
-int stateSaveJobID(jobid_t jobid) {
-	char filename[PATH_MAX];
-	sprintf(filename, "%s/jobid", server.state_dir);
-
-	FILE *f = fopen(filename, "w");
+	if (sem_init(&saveQueue.ready, 0, 0) != 0 || sem_init(&saveQueue.done, 0, 0) != 0)
+		error_die("Failed to initialise background save semaphores: %s", strerror(errno));
 
-	if (f == NULL) {
-		print_msg(JERS_LOG_WARNING, "Failed to open jobid state file for writing '%s' : %s\n", filename, strerror(errno));
-		return 1;
-	}
+	/* Signals are left to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
 
-	fprintf(f, "%u", jobid);
-	fclose(f);
+	if ((rc = pthread_create(&saveQueue.thread, NULL, saveWriter, NULL)) != 0)
+		error_die("Failed to start background save thread: %s", strerror(rc));
 
-	return 0;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	saveQueue.started = 1;
 }
 
-jobid_t stateLoadJobID(void) {
-	jobid_t jobid = 0;
-	char filename[PATH_MAX];
-	char *line = NULL;
-	size_t size = 0;
+static void queueSaveBatch(struct job **jobs, struct queue **queues, struct resource **resources) {
+	struct saveBatch *b = calloc(1, sizeof(struct saveBatch));
+	int64_t i, start = getTimeMS();
 
-	sprintf(filename, "%s/jobid", server.state_dir);
+	if (!saveQueue.started)
+		startSaveWriter();
 
-	FILE *f = fopen(filename, "r");
+	b->files = malloc(sizeof(struct stateFile) * (server.flush_resources + server.flush_queues + server.flush_jobs + 1));
 
-	if (f == NULL) {
-		if (errno != ENOENT)
-			print_msg(JERS_LOG_WARNING, "Failed to open jobid file '%s': %s", filename, strerror(errno));
+	if (b->files == NULL)
+		error_die("Failed to allocate memory for background save: %s", strerror(errno));
 
-		return 0;
-	}
+	/* Queues and resources first, as with the forked save */
+	for (i = 0; i < server.flush_resources; i++)
+		serializeResource(resources[i], &b->files[b->file_count++]);
 
-	/* Only expect to have one line */
-	ssize_t len = getline(&line, &size, f);
+	for (i = 0; i < server.flush_queues; i++)
+		serializeQueue(queues[i], &b->files[b->file_count++]);
 
-	if (len <= 0) {
-		print_msg(JERS_LOG_WARNING, "Failed to read jobid file '%s': %s", filename, strerror(errno));
-		fclose(f);
-		return 0;
+	if (server.checkpoint.enabled) {
+		checkpointBuild(jobs, server.flush_jobs, &b->checkpoint);
+	} else {
+		for (i = 0; i < server.flush_jobs; i++) {
+			if (serializeJob(jobs[i], &b->files[b->file_count]) == 0)
+				b->file_count++;
+		}
 	}
 
-	jobid = atoi(line);
+	archiveBuildSave(&b->archive, b->archive_path);
 
-	free(line);
-	fclose(f);
+	snprintf(b->jobid_path, sizeof(b->jobid_path), "%s/jobid", server.state_dir);
+	b->start_jobid = server.start_jobid;
+	b->last_commit = server.journal.last_commit;
 
-	return jobid;
-}
+	b->journal_fd = -1;
 
-int stateSaveToDiskChild(struct job ** jobs, struct queue ** queues, struct resource ** resources) {
-	int64_t i;
+	if (server.journal.fd >= 0 && (b->journal_fd = dup(server.journal.fd)) < 0)
+		error_die("Failed to duplicate journal fd for background save: %s", strerror(errno));
 
-	setproctitle("jersd_state_save");
+	print_msg(JERS_LOG_DEBUG, "Serialized background save in %ldms. Jobs:%ld Queues:%ld Resources:%ld",
+		getTimeMS() - start, server.flush_jobs, server.flush_queues, server.flush_resources);
 
-	print_msg(JERS_LOG_DEBUG, "Starting background save. %ld Jobs %ld Queues %ld Resources",
-		server.flush_jobs, server.flush_queues, server.flush_resources);
+	server.flush.batch = b;
+	saveQueuePush(b);
+}
 
-	/* Save the start jobid as a hint when the server starts */
-	stateSaveJobID(server.start_jobid);
+/* Check if the writer thread has finished the current batch. Returns 1 if it has,
+ * with its status in rc in the same form as waitpid() would */
 
-	/* Save the queues and resources first, to avoid having to handle
-	 * situations where we might have to recover jobs that reference
-	 * queues and resources that don't exist */
+static int saveBatchFinished(int block, int *rc) {
+	struct saveBatch *b = server.flush.batch;
 
-	for (i = 0; i < server.flush_resources; i++) {
-		if (stateSaveResource(resources[i]))
-			return 1;
-	}
+	while (!atomic_load_explicit(&b->done, memory_order_acquire)) {
+		if (!block)
+			return 0;
 
-	for (i = 0; i < server.flush_queues; i++) {
-		if (stateSaveQueue(queues[i]))
-			return 1;
+		sem_wait(&saveQueue.done);
 	}
 
-	for (i = 0; i < server.flush_jobs; i++) {
-		if (stateSaveJob(jobs[i]))
-			return 1;
+	while (sem_trywait(&saveQueue.done) == 0);
+
+	*rc = W_EXITCODE(b->status, 0);
+
+	/* Report anything the writer ran into */
+	if (b->error[0])
+		print_msg(JERS_LOG_WARNING, "%s", b->error);
+
+	if (b->warning[0])
+		print_msg(JERS_LOG_WARNING, "%s", b->warning);
+
+	for (int64_t i = 0; i < b->file_count; i++)
+		freeStateFile(&b->files[i]);
+
+	free(b->files);
+
+	if (b->checkpoint.data.data) {
+		checkpointWriteDone(&b->checkpoint);
+		buffFree(&b->checkpoint.data);
 	}
 
-	/* Flush any directory we might have touched */
-	if (flushStateDirs())
-		return 1;
+	if (b->archive.data)
+		buffFree(&b->archive);
 
-	return 0;
+	free(b);
+	server.flush.batch = NULL;
+
+	return 1;
 }
 
 /* This function is responsible for commiting dirty objects to disk.
@@ -935,12 +1481,17 @@ void stateSaveToDisk(int block) {
 	static struct queue ** dirtyQueues = NULL;
 	static struct resource ** dirtyResources = NULL;
 
-	/* If pid is populated we kicked off a save previously */
-	if (server.flush.pid) {
+	/* If pid or batch is populated we kicked off a save previously */
+	if (server.flush.pid || server.flush.batch) {
 		int rc = 0;
 		pid_t retPid = 0;
 
-		if ((retPid = waitpid(server.flush.pid, &rc, block? 0 : WNOHANG)) > 0) {
+		if (server.flush.batch)
+			retPid = saveBatchFinished(block, &rc);
+		else
+			retPid = waitpid(server.flush.pid, &rc, block? 0 : WNOHANG);
+
+		if (retPid > 0) {
 			int status = 0, signo = 0;
 
 			if (WIFEXITED(rc)) {
@@ -1017,6 +1568,10 @@ void stateSaveToDisk(int block) {
 				}
 			}
 
+			checkpointSaveDone(status);
+			manifestSaveDone(status);
+			archiveSaveDone(status);
+
 			/* Clear our active flush counts  */
 			server.flush_jobs = server.flush_queues = server.flush_resources = 0;
 
@@ -1042,7 +1597,7 @@ void stateSaveToDisk(int block) {
 		return;
 	}
 
-	if (server.dirty_jobs == 0 && server.dirty_queues == 0 && server.dirty_resources == 0)
+	if (server.dirty_jobs == 0 && server.dirty_queues == 0 && server.dirty_resources == 0 && !server.archive.due)
 		return;
 
 	if (server.readonly == READONLY_ENOSPACE) {
@@ -1117,6 +1672,24 @@ void stateSaveToDisk(int block) {
 
 	startTime = getTimeMS();
 
+	/* The child marks the last record as committed, so it needs to be in the file */
+	flushJournalBuffer();
+	checkpointStartSave();
+	manifestStartSave();
+	archiveStartSave();
+
+	if (server.flush.thread) {
+		/* Hand the dirty objects to the writer thread instead of forking */
+		queueSaveBatch(dirtyJobs, dirtyQueues, dirtyResources);
+
+		if (block) {
+			print_msg(JERS_LOG_INFO, "Waiting for background save to complete (blocking)");
+			stateSaveToDisk(1);
+		}
+
+		return;
+	}
+
 	server.flush.pid = fork();
 
 	if (server.flush.pid == -1) {
@@ -1140,6 +1713,12 @@ void stateSaveToDisk(int block) {
 				server.flush_jobs, server.flush_queues, server.flush_resources);
 
 			fdatasync(server.journal.fd);
+
+			buff_t segment;
+			char path[PATH_MAX];
+
+			if (archiveBuildSave(&segment, path) && archiveWriteSave(&segment, path) != 0)
+				print_msg(JERS_LOG_WARNING, "Failed to write archive segment %s", path);
 		} else {
 			print_msg(JERS_LOG_WARNING, "Background save: Failed.\n");
 		}
@@ -1174,20 +1753,19 @@ void createDir(const char *path) {
 	return;
 }
 
-/* Flush the specified directory */
-int flushDir(char *path) {
+/* Flush the specified directory, or the directory a file is in. This doesn't
+ * log anything, so it can be used by the background save writer thread */
+int syncDir(const char *path) {
 	struct stat buf;
 	char *temp = NULL;
+	int rc = 0;
 
 	int fd = open(path, O_RDONLY);
 
-	if (fd < 0) {
-		print_msg(JERS_LOG_WARNING, "flushDir: Failed to open %s: %s", path, strerror(errno));
+	if (fd < 0)
 		return 1;
-	}
 
 	if (fstat(fd, &buf) == -1) {
-		print_msg(JERS_LOG_WARNING, "flushDir: Failed to stat() %s: %s", path, strerror(errno));
 		close(fd);
 		return 1;
 	}
@@ -1195,55 +1773,68 @@ int flushDir(char *path) {
 	/* If this is not a directory, strip off the filename */
 	if (!S_ISDIR(buf.st_mode)) {
 		temp = strdup(path);
-		path = dirname(temp);
 
 		close(fd);
+		fd = open(dirname(temp), O_RDONLY);
+		free(temp);
 
-		fd = open(path, O_RDONLY);
-
-		if (fd < 0) {
-			print_msg(JERS_LOG_WARNING, "flushDir: Failed to open directory %s: %s", path, strerror(errno));
-			free(temp);
+		if (fd < 0)
 			return 1;
-		}
 	}
 
-	if (fsync(fd)) {
-		close(fd);
-		free(temp);
-		return 1;
-	}
+	if (fsync(fd))
+		rc = 1;
 
 	close(fd);
 
-	free(temp);
+	return rc;
+}
+
+int flushDir(char *path) {
+	if (syncDir(path) != 0) {
+		print_msg(JERS_LOG_WARNING, "flushDir: Failed to flush %s: %s", path, strerror(errno));
+		return 1;
+	}
+
 	return 0;
 }
 
-/* Flush all the state directories */
-int flushStateDirs(void) {
-	char tmp[PATH_MAX];
+/* Flush all the state directories. On failure, the directory
+ * that couldn't be flushed is left in 'failed' */
+static int syncStateDirs(char *failed) {
 	int highest_dir = server.max_jobid / STATE_DIV_FACTOR;
 	int i;
 
-	if (flushDir(server.state_dir))
+	strcpy(failed, server.state_dir);
+	if (syncDir(failed))
 		return 1;
 
-	sprintf(tmp, "%s/resources", server.state_dir);
-	if (flushDir(tmp))
+	sprintf(failed, "%s/resources", server.state_dir);
+	if (syncDir(failed))
 		return 1;
 
-	sprintf(tmp, "%s/queues", server.state_dir);
-	if (flushDir(tmp))
+	sprintf(failed, "%s/queues", server.state_dir);
+	if (syncDir(failed))
 		return 1;
 
-	int len = sprintf(tmp, "%s/jobs", server.state_dir);
-	if (flushDir(tmp))
+	int len = sprintf(failed, "%s/jobs", server.state_dir);
+	if (syncDir(failed))
 		return 1;
 
 	for (i = 0; i <= highest_dir; i++) {
-		sprintf(tmp + len, "/%d", i);
-	if (flushDir(tmp))
+		sprintf(failed + len, "/%d", i);
+		if (syncDir(failed))
+			return 1;
+	}
+
+	return 0;
+}
+
+int flushStateDirs(void) {
+	char failed[PATH_MAX];
+
+	if (syncStateDirs(failed) != 0) {
+		print_msg(JERS_LOG_WARNING, "flushDir: Failed to flush %s: %s", failed, strerror(errno));
 		return 1;
 	}
 
@@ -1279,6 +1870,9 @@ void stateInit(void) {
 
 	flushStateDirs();
 
+	checkpointInit();
+	archiveInit();
+
 	/* Load the 'high' jobid hint */
 	server.start_jobid = stateLoadJobID();
 }
@@ -1286,29 +1880,104 @@ void stateInit(void) {
 /* Read through the current state files converting the commands
  *  to the appropriate job/queue/res files */
 
-struct job * stateLoadJob(const char * fileName) {
+/* Keys that are only loaded with the details of a job */
+static int isJobDetail(const char *key) {
+	static const char *details[] = {"SHELL", "PRECMD", "POSTCMD", "STDOUT", "STDERR",
+		"ARGC", "ARGV", "ENV_COUNT", "ENV", "TAG_COUNT", NULL};
+
+	if (strncmp(key, "USAGE_", 6) == 0)
+		return 1;
+
+	for (int i = 0; details[i]; i++) {
+		if (strcmp(key, details[i]) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* With lazy loading, only the header of a finished job is loaded. The state
+ * is near the end of the file, so the file is read in one go and checked
+ * for it before parsing. */
+
+static FILE *openJobFile(const char *fileName, int lazy, char **buffer, int *header_only) {
+	*header_only = 0;
+	*buffer = NULL;
+
+	if (!lazy)
+		return fopen(fileName, "r");
+
+	int fd = open(fileName, O_RDONLY);
+	struct stat st;
+	char *data;
+	FILE *f;
+
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0 || (data = malloc(st.st_size + 1)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	ssize_t len = read(fd, data, st.st_size);
+	close(fd);
+
+	if (len < 0) {
+		free(data);
+		return NULL;
+	}
+
+	data[len] = '\0';
+
+	char *state = memmem(data, len, "\nSTATE ", 7);
+
+	if (state) {
+		int s = atoi(state + 7);
+		*header_only = (s == JERS_JOB_COMPLETED || s == JERS_JOB_EXITED);
+	}
+
+	if ((f = fmemopen(data, len ? len : 1, "r")) == NULL) {
+		free(data);
+		return NULL;
+	}
+
+	*buffer = data;
+	return f;
+}
+
+/* Parse a job state file. If the file can't be loaded, either give up or
+ * just return NULL when 'fatal' is 0 */
+
+static struct job *parseJobFile(const char *fileName, int lazy, int fatal) {
 	FILE * f = NULL;
 	char * line = NULL;
 	size_t line_size = 0;
 	ssize_t len;
 	jobid_t jobid = 0;
 	char * temp;
+	char * buffer = NULL;
+	int header_only = 0;
+	struct job * j = NULL;
+	char error[PATH_MAX + 128];
 
-	f = fopen(fileName, "r");
+	f = openJobFile(fileName, lazy, &buffer, &header_only);
 
 	if (!f) {
-		error_die("Failed to open job file %s: %s\n", fileName, strerror(errno));
+		snprintf(error, sizeof(error), "Failed to open job file %s: %s", fileName, strerror(errno));
+		goto parse_error;
 	}
 
 	temp = strrchr(fileName, '/');
 
 	if (temp == NULL) {
-		error_die("Failed to determine jobid from filename %s", fileName);
+		snprintf(error, sizeof(error), "Failed to determine jobid from filename %s", fileName);
+		goto parse_error;
 	}
 
 	jobid = atoi(temp + 1); // + 1 to move past the '/'
 
-	struct job * j = calloc(sizeof(struct job), 1);
+	j = calloc(sizeof(struct job), 1);
 	j->jobid = jobid;
 	j->obj.type = JERS_OBJECT_JOB;
 
@@ -1320,19 +1989,25 @@ struct job * stateLoadJob(const char * fileName) {
 		if (line[len - 1] == '\n')
 			line[len - 1] = '\0';
 
-		if (loadKeyValue(line, &key, &value, &index))
-			error_die("Failed to parse job file: %s", fileName);
+		if (loadKeyValue(line, &key, &value, &index)) {
+			snprintf(error, sizeof(error), "Failed to parse job file: %s", fileName);
+			goto parse_error;
+		}
 
 		if (!key || !value)
 			continue;
 
+		if (header_only && isJobDetail(key))
+			continue;
+
 		if (strcmp(key, "JOBNAME") == 0) {
 			j->jobname = strdup(value);
 		} else if (strcmp(key, "QUEUENAME") == 0) {
 			j->queue = findQueue(value);
 
 			if (!j->queue) {
-				error_die("Error loading jobid %d - Queue '%s' does not exist", jobid, value);
+				snprintf(error, sizeof(error), "Error loading jobid %d - Queue '%s' does not exist", jobid, value);
+				goto parse_error;
 			}
 		} else if (strcmp(key, "SHELL") == 0) {
 			j->shell = strdup(value);
@@ -1346,21 +2021,38 @@ struct job * stateLoadJob(const char * fileName) {
 			j->stderr = strdup(value);
 		} else if (strcmp(key, "ARGC") == 0) {
 			j->argc = atoi(value);
-			j->argv = malloc(sizeof(char *) * j->argc);
+			j->argv = calloc(j->argc, sizeof(char *));
 		} else if (strcmp(key, "ARGV") == 0) {
 			j->argv[index] = strdup(value);
 		} else if (strcmp(key, "ENV_COUNT") == 0) {
 			j->env_count = atoi(value);
-			j->envs = malloc (sizeof(char *) * j->env_count);
+			j->envs = calloc(j->env_count, sizeof(char *));
 		} else if (strcmp(key, "ENV") == 0) {
 			j->envs[index] = strdup(value);
 		}else if (strcmp(key, "TAG_COUNT") == 0) {
 			j->tag_count = atoi(value);
-			j->tags = malloc (sizeof(key_val_t) * j->tag_count);
+			j->tags = calloc(j->tag_count, sizeof(key_val_t));
 		} else if (strcmp(key, "TAG") == 0) {
 			/* A tag itself is a key value pair seperated by a tab*/
 			char * tag_key = value;
 			char * tag_value = strchr(value, '\t');
+
+			if (header_only) {
+				/* Only the indexed tags are kept, so the job can be added to the indexes */
+				if (tag_value == NULL)
+					continue;
+
+				*tag_value = '\0';
+				int indexed = indexTagPosition(tag_key);
+				*tag_value = '\t';
+
+				if (indexed < 0)
+					continue;
+
+				j->tags = realloc(j->tags, sizeof(key_val_t) * (j->tag_count + 1));
+				index = j->tag_count++;
+			}
+
 			if (tag_value != NULL) {
 				*tag_value = '\0';
 				tag_value++;
@@ -1376,7 +2068,8 @@ struct job * stateLoadJob(const char * fileName) {
 			j->req_resources = malloc(sizeof(struct jobResource) * j->res_count);
 		} else if (strcmp(key, "RES") == 0) {
 			if (resourceStringToResource(value, &j->req_resources[index]) != 0) {
-				error_die("Invalid resource encountered for job %d\n", j->jobid);
+				snprintf(error, sizeof(error), "Invalid resource encountered for job %d", j->jobid);
+				goto parse_error;
 			}
 		} else if (strcmp(key, "UID") == 0) {
 			j->uid = atoi(value);
@@ -1430,20 +2123,140 @@ struct job * stateLoadJob(const char * fileName) {
 	}
 
 	if (len == -1 && feof(f) == 0) {
-		error_die("Error reading job file %s:%s\n", fileName, strerror(errno));
+		snprintf(error, sizeof(error), "Error reading job file %s:%s", fileName, strerror(errno));
+		goto parse_error;
 	}
 
 	if (j->queue == NULL) {
-		error_die("Error loading job %d from file - No queue specified", j->jobid);
+		snprintf(error, sizeof(error), "Error loading job %d from file - No queue specified", j->jobid);
+		goto parse_error;
 	}
 
 	if (j->state == 0)
 		j->state = JERS_JOB_PENDING;
 
+	if (header_only)
+		j->internal_state |= JERS_FLAG_JOB_LAZY;
+
 	free(line);
 	fclose(f);
+	free(buffer);
 
 	return j;
+
+parse_error:
+	if (fatal)
+		error_die("%s", error);
+
+	print_msg(JERS_LOG_WARNING, "%s", error);
+
+	free(line);
+	free(buffer);
+
+	if (f)
+		fclose(f);
+
+	if (j)
+		freeJob(j);
+
+	return NULL;
+}
+
+struct job * stateLoadJob(const char * fileName) {
+	return parseJobFile(fileName, server.lazy_load_jobs && !server.checkpoint.enabled, 1);
+}
+
+/* Read the details of a lazily loaded job from its state file. The file is
+ * only rewritten after the details are loaded, so it is still current.
+ * Returns 1 if the file couldn't be loaded. The job is left with just its
+ * header, and loading is tried again the next time the details are needed. */
+
+int stateLoadJobDetails(struct job *j) {
+	char filename[PATH_MAX];
+
+	if (!(j->internal_state &JERS_FLAG_JOB_LAZY))
+		return 0;
+
+	snprintf(filename, sizeof(filename), "%s/jobs/%d/%d.job", server.state_dir, j->jobid / STATE_DIV_FACTOR, j->jobid);
+
+	struct job *full = parseJobFile(filename, 0, 0);
+
+	if (full == NULL) {
+		print_msg(JERS_LOG_WARNING, "Failed to load the details of job %d - Only its header is available", j->jobid);
+		return 1;
+	}
+
+	j->shell = full->shell;
+	j->pre_cmd = full->pre_cmd;
+	j->post_cmd = full->post_cmd;
+	j->stdout = full->stdout;
+	j->stderr = full->stderr;
+
+	j->argc = full->argc;
+	j->argv = full->argv;
+	j->env_count = full->env_count;
+	j->envs = full->envs;
+
+	/* Replace the indexed tags with the full set. The indexes keep their own copy of the values */
+	freeStringMap(j->tag_count, &j->tags);
+	j->tag_count = full->tag_count;
+	j->tags = full->tags;
+
+	memcpy(&j->usage, &full->usage, sizeof(struct rusage));
+
+	full->shell = full->pre_cmd = full->post_cmd = full->stdout = full->stderr = NULL;
+	full->argc = full->env_count = full->tag_count = 0;
+	full->argv = full->envs = NULL;
+	full->tags = NULL;
+	freeJob(full);
+
+	j->internal_state &= ~JERS_FLAG_JOB_LAZY;
+
+	return 0;
+}
+
+/* Job files are parsed by a pool of threads at startup. Each thread claims
+ * a batch of files at a time, storing the parsed job in the slot matching
+ * its file. Parsing only reads the queue and resource tables. */
+
+#define LOAD_BATCH 256
+#define LOAD_THREADS_MAX 16
+
+struct jobLoader {
+	glob_t *files;
+	struct job **jobs;
+	atomic_size_t next;
+};
+
+static void *jobLoadWorker(void *arg) {
+	struct jobLoader *loader = arg;
+	size_t count = loader->files->gl_pathc;
+	size_t start;
+
+	while ((start = atomic_fetch_add(&loader->next, LOAD_BATCH)) < count) {
+		size_t end = start + LOAD_BATCH < count ? start + LOAD_BATCH : count;
+
+		for (size_t i = start; i < end; i++)
+			loader->jobs[i] = stateLoadJob(loader->files->gl_pathv[i]);
+	}
+
+	return NULL;
+}
+
+static int loadThreads(size_t files) {
+	long threads = server.load_threads;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (threads > LOAD_THREADS_MAX)
+		threads = LOAD_THREADS_MAX;
+
+	/* No point starting threads that won't get a batch */
+	if ((size_t)threads > files / LOAD_BATCH + 1)
+		threads = files / LOAD_BATCH + 1;
+
+	return threads > 0 ? threads : 1;
 }
 
 int stateLoadJobs(void) {
@@ -1456,10 +2269,34 @@ int stateLoadJobs(void) {
 	sd_notify(0, "STATUS=Loading jobs...");
 #endif
 
+	if (checkpointLoadJobs() >= 0) {
+		if (!server.checkpoint.enabled) {
+			/* Switching back to state files. Save every job to its
+			 * own file, then remove the checkpoint segments */
+			for (struct job *j = server.jobTable; j; j = j->hh.next)
+				j->obj.dirty = 1;
+
+			server.dirty_jobs = 1;
+			server.checkpoint.remove = 1;
+		}
+
+		return 0;
+	}
+
+	if (server.checkpoint.enabled) {
+		/* No checkpoint segment yet. The first save writes a snapshot
+		 * of the jobs loaded from the state files, then removes them */
+		server.checkpoint.compact = 1;
+		server.checkpoint.migrate = 1;
+		server.dirty_jobs = 1;
+	}
+
 	sprintf(pattern, "%s/jobs/*/*.job", server.state_dir);
 
 	print_msg(JERS_LOG_INFO, "Loading jobs from %s\n", pattern);
 
+	int64_t start = getTimeMS();
+
 	rc = glob(pattern, 0, NULL, &jobFiles);
 
 	if (rc != 0) {
@@ -1472,15 +2309,66 @@ int stateLoadJobs(void) {
 		error_die("Failed to glob() job files from %s : %s\n", pattern, strerror(errno));
 	}
 
-	print_msg(JERS_LOG_INFO, "Loading %ld jobs from disk", jobFiles.gl_pathc);
+	int64_t glob_ms = getTimeMS() - start;
+	int threads = loadThreads(jobFiles.gl_pathc);
+
+	print_msg(JERS_LOG_INFO, "Loading %ld jobs from disk. Found files in %ldms, parsing with %d threads", jobFiles.gl_pathc, glob_ms, threads);
+
+#ifdef USE_SYSTEMD
+	sd_notifyf(0, "STATUS=Loading jobs - Parsing %ld job files with %d threads...", jobFiles.gl_pathc, threads);
+#endif
+
+	/* Parse the files into detached jobs in parallel */
+	struct jobLoader loader = {&jobFiles, malloc(sizeof(struct job *) * jobFiles.gl_pathc), 0};
+	pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+	int started = 0;
+
+	if (loader.jobs == NULL || workers == NULL)
+		error_die("Failed to allocate memory to load jobs: %s", strerror(errno));
+
+	start = getTimeMS();
+
+	for (started = 0; started < threads - 1; started++) {
+		if ((rc = pthread_create(&workers[started], NULL, jobLoadWorker, &loader)) != 0) {
+			print_msg(JERS_LOG_WARNING, "Failed to start job loading thread: %s", strerror(rc));
+			break;
+		}
+	}
+
+	/* The main thread parses files as well, then waits for the workers */
+	jobLoadWorker(&loader);
+
+	for (i = 0; i < (size_t)started; i++)
+		pthread_join(workers[i], NULL);
+
+	int64_t parse_ms = getTimeMS() - start;
+
+#ifdef USE_SYSTEMD
+	sd_notifyf(0, "STATUS=Loading jobs - Parsed %ld job files in %ldms, adding jobs...", jobFiles.gl_pathc, parse_ms);
+#endif
+
+	/* Then add them to the job table, index and counters in order */
+	start = getTimeMS();
+
+	size_t lazy = 0;
 
 	for (i = 0; i < jobFiles.gl_pathc; i++) {
-		struct job * j = stateLoadJob(jobFiles.gl_pathv[i]);
-		addJob(j, 0);
+		if (loader.jobs[i]->internal_state &JERS_FLAG_JOB_LAZY)
+			lazy++;
+
+		addJob(loader.jobs[i], 0);
 	}
 
-	print_msg(JERS_LOG_INFO, "Loaded %ld jobs", jobFiles.gl_pathc);
+	int64_t add_ms = getTimeMS() - start;
+
+	print_msg(JERS_LOG_INFO, "Loaded %ld jobs (%ld header only). Find:%ldms Parse:%ldms Add:%ldms", jobFiles.gl_pathc, lazy, glob_ms, parse_ms, add_ms);
+
+#ifdef USE_SYSTEMD
+	sd_notifyf(0, "STATUS=Loaded %ld jobs - Find:%ldms Parse:%ldms Add:%ldms", jobFiles.gl_pathc, glob_ms, parse_ms, add_ms);
+#endif
 
+	free(loader.jobs);
+	free(workers);
 	globfree(&jobFiles);
 	return 0;
 }
@@ -1732,11 +2620,13 @@ static inline void decrement_state(struct job *j) {
 		case JERS_JOB_RUNNING:
 			server.stats.jobs.running--;
 			j->queue->stats.running--;
+			schedQueueChanged(j->queue);
 			break;
 
 		case JERS_JOB_PENDING:
 			server.stats.jobs.pending--;
 			j->queue->stats.pending--;
+			removePendingJob(j);
 			break;
 
 		case JERS_JOB_DEFERRED:
@@ -1783,19 +2673,19 @@ static inline void increment_state(struct job *j) {
 		case JERS_JOB_PENDING:
 			server.stats.jobs.pending++;
 			j->queue->stats.pending++;
-			server.candidate_recalc = 1;
+			addPendingJob(j);
+			j->pending_ms = getTimeMS();
+			schedQueueChanged(j->queue);
 			break;
 
 		case JERS_JOB_DEFERRED:
 			server.stats.jobs.deferred++;
 			j->queue->stats.deferred++;
-			server.candidate_recalc = 1;
 			break;
 
 		case JERS_JOB_HOLDING:
 			server.stats.jobs.holding++;
 			j->queue->stats.holding++;
-			server.candidate_recalc = 1;
 			break;
 
 		case JERS_JOB_COMPLETED:
@@ -1811,6 +2701,7 @@ static inline void increment_state(struct job *j) {
 			if (j->internal_state &JERS_FLAG_JOB_STARTED) {
 				server.stats.jobs.start_pending--;
 				j->queue->stats.start_pending--;
+				schedQueueChanged(j->queue);
 			}
 
 			break;
@@ -1825,14 +2716,18 @@ void changeJobState(struct job *j, int new_state, struct queue *new_queue, int d
 	if (j->state != new_state || new_queue != NULL) {
 		/* Update the job state and appropriate counts */
 		decrement_state(j);
+		unindexJob(j);
 
 		if (new_queue != NULL)
 			j->queue = new_queue;
 
 		j->state = new_state;
 		increment_state(j);
+		indexJob(j);
 	}
 
+	updateTimeIndexes(j);
+
 	updateObject(&j->obj, dirty);
 
 	/* Add the email to the pending email list if required */
@@ -1842,6 +2737,20 @@ void changeJobState(struct job *j, int new_state, struct queue *new_queue, int d
 
 void updateObject(jers_object * obj, int dirty) {
 	obj->revision++;
+	obj->change_seq = ++server.changes.seq;
+
+	/* Wake anyone waiting on, or subscribed to, this job changing */
+	if (obj->type == JERS_OBJECT_JOB) {
+		struct job *j = (struct job *)((char *)obj - offsetof(struct job, obj));
+
+		jobChanged(j);
+
+		if (j->waiters)
+			wakeJobWaiters(j);
+
+		if (server.subscribers)
+			notifySubscribers(j);
+	}
 
 	if (dirty) {
 		obj->dirty = 1;
@@ -1858,7 +2767,32 @@ void flush_journal(int force) {
 	if (!force && !server.flush.dirty)
 		return;
 
+	flushJournalBuffer();
 	fdatasync(server.journal.fd);
 	server.flush.lastflush = time(NULL);
 	server.flush.dirty = 0;
+	server.flush.pending = 0;
+}
+
+/* Return the number of milliseconds until the next group commit is due,
+ * or -1 if nothing is waiting to be committed */
+
+int64_t groupCommitWait(void) {
+	if (!server.flush.dirty)
+		return -1;
+
+	if (server.flush.pending >= server.flush.group_bytes)
+		return 0;
+
+	int64_t wait = server.flush.group_start + server.flush.group_ms - getTimeMS();
+
+	return wait > 0 ? wait : 0;
+}
+
+/* Flush every journal record written since the last commit with a single
+ * fdatasync, then release the client responses that were waiting on them */
+
+void commitJournal(void) {
+	flush_journal(0);
+	releaseHeldClients();
 }
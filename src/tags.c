@@ -28,32 +28,89 @@
  */
 
 #include <server.h>
+#include <errno.h>
+#include <string.h>
 
-/* Index the passed in job */
-void addIndexTag(struct job *j, char *tag_value) {
+/* Add a tag key to the list of indexed tags, returning non-zero if it's a duplicate */
+int addIndexTagKey(const char *key) {
+	if (indexTagPosition(key) >= 0)
+		return 1;
+
+	server.index_tags = realloc(server.index_tags, sizeof(struct tagIndex) * (server.index_tag_count + 1));
+
+	if (server.index_tags == NULL)
+		error_die("Failed to allocate memory for index tags: %s", strerror(errno));
+
+	server.index_tags[server.index_tag_count].key = strdup(key);
+	server.index_tags[server.index_tag_count].table = NULL;
+	server.index_tag_count++;
+
+	return 0;
+}
+
+/* Return the position of an indexed tag key, or -1 if it isn't indexed */
+int indexTagPosition(const char *key) {
+	for (int i = 0; i < server.index_tag_count; i++) {
+		if (strcmp(server.index_tags[i].key, key) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Index the passed in job under the tag at position idx */
+void addIndexTag(struct job *j, int idx, char *tag_value) {
 	/* Is this tag value already in the table? */
 	struct indexed_tag *t = NULL;
+	struct tagIndex *ti = &server.index_tags[idx];
 
-	HASH_FIND_STR(server.index_tag_table, tag_value, t);
+	if (j->tag_handles == NULL) {
+		j->tag_handles = calloc(server.index_tag_count, sizeof(struct jobTagHandle));
+
+		if (j->tag_handles == NULL)
+			error_die("Failed to allocate memory for job tag index: %s", strerror(errno));
+	}
+
+	HASH_FIND_STR(ti->table, tag_value, t);
 
 	if (t == NULL) {
 		/* Create the values entry in the tag table */
 		t = calloc(1, sizeof(struct indexed_tag));
 		t->value = strdup(tag_value);
 
-		HASH_ADD_STR(server.index_tag_table, value, t);
+		HASH_ADD_STR(ti->table, value, t);
 	}
 
 	/* Add this job to the values job table */
-	HASH_ADD(tag_hh, t->jobs, jobid, sizeof(int), j);
-	j->index_table = t;
+	struct jobTagHandle *h = &j->tag_handles[idx];
+	h->job = j;
+	h->value = t;
+	HASH_ADD_PTR(t->jobs, job, h);
+}
+
+/* Remove a job from the tag index table at position idx */
+void delIndexTag(struct job *j, int idx) {
+	if (j->tag_handles == NULL || j->tag_handles[idx].value == NULL)
+		return;
+
+	HASH_DELETE(hh, j->tag_handles[idx].value->jobs, &j->tag_handles[idx]);
+	j->tag_handles[idx].value = NULL;
+}
+
+/* Add a job to the index of each indexed tag it has */
+void indexJobTags(struct job *j) {
+	for (int i = 0; i < j->tag_count; i++) {
+		int idx = indexTagPosition(j->tags[i].key);
+
+		if (idx >= 0 && j->tags[i].value)
+			addIndexTag(j, idx, j->tags[i].value);
+	}
 }
 
-/* Remove a job from the tag index table */
-void delIndexTag(struct job *j) {
-	if (j->index_table == NULL)
+void unindexJobTags(struct job *j) {
+	if (j->tag_handles == NULL)
 		return;
 
-	HASH_DELETE(tag_hh, j->index_table->jobs, j);
-	j->index_table = NULL;
+	for (int i = 0; i < server.index_tag_count; i++)
+		delIndexTag(j, i);
 }
@@ -31,13 +31,33 @@
 
 #include <server.h>
 
+/* Each indexed tag key has a hash table of the values it has been given,
+ * with each value holding a table of the jobs with that value */
+struct tagIndex {
+	char *key;
+	struct indexed_tag *table;
+};
+
 struct indexed_tag {
 	char *value;
-	struct job *jobs;
+	struct jobTagHandle *jobs;
+
+	UT_hash_handle hh;
+};
+
+/* A jobs entry in one of the tag indexes. Jobs have one for each indexed
+ * tag, in the same order as server.index_tags */
+struct jobTagHandle {
+	struct job *job;
+	struct indexed_tag *value;	// NULL if the job doesn't have the tag
 
 	UT_hash_handle hh;
 };
 
-void addIndexTag(struct job *j, char *tag_value);
-void delIndexTag(struct job *j);
+int addIndexTagKey(const char *key);
+int indexTagPosition(const char *key);
+void addIndexTag(struct job *j, int idx, char *tag_value);
+void delIndexTag(struct job *j, int idx);
+void indexJobTags(struct job *j);
+void unindexJobTags(struct job *j);
 #endif
@@ -0,0 +1,362 @@
+/* Copyright (c) 2020 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <server.h>
+#include <commands.h>
+#include <json.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <utlist.h>
+
+/* Clients blocked in a WAIT_JOB request are attached to the job they are
+ * waiting on, and are woken when the jobs revision changes. Waiters with a
+ * timeout are also kept in a min-heap ordered by deadline, with a timerfd in
+ * the main epoll set armed for the earliest one. */
+
+static int64_t waitTimeMS(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (tp.tv_sec * 1000) + (tp.tv_nsec / 1000000);
+}
+
+static inline void waiterSet(int64_t pos, struct jobWaiter *w) {
+	server.waiters.heap[pos] = w;
+	w->heap_index = pos + 1;
+}
+
+static void waiterSiftUp(int64_t pos) {
+	struct jobWaiter *w = server.waiters.heap[pos];
+
+	while (pos > 0) {
+		int64_t parent = (pos - 1) / 2;
+
+		if (server.waiters.heap[parent]->deadline <= w->deadline)
+			break;
+
+		waiterSet(pos, server.waiters.heap[parent]);
+		pos = parent;
+	}
+
+	waiterSet(pos, w);
+}
+
+static void waiterSiftDown(int64_t pos) {
+	struct jobWaiter *w = server.waiters.heap[pos];
+
+	while (1) {
+		int64_t child = pos * 2 + 1;
+
+		if (child >= server.waiters.count)
+			break;
+
+		if (child + 1 < server.waiters.count && server.waiters.heap[child + 1]->deadline < server.waiters.heap[child]->deadline)
+			child++;
+
+		if (w->deadline <= server.waiters.heap[child]->deadline)
+			break;
+
+		waiterSet(pos, server.waiters.heap[child]);
+		pos = child;
+	}
+
+	waiterSet(pos, w);
+}
+
+static void armWaitTimer(void) {
+	struct itimerspec its = {{0}};
+	int64_t next = server.waiters.count ? server.waiters.heap[0]->deadline : 0;
+
+	if (server.waiters.timer.type != WAIT_TIMER || next == server.waiters.armed)
+		return;
+
+	/* A zero value disarms the timer */
+	its.it_value.tv_sec = next / 1000;
+	its.it_value.tv_nsec = (next % 1000) * 1000000;
+
+	if (timerfd_settime(server.waiters.timer.socket, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to arm job wait timer: %s", strerror(errno));
+		return;
+	}
+
+	server.waiters.armed = next;
+}
+
+static void waiterHeapAdd(struct jobWaiter *w) {
+	if (server.waiters.count >= server.waiters.size) {
+		server.waiters.size = server.waiters.size ? server.waiters.size * 2 : 64;
+		server.waiters.heap = realloc(server.waiters.heap, sizeof(struct jobWaiter *) * server.waiters.size);
+
+		if (server.waiters.heap == NULL)
+			error_die("Failed to allocate memory for job wait heap: %s", strerror(errno));
+	}
+
+	server.waiters.heap[server.waiters.count++] = w;
+	waiterSiftUp(server.waiters.count - 1);
+
+	if (w->heap_index == 1)
+		armWaitTimer();
+}
+
+static void waiterHeapRemove(struct jobWaiter *w) {
+	int64_t pos = w->heap_index - 1;
+	struct jobWaiter *last;
+
+	if (w->heap_index == 0)
+		return;
+
+	w->heap_index = 0;
+	last = server.waiters.heap[--server.waiters.count];
+
+	if (pos < server.waiters.count) {
+		waiterSet(pos, last);
+		waiterSiftUp(pos);
+		waiterSiftDown(last->heap_index - 1);
+	}
+
+	if (pos == 0)
+		armWaitTimer();
+}
+
+/* Unlink a waiter from its job and the deadline heap. This is used as the
+ * clients blocking free_callback, so it is also called on disconnect. */
+
+void removeJobWaiter(void *data) {
+	struct jobWaiter *w = data;
+
+	if (w->job) {
+		DL_DELETE(w->job->waiters, w);
+		w->job = NULL;
+	}
+
+	waiterHeapRemove(w);
+}
+
+/* Block a client until the revision of the job changes, or the timeout (in
+ * seconds) expires. A timeout less than zero waits forever */
+
+void addJobWaiter(client *c, struct job *j, int64_t revision, int timeout) {
+	struct jobWaiter *w = calloc(sizeof(struct jobWaiter), 1);
+
+	if (w == NULL)
+		error_die("Failed to allocate memory for job waiter: %s", strerror(errno));
+
+	w->c = c;
+	w->job = j;
+	w->revision = revision;
+
+	DL_APPEND(j->waiters, w);
+
+	if (timeout > 0) {
+		w->deadline = waitTimeMS() + ((int64_t)timeout * 1000);
+		waiterHeapAdd(w);
+	}
+
+	c->blocking.data = w;
+	c->blocking.free_callback = removeJobWaiter;
+}
+
+/* Release the client from its blocked state and free the waiter */
+
+static void releaseJobWaiter(struct jobWaiter *w) {
+	client *c = w->c;
+
+	removeJobWaiter(w);
+
+	c->blocking.data = NULL;
+	c->blocking.free_callback = NULL;
+	free(w);
+}
+
+/* Wake any clients waiting on this job. Called whenever the jobs revision
+ * changes, or the job is being removed. */
+
+void wakeJobWaiters(struct job *j) {
+	struct jobWaiter *w, *tmp;
+
+	DL_FOREACH_SAFE(j->waiters, w, tmp) {
+		if (w->revision == j->obj.revision && !(j->internal_state &JERS_FLAG_DELETED))
+			continue;
+
+		client *c = w->c;
+		releaseJobWaiter(w);
+		sendClientReturnCode(c, NULL, "0");
+	}
+}
+
+void initWaitTimer(void) {
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0)
+		error_die("Failed to create job wait timer: %s", strerror(errno));
+
+	server.waiters.timer.type = WAIT_TIMER;
+	server.waiters.timer.socket = fd;
+	server.waiters.timer.event_fd = server.event_fd;
+	server.waiters.timer.ptr = NULL;
+	server.waiters.timer.events = 0;
+
+	if (pollSetReadable(&server.waiters.timer))
+		error_die("Failed to add job wait timer to epoll: %s", strerror(errno));
+
+	server.waiters.armed = 0;
+	armWaitTimer();
+}
+
+/* Send a timeout to any waiters that have passed their deadline */
+
+int handleWaitTimer(struct connectionType *connection) {
+	uint64_t expirations;
+	int64_t now = waitTimeMS();
+
+	if (read(connection->socket, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		print_msg(JERS_LOG_WARNING, "Failed to read job wait timer: %s", strerror(errno));
+
+	server.waiters.armed = 0;
+
+	while (server.waiters.count && server.waiters.heap[0]->deadline <= now) {
+		struct jobWaiter *w = server.waiters.heap[0];
+		client *c = w->c;
+
+		releaseJobWaiter(w);
+		sendError(c, JERS_ERR_TIMEOUT, NULL);
+	}
+
+	armWaitTimer();
+
+	return 0;
+}
+
+void freeWaitTimer(void) {
+	if (server.waiters.timer.type == WAIT_TIMER)
+		close(server.waiters.timer.socket);
+
+	free(server.waiters.heap);
+	memset(&server.waiters, 0, sizeof(server.waiters));
+}
+
+/* Subscribers get a stream of compact events (jobid, revision, state and
+ * exitcode) for every change to a job matching their filter. Only the queue,
+ * tag and uid filters are used. */
+
+void addSubscriber(client *c, jersJobFilter *filter) {
+	struct subscriber *s = calloc(sizeof(struct subscriber), 1);
+
+	if (s == NULL)
+		error_die("Failed to allocate memory for subscriber: %s", strerror(errno));
+
+	s->c = c;
+	s->filter.filter_fields = filter->filter_fields &(JERS_FILTER_QUEUE | JERS_FILTER_TAGS | JERS_FILTER_UID);
+	s->filter.filters.queue_name = filter->filters.queue_name;
+	s->filter.filters.tag_count = filter->filters.tag_count;
+	s->filter.filters.tags = filter->filters.tags;
+	s->filter.filters.uid = filter->filters.uid;
+
+	DL_APPEND(server.subscribers, s);
+
+	c->blocking.data = s;
+	c->blocking.free_callback = removeSubscriber;
+}
+
+void removeSubscriber(void *data) {
+	struct subscriber *s = data;
+
+	DL_DELETE(server.subscribers, s);
+
+	free(s->filter.filters.queue_name);
+	freeStringMap(s->filter.filters.tag_count, (key_val_t **)&s->filter.filters.tags);
+}
+
+static int subscriberMatches(struct subscriber *s, struct job *j) {
+	jersJobFilter *f = &s->filter;
+
+	if (f->filter_fields &JERS_FILTER_UID && f->filters.uid != j->uid)
+		return 0;
+
+	if (f->filter_fields &JERS_FILTER_QUEUE && matches(f->filters.queue_name, j->queue->name) != 0)
+		return 0;
+
+	if (f->filter_fields &JERS_FILTER_TAGS) {
+		stateLoadJobDetails(j);
+
+		for (int i = 0; i < f->filters.tag_count; i++) {
+			int k;
+
+			for (k = 0; k < j->tag_count; k++) {
+				if (strcmp(j->tags[k].key, f->filters.tags[i].key) == 0 && matches(f->filters.tags[i].value, j->tags[k].value) == 0)
+					break;
+			}
+
+			if (k == j->tag_count)
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Send an event for this job to each matching subscriber. A subscriber that
+ * isn't reading its events has them dropped once it has too much unsent data,
+ * the count of dropped events is sent ahead of the next event that fits. */
+
+void notifySubscribers(struct job *j) {
+	struct subscriber *s;
+
+	DL_FOREACH(server.subscribers, s) {
+		client *c = s->c;
+		buff_t b;
+
+		if (!subscriberMatches(s, j))
+			continue;
+
+		if (c->response.used - c->response_sent > JERS_SUBSCRIBE_MAX_PENDING) {
+			s->dropped++;
+			continue;
+		}
+
+		initResponse(&b, 1);
+
+		if (s->dropped) {
+			JSONStartObject(&b, NULL, 0);
+			JSONAddInt(&b, DROPPED, s->dropped);
+			JSONEndObject(&b);
+			s->dropped = 0;
+		}
+
+		JSONStartObject(&b, NULL, 0);
+		JSONAddInt(&b, JOBID, j->jobid);
+		JSONAddInt(&b, REVISION, j->obj.revision);
+		JSONAddInt(&b, STATE, j->state);
+		JSONAddInt(&b, EXITCODE, j->exitcode);
+		JSONEndObject(&b);
+
+		sendClientMessage(c, NULL, &b);
+	}
+}
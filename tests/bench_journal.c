@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <server.h>
+
+/* Microbenchmark of journal appends, with and without the write buffer.
+ * Flushes are deferred, so this measures the cost of the writes alone.
+ * Built with 'make bench', it isn't part of the test suite */
+
+#define BENCH_APPENDS 50000
+
+struct jersServer server = {0};
+
+char * server_log = "jersd";
+int server_log_mode = JERS_LOG_CRITICAL;
+
+static int benchAppends(const char *name, size_t buffer_size, int first) {
+	char json[] = "{\"ADD_JOB\":{\"VERSION\":1,\"FIELDS\":{\"JOBNAME\":\"benchmark_job\",\"QUEUENAME\":\"q1\","
+		"\"ARGS\":[\"/bin/sleep\",\"10\"],\"PRIORITY\":100,\"UID\":1000,\"STDOUT\":\"/tmp/out.log\","
+		"\"TAGS\":{\"owner\":\"batch\",\"system\":\"accounts\"}}}}";
+	msg_t msg;
+	int rc = 0;
+
+	if (load_message(json, &msg) != 0)
+		return 1;
+
+	server.journal.buffer_size = buffer_size;
+	int64_t start = getTimeMS();
+
+	for (int i = first; i < first + BENCH_APPENDS && rc == 0; i++)
+		rc = stateSaveCmd(1000, "ADD_JOB", &msg, i + 1, 1);
+
+	if (rc == 0)
+		rc = flushJournalBuffer();
+
+	int64_t elapsed = getTimeMS() - start;
+
+	if (rc == 0)
+		printf("%-12s %9ld appends/sec\n", name, BENCH_APPENDS * 1000L / (elapsed ? elapsed : 1));
+
+	free_message(&msg);
+	return rc;
+}
+
+int main(int argc, char *argv[]) {
+	char dir[] = "/tmp/jers_bench_journalXXXXXX";
+	char path[PATH_MAX];
+	int rc;
+
+	UNUSED(argc);
+	UNUSED(argv);
+
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "Failed to create benchmark directory: %s\n", strerror(errno));
+		return 1;
+	}
+
+	sortfields();
+
+	server.state_dir = dir;
+	server.journal.fd = server.journal.index_fd = -1;
+	server.journal.extend_block_size = JOURNAL_EXTEND_DEFAULT;
+	server.flush.defer = 1;
+
+	rc = benchAppends("unbuffered", 0, 0) || benchAppends("buffered", 65536, BENCH_APPENDS);
+
+	if (rc)
+		fprintf(stderr, "Failed to append to the journal\n");
+
+	if (server.journal.fd >= 0)
+		close(server.journal.fd);
+
+	if (server.journal.index_fd >= 0)
+		close(server.journal.index_fd);
+
+	snprintf(path, sizeof(path), "%s/journal.%s", dir, server.journal.datetime);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/journal_index.%s", dir, server.journal.datetime);
+	unlink(path);
+	rmdir(dir);
+
+	return rc;
+}
@@ -27,6 +27,7 @@ void test_jobs(void);
 void test_state(void);
 void test_sched(void);
 void test_list(void);
+void test_journal(void);
 
 struct test_case {
 	const char *name;
@@ -45,6 +46,7 @@ struct test_case test_cases[] = {
 	{"State", test_state},
 	{"Sched", test_sched},
 	{"List", test_list},
+	{"Journal", test_journal},
 };
 
 int main (int argc, char *argv[]) {
@@ -58,7 +58,28 @@ int check_sort() {
 	return 0;
 }
 
+/* The copies need to be independent of the originals */
+int check_dup(void) {
+	char *array[] = {"one", "two"};
+	key_val_t map[] = {{"key", "value"}, {"empty", NULL}};
+	char **array_copy = dupStringArray(2, array);
+	key_val_t *map_copy = dupStringMap(2, map);
+	int rc = 0;
+
+	if (array_copy[0] == array[0] || strcmp(array_copy[1], "two") != 0)
+		rc = 1;
+
+	if (map_copy[0].key == map[0].key || strcmp(map_copy[0].value, "value") != 0 || map_copy[1].value != NULL)
+		rc = 1;
+
+	freeStringArray(2, &array_copy);
+	freeStringMap(2, &map_copy);
+
+	return rc;
+}
+
 void test_fields(void) {
 	TEST("Field names", check_names());
 	TEST("Sorted fields", check_sort());
+	TEST("Duplicate arrays", check_dup());
 }
\ No newline at end of file
@@ -10,8 +10,57 @@ void clear_jobtable(void) {
 
 	HASH_ITER(hh, server.jobTable, j, tmp) {
 		HASH_DEL(server.jobTable, j);
+
+		for (int i = 0; i < TIME_INDEX_COUNT; i++)
+			free(j->time_links[i].next);
+
+		free(j->tag_handles);
 		free(j);
 	}
+
+	memset(server.timeIndex, 0, sizeof(server.timeIndex));
+}
+
+/* Free the jobs and indexes the tests below add, leaving an empty server */
+static void reset_server(void) {
+	struct uidIndex *u, *tmp;
+
+	clear_jobtable();
+
+	HASH_ITER(hh, server.uidIndex, u, tmp) {
+		HASH_DEL(server.uidIndex, u);
+		free(u);
+	}
+
+	for (int i = 0; i < server.index_tag_count; i++) {
+		struct indexed_tag *t, *tmp_tag;
+
+		HASH_ITER(hh, server.index_tags[i].table, t, tmp_tag) {
+			HASH_DEL(server.index_tags[i].table, t);
+			free(t->value);
+			free(t);
+		}
+
+		free(server.index_tags[i].key);
+	}
+
+	free(server.index_tags);
+
+	for (int i = 0; i < JERS_TOMBSTONE_MAX; i++)
+		free(server.changes.tombstones[i].queue);
+
+	free(server.checkpoint.deleted);
+	memset(&server, 0, sizeof(struct jersServer));
+}
+
+static struct job *new_job(jobid_t jobid, struct queue *q, int state) {
+	struct job *j = calloc(1, sizeof(struct job));
+
+	j->jobid = jobid;
+	j->queue = q;
+	j->state = state;
+
+	return j;
 }
 
 static void test_jobids(void) {
@@ -153,8 +202,275 @@ static void test_jobids(void) {
 	clear_jobtable();
 }
 
-void test_jobs(void) {
-	test_jobids();
+/* Jobs should move between the state, queue and uid indexes as they change */
+static int check_indexes(void) {
+	struct queue q1 = {0}, q2 = {0};
+	struct job *j[4];
+	struct uidIndex *u;
+	int states[4] = {JERS_JOB_HOLDING, JERS_JOB_HOLDING, JERS_JOB_COMPLETED, JERS_JOB_HOLDING};
+	int rc = 1;
+
+	reset_server();
+
+	for (int i = 0; i < 4; i++) {
+		j[i] = new_job(i + 1, i < 3 ? &q1 : &q2, states[i]);
+		j[i]->uid = 1000 + i % 2;
+		addJob(j[i], 0);
+	}
+
+	changeJobState(j[0], JERS_JOB_RUNNING, NULL, 0);
+	changeJobState(j[1], JERS_JOB_HOLDING, &q2, 0);
+	deleteJob(j[2]);
+
+	u = findUidIndex(1000);
+
+	if (jobIndexCount(&server.stateIndex, JERS_JOB_HOLDING) != 2 || jobIndexCount(&server.stateIndex, ~0) != 3)
+		goto check_indexes_cleanup;
+
+	if (jobIndexCount(&q1.index, ~0) != 1 || q1.index.jobs[0] != j[0] || jobIndexCount(&q2.index, JERS_JOB_HOLDING) != 2)
+		goto check_indexes_cleanup;
+
+	/* uid 1000 has job 1 running, job 3 was deleted */
+	if (u == NULL || jobIndexCount(&u->index, ~0) != 1 || u->index.jobs[0] != j[0])
+		goto check_indexes_cleanup;
+
+	if (q2.index.jobs[3] != j[3] || j[3]->links[JOB_LINK_QUEUE].next != j[1] || j[1]->links[JOB_LINK_QUEUE].next != NULL)
+		goto check_indexes_cleanup;
+
+	rc = 0;
+
+check_indexes_cleanup:
+	reset_server();
+	return rc;
+}
+
+/* Jobs are indexed under each of the indexed tags they have */
+static int check_index_tags(void) {
+	struct queue q = {0};
+	key_val_t tags[2][2] = {{{"batch_id", "b1"}, {"pipeline", "p1"}}, {{"owner", "x"}, {"pipeline", "p1"}}};
+	struct job *j[2];
+	struct indexed_tag *t = NULL;
+	int rc = 1;
+
+	reset_server();
+
+	if (addIndexTagKey("batch_id") || addIndexTagKey("pipeline") || addIndexTagKey("pipeline") == 0)
+		goto check_index_tags_cleanup;
+
+	for (int i = 0; i < 2; i++) {
+		j[i] = new_job(i + 1, &q, JERS_JOB_HOLDING);
+		j[i]->tag_count = 2;
+		j[i]->tags = tags[i];
+		addJob(j[i], 0);
+	}
+
+	HASH_FIND_STR(server.index_tags[1].table, "p1", t);
+
+	if (t == NULL || HASH_CNT(hh, t->jobs) != 2 || HASH_CNT(hh, server.index_tags[0].table) != 1)
+		goto check_index_tags_cleanup;
+
+	HASH_FIND_STR(server.index_tags[0].table, "b1", t);
+
+	if (t == NULL || HASH_CNT(hh, t->jobs) != 1 || t->jobs->job != j[0] || j[1]->tag_handles[0].value != NULL)
+		goto check_index_tags_cleanup;
+
+	/* Removing a job from one index leaves it in the others */
+	delIndexTag(j[0], 0);
+
+	if (t->jobs != NULL || j[0]->tag_handles[1].value == NULL || HASH_CNT(hh, j[0]->tag_handles[1].value->jobs) != 2)
+		goto check_index_tags_cleanup;
+
+	unindexJobTags(j[1]);
+
+	if (HASH_CNT(hh, j[0]->tag_handles[1].value->jobs) != 1)
+		goto check_index_tags_cleanup;
+
+	rc = 0;
+
+check_index_tags_cleanup:
+	reset_server();
+	return rc;
+}
+
+/* Jobs should be kept in time order, and move as their times change */
+static int check_time_indexes(void) {
+	struct queue q = {0};
+	struct job *j;
+	int rc = 1;
 
+	reset_server();
 
+	/* Submitted in reverse order, with two at the same time */
+	for (int i = 0; i < 100; i++) {
+		j = new_job(i + 1, &q, JERS_JOB_HOLDING);
+		j->submit_time = 1000 - i + (i == 50);
+		addJob(j, 0);
+	}
+
+	time_t last = 0;
+	int count = 0;
+
+	for (j = timeIndexSeek(TIME_INDEX_SUBMIT, 0); j; j = j->time_links[TIME_INDEX_SUBMIT].next[0], count++) {
+		if (j->submit_time < last)
+			goto check_time_indexes_cleanup;
+
+		last = j->submit_time;
+	}
+
+	if (count != 100 || timeIndexCount(TIME_INDEX_SUBMIT, 950, 960, 100) != 11 || timeIndexCount(TIME_INDEX_SUBMIT, 950, 960, 5) != 5)
+		goto check_time_indexes_cleanup;
+
+	if (timeIndexSeek(TIME_INDEX_SUBMIT, 951)->jobid != 50 || server.timeIndex[TIME_INDEX_FINISH].count != 0)
+		goto check_time_indexes_cleanup;
+
+	/* Finishing adds a job to the finish index, deleting removes it from them all */
+	j = findJob(10);
+	j->finish_time = 2000;
+	changeJobState(j, JERS_JOB_COMPLETED, NULL, 0);
+
+	if (timeIndexSeek(TIME_INDEX_FINISH, 1) != j || timeIndexCount(TIME_INDEX_START, 1, INT64_MAX, 100) != 0)
+		goto check_time_indexes_cleanup;
+
+	deleteJob(j);
+
+	if (server.timeIndex[TIME_INDEX_FINISH].count != 0 || timeIndexCount(TIME_INDEX_SUBMIT, 0, INT64_MAX, 1000) != 99)
+		goto check_time_indexes_cleanup;
+
+	rc = 0;
+
+check_time_indexes_cleanup:
+	reset_server();
+	return rc;
+}
+
+/* A name search should return every job that could match the pattern */
+static int check_name_index(void) {
+	struct queue q = {0};
+	char *names[] = {"etl_sales_daily", "etl_hr_weekly", "load_etl_daily", "etl_daily", "report", "rep", NULL};
+	jobid_t *jobids = NULL;
+	int rc = 1;
+
+	reset_server();
+	server.index_job_names = 1;
+
+	for (int i = 0; names[i]; i++) {
+		struct job *j = new_job(10 - i, &q, JERS_JOB_HOLDING);
+		j->jobname = names[i];
+		addJob(j, 0);
+	}
+
+	/* Prefix and suffix: etl_sales_daily and etl_daily */
+	if (nameIndexSearch("etl_*_daily", &jobids) != 2 || jobids[0] != 7 || jobids[1] != 10)
+		goto check_name_index_cleanup;
+
+	free(jobids);
+
+	if (nameIndexSearch("*etl*", &jobids) != 4 || nameIndexEstimate("*re?ort") != 1 || nameIndexEstimate("*xyz*") != 0)
+		goto check_name_index_cleanup;
+
+	free(jobids);
+	jobids = NULL;
+
+	/* Too short to narrow the search, or using an escape */
+	if (nameIndexEstimate("*a*") != -1 || nameIndexEstimate("etl\\_*") != -1 || nameIndexEstimate("[er]tl_*") != 4)
+		goto check_name_index_cleanup;
+
+	/* An exact name */
+	if (nameIndexSearch("rep", &jobids) != 1 || jobids[0] != 5)
+		goto check_name_index_cleanup;
+
+	free(jobids);
+	jobids = NULL;
+
+	nameIndexDel(findJob(5));
+
+	if (nameIndexEstimate("rep") != 0 || nameIndexEstimate("rep*") != 1)
+		goto check_name_index_cleanup;
+
+	rc = 0;
+
+check_name_index_cleanup:
+	free(jobids);
+	reset_server();
+	return rc;
+}
+
+struct changes {
+	int job_count;
+	int deleted_count;
+	jobid_t jobs[8];
+	jobid_t deleted[8];
+};
+
+static void changed_job(struct job *j, void *arg) {
+	struct changes *c = arg;
+	c->jobs[c->job_count++] = j->jobid;
+}
+
+static void deleted_job(const struct tombstone *t, void *arg) {
+	struct changes *c = arg;
+
+	/* The tombstone keeps the uid and queue to filter on */
+	if (t->uid == 1000 + t->jobid && strcmp(t->queue, "q1") == 0)
+		c->deleted[c->deleted_count++] = t->jobid;
+}
+
+/* Only the jobs changed, or cleaned up, after a sequence should be returned */
+static int check_changes(void) {
+	struct queue q = {.name = "q1"};
+	struct job *j[5];
+	struct changes c = {0};
+	int rc = 1;
+
+	reset_server();
+	server.changes.seq = server.changes.floor = 1000;
+	server.checkpoint.enabled = 1;
+
+	for (int i = 0; i < 5; i++) {
+		j[i] = new_job(i + 1, &q, JERS_JOB_HOLDING);
+		j[i]->uid = 1000 + i + 1;
+		addJob(j[i], 0);
+	}
+
+	int64_t since = server.changes.seq;
+
+	if (since != 1005 || j[4]->obj.change_seq != 1005)
+		goto check_changes_cleanup;
+
+	changeJobState(j[1], JERS_JOB_RUNNING, NULL, 0);
+	deleteJob(j[3]);
+
+	jobChangesSince(since, changed_job, deleted_job, &c);
+
+	if (c.job_count != 2 || c.jobs[0] != 2 || c.jobs[1] != 4 || c.deleted_count != 0)
+		goto check_changes_cleanup;
+
+	/* Once cleaned up, the job is only returned as a tombstone */
+	cleanupJob(j[3]);
+	memset(&c, 0, sizeof(c));
+	jobChangesSince(since, changed_job, deleted_job, &c);
+
+	if (c.job_count != 1 || c.jobs[0] != 2 || c.deleted_count != 1 || c.deleted[0] != 4)
+		goto check_changes_cleanup;
+
+	memset(&c, 0, sizeof(c));
+	jobChangesSince(server.changes.seq, changed_job, deleted_job, &c);
+
+	if (c.job_count != 0 || c.deleted_count != 0)
+		goto check_changes_cleanup;
+
+	rc = 0;
+
+check_changes_cleanup:
+	reset_server();
+	return rc;
+}
+
+void test_jobs(void) {
+	test_jobids();
+	TEST("Job indexes", check_indexes());
+	TEST("Indexed tags", check_index_tags());
+	TEST("Time indexes", check_time_indexes());
+	TEST("Job name index", check_name_index());
+	TEST("Job changes", check_changes());
 }
\ No newline at end of file
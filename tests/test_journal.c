@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <jers_tests.h>
+#include <server.h>
+
+int check_crc32c(void) {
+	/* Standard CRC32C check value */
+	if (crc32c(0, "123456789", 9) != 0xE3069283)
+		return 1;
+
+	/* The CRC can be calculated in pieces */
+	if (crc32c(crc32c(0, "1234", 4), "56789", 5) != 0xE3069283)
+		return 1;
+
+	return 0;
+}
+
+/* Encode a record, then decode it again */
+int check_record(void) {
+	const char *json = "{\"ADD_JOB\":{\"VERSION\":1,\"FIELDS\":{\"JOBNAME\":\"a \\\"name\\\"\\n\",\"PRIORITY\":-5,\"HOLD\":true,"
+		"\"ARGS\":[\"/bin/true\",\"\"],\"TAGS\":{\"key\":\"value\"}}}}";
+	struct journalRecord r;
+	char *buffer = NULL;
+	size_t buffer_size = 0;
+	buff_t b;
+	int rc = 1;
+
+	sortfields();
+	buffNew(&b, 0);
+
+	if (journalEncodeJSON(&b, 1590000000123, 1000, "ADD_JOB", json, 10, 3) != 0)
+		goto check_record_cleanup;
+
+	journalEncodeEOJ(&b);
+
+	ssize_t len = journalDecodeRecord(b.data, b.used, &r, &buffer, &buffer_size);
+
+	if (len <= 0 || !r.has_msg || r.uid != 1000 || r.jobid != 10 || r.revision != 3 || r.timestamp != 1590000000123)
+		goto check_record_cleanup;
+
+	if (strcmp(r.msg.command, "ADD_JOB") != 0 || r.msg.version != 1 || r.msg.item_count != 1 || r.msg.items[0].field_count != 5)
+		goto check_record_cleanup;
+
+	field *f = r.msg.items[0].fields;
+
+	if (strcmp(f[0].value.string, "a \"name\"\n") != 0 || f[1].value.number != -5 || f[2].value.boolean != 1)
+		goto check_record_cleanup;
+
+	if (f[3].value.string_array.count != 2 || strcmp(f[3].value.string_array.strings[1], "") != 0)
+		goto check_record_cleanup;
+
+	if (f[4].value.map.count != 1 || strcmp(f[4].value.map.keys[0].value, "value") != 0)
+		goto check_record_cleanup;
+
+	free_message(&r.msg);
+
+	/* Followed by the end of journal record */
+	if (journalDecodeRecord(b.data + len, b.used - len, &r, &buffer, &buffer_size) <= 0 || r.marker != '$')
+		goto check_record_cleanup;
+
+	/* A corrupt record should be rejected */
+	b.data[len - 1] ^= 1;
+
+	if (journalDecodeRecord(b.data, b.used, &r, &buffer, &buffer_size) != -1)
+		goto check_record_cleanup;
+
+	rc = 0;
+
+check_record_cleanup:
+	buffFree(&b);
+	free(buffer);
+	return rc;
+}
+
+/* A record written by the first version of the binary format. It must always
+ * decode the same way, whatever happens to the field list. It includes a field
+ * ID this version doesn't know (4000) and a field tagged by name */
+static const unsigned char fixture_record[] = {
+	0x20, 0x01, 0x07, 0x00, 0x58, 0x00, 0x00, 0x00, 0x41, 0x9d, 0xe8, 0xaf,
+	0x01, 0x00, 0x00, 0x00, 0xe8, 0x03, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00,
+	0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7b, 0x9c, 0x62, 0x33,
+	0x72, 0x01, 0x00, 0x00, 0x41, 0x44, 0x44, 0x5f, 0x4a, 0x4f, 0x42, 0x01,
+	0x01, 0x07, 0x12, 0x0a, 0x61, 0x20, 0x22, 0x6e, 0x61, 0x6d, 0x65, 0x22,
+	0x0a, 0x43, 0x09, 0x49, 0x01, 0x82, 0xfa, 0x01, 0x15, 0x66, 0x72, 0x6f,
+	0x6d, 0x20, 0x61, 0x20, 0x6e, 0x65, 0x77, 0x65, 0x72, 0x20, 0x76, 0x65,
+	0x72, 0x73, 0x69, 0x6f, 0x6e, 0x24, 0x02, 0x0a, 0x2f, 0x62, 0x69, 0x6e,
+	0x2f, 0x74, 0x72, 0x75, 0x65, 0x01, 0x02, 0x0a, 0x51, 0x55, 0x45, 0x55,
+	0x45, 0x4e, 0x41, 0x4d, 0x45, 0x03, 0x71, 0x31, 0x7d, 0x01, 0x04, 0x6b,
+	0x65, 0x79, 0x06, 0x76, 0x61, 0x6c, 0x75, 0x65,
+};
+
+int check_fixture(void) {
+	struct journalRecord r;
+	char *buffer = NULL;
+	size_t buffer_size = 0;
+	int rc = 1;
+
+	sortfields();
+
+	/* Every field needs an ID before it can be journalled */
+	for (int i = 0; i < ENDOFFIELDS; i++) {
+		if (journalFieldId(i) <= 0)
+			return 1;
+	}
+
+	if (journalDecodeRecord((const char *)fixture_record, sizeof(fixture_record), &r, &buffer, &buffer_size) != sizeof(fixture_record)) {
+		free(buffer);
+		return 1;
+	}
+
+	if (strcmp(r.msg.command, "ADD_JOB") != 0 || r.uid != 1000 || r.jobid != 10 || r.revision != 3 || r.msg.items[0].field_count != 6)
+		goto check_fixture_cleanup;
+
+	field *f = r.msg.items[0].fields;
+
+	if (f[0].number != JOBNAME || strcmp(f[0].value.string, "a \"name\"\n") != 0)
+		goto check_fixture_cleanup;
+
+	if (f[1].number != PRIORITY || f[1].value.number != -5 || f[2].number != HOLD || f[2].value.boolean != 1)
+		goto check_fixture_cleanup;
+
+	if (f[3].number != ARGS || f[3].value.string_array.count != 2 || strcmp(f[3].value.string_array.strings[0], "/bin/true") != 0)
+		goto check_fixture_cleanup;
+
+	if (f[4].number != QUEUENAME || strcmp(f[4].value.string, "q1") != 0)
+		goto check_fixture_cleanup;
+
+	if (f[5].number != TAGS || f[5].value.map.count != 1 || strcmp(f[5].value.map.keys[0].key, "key") != 0)
+		goto check_fixture_cleanup;
+
+	rc = 0;
+
+check_fixture_cleanup:
+	free_message(&r.msg);
+	free(buffer);
+	return rc;
+}
+
+/* Enough records for one index entry */
+#define CHECK_APPENDS (JOURNAL_INDEX_INTERVAL + 300)
+
+static int appendRecords(int first, int count, size_t buffer_size) {
+	char json[] = "{\"ADD_JOB\":{\"VERSION\":1,\"FIELDS\":{\"JOBNAME\":\"append_job\",\"ARGS\":[\"/bin/true\"]}}}";
+	msg_t msg;
+	int rc = 0;
+
+	if (load_message(json, &msg) != 0)
+		return 1;
+
+	server.journal.buffer_size = buffer_size;
+
+	for (int i = first; i < first + count && rc == 0; i++)
+		rc = stateSaveCmd(1000, "ADD_JOB", &msg, i + 1, 1);
+
+	if (rc == 0)
+		rc = flushJournalBuffer();
+
+	free_message(&msg);
+	return rc;
+}
+
+/* Records are written in order, with and without the write buffer, and the
+ * index entry is at the start of the record following the ones it counts */
+int check_appends(void) {
+	char dir[] = "/tmp/jers_test_journalXXXXXX";
+	char journal[PATH_MAX], index[PATH_MAX];
+	struct flush flush = server.flush;
+	struct journal saved = server.journal;
+	char *line = NULL;
+	size_t line_size = 0;
+	int64_t count = 0, indexed;
+	off_t index_offset, indexed_offset = -1;
+	FILE *f = NULL;
+	int rc = 1;
+
+	if (mkdtemp(dir) == NULL)
+		return 1;
+
+	server.state_dir = dir;
+	server.journal.fd = server.journal.index_fd = -1;
+	server.journal.record = 0;
+	server.journal.extend_block_size = JOURNAL_EXTEND_DEFAULT;
+	server.flush.defer = 1;
+
+	if (appendRecords(0, CHECK_APPENDS / 2, 0) || appendRecords(CHECK_APPENDS / 2, CHECK_APPENDS - CHECK_APPENDS / 2, 65536))
+		goto check_appends_cleanup;
+
+	snprintf(journal, sizeof(journal), "%s/journal.%s", dir, server.journal.datetime);
+	index_offset = journalIndexLookup(server.journal.datetime, CHECK_APPENDS, &indexed);
+
+	if ((f = fopen(journal, "r")) == NULL)
+		goto check_appends_cleanup;
+
+	while (getline(&line, &line_size, f) > 0 && line[0] == ' ') {
+		struct journalEntry e;
+
+		if (parseJournalEntry(line, &e) != 0 || e.uid != 1000 || e.jobid != count + 1)
+			break;
+
+		if (++count == indexed)
+			indexed_offset = ftell(f);
+	}
+
+	if (count == CHECK_APPENDS && server.journal.record == count && indexed == JOURNAL_INDEX_INTERVAL && index_offset == indexed_offset)
+		rc = 0;
+
+check_appends_cleanup:
+	free(line);
+
+	if (f)
+		fclose(f);
+
+	if (server.journal.fd >= 0)
+		close(server.journal.fd);
+
+	if (server.journal.index_fd >= 0)
+		close(server.journal.index_fd);
+
+	snprintf(journal, sizeof(journal), "%s/journal.%s", dir, server.journal.datetime);
+	snprintf(index, sizeof(index), "%s/journal_index.%s", dir, server.journal.datetime);
+	unlink(journal);
+	unlink(index);
+
+	server.journal = saved;
+	server.flush = flush;
+	server.state_dir = NULL;
+	rmdir(dir);
+	return rc;
+}
+
+static int writeTestJournal(const char *dir, const char *datetime) {
+	char journal[PATH_MAX], zeros[4096] = {0};
+	snprintf(journal, sizeof(journal), "%s/journal.%s", dir, datetime);
+	FILE *f = fopen(journal, "w");
+
+	if (f == NULL)
+		return 1;
+
+	fputs("*record\n", f);
+	fwrite(zeros, 1, sizeof(zeros), f);
+	return fclose(f);
+}
+
+static int writeTestIndex(const char *dir, const char *datetime, uint64_t offset) {
+	char index[PATH_MAX];
+	struct journalIndexEntry entry = {1, offset};
+	snprintf(index, sizeof(index), "%s/journal_index.%s", dir, datetime);
+	FILE *f = fopen(index, "w");
+
+	if (f == NULL)
+		return 1;
+
+	fwrite(&entry, sizeof(entry), 1, f);
+	return fclose(f);
+}
+
+static off_t journalSize(const char *dir, const char *datetime) {
+	char journal[PATH_MAX];
+	struct stat st;
+	snprintf(journal, sizeof(journal), "%s/journal.%s", dir, datetime);
+	return stat(journal, &st) == 0 ? st.st_size : -1;
+}
+
+/* Committed journals are compacted, then removed once they are too old.
+ * The journal holding the last commit is left alone. Compaction starts
+ * from the index, unless the entry isn't at the start of a record */
+int check_retention(void) {
+	char dir[] = "/tmp/jers_test_retentionXXXXXX";
+	char path[PATH_MAX];
+	int rc = 1;
+
+	if (mkdtemp(dir) == NULL)
+		return 1;
+
+	server.state_dir = dir;
+	server.retention.compact = 1;
+	strcpy(server.retention.journal, "20000103");
+	server.retention.offset = 8;
+
+	if (writeTestJournal(dir, "20000101") || writeTestJournal(dir, "20000102") || writeTestJournal(dir, "20000103"))
+		goto check_retention_cleanup;
+
+	if (writeTestIndex(dir, "20000101", 100) || writeTestIndex(dir, "20000102", 8))
+		goto check_retention_cleanup;
+
+	journalRetention();
+
+	if (journalSize(dir, "20000101") != 8 || journalSize(dir, "20000102") != 8 || journalSize(dir, "20000103") != 4104)
+		goto check_retention_cleanup;
+
+	/* The manifest should have recorded the compaction */
+	memset(&server.retention, 0, sizeof(server.retention));
+
+	if (readJournalManifest() || strcmp(server.retention.journal, "20000103") || server.retention.offset != 8 || strcmp(server.retention.compacted, "20000102"))
+		goto check_retention_cleanup;
+
+	/* Startup probes forward from the manifest journal */
+	char **journals = NULL;
+	size_t count = 0;
+	int listed = manifestJournals(&journals, &count) == 0 && count == 1 && strcmp(journals[0] + strlen(dir), "/journal.20000103") == 0;
+
+	for (size_t i = 0; i < count; i++)
+		free(journals[i]);
+
+	free(journals);
+	strcpy(server.retention.journal, "20000101");
+	listed = listed && manifestJournals(&journals, &count) == 0 && count == 3;
+
+	for (size_t i = 0; i < count; i++)
+		free(journals[i]);
+
+	free(journals);
+
+	if (!listed)
+		goto check_retention_cleanup;
+
+	strcpy(server.retention.journal, "20000103");
+	server.retention.days = 1;
+	journalRetention();
+
+	if (journalSize(dir, "20000101") != -1 || journalSize(dir, "20000102") != -1 || journalSize(dir, "20000103") != 4104)
+		goto check_retention_cleanup;
+
+	rc = 0;
+
+check_retention_cleanup:
+	snprintf(path, sizeof(path), "%s/journal.20000101", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/journal.20000102", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/journal.20000103", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/journal_index.20000101", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/journal_index.20000102", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/journals.manifest", dir);
+	unlink(path);
+
+	memset(&server.retention, 0, sizeof(server.retention));
+	server.state_dir = NULL;
+	rmdir(dir);
+	return rc;
+}
+
+void test_journal(void) {
+	TEST("CRC32C", check_crc32c());
+	TEST("Binary records", check_record());
+	TEST("Binary record fixture", check_fixture());
+	TEST("Journal appends", check_appends());
+	TEST("Journal retention", check_retention());
+}
@@ -3,8 +3,6 @@
 #include <jers_tests.h>
 #include <server.h>
 
-void generateCandidatePool(void);
-void releaseDeferred(void);
 void clear_jobtable(void);
 
 int test_generateCandidatePool(void) {
@@ -20,19 +18,38 @@ int test_generateCandidatePool(void) {
 		{.name = "test_queue3", .priority = 5, .job_limit = 1}	 // Second
 	};
 
+	struct job *candidates[10];
+	int64_t count = 0;
+	struct candidateIter it = {0};
+
+	for (int i = 0; i < 3; i++) {
+		struct queue *qp = &q[i];
+		HASH_ADD_STR(server.queueTable, name, qp);
+	}
+
 /* Add a whole bunch of jobs */
 #include <_test_gen_jobs.c>
 
+	/* The jobs are added directly to the hash table, so put the pending ones
+	 * onto their queues. Deleted jobs would have had their state cleared. */
+	for (j = server.jobTable; j; j = j->hh.next) {
+		if (j->state == JERS_JOB_PENDING && !(j->internal_state &JERS_FLAG_DELETED))
+			addPendingJob(j);
+	}
+
 	generateCandidatePool();
 
-	if (server.candidate_pool_jobs != expected_count) {
-		DEBUG("Incorrect number of jobs in candidate pool. Expected:%ld Got:%ld\n", expected_count, server.candidate_pool_jobs);
+	while ((j = nextCandidate(&it)) && count < 10)
+		candidates[count++] = j;
+
+	if (count != expected_count) {
+		DEBUG("Incorrect number of jobs in candidate pool. Expected:%ld Got:%ld\n", expected_count, count);
 		status = 1;
 		goto end;
 	}
 
-	for (int i = 0; i < server.candidate_pool_jobs; i++) {
-		if (expected_order[i] != server.candidate_pool[i]->jobid) {
+	for (int i = 0; i < count; i++) {
+		if (expected_order[i] != candidates[i]->jobid) {
 			printf("Candidate pool is not in the expected order. Expected:\n");
 			for (int j = 0; j < expected_count; j++) {
 				printf("[%d] = %d\n", j, expected_order[j]);
@@ -41,9 +58,9 @@ int test_generateCandidatePool(void) {
 			printf("Got:\n");
 			for (int j = 0; j < expected_count; j++) {
 				printf("[%d] = %d QueuePriority:%d Priority:%d\n", j,
-					   server.candidate_pool[j]->jobid,
-					   server.candidate_pool[j]->queue->priority,
-					   server.candidate_pool[j]->priority);
+					   candidates[j]->jobid,
+					   candidates[j]->queue->priority,
+					   candidates[j]->priority);
 			}
 
 			status = 1;
@@ -51,11 +68,163 @@ int test_generateCandidatePool(void) {
 		}
 	}
 
+	/* Removing a job should keep the remaining jobs in order */
+	removePendingJob(candidates[1]);
+	it = (struct candidateIter){0};
+	count = 0;
+
+	while ((j = nextCandidate(&it))) {
+		if (count == 1)
+			count++;
+
+		if (count >= expected_count || expected_order[count] != j->jobid) {
+			printf("Candidate pool is not in the expected order after removing job %d\n", candidates[1]->jobid);
+			status = 1;
+			goto end;
+		}
+
+		count++;
+	}
+
 end:
 	clear_jobtable();
+	HASH_CLEAR(hh, server.queueTable);
+	server.candidate_recalc = 1;
 	return status;
 }
 
+int test_checkJobsBlockedQueues(void) {
+	int status = 0;
+	/* Neither queue is started, so no jobs should be considered */
+	struct queue q[] = {
+		{.name = "test_queue1", .priority = 1, .job_limit = 10},
+		{.name = "test_queue2", .priority = 10, .job_limit = 5},
+		{.name = "test_queue3", .priority = 5, .job_limit = 1, .state = JERS_QUEUE_FLAG_STARTED}
+	};
+
+	for (int i = 0; i < 3; i++) {
+		struct queue *qp = &q[i];
+		HASH_ADD_STR(server.queueTable, name, qp);
+	}
+
+#include <_test_gen_jobs.c>
+
+	for (j = server.jobTable; j; j = j->hh.next) {
+		if (j->state == JERS_JOB_PENDING && !(j->internal_state &JERS_FLAG_DELETED))
+			addPendingJob(j);
+	}
+
+	server.max_run_jobs = UNLIMITED_JOBS;
+	server.candidate_recalc = 1;
+	checkJobs();
+
+	for (j = server.jobTable; j; j = j->hh.next) {
+		if (j->state != JERS_JOB_PENDING || j->internal_state &JERS_FLAG_DELETED)
+			continue;
+
+		int expected = j->queue == &q[2] ? JERS_PEND_AGENTDOWN : JERS_PEND_QUEUESTOPPED;
+
+		if (getPendReason(j) != expected || j->internal_state &JERS_FLAG_JOB_STARTED) {
+			printf("Job %d has pend reason %d, expected %d\n", j->jobid, getPendReason(j), expected);
+			status = 1;
+			break;
+		}
+	}
+
+	clear_jobtable();
+	HASH_CLEAR(hh, server.queueTable);
+	server.candidate_recalc = 1;
+	return status;
+}
+
+/* Only the queues flagged as changed should be rechecked, unless a full pass is requested */
+int test_checkJobsDirtyQueues(void) {
+	int status = 0;
+	struct resource r = {.name = "test_res", .count = 1, .in_use = 1};
+	struct queue q[] = {
+		{.name = "test_queue1", .priority = 1, .job_limit = 10},
+		{.name = "test_queue2", .priority = 10, .job_limit = 5},
+	};
+	struct job jobs[] = {
+		{.jobid = 1, .queue = &q[0], .state = JERS_JOB_PENDING},
+		{.jobid = 2, .queue = &q[1], .state = JERS_JOB_PENDING},
+	};
+	int64_t full_passes = server.sched_stats.full_passes;
+
+	for (int i = 0; i < 2; i++) {
+		struct queue *qp = &q[i];
+		HASH_ADD_STR(server.queueTable, name, qp);
+		addPendingJob(&jobs[i]);
+	}
+
+	server.max_run_jobs = UNLIMITED_JOBS;
+	server.candidate_recalc = 1;
+	checkJobs();
+
+	/* Both queues are stopped. Starting them is only noticed for the changed queue */
+	q[0].state = q[1].state = JERS_QUEUE_FLAG_STARTED;
+	schedQueueChanged(&q[1]);
+	checkJobs();
+
+	if (q[0].pend_reason != JERS_PEND_QUEUESTOPPED || q[1].pend_reason != JERS_PEND_AGENTDOWN) {
+		printf("Unexpected pend reasons after checking a changed queue: %d %d\n", q[0].pend_reason, q[1].pend_reason);
+		status = 1;
+		goto end;
+	}
+
+	/* Freeing a resource only wakes the queues waiting on it */
+	q[0].res_wait = 1;
+	schedResourceFreed(&r);
+
+	if (server.sched_wake || q[0].sched_dirty) {
+		printf("Freeing a resource nothing was waiting on woke the scheduler\n");
+		status = 1;
+		goto end;
+	}
+
+	r.waiting = 1;
+	schedResourceFreed(&r);
+
+	if (!server.sched_wake || !q[0].sched_dirty || q[1].sched_dirty || r.waiting) {
+		printf("Freeing a waited on resource did not wake the waiting queue\n");
+		status = 1;
+		goto end;
+	}
+
+	server.sched_all = 1;
+	checkJobs();
+
+	if (q[0].pend_reason != JERS_PEND_AGENTDOWN || server.sched_stats.full_passes != full_passes + 2) {
+		printf("Full pass did not check every queue\n");
+		status = 1;
+	}
+
+end:
+	for (int i = 0; i < 2; i++)
+		free(jobs[i].pending_next);
+
+	HASH_CLEAR(hh, server.queueTable);
+	server.candidate_recalc = 1;
+	return status;
+}
+
+/* Check every job in the deferred heap is no earlier than its parent */
+static int checkDeferredHeap(void) {
+	for (int64_t i = 1; i < server.deferred.count; i++) {
+		struct job *parent = server.deferred.heap[(i - 1) / 2];
+		struct job *child = server.deferred.heap[i];
+
+		if (child->defer_time < parent->defer_time || child->deferred_index != i + 1) {
+			printf("Unexpected defer time order:\n");
+			printf("Parent - jobid:%u defer_time:%ld\n", parent->jobid, parent->defer_time);
+			printf("Child  - jobid:%u defer_time:%ld\n", child->jobid, child->defer_time);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 int test_releaseDeferred(void) {
 	int status = 0;
 	jobid_t expected_pend[] = {5, 10, 32, 500};
@@ -67,55 +236,45 @@ int test_releaseDeferred(void) {
 /* Load the jobs */
 #include <_test_gen_jobs2.c>
 
-	int64_t count = 0;
-
-	/* Check the jobs loaded into the deferred linked list in order */
-	for (struct job *j = server.deferred_list; j; j = j->deferred_next)
-	{
-		if (j->deferred_next) {
-			if (j->deferred_next->defer_time < j->defer_time) {
-				printf("Unexpected defer time order:\n");
-				printf("Current - jobid:%u defer_time:%ld\n", j->jobid, j->defer_time);
-				printf("Next    - jobid:%u defer_time:%ld\n", j->deferred_next->jobid, j->deferred_next->defer_time);
-				status = 1;
-				goto end;
-			}
-		}
-
-		count++;
+	/* Check the jobs loaded into the deferred heap are ordered */
+	if (checkDeferredHeap()) {
+		status = 1;
+		goto end;
 	}
 
-	if (count != expected_defer_count)
+	if (server.deferred.count != expected_defer_count)
 	{
-		printf("Unexpected number of jobs in deferred list, expected %ld, got %ld\n", expected_pend_count, count);
+		printf("Unexpected number of jobs in deferred heap, expected %ld, got %ld\n", expected_defer_count, server.deferred.count);
 		status = 1;
 		goto end;
 	}
 
 	releaseDeferred();
 
-	/* After releasing the jobs, they should have been removed from the linked list */
-	for (struct job *j = server.deferred_list; j; j = j->deferred_next)
+	/* After releasing the jobs, they should have been removed from the heap */
+	for (int64_t i = 0; i < server.deferred.count; i++)
 	{
-		/* Check if it should be in the list at all */
-		for (int i = 0; i < expected_pend_count; i++) {
-			if (expected_pend[i] == j->jobid)
+		/* Check if it should be in the heap at all */
+		for (int k = 0; k < expected_pend_count; k++) {
+			if (expected_pend[k] == server.deferred.heap[i]->jobid)
 			{
-				printf("Error - Released job %d was in the deferred list\n", j->jobid);
+				printf("Error - Released job %d was in the deferred heap\n", server.deferred.heap[i]->jobid);
 				status = 1;
 				goto end;
 			}
 		}
+	}
 
-		if (j->deferred_next) {
-			if (j->deferred_next->defer_time < j->defer_time) {
-				printf("Unexpected defer time order (after release):\n");
-				printf("Current - jobid:%u defer_time:%ld\n", j->jobid, j->defer_time);
-				printf("Next    - jobid:%u defer_time:%ld\n", j->deferred_next->jobid, j->deferred_next->defer_time);
-				status = 1;
-				goto end;
-			}
-		}
+	if (checkDeferredHeap()) {
+		printf("Deferred heap out of order after release\n");
+		status = 1;
+		goto end;
+	}
+
+	if (server.deferred.count != expected_defer_count - expected_pend_count) {
+		printf("Unexpected number of jobs left in deferred heap: %ld\n", server.deferred.count);
+		status = 1;
+		goto end;
 	}
 
 	/* Check the expected jobs are now the only ones pending */
@@ -140,10 +299,57 @@ int test_releaseDeferred(void) {
 
 end:
 	clear_jobtable();
+	server.deferred.count = 0;
+	return status;
+}
+
+/* Jobs moving in and out of a pending list keep it in order, reusing the
+ * forward pointers of the jobs that left it. Started jobs aren't added back */
+int test_pendingList(void) {
+	struct queue q = {.name = "test_queue"};
+	struct job jobs[64] = {0};
+	int status = 0;
+
+	for (int i = 0; i < 64; i++) {
+		jobs[i].jobid = i + 1;
+		jobs[i].queue = &q;
+		jobs[i].priority = i % 4;
+		addPendingJob(&jobs[i]);
+	}
+
+	for (int i = 0; i < 64; i += 2)
+		removePendingJob(&jobs[i]);
+
+	jobs[0].internal_state = JERS_FLAG_JOB_STARTED;
+
+	for (int i = 0; i < 64; i += 2)
+		addPendingJob(&jobs[i]);
+
+	int count = 0;
+
+	for (struct job *j = q.pending.head[0]; j; j = j->pending_next[0], count++) {
+		struct job *next = j->pending_next[0];
+
+		if (j == &jobs[0] || (next && (next->priority > j->priority || (next->priority == j->priority && next->jobid < j->jobid))))
+			status = 1;
+	}
+
+	if (count != 63 || q.pending.count != 63)
+		status = 1;
+
+	for (int i = 0; i < 64; i++)
+		removePendingJob(&jobs[i]);
+
+	if (q.pending.head[0] != NULL || q.pending.count != 0)
+		status = 1;
+
 	return status;
 }
 
 void test_sched(void) {
 	TEST("generateCandidatePool", test_generateCandidatePool());
+	TEST("checkJobs - Blocked queues", test_checkJobsBlockedQueues());
+	TEST("checkJobs - Changed queues", test_checkJobsDirtyQueues());
 	TEST("releaseDeferred", test_releaseDeferred());
+	TEST("Pending list", test_pendingList());
 }
@@ -171,6 +171,229 @@ static int test_job_state(struct job *j) {
 	return status;
 }
 
+/* Load a finished job lazily, then fault its details in */
+
+static int test_lazy_job(struct job *j) {
+	char filename[PATH_MAX];
+	int status = 1;
+
+	if (stateSaveJob(j) != 0) {
+		DEBUG("Failed to save job");
+		return 1;
+	}
+
+	sprintf(filename, "%s/jobs/%d/%d.job", server.state_dir, j->jobid / STATE_DIV_FACTOR, j->jobid);
+
+	server.lazy_load_jobs = 1;
+	struct job *new = stateLoadJob(filename);
+	server.lazy_load_jobs = 0;
+
+	if (!(new->internal_state &JERS_FLAG_JOB_LAZY) || new->argc || new->argv || new->stdout || new->env_count) {
+		DEBUG("Job was not loaded lazily");
+		goto lazy_done;
+	}
+
+	if (new->exitcode != j->exitcode || new->finish_time != j->finish_time || new->queue != j->queue) {
+		DEBUG("Job header does not match");
+		goto lazy_done;
+	}
+
+	/* A missing file leaves the job with just its header */
+	char moved[PATH_MAX + 8];
+	sprintf(moved, "%s.moved", filename);
+	rename(filename, moved);
+
+	if (stateLoadJobDetails(new) == 0 || !(new->internal_state &JERS_FLAG_JOB_LAZY) || new->argc) {
+		DEBUG("Loaded the details of a missing job file");
+		rename(moved, filename);
+		goto lazy_done;
+	}
+
+	rename(moved, filename);
+
+	if (stateLoadJobDetails(new) != 0) {
+		DEBUG("Failed to load job details");
+		goto lazy_done;
+	}
+
+	status = cmp_job(j, new);
+
+lazy_done:
+	freeJob(new);
+	unlink(filename);
+
+	return status;
+}
+
+static struct job *checkpoint_job(jobid_t jobid, const char *name, struct queue *q, int state) {
+	struct job *j = calloc(1, sizeof(struct job));
+
+	j->jobid = jobid;
+	j->obj.type = JERS_OBJECT_JOB;
+	j->obj.revision = 1;
+	j->jobname = strdup(name);
+	j->queue = q;
+	j->argc = 2;
+	j->argv = malloc(sizeof(char *) * 2);
+	j->argv[0] = strdup("echo");
+	j->argv[1] = strdup("t\tw\no");
+	j->submit_time = (time_t) UINT32_MAX + 100;
+	j->submitter = getuid();
+	j->state = state;
+	j->nice = UNSET_32;
+	j->stdout = strdup("/tmp/test_stdout.log");
+
+	return j;
+}
+
+/* Write a snapshot, then a checkpoint with a modified and a deleted job,
+ * and load the jobs back from the segment */
+
+static int test_checkpoint(struct queue *q) {
+	struct job *jobs[3];
+	struct job *j, *tmp;
+	int status = 1;
+
+	server.checkpoint.enabled = 1;
+	checkpointInit();
+
+	for (int i = 0; i < 3; i++) {
+		jobs[i] = checkpoint_job(100 + i, "checkpoint job", q, JERS_JOB_HOLDING);
+		HASH_ADD_INT(server.jobTable, jobid, jobs[i]);
+	}
+
+	server.checkpoint.compact = 1;
+
+	if (checkpointSave(NULL, 0) != 0)
+		goto test_checkpoint_cleanup;
+
+	checkpointSaveDone(0);
+
+	jobs[1]->obj.revision++;
+	jobs[1]->state = JERS_JOB_EXITED;
+	jobs[1]->exitcode = 1;
+	jobs[1]->finish_time = time(NULL);
+
+	checkpointDelJob(jobs[2]->jobid);
+	HASH_DEL(server.jobTable, jobs[2]);
+	freeJob(jobs[2]);
+
+	checkpointStartSave();
+
+	if (checkpointSave(&jobs[1], 1) != 0)
+		goto test_checkpoint_cleanup;
+
+	checkpointSaveDone(0);
+
+	/* Torn write after the last checkpoint */
+	char segment[PATH_MAX];
+	sprintf(segment, "%s/checkpoint/segment.%016ld", server.state_dir, server.checkpoint.seq);
+	FILE *f = fopen(segment, "a");
+	fprintf(f, "JERSCKPT partial");
+	fclose(f);
+
+	/* Load them back up */
+	server.jobTable = NULL;
+
+	if (checkpointLoadJobs() != 2 || HASH_COUNT(server.jobTable) != 2)
+		goto test_checkpoint_cleanup;
+
+	for (int i = 0; i < 2; i++) {
+		j = findJob(jobs[i]->jobid);
+
+		/* addJob() updates the revision of each loaded job */
+		jobs[i]->obj.revision++;
+
+		if (j == NULL || cmp_job(jobs[i], j) != 0)
+			goto test_checkpoint_cleanup;
+	}
+
+	status = 0;
+
+test_checkpoint_cleanup:
+	HASH_ITER(hh, server.jobTable, j, tmp) {
+		HASH_DEL(server.jobTable, j);
+		freeJob(j);
+	}
+
+	freeJob(jobs[0]);
+	freeJob(jobs[1]);
+
+	server.checkpoint.enabled = 0;
+	return status;
+}
+
+static void archivedJob(struct job *j, void *arg) {
+	struct job **jobs = arg;
+
+	for (int i = 0; i < 3; i++) {
+		if (jobs[i]->jobid != j->jobid || strcmp(jobs[i]->queue->name, j->queue->name) != 0)
+			continue;
+
+		/* Archived jobs point to a copy of their queue */
+		j->queue = jobs[i]->queue;
+
+		if (cmp_job(jobs[i], j) == 0)
+			jobs[i]->obj.dirty++;
+	}
+}
+
+/* Archive jobs to two segments, then search them on a finish time range */
+
+static int test_archive(struct queue *q) {
+	struct job *jobs[3];
+	jersJobFilter filter = {0};
+	time_t now = time(NULL);
+	int status = 1;
+
+	server.archive.after = 1;
+	archiveInit();
+
+	for (int i = 0; i < 3; i++) {
+		jobs[i] = checkpoint_job(300 - i, "archived job", q, JERS_JOB_COMPLETED);
+		jobs[i]->obj.revision = 0;
+		jobs[i]->start_time = jobs[i]->submit_time + 10;
+		jobs[i]->finish_time = now - (i * 1000);
+	}
+
+	jobs[2]->state = JERS_JOB_EXITED;
+	jobs[2]->exitcode = -1;
+
+	if (archiveWrite(jobs, 2) != 0 || archiveWrite(&jobs[2], 1) != 0)
+		goto test_archive_cleanup;
+
+	/* Reload the segment headers */
+	archiveInit();
+
+	if (server.archive.count != 2)
+		goto test_archive_cleanup;
+
+	/* Only the jobs in the first segment can match */
+	filter.filter_fields = JERS_FILTER_AFTER;
+	filter.filters.after.finished = now - 1500;
+	archiveSearch(&filter, archivedJob, jobs);
+
+	if (jobs[0]->obj.dirty != 1 || jobs[1]->obj.dirty != 1 || jobs[2]->obj.dirty != 0)
+		goto test_archive_cleanup;
+
+	/* Both segments */
+	filter.filter_fields = JERS_FILTER_BEFORE;
+	filter.filters.before.finished = now;
+	archiveSearch(&filter, archivedJob, jobs);
+
+	if (jobs[0]->obj.dirty != 2 || jobs[1]->obj.dirty != 2 || jobs[2]->obj.dirty != 1)
+		goto test_archive_cleanup;
+
+	status = 0;
+
+test_archive_cleanup:
+	for (int i = 0; i < 3; i++)
+		freeJob(jobs[i]);
+
+	server.archive.after = 0;
+	return status;
+}
+
 static void test_job_states(void) {
 	struct job j = {0};
 	char *args[20];
@@ -263,6 +486,7 @@ static void test_job_states(void) {
 	j.priority = 5;
 
 	TEST("State{Save/load}Job - Exited job", test_job_state(&j) != 0);
+	TEST("State{Save/load}Job - Lazy load exited job", test_lazy_job(&j) != 0);
 
 
 	/* Large int64_t fields populated */
@@ -306,6 +530,9 @@ static void test_job_states(void) {
 
 
 
+	TEST("State checkpoint - Save/load", test_checkpoint(q));
+	TEST("State archive - Write/search", test_archive(q));
+
 	/* Remove our dummy queue */
 	HASH_DEL(server.queueTable, q);
 	free(q);